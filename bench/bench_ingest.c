@@ -0,0 +1,417 @@
+/**
+ * End-to-end ingest benchmark.
+ *
+ * Generates a synthetic corpus (see corpus.h) in a scratch folder, writes a dir.ini
+ * pointing meta at it and at an empty destination, runs the meta executable there and
+ * measures the run: wall time, files per second, I/O system calls per file and the peak
+ * resident set size. Every run starts from a freshly generated, identical corpus. The
+ * results are printed as JSON, so a CI job can compare them against a previous build.
+ *
+ * Usage: bench_ingest [--files N] [--depth N] [--seed N] [--runs N] [--meta PATH]
+ *                     [--work DIR] [--json FILE] [--keep] [-- meta options...]
+ */
+
+#include "corpus.h"
+#include "../include/filelist.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#endif
+
+#define BENCH_MAX_RUNS 100
+#define BENCH_MAX_ARGS 32
+
+typedef struct benchResult {
+    double seconds;
+    int exitCode;
+    int moved;              // files that arrived in the destination
+    uint64_t readCalls;     // read system calls (I/O operations on Windows)
+    uint64_t writeCalls;    // write system calls (I/O operations on Windows)
+    uint64_t otherCalls;    // other I/O operations, Windows only
+    long peakRssKb;
+} benchResult;
+
+static double
+now_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int
+count_file(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    (*(int*)ctx)++;
+    free(filename);
+    return 0;
+}
+
+static void
+remove_tree(path)
+    const char* path;
+{
+    char child[_MAX_PATH];
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find;
+
+    snprintf(child, sizeof(child), "%s\\*", path);
+    if ((find = FindFirstFileA(child, &data)) != INVALID_HANDLE_VALUE) {
+        do {
+            if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, "..")) {
+                continue;
+            }
+            snprintf(child, sizeof(child), "%s\\%s", path, data.cFileName);
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                remove_tree(child);
+            } else {
+                DeleteFileA(child);
+            }
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+    RemoveDirectoryA(path);
+#else
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    struct stat st;
+
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+                continue;
+            }
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+                remove_tree(child);
+            } else {
+                unlink(child);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+#endif
+}
+
+static bool
+absolute_path(path, out)
+    const char* path;
+    char* out;
+{
+#ifdef _WIN32
+    return _fullpath(out, path, _MAX_PATH) != NULL;
+#else
+    return realpath(path, out) != NULL;
+#endif
+}
+
+static bool
+run_meta(meta, workDir, argv, result)
+    const char* meta;
+    const char* workDir;
+    char* const* argv;
+    benchResult* result;
+{
+#ifdef _WIN32
+    char commandLine[4096];
+    size_t n = 0;
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    HANDLE nul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &inherit, OPEN_EXISTING, 0, NULL);
+    IO_COUNTERS io;
+    PROCESS_MEMORY_COUNTERS memory;
+    DWORD exitCode = 1;
+    double start;
+
+    for (int i = 0; argv[i] && n < sizeof(commandLine); i++) {
+        n += snprintf(commandLine + n, sizeof(commandLine) - n, "%s\"%s\"", i ? " " : "", argv[i]);
+    }
+
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = nul;
+    startup.hStdError = nul;
+
+    start = now_seconds();
+    if (!CreateProcessA(meta, commandLine, NULL, NULL, TRUE, 0, NULL, workDir, &startup, &process)) {
+        CloseHandle(nul);
+        return false;
+    }
+    WaitForSingleObject(process.hProcess, INFINITE);
+    result->seconds = now_seconds() - start;
+
+    GetExitCodeProcess(process.hProcess, &exitCode);
+    result->exitCode = (int)exitCode;
+    if (GetProcessIoCounters(process.hProcess, &io)) {
+        result->readCalls = io.ReadOperationCount;
+        result->writeCalls = io.WriteOperationCount;
+        result->otherCalls = io.OtherOperationCount;
+    }
+    if (GetProcessMemoryInfo(process.hProcess, &memory, sizeof(memory))) {
+        result->peakRssKb = (long)(memory.PeakWorkingSetSize / 1024);
+    }
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    CloseHandle(nul);
+    return true;
+#else
+    struct rusage usage;
+    siginfo_t info;
+    char ioPath[64];
+    char line[128];
+    FILE* io;
+    int status = 0;
+    double start = now_seconds();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        int nul = open("/dev/null", O_WRONLY);
+        if (chdir(workDir) != 0) {
+            _exit(127);
+        }
+        if (nul >= 0) {
+            dup2(nul, STDOUT_FILENO);
+            dup2(nul, STDERR_FILENO);
+        }
+        execv(meta, argv);
+        _exit(127);
+    }
+
+    // Wait without reaping, so the child's I/O counters can still be read
+    while (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT) != 0 && errno == EINTR) {
+    }
+    result->seconds = now_seconds() - start;
+
+    snprintf(ioPath, sizeof(ioPath), "/proc/%d/io", (int)pid);
+    if ((io = fopen(ioPath, "r")) != NULL) {
+        while (fgets(line, sizeof(line), io)) {
+            unsigned long long value;
+            if (sscanf(line, "syscr: %llu", &value) == 1) {
+                result->readCalls = value;
+            } else if (sscanf(line, "syscw: %llu", &value) == 1) {
+                result->writeCalls = value;
+            }
+        }
+        fclose(io);
+    }
+
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return false;
+    }
+    result->exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    result->peakRssKb = usage.ru_maxrss;
+    return true;
+#endif
+}
+
+static int
+compare_doubles(a, b)
+    const void* a;
+    const void* b;
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void
+print_json(out, files, depth, seed, corpus, results, runs)
+    FILE* out;
+    int files;
+    int depth;
+    uint32_t seed;
+    const corpusStats* corpus;
+    const benchResult* results;
+    int runs;
+{
+    double rates[BENCH_MAX_RUNS];
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"ingest\",\n");
+    fprintf(out, "  \"files\": %d,\n", files);
+    fprintf(out, "  \"depth\": %d,\n", depth);
+    fprintf(out, "  \"seed\": %u,\n", (unsigned)seed);
+    fprintf(out, "  \"corpus_bytes\": %llu,\n", (unsigned long long)corpus->bytes);
+    fprintf(out, "  \"expected_rejects\": %d,\n", corpus->broken);
+    fprintf(out, "  \"runs\": [\n");
+    for (int i = 0; i < runs; i++) {
+        const benchResult* r = &results[i];
+        uint64_t calls = r->readCalls + r->writeCalls + r->otherCalls;
+        rates[i] = r->seconds > 0 ? files / r->seconds : 0;
+        fprintf(out, "    { \"seconds\": %.6f, \"files_per_sec\": %.1f, \"moved\": %d, \"exit_code\": %d, "
+                     "\"read_syscalls\": %llu, \"write_syscalls\": %llu, \"other_io\": %llu, "
+                     "\"syscalls_per_file\": %.2f, \"peak_rss_kb\": %ld }%s\n",
+                r->seconds, rates[i], r->moved, r->exitCode,
+                (unsigned long long)r->readCalls, (unsigned long long)r->writeCalls,
+                (unsigned long long)r->otherCalls, files ? (double)calls / files : 0.0,
+                r->peakRssKb, i + 1 < runs ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    qsort(rates, runs, sizeof(double), compare_doubles);
+    fprintf(out, "  \"median_files_per_sec\": %.1f\n", runs ? rates[runs / 2] : 0.0);
+    fprintf(out, "}\n");
+}
+
+int
+main(argc, argv)
+    int argc;
+    char* argv[];
+{
+    int files = 1000;
+    int depth = 2;
+    uint32_t seed = 12345;
+    int runs = 3;
+    bool keep = false;
+    const char* metaArg = NULL;
+    const char* workArg = "bench-work";
+    const char* jsonPath = NULL;
+    char meta[_MAX_PATH];
+    char work[_MAX_PATH - 16];     // room for the names appended below
+    char src[_MAX_PATH];
+    char dst[_MAX_PATH];
+    char path[_MAX_PATH];
+    char depthArg[16];
+    char* metaArgv[BENCH_MAX_ARGS];
+    int metaArgc = 0;
+    benchResult results[BENCH_MAX_RUNS];
+    corpusStats corpus;
+    FILE* out = stdout;
+
+#ifdef _WIN32
+    metaArg = "meta.exe";
+#else
+    metaArg = "./meta";
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--") ) {
+            // Everything after "--" is passed on to meta
+            for (i++; i < argc && metaArgc < BENCH_MAX_ARGS - 6; i++) {
+                metaArgv[4 + metaArgc++] = argv[i];
+            }
+            break;
+        } else if (i + 1 < argc && !strcmp(argv[i], "--files")) {
+            files = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--depth")) {
+            depth = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--seed")) {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--runs")) {
+            runs = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--meta")) {
+            metaArg = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--work")) {
+            workArg = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--json")) {
+            jsonPath = argv[++i];
+        } else if (!strcmp(argv[i], "--keep")) {
+            keep = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--files N] [--depth N] [--seed N] [--runs N] [--meta PATH] "
+                            "[--work DIR] [--json FILE] [--keep] [-- meta options...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (files < 1 || depth < 0 || runs < 1 || runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "Error : Invalid --files, --depth or --runs.\n");
+        return 1;
+    }
+    if (!absolute_path(metaArg, meta)) {
+        fprintf(stderr, "Error : meta executable '%s' not found.\n", metaArg);
+        return 1;
+    }
+
+    // meta --depth N --no-cache [options...]; a cache would turn later runs into no-ops
+    snprintf(depthArg, sizeof(depthArg), "%d", depth);
+    metaArgv[0] = meta;
+    metaArgv[1] = "--depth";
+    metaArgv[2] = depthArg;
+    metaArgv[3] = "--no-cache";
+    metaArgv[4 + metaArgc] = NULL;
+
+    if ((_mkdir(workArg) != 0 && errno != EEXIST) || !absolute_path(workArg, path)) {
+        perror("Error : Work folder");
+        return 1;
+    }
+    if (strlen(path) >= sizeof(work)) {
+        fprintf(stderr, "Error : Work folder path too long.\n");
+        return 1;
+    }
+    strcpy(work, path);
+
+    for (int run = 0; run < runs; run++) {
+        benchResult* result = &results[run];
+        FILE* ini;
+
+        memset(result, 0, sizeof(*result));
+        snprintf(src, sizeof(src), "%s/src", work);
+        snprintf(dst, sizeof(dst), "%s/dst", work);
+        remove_tree(src);
+        remove_tree(dst);
+        if (_mkdir(src) != 0 || _mkdir(dst) != 0) {
+            perror("Error : Scratch folders");
+            return 1;
+        }
+
+        // The same seed gives the same corpus on every run
+        if (!corpus_generate(src, files, depth, seed, &corpus)) {
+            perror("Error : Couldn't write the corpus");
+            return 1;
+        }
+
+        snprintf(path, sizeof(path), "%s/dir.ini", work);
+        if (!(ini = fopen(path, "wb"))) {
+            perror("Error : dir.ini");
+            return 1;
+        }
+        fprintf(ini, "[Directory]\nSource=%s\nDestination=%s\n", src, dst);
+        fclose(ini);
+
+        if (!run_meta(meta, work, metaArgv, result)) {
+            perror("Error : Couldn't run meta");
+            return 1;
+        }
+        scan_directory(dst, -1, NULL, count_file, &result->moved);
+
+        fprintf(stderr, "run %d: %.3f s, %d of %d files moved\n", run + 1, result->seconds, result->moved, files);
+    }
+
+    if (!keep) {
+        remove_tree(work);
+    }
+
+    if (jsonPath && !(out = fopen(jsonPath, "w"))) {
+        perror("Error : JSON output");
+        return 1;
+    }
+    print_json(out, files, depth, seed, &corpus, results, runs);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,446 @@
+/**
+ * Microbenchmarks for the parsing and path-formatting kernels.
+ *
+ * parseFlacMeta(), validateFlacMeta(), toLowerCase(), replaceChars() and
+ * reformat_file_path() are timed in-process over buffers held in memory, so the
+ * numbers are free of disk and scheduling noise. Each kernel runs on a tiny, a typical
+ * and one or more pathological inputs (10k comments, 1 MB of lyrics...). Every case is
+ * repeated until it has run for at least --min-time seconds and is reported as ns/op
+ * and allocations/op, as a table on stderr and as JSON.
+ *
+ * The kernels are static, so metadata.c is compiled into this file. Allocations are
+ * counted by routing the malloc() family of metadata.c through counting wrappers; the
+ * kernels that modify their input in place restore it first, which is included in
+ * ns/op.
+ *
+ * Usage: bench_kernels [--min-time SECONDS] [--json FILE] [name filter]
+ */
+
+#include "corpus.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static uint64_t benchAllocs = 0;    // allocations made by metadata.c
+
+static void*
+bench_malloc(size)
+    size_t size;
+{
+    benchAllocs++;
+    return malloc(size);
+}
+
+static void*
+bench_calloc(count, size)
+    size_t count;
+    size_t size;
+{
+    benchAllocs++;
+    return calloc(count, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#include "../src/metadata.c"
+#undef malloc
+#undef calloc
+
+#define BENCH_LYRICS_SIZE (1024 * 1024)
+#define BENCH_MANY_COMMENTS 10000
+#define BENCH_MAX_CASES 32
+
+typedef struct benchCase {
+    const char* name;
+    void (*run)(void* input);       // one operation
+    void* input;
+    double nsPerOp;
+    double allocsPerOp;
+    uint64_t iterations;
+} benchCase;
+
+typedef struct commentInput {
+    BYTE* block;
+    int size;
+    audioMetaData meta;
+} commentInput;
+
+typedef struct vendorInput {
+    BYTE* block;            // length field followed by the vendor string
+    DWORD length;
+} vendorInput;
+
+typedef struct stringInput {
+    const char* original;
+    char* work;             // restored from original before every operation
+    size_t size;            // including the terminator
+} stringInput;
+
+typedef struct pathInput {
+    audioMetaData meta;
+    char title[MAX_LENGTH];
+    const char* folder;
+} pathInput;
+
+static volatile int benchSink;      // keeps results alive
+
+static double
+now_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void
+run_parse(input)
+    void* input;
+{
+    commentInput* in = (commentInput*)input;
+
+    // Edits queue up to FLAC_MAX_EDITS and values are copied to the scratch arena;
+    // start every operation with an empty queue and arena, as process_file() does
+    in->meta.editCount = 0;
+    arena_reset(arena_scratch());
+    benchSink += parseFlacMeta(&in->meta, in->block, in->size);
+}
+
+static void
+run_validate(input)
+    void* input;
+{
+    vendorInput* in = (vendorInput*)input;
+    BYTE* buffer = in->block + sizeof(DWORD);
+    int offset = 0;
+
+    benchSink += validateFlacMeta(&buffer, &offset, in->length) + offset;
+}
+
+static void
+run_lower(input)
+    void* input;
+{
+    stringInput* in = (stringInput*)input;
+    caseSpan changed;
+
+    memcpy(in->work, in->original, in->size);
+    benchSink += toLowerCase(in->work, &changed);
+}
+
+static void
+run_replace(input)
+    void* input;
+{
+    stringInput* in = (stringInput*)input;
+
+    memcpy(in->work, in->original, in->size);
+    replaceChars(in->work);
+    benchSink += in->work[0];
+}
+
+static void
+run_reformat(input)
+    void* input;
+{
+    pathInput* in = (pathInput*)input;
+
+    reformat_file_path(&in->meta, in->folder);
+    benchSink += in->meta.pathname[0];
+}
+
+/**
+ * Runs a case with a doubling number of iterations until one batch takes at least
+ * minTime seconds, and keeps the figures of that batch.
+ */
+static void
+measure(bench, minTime)
+    benchCase* bench;
+    double minTime;
+{
+    uint64_t iterations = 1;
+
+    bench->run(bench->input);   // warm up caches and the branch predictor
+
+    for (;;) {
+        uint64_t allocs = benchAllocs;
+        double start = now_seconds();
+        double elapsed;
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            bench->run(bench->input);
+        }
+        elapsed = now_seconds() - start;
+
+        if (elapsed >= minTime || iterations >= ((uint64_t)1 << 40)) {
+            bench->nsPerOp = elapsed * 1e9 / (double)iterations;
+            bench->allocsPerOp = (double)(benchAllocs - allocs) / (double)iterations;
+            bench->iterations = iterations;
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+static commentInput*
+comment_input(block, size)
+    BYTE* block;
+    size_t size;
+{
+    commentInput* in = (commentInput*)calloc(1, sizeof(commentInput));
+
+    if (!in || !block) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    in->block = block;
+    in->size = (int)size;
+    initialize_audioMetaData(&in->meta, "bench.flac", "flac");
+    return in;
+}
+
+/**
+ * A typical comment block followed by one LYRICS comment of BENCH_LYRICS_SIZE bytes.
+ */
+static commentInput*
+lyrics_input(state)
+    uint32_t* state;
+{
+    size_t size;
+    BYTE* comments = corpus_build_comments(7, state, 0, &size);
+    BYTE* block = comments ? (BYTE*)realloc(comments, size + 4 + 7 + BENCH_LYRICS_SIZE) : NULL;
+    DWORD vendorLength;
+    DWORD count;
+    DWORD length = 7 + BENCH_LYRICS_SIZE;
+
+    if (!block) {
+        free(comments);
+        return comment_input(NULL, 0);
+    }
+
+    // One more comment than the block says
+    memcpy(&vendorLength, block, sizeof(DWORD));
+    memcpy(&count, block + 4 + vendorLength, sizeof(DWORD));
+    count++;
+    memcpy(block + 4 + vendorLength, &count, sizeof(DWORD));
+
+    memcpy(block + size, &length, sizeof(DWORD));
+    memcpy(block + size + 4, "LYRICS=", 7);
+    for (size_t i = 0; i < BENCH_LYRICS_SIZE; i++) {
+        block[size + 11 + i] = (BYTE)((i % 7 == 6) ? ' ' : 'a' + corpus_random(state) % 26);
+    }
+    return comment_input(block, size + 4 + 7 + BENCH_LYRICS_SIZE);
+}
+
+static vendorInput*
+vendor_input(vendor, padding)
+    const char* vendor;
+    size_t padding;         // bytes placed in front of the vendor string
+{
+    size_t vendorLength = strlen(vendor);
+    vendorInput* in = (vendorInput*)malloc(sizeof(vendorInput));
+    BYTE* block = (BYTE*)malloc(sizeof(DWORD) + padding + vendorLength);
+
+    if (!in || !block) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    in->block = block;
+    in->length = (DWORD)(padding + vendorLength);
+    memcpy(block, &in->length, sizeof(DWORD));
+    memset(block + sizeof(DWORD), 'l', padding);    // near misses all the way
+    memcpy(block + sizeof(DWORD) + padding, vendor, vendorLength);
+    return in;
+}
+
+static stringInput*
+string_input(text)
+    const char* text;
+{
+    stringInput* in = (stringInput*)malloc(sizeof(stringInput));
+
+    if (!in) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    in->original = text;
+    in->size = strlen(text) + 1;
+    if (!(in->work = (char*)malloc(in->size))) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    return in;
+}
+
+static char*
+repeat_text(unit, size)
+    const char* unit;
+    size_t size;            // length of the result, without the terminator
+{
+    size_t unitLength = strlen(unit);
+    char* text = (char*)malloc(size + 1);
+
+    if (!text) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i++) {
+        text[i] = unit[i % unitLength];
+    }
+    text[size] = '\0';
+    return text;
+}
+
+static pathInput*
+path_input(title, track, folder)
+    const char* title;
+    int track;
+    const char* folder;
+{
+    pathInput* in = (pathInput*)calloc(1, sizeof(pathInput));
+
+    if (!in) {
+        fprintf(stderr, "Error : Out of memory.\n");
+        exit(1);
+    }
+    initialize_audioMetaData(&in->meta, "bench.flac", "flac");
+    snprintf(in->title, sizeof(in->title), "%s", title);
+    in->meta.title = in->title;
+    in->meta.track[0] = track;
+    in->folder = folder;
+    return in;
+}
+
+static void
+print_json(out, cases, count, minTime)
+    FILE* out;
+    const benchCase* cases;
+    int count;
+    double minTime;
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"kernels\",\n");
+    fprintf(out, "  \"min_time\": %.3f,\n", minTime);
+    fprintf(out, "  \"results\": [\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "    { \"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"iterations\": %llu }%s\n",
+                cases[i].name, cases[i].nsPerOp, cases[i].allocsPerOp,
+                (unsigned long long)cases[i].iterations, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+int
+main(argc, argv)
+    int argc;
+    char* argv[];
+{
+    double minTime = 0.2;
+    const char* jsonPath = NULL;
+    const char* filter = NULL;
+    uint32_t state = 12345;
+    benchCase cases[BENCH_MAX_CASES];
+    int caseCount = 0;
+    int ran = 0;
+    size_t size;
+    char folder[MAX_LENGTH];
+    FILE* out = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--min-time")) {
+            minTime = atof(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--json")) {
+            jsonPath = argv[++i];
+        } else if (argv[i][0] != '-' && !filter) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--min-time SECONDS] [--json FILE] [name filter]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!wordcase_compile()) {
+        fprintf(stderr, "Error : Couldn't compile the word list.\n");
+        return 1;
+    }
+
+#define ADD_CASE(caseName, caseRun, caseInput) \
+    cases[caseCount].name = (caseName); \
+    cases[caseCount].run = (caseRun); \
+    cases[caseCount].input = (caseInput); \
+    caseCount++
+
+    // parseFlacMeta(): the 8 tags meta reads, a typical tagged file, then the pathological ones
+    {
+        BYTE* block = corpus_build_comments(1, &state, 0, &size);
+        ADD_CASE("parseFlacMeta/tiny", run_parse, comment_input(block, size));
+        block = corpus_build_comments(2, &state, 12, &size);
+        ADD_CASE("parseFlacMeta/typical", run_parse, comment_input(block, size));
+        block = corpus_build_comments(3, &state, BENCH_MANY_COMMENTS, &size);
+        ADD_CASE("parseFlacMeta/10k_comments", run_parse, comment_input(block, size));
+        ADD_CASE("parseFlacMeta/1mb_lyrics", run_parse, lyrics_input(&state));
+    }
+
+    // validateFlacMeta(): the identifier is searched for anywhere in the vendor string
+    ADD_CASE("validateFlacMeta/tiny", run_validate, vendor_input("libFLAC", 0));
+    ADD_CASE("validateFlacMeta/typical", run_validate, vendor_input("reference libFLAC 1.4.3 20230623", 0));
+    ADD_CASE("validateFlacMeta/1mb_vendor", run_validate, vendor_input("libFLAC", BENCH_LYRICS_SIZE));
+
+    // toLowerCase(): a field holds at most MAX_LENGTH - 1 bytes
+    ADD_CASE("toLowerCase/tiny", run_lower, string_input("Abba"));
+    ADD_CASE("toLowerCase/typical", run_lower, string_input("Song Of The Year In The Rain"));
+    ADD_CASE("toLowerCase/no_match", run_lower, string_input("Bohemian Rhapsody Remastered Version"));
+    ADD_CASE("toLowerCase/all_words", run_lower, string_input(repeat_text("X A ", MAX_LENGTH - 1)));
+
+    // replaceChars()
+    ADD_CASE("replaceChars/tiny", run_replace, string_input("x"));
+    ADD_CASE("replaceChars/typical", run_replace, string_input("AC/DC Live? Part 1\\2"));
+    ADD_CASE("replaceChars/1mb_clean", run_replace, string_input(repeat_text("Sunshine ", BENCH_LYRICS_SIZE)));
+    ADD_CASE("replaceChars/1mb_separators", run_replace, string_input(repeat_text("/\\?", BENCH_LYRICS_SIZE)));
+
+    // reformat_file_path()
+    snprintf(folder, sizeof(folder), "%s", repeat_text("Folder ", MAX_LENGTH - 1));
+    ADD_CASE("reformat_file_path/tiny", run_reformat, path_input("x", 1, "d"));
+    ADD_CASE("reformat_file_path/typical", run_reformat,
+             path_input("Song of the Year", 7, "D:/Music/Some Artist/Some Album"));
+    ADD_CASE("reformat_file_path/separators", run_reformat,
+             path_input("Either/Or? Live\\Studio", 12, "D:/Music/Some Artist/Some Album"));
+    ADD_CASE("reformat_file_path/max_length", run_reformat,
+             path_input(repeat_text("Long Title ", MAX_LENGTH - 1), 99, folder));
+
+#undef ADD_CASE
+
+    fprintf(stderr, "%-36s %14s %12s %14s\n", "case", "ns/op", "allocs/op", "iterations");
+    for (int i = 0; i < caseCount; i++) {
+        if (filter && !strstr(cases[i].name, filter)) {
+            continue;
+        }
+        measure(&cases[i], minTime);
+        fprintf(stderr, "%-36s %14.2f %12.3f %14llu\n", cases[i].name, cases[i].nsPerOp,
+                cases[i].allocsPerOp, (unsigned long long)cases[i].iterations);
+        cases[ran++] = cases[i];
+    }
+
+    if (jsonPath && !(out = fopen(jsonPath, "w"))) {
+        perror("Error : JSON output");
+        return 1;
+    }
+    print_json(out, cases, ran, minTime);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    wordcase_free();
+    return 0;
+}
@@ -0,0 +1,404 @@
+#include "corpus.h"
+
+typedef struct byteBuffer {
+    BYTE* data;
+    size_t len;
+    size_t cap;
+    bool failed;            // an allocation failed; everything after is dropped
+} byteBuffer;
+
+static const char* corpusWords[] = {
+    "Love", "Night", "River", "Song", "Light", "Dream", "Heart", "Fire", "Road", "Time",
+    "Summer", "Rain", "Ghost", "City", "Stars", "Blue", "Golden", "Silent", "Wild", "Home",
+};
+
+// Function words from WORDCASE_DEFAULT_WORDS, so toLowerCase() has something to do
+static const char* corpusFunctionWords[] = {
+    "In", "Is", "The", "With", "A", "As", "At", "And", "For", "From", "To", "Or", "Of", "On",
+};
+
+static const char* corpusFillers[] = {
+    "COMMENT", "ENCODER", "REPLAYGAIN_TRACK_GAIN", "REPLAYGAIN_ALBUM_GAIN", "COMPOSER",
+    "ISRC", "LABEL", "DESCRIPTION", "LYRICS",
+};
+
+static const char* corpusGenres[] = { "Rock", "Jazz", "Pop", "Folk", "Electronic", "Classical" };
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+uint32_t
+corpus_random(state)
+    uint32_t* state;
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void
+buffer_append(buffer, data, length)
+    byteBuffer* buffer;
+    const void* data;
+    size_t length;
+{
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->len + length > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap : 4096;
+        BYTE* grown;
+        while (cap < buffer->len + length) {
+            cap *= 2;
+        }
+        if (!(grown = (BYTE*)realloc(buffer->data, cap))) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = grown;
+        buffer->cap = cap;
+    }
+    if (data) {
+        memcpy(buffer->data + buffer->len, data, length);
+    } else {
+        memset(buffer->data + buffer->len, 0, length);
+    }
+    buffer->len += length;
+}
+
+static void
+buffer_append_le32(buffer, value)
+    byteBuffer* buffer;
+    uint32_t value;
+{
+    BYTE bytes[4] = { (BYTE)value, (BYTE)(value >> 8), (BYTE)(value >> 16), (BYTE)(value >> 24) };
+    buffer_append(buffer, bytes, 4);
+}
+
+static void
+buffer_append_be32(buffer, value)
+    byteBuffer* buffer;
+    uint32_t value;
+{
+    BYTE bytes[4] = { (BYTE)(value >> 24), (BYTE)(value >> 16), (BYTE)(value >> 8), (BYTE)value };
+    buffer_append(buffer, bytes, 4);
+}
+
+static void
+buffer_append_random(buffer, state, length)
+    byteBuffer* buffer;
+    uint32_t* state;
+    size_t length;
+{
+    size_t start = buffer->len;
+
+    buffer_append(buffer, NULL, length);
+    if (!buffer->failed) {
+        for (size_t i = 0; i < length; i++) {
+            buffer->data[start + i] = (BYTE)corpus_random(state);
+        }
+    }
+}
+
+static void
+append_comment(buffer, name, value)
+    byteBuffer* buffer;
+    const char* name;
+    const char* value;
+{
+    size_t nameLength = strlen(name);
+    size_t valueLength = strlen(value);
+
+    buffer_append_le32(buffer, (uint32_t)(nameLength + 1 + valueLength));
+    buffer_append(buffer, name, nameLength);
+    buffer_append(buffer, "=", 1);
+    buffer_append(buffer, value, valueLength);
+}
+
+// Title case phrase of 'words' words, with function words only in the middle
+static void
+make_phrase(text, size, state, words)
+    char* text;
+    size_t size;
+    uint32_t* state;
+    int words;
+{
+    size_t n = 0;
+
+    text[0] = '\0';
+    for (int i = 0; i < words && n + 16 < size; i++) {
+        const char* word;
+        if (i > 0 && i < words - 1 && corpus_random(state) % 2) {
+            word = corpusFunctionWords[corpus_random(state) % COUNT(corpusFunctionWords)];
+        } else {
+            word = corpusWords[corpus_random(state) % COUNT(corpusWords)];
+        }
+        n += snprintf(text + n, size - n, "%s%s", i ? " " : "", word);
+    }
+}
+
+BYTE*
+corpus_build_comments(index, state, fillers, length)
+    int index;
+    uint32_t* state;
+    int fillers;
+    size_t* length;
+{
+    static const char vendor[] = "reference libFLAC 1.4.3 20230623";
+    byteBuffer buffer = { NULL, 0, 0, false };
+    int album = index / 12;
+    int artist = album / 3;
+    uint32_t nameState = 0x9E3779B9u ^ (uint32_t)artist;
+    char text[MAX_LENGTH];
+    char number[16];
+
+    buffer_append_le32(&buffer, sizeof(vendor) - 1);
+    buffer_append(&buffer, vendor, sizeof(vendor) - 1);
+    buffer_append_le32(&buffer, (uint32_t)(8 + fillers));
+
+    // Artist and album names only depend on their number, so tracks group into albums
+    make_phrase(text, sizeof(text), &nameState, 2 + (int)(nameState % 3));
+    snprintf(text + strlen(text), sizeof(text) - strlen(text), " %d", artist);
+    append_comment(&buffer, (artist % 4 == 0) ? "ARTIST" : "artist", text);
+
+    nameState ^= (uint32_t)album * 2654435761u;
+    corpus_random(&nameState);
+    make_phrase(text, sizeof(text), &nameState, 2 + (int)(nameState % 4));
+    snprintf(text + strlen(text), sizeof(text) - strlen(text), " %d", album);
+    append_comment(&buffer, "ALBUM", text);
+
+    make_phrase(text, sizeof(text), state, 2 + (int)(corpus_random(state) % 5));
+    append_comment(&buffer, "TITLE", text);
+
+    snprintf(number, sizeof(number), "%d", index % 12 + 1);
+    append_comment(&buffer, "TRACKNUMBER", number);
+    append_comment(&buffer, "TRACKTOTAL", "12");
+    append_comment(&buffer, "DISCNUMBER", "1");
+    snprintf(number, sizeof(number), "%d", 1960 + album % 60);
+    append_comment(&buffer, "DATE", number);
+    append_comment(&buffer, "GENRE", corpusGenres[album % COUNT(corpusGenres)]);
+
+    for (int i = 0; i < fillers; i++) {
+        const char* name = corpusFillers[corpus_random(state) % COUNT(corpusFillers)];
+        if (!strcmp(name, "LYRICS")) {
+            // Long values the parser should step over without looking at them
+            size_t lyricsLength = 500 + corpus_random(state) % 4000;
+            buffer_append_le32(&buffer, (uint32_t)(7 + lyricsLength));
+            buffer_append(&buffer, "LYRICS=", 7);
+            for (size_t j = 0; j < lyricsLength; j++) {
+                char c = (char)('a' + corpus_random(state) % 27);
+                buffer_append(&buffer, c > 'z' ? " " : &c, 1);
+            }
+        } else {
+            make_phrase(text, sizeof(text), state, 1 + (int)(corpus_random(state) % 6));
+            append_comment(&buffer, name, text);
+        }
+    }
+
+    if (buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+    *length = buffer.len;
+    return buffer.data;
+}
+
+static void
+append_picture(buffer, album, size)
+    byteBuffer* buffer;
+    int album;
+    size_t size;
+{
+    static const char mime[] = "image/jpeg";
+    static const BYTE jpegStart[] = { 0xFF, 0xD8, 0xFF, 0xE0 };
+    static const BYTE jpegEnd[] = { 0xFF, 0xD9 };
+    uint32_t pictureState = 0x85EBCA6Bu ^ (uint32_t)(album + 1);   // same cover for the whole album
+
+    buffer_append_be32(buffer, 3);                  // front cover
+    buffer_append_be32(buffer, sizeof(mime) - 1);
+    buffer_append(buffer, mime, sizeof(mime) - 1);
+    buffer_append_be32(buffer, 0);                  // no description
+    buffer_append_be32(buffer, 500);                // width, height, depth, colors
+    buffer_append_be32(buffer, 500);
+    buffer_append_be32(buffer, 24);
+    buffer_append_be32(buffer, 0);
+    buffer_append_be32(buffer, (uint32_t)size);
+    buffer_append(buffer, jpegStart, sizeof(jpegStart));
+    buffer_append_random(buffer, &pictureState, size - sizeof(jpegStart) - sizeof(jpegEnd));
+    buffer_append(buffer, jpegEnd, sizeof(jpegEnd));
+}
+
+BYTE*
+corpus_build_flac(index, state, length, broken)
+    int index;
+    uint32_t* state;
+    size_t* length;
+    bool* broken;
+{
+    static const size_t pictureSizes[] = { 0, 0, 0, 0, 24 * 1024, 24 * 1024, 120 * 1024, 500 * 1024 };
+    static const size_t paddingSizes[] = { 0, 1024, 8192, 65536 };
+    byteBuffer buffer = { NULL, 0, 0, false };
+    int order[5];           // block types after STREAMINFO, in file order
+    int blocks = 0;
+    size_t pictureSize = pictureSizes[corpus_random(state) % COUNT(pictureSizes)];
+    size_t paddingSize = paddingSizes[corpus_random(state) % COUNT(paddingSizes)];
+    int fillers = (int)(corpus_random(state) % (CORPUS_MAX_FILLER + 1));
+    bool isBroken = (index % CORPUS_BROKEN_EVERY) == CORPUS_BROKEN_EVERY - 1;
+    size_t commentEnd = 0;
+
+    order[blocks++] = FLAC_META_VORBIS_COMMENT;
+    if (corpus_random(state) % 3 == 0) {
+        order[blocks++] = 3;        // SEEKTABLE
+    }
+    if (corpus_random(state) % 5 == 0) {
+        order[blocks++] = 2;        // APPLICATION
+    }
+    if (pictureSize) {
+        order[blocks++] = 6;        // PICTURE
+    }
+    if (paddingSize) {
+        order[blocks++] = 1;        // PADDING
+    }
+
+    // Any order after STREAMINFO, so the comment block may sit behind a large picture
+    for (int i = blocks - 1; i > 0; i--) {
+        int j = (int)(corpus_random(state) % (uint32_t)(i + 1));
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    buffer_append(&buffer, "fLaC", 4);
+
+    // STREAMINFO: 4096 sample blocks, 44.1 kHz, stereo, 16 bit, and a random MD5 of the "audio"
+    {
+        BYTE streaminfo[34] = {
+            0x10, 0x00, 0x10, 0x00, 0x00, 0x00, 0x10, 0x00, 0x30, 0x00,
+            0x0A, 0xC4, 0x42, 0xF0, 0x00, 0x10, 0x00, 0x00,
+        };
+        BYTE header[4] = { 0, 0, 0, sizeof(streaminfo) };
+        for (int i = 18; i < (int)sizeof(streaminfo); i++) {
+            streaminfo[i] = (BYTE)corpus_random(state);
+        }
+        buffer_append(&buffer, header, 4);
+        buffer_append(&buffer, streaminfo, sizeof(streaminfo));
+    }
+
+    for (int i = 0; i < blocks; i++) {
+        BYTE header[4];
+        size_t start = buffer.len;
+
+        buffer_append(&buffer, NULL, 4);
+        switch (order[i]) {
+            case FLAC_META_VORBIS_COMMENT: {
+                size_t commentLength;
+                BYTE* comments = corpus_build_comments(index, state, fillers, &commentLength);
+                if (!comments) {
+                    buffer.failed = true;
+                    break;
+                }
+                buffer_append(&buffer, comments, commentLength);
+                free(comments);
+                commentEnd = buffer.len;
+                break;
+            }
+            case 3:
+                buffer_append_random(&buffer, state, 18 * (1 + corpus_random(state) % 20));
+                break;
+            case 2:
+                buffer_append(&buffer, "meta", 4);
+                buffer_append_random(&buffer, state, 64);
+                break;
+            case 6:
+                append_picture(&buffer, index / 12, pictureSize);
+                break;
+            case 1:
+                buffer_append(&buffer, NULL, paddingSize);
+                break;
+        }
+        if (buffer.failed) {
+            break;
+        }
+
+        size_t blockLength = buffer.len - start - 4;
+        header[0] = (BYTE)(order[i] | (i == blocks - 1 ? 0x80 : 0));
+        header[1] = (BYTE)(blockLength >> 16);
+        header[2] = (BYTE)(blockLength >> 8);
+        header[3] = (BYTE)blockLength;
+        memcpy(buffer.data + start, header, 4);
+    }
+
+    // Fake audio frames after the metadata
+    buffer_append_random(&buffer, state, CORPUS_AUDIO_MIN + corpus_random(state) % (CORPUS_AUDIO_MAX - CORPUS_AUDIO_MIN));
+
+    if (buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+
+    // A file cut off inside its comment block
+    if (isBroken) {
+        buffer.len = commentEnd - (commentEnd > 64 ? 32 : 1);
+    }
+    if (broken) {
+        *broken = isBroken;
+    }
+    *length = buffer.len;
+    return buffer.data;
+}
+
+bool
+corpus_generate(dir, files, depth, seed, stats)
+    const char* dir;
+    int files;
+    int depth;
+    uint32_t seed;
+    corpusStats* stats;
+{
+    uint32_t state = seed ? seed : 1;
+    char path[_MAX_PATH];
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+    }
+
+    for (int i = 0; i < files; i++) {
+        int levels = depth > 0 ? (int)(corpus_random(&state) % (uint32_t)(depth + 1)) : 0;
+        size_t n = (size_t)snprintf(path, sizeof(path), "%s", dir);
+        size_t length;
+        bool broken;
+        BYTE* data;
+        FILE* file;
+
+        // Spread the files over a few folders per level
+        for (int level = 0; level < levels && n < sizeof(path); level++) {
+            n += snprintf(path + n, sizeof(path) - n, "/set%d", (int)(corpus_random(&state) % 4));
+            if (_mkdir(path) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+        snprintf(path + n, sizeof(path) - n, "/track%05d.flac", i);
+
+        if (!(data = corpus_build_flac(i, &state, &length, &broken))) {
+            return false;
+        }
+        if (!(file = fopen(path, "wb")) || fwrite(data, 1, length, file) != length) {
+            if (file) {
+                fclose(file);
+            }
+            free(data);
+            return false;
+        }
+        fclose(file);
+        free(data);
+
+        if (stats) {
+            stats->files++;
+            stats->broken += broken;
+            stats->bytes += length;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file corpus.h
+ * @brief Declarations for the synthetic FLAC corpus used by the benchmarks.
+ *
+ * Every file is derived from a 32-bit seed, so the same seed always produces the same
+ * corpus. Files vary in the order of their metadata blocks, the number of Vorbis
+ * comments, the size of PICTURE and PADDING blocks and the folder they are placed in.
+ * Tag values contain the function words handled by toLowerCase(), and a small share of
+ * the files is deliberately broken so error paths are exercised as well.
+ */
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include "../include/metadata.h"
+
+#define CORPUS_BROKEN_EVERY 50          // every n-th file has a truncated comment block
+#define CORPUS_MAX_FILLER 40            // extra comments besides the ones meta reads
+#define CORPUS_AUDIO_MIN (16 * 1024)    // bytes of fake audio after the metadata
+#define CORPUS_AUDIO_MAX (64 * 1024)
+
+typedef struct corpusStats {
+    int files;              // files written
+    int broken;             // files expected to be rejected
+    uint64_t bytes;         // total size of the files
+} corpusStats;
+
+/**
+ * @brief Returns the next number of a xorshift32 sequence.
+ *
+ * @param state The generator state; must not be 0.
+ * @return The next pseudo-random number.
+ */
+uint32_t
+corpus_random(uint32_t* state);
+
+/**
+ * @brief Builds one synthetic FLAC file in memory.
+ *
+ * @param index The number of the file within the corpus; selects artist, album and track.
+ * @param state The generator state.
+ * @param length Receives the size of the file.
+ * @param broken Receives true if the file was built to be rejected. May be NULL.
+ * @return The file contents, allocated with malloc(), or NULL if memory runs out.
+ */
+BYTE*
+corpus_build_flac(int index, uint32_t* state, size_t* length, bool* broken);
+
+/**
+ * @brief Builds the body of a Vorbis comment block (vendor string and comments).
+ *
+ * @param index The number of the file; selects artist, album and track.
+ * @param state The generator state.
+ * @param fillers Number of comments added besides the ones meta reads.
+ * @param length Receives the size of the block body.
+ * @return The block body, allocated with malloc(), or NULL if memory runs out.
+ */
+BYTE*
+corpus_build_comments(int index, uint32_t* state, int fillers, size_t* length);
+
+/**
+ * @brief Writes a corpus of synthetic FLAC files.
+ *
+ * @param dir The folder to write to; subfolders are created as needed.
+ * @param files How many files to write.
+ * @param depth How many levels of subfolders the files are spread over.
+ * @param seed Selects the corpus; the same seed writes the same files.
+ * @param stats Receives what was written. May be NULL.
+ * @return true on success, false if a file or folder could not be written.
+ */
+bool
+corpus_generate(const char* dir, int files, int depth, uint32_t seed, corpusStats* stats);
+
+#endif // CORPUS_H
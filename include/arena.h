@@ -0,0 +1,136 @@
+/**
+ * @file arena.h
+ * @brief Declarations for the run-scoped arena and slab allocators.
+ *
+ * An arena hands out memory by bumping a pointer through large chunks; nothing is freed
+ * on its own, the whole arena is rewound or released at once. Paths found by the scan
+ * and their task records come from one arena owned by the main thread. Every thread
+ * that processes files has a scratch arena for the metadata record and the read
+ * window of the file it is working on, rewound before the next file.
+ *
+ * A slab recycles blocks of one fixed size between threads, for buffers that are
+ * filled on one thread and released on another (the headers read by the I/O engine).
+ *
+ * After the first few files neither allocator calls malloc() again, and each one
+ * gives all of its memory back with a single call at the end of the run.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16                      // alignment of every allocation
+#define ARENA_PATH_CHUNK (256 * 1024)       // chunk size of the path arena
+#define ARENA_SCRATCH_CHUNK (64 * 1024)     // scratch arena chunk, on top of the probe size
+#define SLAB_BATCH 16                       // blocks allocated together when a slab runs dry
+
+typedef struct arena arena;
+typedef struct slab slab;
+
+/**
+ * @brief Creates an empty arena.
+ *
+ * @param chunkSize Size of the chunks memory is handed out from. Larger requests get a
+ *                  chunk of their own.
+ * @return The arena, or NULL if memory runs out.
+ */
+arena*
+arena_create(size_t chunkSize);
+
+/**
+ * @brief Allocates memory from an arena. Not thread-safe; an arena has one owner.
+ *
+ * @param a The arena.
+ * @param size Number of bytes, aligned to ARENA_ALIGN.
+ * @return The memory (uninitialized), or NULL if memory runs out.
+ */
+void*
+arena_alloc(arena* a, size_t size);
+
+/**
+ * @brief Returns how many bytes have been handed out since the last reset.
+ */
+size_t
+arena_used(const arena* a);
+
+/**
+ * @brief Rewinds an arena so its memory can be handed out again.
+ *
+ * The first chunk is kept; chunks added because it ran out are freed, so one large
+ * file doesn't keep its memory for the rest of the run.
+ *
+ * @param a The arena. Every pointer handed out by it becomes invalid.
+ */
+void
+arena_reset(arena* a);
+
+/**
+ * @brief Frees an arena and every chunk it holds.
+ *
+ * @param a The arena. May be NULL.
+ */
+void
+arena_destroy(arena* a);
+
+/**
+ * @brief Sets the chunk size of the scratch arenas created from now on.
+ *
+ * @param chunkSize The chunk size; should hold a metadata record and a probe window.
+ */
+void
+arena_scratch_init(size_t chunkSize);
+
+/**
+ * @brief Returns the calling thread's scratch arena, creating it on first use.
+ *
+ * @return The arena, or NULL if memory runs out.
+ */
+arena*
+arena_scratch(void);
+
+/**
+ * @brief Frees the scratch arenas of all threads.
+ *
+ * Must only be called once no other thread uses its scratch arena any more, i.e.
+ * after the worker pool has been destroyed.
+ */
+void
+arena_scratch_release(void);
+
+/**
+ * @brief Creates a slab of fixed-size blocks.
+ *
+ * @param blockSize The size of every block.
+ * @return The slab, or NULL if memory runs out.
+ */
+slab*
+slab_create(size_t blockSize);
+
+/**
+ * @brief Takes a block from a slab. Thread-safe.
+ *
+ * @param s The slab.
+ * @return A block of the slab's size, or NULL if memory runs out.
+ */
+void*
+slab_get(slab* s);
+
+/**
+ * @brief Returns a block to the slab it was taken from. Thread-safe.
+ *
+ * @param s The slab.
+ * @param block The block. May be NULL.
+ */
+void
+slab_put(slab* s, void* block);
+
+/**
+ * @brief Frees a slab and every block it ever handed out.
+ *
+ * @param s The slab. May be NULL.
+ */
+void
+slab_destroy(slab* s);
+
+#endif // ARENA_H
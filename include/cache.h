@@ -0,0 +1,125 @@
+/**
+ * @file cache.h
+ * @brief Declarations for the persistent metadata cache.
+ *
+ * The cache remembers the parsed metadata (or why parsing failed) for files that
+ * stayed in the source folder, keyed on device, inode, size and modification time.
+ * A rerun over an unchanged inbox only has to stat those files instead of reading them.
+ *
+ * On disk the cache is a header, an array of fixed-size entries sorted by key, and a
+ * pool of null terminated strings. It is mapped read-only and searched in place.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "metadata.h"
+
+#define CACHE_FILE "meta.cache"
+#define CACHE_MAGIC "MCACHE03"
+
+typedef enum {
+    CACHE_MISS,         // no record for this key
+    CACHE_PARSED,       // metadata was read successfully
+    CACHE_REJECTED      // the file could not be parsed
+} CacheStatus;
+
+typedef struct cacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;      // nanoseconds
+} cacheKey;
+
+typedef struct cacheHeader {
+    char magic[8];
+    uint32_t count;     // number of entries following the header
+    uint32_t poolSize;  // bytes of string pool following the entries
+} cacheHeader;
+
+typedef struct cacheEntry {
+    cacheKey key;
+    uint32_t strings;   // pool offset of "artist\0album\0title\0date\0genre\0"
+    uint16_t status;    // CacheStatus
+    uint16_t track[2];
+    uint16_t disc[2];
+    uint16_t reason;    // FailReason of a rejected file
+    BYTE audioMd5[AUDIO_MD5_SIZE];  // from STREAMINFO, all zero if unknown
+} cacheEntry;
+
+typedef struct metaCache metaCache;
+
+/**
+ * @brief Opens the cache file and maps its contents.
+ *
+ * A missing, truncated or foreign file is treated as an empty cache.
+ *
+ * @param path The cache file.
+ * @return The cache, or NULL if memory could not be allocated.
+ */
+metaCache*
+cache_open(const char* path);
+
+/**
+ * @brief Builds the cache key of a file from its stat() information.
+ *
+ * @param filename The file to stat.
+ * @param key Receives the key.
+ * @return true on success, false if the file could not be stat'ed.
+ */
+bool
+cache_key(const char* filename, cacheKey* key);
+
+/**
+ * @brief Looks up a file in the cache.
+ *
+ * On CACHE_PARSED the metadata fields of 'meta' are filled in from the record and its
+ * pathname is set to 'filename'. The string fields point into the mapped cache file and
+ * stay valid until cache_close(). Records that are looked up are kept by cache_save().
+ *
+ * @param cache The cache.
+ * @param key The key of the file.
+ * @param filename The current path of the file.
+ * @param meta Receives the cached metadata.
+ * @param reason Receives why the file was rejected on CACHE_REJECTED. May be NULL.
+ * @return CACHE_MISS, CACHE_PARSED or CACHE_REJECTED.
+ */
+CacheStatus
+cache_lookup(metaCache* cache, const cacheKey* key, const char* filename, audioMetaData* meta, FailReason* reason);
+
+/**
+ * @brief Records the outcome of parsing a file.
+ *
+ * Metadata with queued tag edits isn't stored: a record holds the values, not the edits,
+ * so such a file is parsed again next time and its tags are still rewritten.
+ *
+ * @param cache The cache.
+ * @param key The key of the file.
+ * @param meta The parsed metadata, or NULL if parsing failed.
+ * @param reason Why parsing failed, if it did.
+ */
+void
+cache_store(metaCache* cache, const cacheKey* key, const audioMetaData* meta, FailReason reason);
+
+/**
+ * @brief Writes the cache back to disk.
+ *
+ * Only records that were looked up or stored during this run are written, so files
+ * that have left the source folder drop out of the cache. The file is replaced
+ * atomically.
+ *
+ * @param cache The cache.
+ * @return true on success, false otherwise.
+ */
+bool
+cache_save(metaCache* cache);
+
+/**
+ * @brief Unmaps the cache file and frees the cache.
+ *
+ * @param cache The cache. May be NULL.
+ */
+void
+cache_close(metaCache* cache);
+
+#endif // CACHE_H
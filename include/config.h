@@ -5,16 +5,40 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <ctype.h>
 #ifdef _WIN32
 #include <direct.h>
 #include <io.h>
 #else
 #include <unistd.h>
+#include <limits.h>
+#define _MAX_PATH PATH_MAX
+#define _access access
 #endif
 
-#endif // CONFIG_H
-
 #define MAX_CMD 64
+#define MAX_TAGS 8      // --tag settings per run
+
+typedef struct runOptions {
+    int jobs;               // number of worker threads processing files
+    int maxDepth;           // subdirectory levels of Source= to scan, negative for no limit
+    size_t probeSize;       // bytes read from the start of each FLAC file in one go
+    int deferRewrite;       // nonzero to rewrite changed tags after the move instead of before
+    int useCache;           // nonzero to reuse parse results of earlier runs (meta.cache)
+    int watch;              // nonzero to keep running and process new files as they arrive
+    int syncPolicy;         // SYNC_NONE, SYNC_FILE or SYNC_ALL for files copied across file systems
+    int ioBatch;            // files whose headers are read together during the scan, 0 to read each on its own
+    const char* statsPath;  // file the run statistics are appended to, NULL for none
+    int statsInterval;      // seconds between snapshots written during the run, 0 for the final one only
+    int plan;               // nonzero to parse every file first and then move them sorted by destination
+    const char* dryRunPath; // file the plan is written to instead of being carried out, NULL for none
+    const char* executePath;    // plan file to carry out instead of scanning, NULL for none
+    const char* journalPath;    // move journal for crash-safe moves with batched folder syncs, NULL for none
+    int dedup;              // nonzero to leave tracks whose audio is already in the library where they are
+    const char* tags[MAX_TAGS]; // "NAME=value" comments set in every FLAC file
+    int tagCount;
+    int coverArt;           // nonzero to write the front cover of FLAC files to folder.jpg in their album folder
+} runOptions;
 
 /**
  * @brief Checks if the given path is a valid drive path on Windows or a valid relative path on Unix/Linux.
@@ -35,10 +59,52 @@ is_valid_drive_path(const char* path);
  * Reads the source and destination paths from a configuration file named "dir.ini." If the file doesn't exist,
  * it creates the file, initializes it with default values, and prompts the user to set the paths using Notepad on Windows.
  * Validates the paths for existence, validity as drive paths, and read and write permissions.
+ * Any number of optional "Lowercase=word,word,..." lines replace the default list of
+ * function words turned to lowercase in tags (see wordcase.h).
  *
  * @param src_path Buffer to store the source path.
  * @param dest_path Buffer to store the destination path.
  * @return 0 on success, 1 on error.
  */
 int
-setup(char* src_path, char* dest_path);
\ No newline at end of file
+setup(char* src_path, char* dest_path);
+
+
+/**
+ * @brief Parses the command line options.
+ *
+ * Recognized options:
+ *   --jobs N, -j N    Process N files concurrently (default: number of cores).
+ *   --recursive, -r   Scan every subdirectory of the source folder.
+ *   --depth N         Scan at most N levels of subdirectories (default: 0, the source folder only).
+ *   --probe-size N    Read the first N bytes of each FLAC file at once; accepts a K or M suffix (default: 64K).
+ *   --defer-rewrite   Rewrite changed tags once the file has been moved, so files that fail are left untouched.
+ *   --no-cache        Don't read or update the metadata cache (meta.cache).
+ *   --watch           After the initial scan, keep processing new files as they are completed (Linux only).
+ *   --fsync MODE      How much to sync when a file is copied to another file system: none, file or all (default: file).
+ *   --io-batch N      Read the headers of N files at once during the scan, using io_uring where available (default: 0, off).
+ *   --stats FILE      Append per-stage timings and failure counts to FILE as one line of JSON at the end of the run.
+ *   --stats-interval N  Also append a snapshot every N seconds while running (requires --stats).
+ *   --plan            Parse every file first, then move them album by album, sorted by destination.
+ *   --dry-run FILE    Parse every file and write the plan to FILE without moving anything.
+ *   --execute FILE    Carry out a plan written by --dry-run instead of scanning the source folder, with the
+ *                     --tag settings the plan was made with.
+ *   --journal FILE    Record moves in FILE and sync their folders in batches, so moves survive a crash;
+ *                     moves an interrupted run left in FILE are settled first.
+ *   --dedup           Leave FLAC files whose audio (STREAMINFO MD5) is already in the library, or whose
+ *                     destination holds a different encode, in the source folder. Indexed in <library>/.meta-md5.
+ *                     With --execute, the files of the plan are checked as they are moved.
+ *   --tag NAME=VALUE  Set the Vorbis comment NAME to VALUE in every FLAC file, replacing the comments of that
+ *                     name; an empty VALUE removes them. The file is filed under the new value. Up to MAX_TAGS times.
+ *   --cover-art       Write the front cover embedded in FLAC files to folder.jpg (or folder.png) in their album
+ *                     folder, once per album and never over an image meta didn't write.
+ *
+ * @param argc The argument count passed to main().
+ * @param argv The argument vector passed to main().
+ * @param opts The options structure to fill in. Unspecified options get their defaults.
+ * @return 0 on success, 1 on an unknown or malformed option.
+ */
+int
+parse_options(int argc, char* argv[], runOptions* opts);
+
+#endif // CONFIG_H
@@ -0,0 +1,81 @@
+/**
+ * @file coverart.h
+ * @brief Declarations for writing the cover art of --cover-art.
+ *
+ * Media servers look for the art of an album in a file next to its tracks. With
+ * --cover-art, the front cover embedded in the PICTURE block of each FLAC track is
+ * written to folder.jpg (or folder.png) in its album folder. The image is copied from
+ * its offset in the track with move_copy_range(), so it goes from file to file in the
+ * kernel without being read.
+ *
+ * The art of an album is decided once per run, by the first of its tracks that is
+ * filed: tracks of an album that carry different images don't take turns overwriting
+ * each other's. A table keyed by album folder tells which albums are decided, so the
+ * other tracks cost a lookup. The image is copied without holding the table's lock; the
+ * album's other tracks pass over it meanwhile, and if the copy fails, the next one tries. The images are told apart by a fingerprint: their length
+ * and a hash of COVERART_SAMPLE bytes from either end.
+ *
+ * Art the user put in a folder is never overwritten. The image is written when the
+ * folder has none, or replaced when the one it has is still the image meta wrote there,
+ * by this run or an earlier one. Those are kept in a record in the library itself
+ * (COVERART_FILE), with their fingerprints, so an image the user replaced or edited
+ * since is theirs. On disk the record is a header followed by one record per folder:
+ * the length, hash and type of the image, a 16-bit path length and the folder's path
+ * relative to the library.
+ */
+
+#ifndef COVERART_H
+#define COVERART_H
+
+#include "metadata.h"
+
+#define COVERART_NAME "folder"
+#define COVERART_FILE ".meta-covers"
+#define COVERART_MAGIC "MCOVER01"
+#define COVERART_RECORD_SIZE 15     // length, hash, type and path length of a record
+#define COVERART_TYPES 2            // jpg and png
+#define COVERART_SAMPLE 4096        // bytes hashed from each end of an image
+#define COVERART_MIN_SLOTS 256
+
+typedef struct coverArt coverArt;
+
+/**
+ * @brief Opens the table of album folders of a library, with the record of the art
+ *        meta wrote there.
+ *
+ * @param library The library folder.
+ * @return The table, or NULL if memory runs out.
+ */
+coverArt*
+coverart_open(const char* library);
+
+/**
+ * @brief Writes the front cover of a FLAC track to its album folder, if that folder's
+ *        art wasn't decided yet this run. Thread-safe.
+ *
+ * @param covers The table.
+ * @param trackPath The track, in its album folder.
+ * @return true if the folder's art is decided (or the track has none), false if it
+ *         couldn't be read or written (reported).
+ */
+bool
+coverart_write(coverArt* covers, const char* trackPath);
+
+/**
+ * @brief Writes the record of the art meta wrote back to the library, if it changed.
+ *
+ * @param covers The table.
+ * @return true on success.
+ */
+bool
+coverart_save(coverArt* covers);
+
+/**
+ * @brief Frees the table.
+ *
+ * @param covers The table. May be NULL.
+ */
+void
+coverart_close(coverArt* covers);
+
+#endif // COVERART_H
@@ -0,0 +1,58 @@
+/**
+ * @file dircache.h
+ * @brief Declarations for the process-wide cache of destination directories.
+ *
+ * Artist and album folders that have been created or found once are remembered, so
+ * later tracks of the same album need no existence checks at all. On POSIX systems
+ * the cache also keeps up to DIRCACHE_MAX_FDS directories open, so subfolders are
+ * created with mkdirat() and files are moved in with renameat() relative to them.
+ * All functions are safe to call from several worker threads.
+ */
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include "metadata.h"
+
+#define DIRCACHE_MAX_FDS 256
+#define DIRCACHE_NO_FD (-1)         // directory verified, but no descriptor is held
+#define DIRCACHE_FAILED (-2)        // directory could not be opened or created
+
+/**
+ * @brief Makes sure a directory exists and remembers it.
+ *
+ * A cached directory costs one hash lookup. Otherwise the directory is created
+ * relative to 'parentFd' (or by its full path if the parent has no descriptor), an
+ * existing directory being fine, and added to the cache.
+ *
+ * @param path The full path of the directory; used as the cache key.
+ * @param parentFd Descriptor of the parent directory as returned by this function,
+ *                 or DIRCACHE_NO_FD.
+ * @param name The last component of 'path', or NULL to only open an existing directory.
+ * @return A descriptor for the directory, DIRCACHE_NO_FD if the directory exists but no
+ *         descriptor is held, or DIRCACHE_FAILED if it could not be created.
+ */
+int
+dircache_mkdir(const char* path, int parentFd, const char* name);
+
+/**
+ * @brief Moves a file into a cached directory.
+ *
+ * If the directory part of 'newPath' is held open, the file is moved with renameat()
+ * relative to it; otherwise rename() is used. When the target directory has vanished,
+ * its cache entry is dropped so the next file recreates it.
+ *
+ * @param oldPath The current path of the file.
+ * @param newPath The new path of the file.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int
+dircache_rename(const char* oldPath, const char* newPath);
+
+/**
+ * @brief Closes all cached directory descriptors and empties the cache.
+ */
+void
+dircache_clear(void);
+
+#endif // DIRCACHE_H
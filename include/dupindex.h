@@ -0,0 +1,98 @@
+/**
+ * @file dupindex.h
+ * @brief Declarations for the duplicate index of --dedup.
+ *
+ * Every FLAC file carries the MD5 of its decoded audio in STREAMINFO. The index maps
+ * those MD5s to the tracks meta has moved into the library, and their paths back to
+ * the MD5s, so an incoming track is classified with two hash lookups:
+ *
+ *   new               the audio isn't in the library yet
+ *   duplicate         the same audio is already in the library, under any name
+ *   different encode  its destination holds a track with different audio
+ *
+ * Paths are stored relative to the library, and the index is kept in the library
+ * itself (DUPINDEX_FILE), so it stays valid when the library is moved. Tracks that
+ * were removed from the library since they were indexed are noticed on lookup and
+ * forgotten. A library without an index is indexed from the STREAMINFO of its FLAC
+ * files when it is opened, so tracks filed before --dedup was first used count too.
+ *
+ * On disk the index is a header followed by one record per track: the MD5, a 16-bit
+ * path length and the path.
+ */
+
+#ifndef DUPINDEX_H
+#define DUPINDEX_H
+
+#include "metadata.h"
+
+#define DUPINDEX_FILE ".meta-md5"
+#define DUPINDEX_MAGIC "MDUPIX01"
+#define DUPINDEX_MIN_SLOTS 1024
+
+typedef enum {
+    DUP_NEW,            // not in the library; recorded under its destination
+    DUP_DUPLICATE,      // the same audio is already in the library
+    DUP_DIFFERENT       // the destination already holds different audio
+} DupStatus;
+
+typedef struct dupIndex dupIndex;
+
+/**
+ * @brief Opens the duplicate index of a library.
+ *
+ * A missing or foreign index file is rebuilt by reading the STREAMINFO of every FLAC
+ * file in the library.
+ *
+ * @param library The library folder.
+ * @return The index, or NULL if memory runs out.
+ */
+dupIndex*
+dupindex_open(const char* library);
+
+/**
+ * @brief Classifies an incoming track, recording it if it is new. Thread-safe.
+ *
+ * A new track is recorded right away, so a second copy arriving later in the same run
+ * is recognized even before the first one has been moved. If it isn't moved after all,
+ * dupindex_forget() takes it out again.
+ *
+ * @param index The index.
+ * @param md5 The MD5 of the track's audio. Must not be all zero.
+ * @param path The full destination path of the track.
+ * @param existing Receives the full path of the track already in the library on
+ *                 DUP_DUPLICATE and DUP_DIFFERENT.
+ * @param size Size of 'existing'.
+ * @return The classification.
+ */
+DupStatus
+dupindex_classify(dupIndex* index, const BYTE* md5, const char* path, char* existing, size_t size);
+
+/**
+ * @brief Forgets a track dupindex_classify() recorded as new, which wasn't moved. Thread-safe.
+ *
+ * Only one track in the index has that MD5: any later one was classified as a duplicate.
+ *
+ * @param index The index.
+ * @param md5 The MD5 it was classified with.
+ */
+void
+dupindex_forget(dupIndex* index, const BYTE* md5);
+
+/**
+ * @brief Writes the index back to the library if it has changed.
+ *
+ * @param index The index.
+ * @return true on success, false otherwise (with the error reported).
+ */
+bool
+dupindex_save(dupIndex* index);
+
+/**
+ * @brief Frees the index without saving it.
+ *
+ * @param index The index. May be NULL.
+ */
+void
+dupindex_close(dupIndex* index);
+
+#endif // DUPINDEX_H
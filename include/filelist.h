@@ -5,6 +5,13 @@
 
 #endif
 
+#ifndef STDLIB_H
+#define STDLIB_H
+
+#include <stdlib.h>
+
+#endif
+
 #ifndef STRING_H
 #define STRING_H
 
@@ -12,14 +19,55 @@
 
 #endif
 
+#include <stdbool.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#define _MAX_PATH PATH_MAX
+#endif
+
+#include "arena.h"
+
+#define FILELIST_BATCH 256
+
+/**
+ * @brief Callback invoked by scan_directory() for every file found.
+ *
+ * @param filename The full path of the file ("<dir>/<name>"). If the scan was given an arena,
+ *                 the path lives there until the arena is reset; otherwise ownership passes
+ *                 to the callback, which must free() it.
+ * @param ctx The context pointer passed to scan_directory().
+ * @return 0 to continue scanning, nonzero to stop.
+ */
+typedef int (*fileCallback)(char* filename, void* ctx);
+
+/**
+ * @brief Scans a directory tree in a single pass and hands each regular file to a callback.
+ *
+ * Entries are delivered as soon as readdir() returns them, so the caller can start
+ * processing while the scan is still running. On POSIX systems subdirectories are
+ * opened with openat() relative to their parent, and entries reported as DT_UNKNOWN
+ * are resolved with fstatat() instead of being skipped. Symbolic links are not followed.
+ *
+ * @param path The path of the directory.
+ * @param maxDepth How many levels of subdirectories to descend into: 0 scans only 'path',
+ *                 a negative value has no limit.
+ * @param paths The arena the paths are allocated from, or NULL to malloc() each one.
+ * @param callback The function called for every regular file.
+ * @param ctx A context pointer passed through to the callback.
+ * @return The number of files delivered to the callback, or -1 if the directory can't be opened.
+ */
+int
+scan_directory(const char* path, int maxDepth, arena* paths, fileCallback callback, void* ctx);
 
 /**
  * @brief Retrieves the list of filenames in a given directory.
  *
- * Opens the specified directory, counts the number of regular files,
- * allocates memory for an array of strings, and populates it with the names of regular files.
+ * Scans the specified directory once with scan_directory(), growing the array
+ * FILELIST_BATCH entries at a time, and populates it with the names of regular files.
  * Memory allocated for filenames must be freed by the caller.
  *
  * @param path The path of the directory.
@@ -40,7 +88,7 @@ get_filenames(char* path, int* count/*, const char* ext*/);
  * @return A pointer to the file extension in the original filename, or NULL if no extension is found.
  *
  * @note The returned pointer is part of the original filename and should not be modified or freed.
- * @note If the filename ends with a period, or if no period is found, NULL is returned.
+ * @note If the filename ends with a period, or if no period is found after the last '/', NULL is returned.
  */
 char*
 get_file_extension(const char* filename);
@@ -0,0 +1,83 @@
+/**
+ * @file ioengine.h
+ * @brief Declarations for the batched header reader.
+ *
+ * Parsing a FLAC file is dominated by the latency of opening it and reading its first
+ * few kilobytes. The engine collects file names into batches and reads the start of
+ * every file in a batch at once: on Linux the opens and reads of the whole batch are
+ * submitted to an io_uring and handed on in completion order; elsewhere, or when the
+ * kernel refuses io_uring, every file of the batch is opened and given a readahead hint
+ * before the headers are read one by one with pread().
+ */
+
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include "metadata.h"
+#include "arena.h"
+
+#define IOENGINE_MAX_BATCH 4096
+
+/**
+ * @brief Receives the start of a file read by the engine.
+ *
+ * @param filename The file, as given to ioengine_add().
+ * @param data The bytes read from offset 0, or NULL if the file could not be opened or
+ *             read. The buffer comes from the engine's slab; the callback (or whoever
+ *             it hands the buffer on to) returns it with slab_put().
+ * @param len Number of valid bytes in 'data'.
+ * @param ctx The context given to ioengine_create().
+ */
+typedef void (*headerCallback)(char* filename, BYTE* data, size_t len, void* ctx);
+
+typedef struct ioEngine ioEngine;
+
+/**
+ * @brief Creates a header reader.
+ *
+ * @param batch How many files are read together (at most IOENGINE_MAX_BATCH).
+ * @param readSize How many bytes are read from the start of each file.
+ * @param buffers The slab header buffers are taken from; its blocks must hold at least
+ *                readSize bytes. It must outlive every buffer handed out.
+ * @param callback Called once for every file added, from the thread that adds files.
+ * @param ctx Passed to the callback.
+ * @return The engine, or NULL if it could not be created.
+ */
+ioEngine*
+ioengine_create(int batch, size_t readSize, slab* buffers, headerCallback callback, void* ctx);
+
+/**
+ * @brief Adds a file to the current batch; reads the batch once it is full.
+ *
+ * @param engine The engine.
+ * @param filename The file to read. It must stay valid until the callback has been called for it.
+ */
+void
+ioengine_add(ioEngine* engine, char* filename);
+
+/**
+ * @brief Reads the files of a partly filled batch.
+ *
+ * @param engine The engine.
+ */
+void
+ioengine_flush(ioEngine* engine);
+
+/**
+ * @brief Returns the name of the I/O method in use ("io_uring" or "pread").
+ *
+ * @param engine The engine.
+ * @return A static string.
+ */
+const char*
+ioengine_name(const ioEngine* engine);
+
+/**
+ * @brief Flushes the engine and frees it.
+ *
+ * @param engine The engine to destroy. May be NULL.
+ */
+void
+ioengine_destroy(ioEngine* engine);
+
+#endif // IOENGINE_H
@@ -0,0 +1,89 @@
+/**
+ * @file journal.h
+ * @brief Declarations for the move journal of --journal.
+ *
+ * Syncing the source and destination folders after every move costs two fsyncs per
+ * file. The journal makes moves crash-safe at a fraction of that: each move is recorded
+ * in an append-only file before it is carried out, and the folders are synced in
+ * batches (group commit), once per folder for up to JOURNAL_BATCH moves. A commit
+ * record then marks the whole batch durable.
+ *
+ * Files copied across file systems keep their source until the batch is committed, so
+ * a crash can leave a duplicate but never lose a file. When the journal is opened, moves
+ * a previous run left uncommitted are settled: copies whose intent was recorded are
+ * finished by removing the source, half-written copies are rolled back, and folders of
+ * completed renames are synced. A journal that can't be read, or holds a move that can't
+ * be settled, isn't opened at all, so its record of the move is kept. Once a commit leaves
+ * no move pending, the file is emptied, so a long --watch doesn't grow it.
+ *
+ * The file holds one record per line; paths are length-prefixed so any byte may appear
+ * in them:
+ *
+ *   M <seq> <source length> <destination length>\n<source><destination>\n
+ *   X <seq>\n     the move was a copy and its source is still in place
+ *   C <seq>\n     the move is durable, or failed and left nothing to settle
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "metadata.h"
+#include "move.h"
+
+#define JOURNAL_BATCH 64            // moves per group commit
+#define JOURNAL_MAX_DELAY 1000      // ms a move may wait for its commit
+#define JOURNAL_FLUSH_NAP 100       // ms between checks of the flusher thread while a batch waits
+#define JOURNAL_CHUNK (16 * 1024)   // arena chunk size for the paths of a batch
+
+typedef struct moveJournal moveJournal;
+
+/**
+ * @brief Opens a journal, settling the moves a previous run left uncommitted.
+ *
+ * @param path The journal file. Created if it doesn't exist.
+ * @return The journal, or NULL (with the error reported) if it can't be opened or a
+ *         previous run's move in it couldn't be settled.
+ */
+moveJournal*
+journal_open(const char* path);
+
+/**
+ * @brief Moves a file like move_file(), recording it in the journal. Thread-safe.
+ *
+ * The move is durable once its batch is committed: when JOURNAL_BATCH moves have been
+ * made, when the oldest uncommitted move is JOURNAL_MAX_DELAY ms old (checked by a thread
+ * of the journal, so the bound holds while no further moves arrive), or when
+ * journal_commit() or journal_close() is called.
+ *
+ * @param journal The journal.
+ * @param oldPath The current path of the file.
+ * @param newPath The new path of the file. Its folder must exist.
+ * @param sync How much to fsync a copied file before it is renamed into place. A copy is
+ *             always synced, since its source is removed without waiting for the system.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int
+journal_move(moveJournal* journal, const char* oldPath, const char* newPath, SyncPolicy sync);
+
+/**
+ * @brief Commits the moves made since the last commit. Thread-safe.
+ *
+ * @param journal The journal.
+ * @return true on success, false if a folder or the journal couldn't be synced (reported).
+ *         Uncommitted moves are settled by the next journal_open().
+ */
+bool
+journal_commit(moveJournal* journal);
+
+/**
+ * @brief Commits the remaining moves and closes the journal.
+ *
+ * The journal file is removed if everything was committed. If any commit failed, it is
+ * kept so the next journal_open() settles the moves it holds.
+ *
+ * @param journal The journal. May be NULL.
+ */
+void
+journal_close(moveJournal* journal);
+
+#endif // JOURNAL_H
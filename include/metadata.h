@@ -12,41 +12,138 @@
  * @date [11/25/2023]
  */
 
+#ifndef METADATA_H
+#define METADATA_H
+
 #define _CRT_SECURE_NO_WARNINGS 1
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #ifdef _WIN32
 #include <direct.h>
 #include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #else
 #include <unistd.h>
+#include <limits.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #endif
 
-#define strcasecmp _stricmp
+#include "stats.h"
+
+#define FLAC_META_STREAMINFO 0
+#define FLAC_META_PADDING 1
 #define FLAC_META_VORBIS_COMMENT 4
+#define FLAC_META_PICTURE 6
+#define FLAC_PICTURE_OTHER 0    // picture types, see flac_find_cover()
+#define FLAC_PICTURE_FRONT 3
+#define FLAC_MIME_MAX 64        // longer MIME types are not images we write out
+#define FLAC_MAX_BLOCK 0xFFFFFF     // block lengths are 24 bits
+#define FLAC_REWRITE_PADDING 8192   // padding left after the comments when a file is rewritten
+#define FLAC_REWRITE_SUFFIX ".meta-tags"
+#define FLAC_STREAMINFO_SIZE 34
+#define OGG_PAGE_HEADER 27      // bytes before the lacing table of a page
+#define OGG_FLAG_CONTINUED 0x01 // the page goes on with a packet from the page before
+#define OGG_FLAG_FIRST 0x02     // first page of a logical stream
+#define OGG_MAX_COMMENTS (16 * 1024 * 1024)  // larger comment packets are refused rather than read
+#define MP4_MAX_VALUE (64 * 1024)           // larger ilst values are skipped rather than read
+#define FLAC_STREAMINFO_MD5 18  // offset of the MD5 of the decoded audio in STREAMINFO
+#define AUDIO_MD5_SIZE 16
+#define FLAC_PROBE_SIZE (64 * 1024)
+#define FLAC_PROBE_MIN 4096
+#define FLAC_MAX_EDITS 8
+#define VORBIS_TAG_MAX 11   // length of the longest recognized comment name
+#define ID3_HEADER_SIZE 10
+#define ID3_MAX_SIZE (16 * 1024 * 1024)  // larger tags are refused rather than read
 #define MAX_LENGTH 128
 #define FULL_PERMISSIONS 0777
 
+#ifdef _WIN32
+#define strcasecmp _stricmp
 typedef unsigned char BYTE;
 typedef unsigned long DWORD;
+typedef __int64 fileOffset; // long is 32 bits on Windows, too few for files over 2 GB
+#else
+#define _MAX_PATH PATH_MAX
+#define _access access
+#define _mkdir(path) mkdir(path, FULL_PERMISSIONS)
+#define _strnicmp strncasecmp
+#define _open open
+#define _read read
+#define _lseek lseek
+#define _lseeki64 lseek
+#define _close close
+#define _O_RDONLY O_RDONLY
+#define _O_BINARY 0
+typedef unsigned char BYTE;
+typedef uint32_t DWORD;     // FLAC length fields are 32 bits; unsigned long is 64 on LP64
+typedef off_t fileOffset;
+#endif
+
+typedef struct tagEdit {
+    int offset;             // file offset of the value to overwrite
+    int length;             // number of bytes in text
+    const char* text;       // replacement bytes, same length as the original value; points into the field
+} tagEdit;
 
+// The string fields hold whole tag values however long they are. They point into the
+// scratch arena of the thread that parsed the file, or into the metadata cache, and are
+// not modified once parsing is done.
 typedef struct audioMetaData {
     char pathname[_MAX_PATH];
     char fileext[10];
-    char artist[64];
-    char album[128];
-    char title[128];
+    const char* artist;
+    const char* album;
+    const char* title;
     char date[5];
-    char genre[32];
+    const char* genre;
     int track[2];
     int disc[2];
     int metaPtr;
     int offset[9];      // enum MetadataField is for the index of this array
+    tagEdit edits[FLAC_MAX_EDITS];  // in-place rewrites queued while parsing
+    int editCount;
+    BYTE audioMd5[AUDIO_MD5_SIZE];  // MD5 of the decoded audio from STREAMINFO, all zero if unknown
 } audioMetaData;
 
+typedef struct flacProbe {
+    int fd;             // the FLAC file, -1 until opened
+    BYTE* data;         // window over part of the file
+    size_t cap;         // allocated size of data
+    fileOffset base;    // file offset of data[0]
+    size_t len;         // valid bytes in data
+    const char* path;   // opened on demand when 'fd' is -1
+} flacProbe;
+
+typedef struct coverImage {
+    fileOffset offset;  // file offset of the image data
+    DWORD length;       // size of the image data, 0 if there is none
+    const char* ext;    // "jpg" or "png"
+} coverImage;
+
+typedef struct oggPage {
+    DWORD serial;       // logical stream the page belongs to
+    int flags;          // OGG_FLAG_CONTINUED, OGG_FLAG_FIRST
+    int segments;       // entries in lacing
+    BYTE lacing[255];   // segment sizes; a size below 255 ends a packet
+    fileOffset body;    // file offset of the page data
+    fileOffset next;    // file offset of the next page
+} oggPage;
+
+typedef struct mp4Atom {
+    BYTE type[4];       // e.g. "moov", or 0xA9 "ART" in ilst
+    fileOffset body;    // file offset of the contents, after the header
+    fileOffset end;     // file offset just past the atom
+} mp4Atom;
+
 typedef enum {
     Artist,       // 0
     Album,        // 1
@@ -59,20 +156,23 @@ typedef enum {
     TotalDiscs    // 8
 } MetadataField;
 
-/**
- * @brief Initializes an audioMetaData structure with default values.
- *
- * This function initializes an audioMetaData structure by setting default values
- * for various metadata fields. It is typically called before populating the structure
- * with actual metadata from a file.
- *
- * @param meta Pointer to the audioMetaData structure to be initialized.
- * @param filename The path to the audio file associated with the metadata.
- * @param ext The file extension of the audio file.
- */
-static void
-initialize_audioMetaData(audioMetaData* meta, const char* filename, char* ext);
+typedef struct vorbisTag {
+    const char* name;       // upper case comment name without the '='
+    MetadataField field;    // where the value is stored
+} vorbisTag;
 
+typedef struct id3Frame {
+    char id[5];             // ID3v2.3/2.4 frame id
+    char id22[4];           // ID3v2.2 frame id, empty if there is none
+    MetadataField field;    // where the value is stored
+} id3Frame;
+
+typedef struct mp4Item {
+    char type[5];           // ilst item type, 0xA9 written as "\xA9"
+    MetadataField field;    // where the value is stored
+} mp4Item;
+
+typedef struct caseSpan caseSpan;
 
 /**
  * @brief Prints the audio metadata to the console.
@@ -87,92 +187,119 @@ print_audioMetaData(audioMetaData* meta);
 
 
 /**
- * @brief Validates the FLAC metadata block by checking for the presence of "libFLAC".
+ * @brief Applies the tag rewrites queued while parsing a file.
  *
- * This function checks if the FLAC metadata block contains the expected "libFLAC"
- * identifier, validating the integrity of the metadata. It advances the buffer
- * pointer and updates the offset if the identifier is found.
+ * All pending edits are written through a single open of the file using positioned
+ * writes. The edits keep their original lengths, so they can be applied either to the
+ * source file before it is moved or to the file at its new location afterwards.
  *
- * @param buffer Pointer to the buffer containing the FLAC metadata block.
- *               The pointer is advanced if validation is successful.
- * @param offset Pointer to the offset tracking the position in the FLAC metadata block.
- *               The offset is updated if validation is successful.
- * @param length The length of the identifier in the metadata block.
+ * @param meta The audioMetaData structure holding the queued edits. The queue is emptied.
+ * @param path The file to write to.
+ * @return true if every edit was written (or there was nothing to write), false otherwise.
+ */
+bool
+write_pending_tags(audioMetaData* meta, const char* path);
+
+
+/**
+ * @brief Writes a list of tag edits to a file, as write_pending_tags() does.
  *
- * @return Returns true if validation is successful, indicating the presence of "libFLAC",
- *         and false if validation fails.
+ * @param edits The edits.
+ * @param count Number of edits.
+ * @param path The file to write to.
+ * @return true if every edit was written (or there was nothing to write), false otherwise.
+ */
+bool
+write_tag_edits(const tagEdit* edits, int count, const char* path);
+
+
+/**
+ * @brief Sets a tag in the audioMetaData structure as if the file carried it.
+ *
+ * Used for the --tag settings, so tracks are filed under the tags they are given.
+ * Names parseVorbisComments() doesn't recognize are ignored; an empty value resets the
+ * field to its default.
  *
- * @note The function dynamically allocates memory for the identifier string and frees it
- *       before returning. The caller is responsible for freeing the memory
- *       allocated for the identifier string.
+ * @param meta Pointer to the audioMetaData structure to be updated.
+ * @param comment The setting as a Vorbis comment, "NAME=value".
  */
-static bool
-validateFlacMeta(BYTE** buffer, int* offset, DWORD length);
+void
+apply_tag_setting(audioMetaData* meta, const char* comment);
 
 
 /**
- * @brief Updates metadata in the file.
+ * @brief Sets Vorbis comments in a FLAC file.
  *
- * This function updates specified metadata (ARTIST, ALBUM, TITLE) in the provided
- * audioMetaData structure and writes the changes back to the file. It uses the type
- * parameter to determine which field to update.
+ * Comments with the names of the settings are replaced by them. The comment block is
+ * rewritten where it is, growing into or shrinking the PADDING block that follows it,
+ * so an edit is usually a single small write at the start of the file:
  *
- * @param flac_meta Pointer to the audioMetaData structure containing metadata.
- * @param type The type of metadata to update (ARTIST, ALBUM, TITLE).
- * @param tagString The tag string containing the new metadata.
- * @param totalBytes The total number of bytes processed in the FLAC metadata block.
+ *   - a block of the same size is overwritten;
+ *   - otherwise the padding takes up the difference, if it is large enough;
+ *   - or the comments take the padding's place entirely.
  *
- * @note The function modifies the metadata in the audioMetaData structure and writes
- *       the changes to the file. It also converts the updated field to lowercase,
- *       if applicable.
+ * Only when there is too little padding is the file rewritten with rewrite_flac_file()
+ * into a temporary file (FLAC_REWRITE_SUFFIX), which then replaces it atomically.
+ *
+ * @param path The FLAC file.
+ * @param tags The settings, as "NAME=value" comments. An empty value removes the comment.
+ * @param count Number of settings.
+ * @return true if the comments are set (or already were), false otherwise (reported).
+ *         On failure the file is left as it was, unless an in-place write failed halfway.
  */
-static void
-updateMetadata(struct audioMetaData* flac_meta, enum MetadataType type, const char* tagString, int totalBytes);
+bool
+flac_write_comments(const char* path, const char* const* tags, int count);
 
 
 /**
- * @brief Replaces specified characters in a string with hyphens.
+ * @brief Finds the front cover among the PICTURE blocks of a FLAC file.
  *
- * This function iterates through each character in the input string and replaces
- * occurrences of '/', '\\', and '?' with hyphens ('-'). It modifies the input
- * string in-place.
+ * Only the block headers and the start of each PICTURE block are read, never the image
+ * itself. A picture of type FLAC_PICTURE_FRONT is preferred; without one, the first
+ * picture of type FLAC_PICTURE_OTHER is taken, as some taggers store the cover that way.
+ * Images other than JPEG and PNG are ignored.
  *
- * @param str Pointer to the string in which characters are to be replaced.
+ * @param fd The FLAC file.
+ * @param image Receives the location of the image; its length is 0 if there is none.
+ * @return true on success, false if the file isn't a FLAC file or a block is corrupt.
  */
-static void
-replaceChars(char *str);
+bool
+flac_find_cover(int fd, coverImage* image);
 
 
 /**
- * @brief Parses the FLAC metadata block and updates the audioMetaData structure.
+ * @brief Reads the MD5 of the decoded audio from the STREAMINFO block of a FLAC file.
  *
- * This function is responsible for parsing the FLAC metadata block, extracting
- * relevant information, and updating the audioMetaData structure accordingly.
- * It specifically handles tags such as ARTIST, ALBUM, TITLE, GENRE, DATE,
- * TRACKNUMBER, TRACKTOTAL, DISCNUMBER, DISCTOTAL, etc.
+ * Only the marker and the first block are read.
  *
- * @param flac_meta Pointer to the audioMetaData structure to be updated.
- * @param buffer Pointer to the buffer containing the FLAC metadata block.
- * @param size Size of the FLAC metadata block.
+ * @param path The FLAC file.
+ * @param md5 Receives AUDIO_MD5_SIZE bytes; all zero if the encoder didn't compute it.
+ * @return false if the file can't be read or doesn't start with STREAMINFO.
+ */
+bool
+flac_read_audio_md5(const char* path, BYTE* md5);
+
+
+/**
+ * @brief Sets how many bytes get_audioMetaData_flac() reads from the start of a file at once.
  *
- * @return Returns true on successful parsing and updating of metadata, and false
- *         on any errors during the process.
+ * The default is FLAC_PROBE_SIZE. Values below FLAC_PROBE_MIN are raised to it.
  *
- * @note The function dynamically allocates memory for the tagString and frees it
- *       before returning. The caller is responsible for freeing the memory
- *       allocated for the tagString.
+ * @param size The probe size in bytes.
  */
-static bool
-parseFlacMeta(audioMetaData* flac_meta, BYTE* buffer, int size);
+void
+set_flac_probe_size(size_t size);
 
 
 /**
  * @brief Retrieves metadata for a FLAC file.
  *
- * This function allocates memory for an audioMetaData structure, reads the header
- * of a FLAC file to check for validity, and processes the FLAC metadata blocks,
- * specifically the Vorbis comment block. It returns a pointer to the created
- * audioMetaData structure.
+ * This function allocates an audioMetaData structure, reads the header
+ * region of a FLAC file with a single read of the probe size (see set_flac_probe_size()),
+ * checks it for validity and walks the FLAC metadata blocks in memory up to the
+ * Vorbis comment block. A second read is only made when a block header or the
+ * comment block lies outside that window, e.g. behind a large PICTURE block.
+ * It returns a pointer to the created audioMetaData structure.
  *
  * @param filename The path to the FLAC file from which metadata is to be retrieved.
  *
@@ -181,67 +308,107 @@ parseFlacMeta(audioMetaData* flac_meta, BYTE* buffer, int size);
  *         is not a valid FLAC file, or if memory allocation fails. Errors are
  *         printed to stderr.
  *
- * @note The caller is responsible for freeing the allocated memory using free()
- *       when done using the audioMetaData structure.
+ * @note The structure and the read window come from the calling thread's scratch arena
+ *       (see arena.h); they stay valid until the caller resets that arena and must not
+ *       be freed.
  */
 audioMetaData*
 get_audioMetaData_flac(const char* filename);
 
 
 /**
- * @brief Retrieves metadata for an MP3 file with ID3 tags.
+ * @brief Retrieves metadata for a FLAC file whose first bytes have already been read.
  *
- * This function allocates memory for an audioMetaData structure, reads the header
- * of an MP3 file to check for the presence of ID3 tags, and initializes default
- * values for artist, album, and other metadata fields. It returns a pointer to the
- * created audioMetaData structure.
+ * Works like get_audioMetaData_flac(), but the probe window starts out with 'data',
+ * e.g. as read by the batched header reader (see ioengine.h). The file itself is only
+ * opened if a block lies beyond the bytes given.
  *
- * @param filename The path to the MP3 file from which metadata is to be retrieved.
+ * @param filename The path to the FLAC file.
+ * @param data The first 'len' bytes of the file. They are only read; the caller
+ *             keeps ownership.
+ * @param len Number of bytes in 'data'.
  *
- * @return Returns a pointer to the allocated audioMetaData structure on success,
- *         or NULL on failure. Failure can occur if the file cannot be opened,
- *         is not an ID3v2 MP3 file, or if memory allocation fails. Errors are
- *         printed to stderr.
+ * @return As for get_audioMetaData_flac().
+ */
+audioMetaData*
+get_audioMetaData_flac_prefix(const char* filename, BYTE* data, size_t len);
+
+
+/**
+ * @brief Retrieves metadata for an Ogg Vorbis or Opus file.
+ *
+ * The pages are walked from the start of the file with the probe window of
+ * get_audioMetaData_flac(). The identification header on the first page tells Vorbis
+ * from Opus; the comment header (Vorbis packet type 3, or OpusTags) that follows is
+ * reassembled from its pages and parsed with parseVorbisComments(). Audio pages are
+ * never parsed.
+ *
+ * Changed tags are not rewritten in Ogg files: a value may be split across pages, and
+ * every page carries a checksum of its contents.
  *
- * @note The caller is responsible for freeing the allocated memory using free()
- *       when done using the audioMetaData structure.
+ * @param filename The path to the Ogg file.
+ *
+ * @return As for get_audioMetaData_flac(). meta->fileext is the extension of the file.
  */
 audioMetaData*
-get_audioMetaData_mp3(const char* filename);
+get_audioMetaData_ogg(const char* filename);
 
 
 /**
- * @brief Converts specified "function words" in a string to lowercase.
+ * @brief Retrieves metadata for an MP4 (AAC or ALAC) file.
  *
- * This function takes a string and converts specific "function words" to lowercase.
- * Function words are defined in the 'words' array and include common words like
- * "In," "Is," "The," etc. The function iterates through the string and converts
- * occurrences of these function words to lowercase.
+ * Top-level atoms are hopped with positioned reads of their headers until moov is
+ * found, so an mdat of any size before it costs nothing. The tags are then read from
+ * moov/udta/meta/ilst (or moov/meta/ilst). A file without tags is returned with
+ * blank fields.
  *
- * @param str Pointer to the string to be processed. The function modifies this
- *            string in-place.
+ * @param filename The path to the MP4 file.
  *
- * @return Returns the number of conversions (number of function words converted to
- *         lowercase) in the given string.
+ * @return As for get_audioMetaData_flac(). meta->fileext is the extension of the file.
  */
-static int
-toLowerCase(char* str);
+audioMetaData*
+get_audioMetaData_mp4(const char* filename);
 
 
 /**
- * @brief Handle error messages by printing them to the standard error stream.
+ * @brief Retrieves metadata for an MP3 file with ID3v2 tags.
+ *
+ * This function allocates an audioMetaData structure, reads the 10 byte
+ * ID3v2 header of an MP3 file and then the whole tag with one read of the size given
+ * in the header. Versions 2.2, 2.3 and 2.4 are supported, including extended headers
+ * and unsynchronisation. It returns a pointer to the created audioMetaData structure.
  *
- * This function prints an error message to the standard error stream.
+ * @param filename The path to the MP3 file from which metadata is to be retrieved.
  *
- * @param message The error message to be printed.
+ * @return Returns a pointer to the allocated audioMetaData structure on success,
+ *         or NULL on failure. Failure can occur if the file cannot be opened,
+ *         is not an ID3v2 MP3 file, or if memory allocation fails. Errors are
+ *         printed to stderr.
+ *
+ * @note The structure and the tag buffer come from the calling thread's scratch arena,
+ *       as for get_audioMetaData_flac().
+ */
+audioMetaData*
+get_audioMetaData_mp3(const char* filename);
+
+
+/**
+ * @brief Handle errors by counting them and printing their message to the standard error stream.
+ *
+ * This function counts the failure in the run statistics (see stats.h) and prints the
+ * message that belongs to the reason to the standard error stream.
+ *
+ * @param reason Why the file (or the run) failed.
  */
 void
-handle_error(const char* message);
+handle_error(FailReason reason);
 
 /**
  * @brief Create an artist folder in the specified destination directory.
  *
  * This function creates an artist folder in the specified destination directory.
+ * Folders are remembered in the directory cache (see dircache.h), so only the first
+ * track of an artist touches the file system.
  *
  * @param dest_dir The destination directory where the artist folder should be created.
  * @param artist The name of the artist for whom the folder is created.
@@ -254,7 +421,8 @@ create_artist_folder(const char* dest_dir, const char* artist, char* folder_name
 /**
  * @brief Create an album folder in the specified destination directory.
  *
- * This function creates an album folder in the specified destination directory.
+ * This function creates an album folder in the specified destination directory,
+ * relative to the cached artist folder where possible.
  *
  * @param dest_dir The destination directory where the album folder should be created.
  * @param artist The name of the artist for whom the album folder is created.
@@ -265,17 +433,43 @@ create_artist_folder(const char* dest_dir, const char* artist, char* folder_name
 bool
 create_album_folder(const char* dest_dir, const char* artist, const char* album, char* folder_name);
 
+/**
+ * @brief Formats the name a file gets in its album folder, "NN. Title.ext".
+ *
+ * Characters that can't be part of a file name are replaced in the copy of the title.
+ *
+ * @param meta The audioMetaData structure containing file information.
+ * @param name Receives the file name.
+ * @param size The size of 'name'.
+ * @return True on success, false if the name doesn't fit.
+ */
+bool
+format_file_name(const audioMetaData* meta, char* name, size_t size);
+
 /**
  * @brief Reformat the file name and path.
  *
- * This function reformats the file name and path by replacing specific characters.
+ * This function builds the new pathname from the folder, track number and title,
+ * replacing specific characters of the title in the copy; the title itself is left as is.
  *
  * @param meta The audioMetaData structure containing file information.
  * @param folder_name The name of the folder in which the file is stored.
+ * @return True on success, false if the path would not fit in the pathname.
  */
-void
+bool
 reformat_file_path(audioMetaData* meta, const char* folder_name);
 
+/**
+ * @brief Works out the name of the artist folder, moving a leading "The " to the end.
+ *
+ * @param meta The audioMetaData structure containing file information.
+ * @param artist Receives the folder name; MAX_LENGTH bytes.
+ * @return True on success, false (with the error reported) if the artist or album is
+ *         blank or the name is too long.
+ */
+bool
+get_artist_folder_name(const audioMetaData* meta, char* artist);
+
 /**
  * @brief Create the album folder structure.
  *
@@ -287,3 +481,5 @@ reformat_file_path(audioMetaData* meta, const char* folder_name);
  */
 bool
 create_folder_structure(audioMetaData* meta, const char* dest_dir);
+
+#endif // METADATA_H
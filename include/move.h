@@ -0,0 +1,120 @@
+/**
+ * @file move.h
+ * @brief Declarations for moving files into the library.
+ *
+ * A move is a rename whenever possible. When the source and destination are on
+ * different file systems, the file is copied instead: first as a reflink clone, then
+ * with copy_file_range() or sendfile() so the kernel does the copy, and only as a last
+ * resort through a user buffer. The copy is written to a temporary name, checked for
+ * size, synced according to the sync policy, renamed into place, and the source is
+ * unlinked afterwards. On Windows the copy is made with CopyFile() and checked and
+ * renamed the same way.
+ */
+
+#ifndef MOVE_H
+#define MOVE_H
+
+#include "metadata.h"
+
+#define MOVE_CHUNK (64 * 1024 * 1024)   // bytes per copy_file_range()/sendfile() call
+#define MOVE_BUFFER (1024 * 1024)       // buffer size for the userspace copy
+#define MOVE_TMP_SUFFIX ".meta-part"
+
+typedef enum {
+    SYNC_NONE,      // leave flushing to the operating system
+    SYNC_FILE,      // fsync the copied file before the source is removed
+    SYNC_ALL        // also fsync the destination folder after the copy is renamed into place
+} SyncPolicy;
+
+/**
+ * @brief Moves a file, falling back to a copy when it has to cross file systems.
+ *
+ * @param oldPath The current path of the file.
+ * @param newPath The new path of the file. Its folder must exist.
+ * @param sync How much to fsync when the file has to be copied.
+ * @return 0 on success, -1 on failure with errno set. On failure the source is left in place.
+ */
+int
+move_file(const char* oldPath, const char* newPath, SyncPolicy sync);
+
+/**
+ * @brief Moves a file like move_file(), optionally leaving the source of a copy in place.
+ *
+ * Used by the journal (see journal.h), which removes the sources of copies itself once
+ * the folders of a whole batch of moves have been synced.
+ *
+ * @param oldPath The current path of the file.
+ * @param newPath The new path of the file. Its folder must exist.
+ * @param sync How much to fsync when the file has to be copied. With 'keepSource' the
+ *             destination folder is never synced here.
+ * @param copied Set to true if the file was copied rather than renamed.
+ * @param keepSource Nonzero to leave the source of a copy for the caller to remove.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int
+move_file_keep(const char* oldPath, const char* newPath, SyncPolicy sync, bool* copied, int keepSource);
+
+/**
+ * @brief Copies the folder part of a path, up to its last slash or backslash.
+ *
+ * @param path The path.
+ * @param dir Receives the folder; "." for a bare file name, "/" for a file in the root.
+ * @param size Size of 'dir'.
+ * @return false if the folder doesn't fit.
+ */
+bool
+move_parent_of(const char* path, char* dir, size_t size);
+
+/**
+ * @brief Syncs a folder, so the renames and unlinks made in it are durable.
+ *
+ * Folders can't be synced on Windows, where this does nothing; moves there write through.
+ *
+ * @param dir The folder.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int
+move_sync_dir(const char* dir);
+
+/**
+ * @brief Syncs the folder that holds a file, see move_sync_dir().
+ *
+ * @param path The file.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int
+move_sync_parent(const char* path);
+
+/**
+ * @brief Renames a finished temporary file over the file it replaces, atomically.
+ *
+ * On Windows this is MoveFileEx() with MOVEFILE_REPLACE_EXISTING and
+ * MOVEFILE_WRITE_THROUGH, so the old file is never missing; elsewhere rename().
+ *
+ * @param tmpPath The temporary file.
+ * @param path The file to replace. Need not exist.
+ * @return 0 on success, -1 on failure with errno set. On failure both files are left as they are.
+ */
+int
+move_replace(const char* tmpPath, const char* path);
+
+/**
+ * @brief Copies a range of bytes from one file to another.
+ *
+ * The kernel copies with copy_file_range() where it can, then with sendfile(); otherwise,
+ * or from where it stopped, the bytes go through a user buffer of MOVE_BUFFER bytes. Used
+ * by the FLAC tag rewrite (see flac_write_comments()) to copy the audio frames and by
+ * --cover-art (see coverart.h) to copy embedded images. The file position of 'dst' may
+ * change.
+ *
+ * @param src The file to copy from.
+ * @param srcOffset Offset of the range in 'src'.
+ * @param dst The file to copy to.
+ * @param dstOffset Offset the range is copied to in 'dst'.
+ * @param size Number of bytes to copy.
+ * @return 0 on success, -1 on failure with errno set (EIO if 'src' ends early).
+ */
+int
+move_copy_range(int src, fileOffset srcOffset, int dst, fileOffset dstOffset, fileOffset size);
+
+#endif // MOVE_H
@@ -0,0 +1,160 @@
+/**
+ * @file plan.h
+ * @brief Declarations for the move plan of --plan, --dry-run and --execute.
+ *
+ * In plan mode every file is parsed first and its destination recorded instead of
+ * moving it right away. The plan is then sorted by destination folder and carried out
+ * album by album, so each folder is created once and the renames into it follow one
+ * another instead of bouncing between albums in readdir() order.
+ *
+ * A plan can be written to a file and carried out later without parsing again. The
+ * file is text, one line per file:
+ *
+ *   T <NAME=VALUE>
+ *   F <source> <library> <artist folder> <album folder> <file name>
+ *   E <dev> <ino> <size> <mtime> <offset>:<hex bytes> ...
+ *
+ * with fields separated by tabs and tabs, newlines and backslashes inside them written
+ * as \t, \n and \\. The T lines come first and hold the --tag settings the plan was
+ * made with: the destinations already use the new values, so the same comments are set
+ * when the plan is carried out. An E line holds the tag rewrites of the F line before it,
+ * together with the cache key of the source file when they were queued; the rewrites are
+ * skipped if the file has changed since.
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "metadata.h"
+#include "config.h"
+#include "cache.h"
+#include "track.h"
+
+#define PLAN_HEADER "# meta move plan 1"
+#define PLAN_MIN_ENTRIES 1024
+
+typedef struct planEdits {
+    cacheKey key;           // the source file when the edits were queued
+    int count;
+    tagEdit edits[FLAC_MAX_EDITS];
+} planEdits;
+
+typedef struct planEntry {
+    const char* source;     // the file to move, see plan_add()
+    const lstr* library;    // destination folder, interned
+    const lstr* artist;     // artist folder name, interned
+    const lstr* album;      // album folder name, interned
+    const lstr* name;       // file name inside the album folder
+    const planEdits* edits; // tag rewrites, or NULL
+    BYTE audioMd5[AUDIO_MD5_SIZE];  // as classified by --dedup; all zero in a plan read from a file
+} planEntry;
+
+typedef struct movePlan movePlan;
+
+/**
+ * @brief Creates an empty plan.
+ *
+ * @return The plan, or NULL if memory runs out.
+ */
+movePlan*
+plan_create(void);
+
+/**
+ * @brief Adds a move to the plan. Thread-safe.
+ *
+ * The folder and file names are copied into the plan; the tag edits queued in 'meta'
+ * are copied along with the cache key of the source file, and so is its audio MD5.
+ *
+ * @param plan The plan.
+ * @param source The file to move. Not copied; it must stay valid as long as the plan.
+ * @param library The destination folder.
+ * @param artist The artist folder name.
+ * @param meta The parsed metadata; supplies the album folder name and the tag edits.
+ * @param name The file name inside the album folder.
+ * @return true on success, false if memory runs out.
+ */
+bool
+plan_add(movePlan* plan, const char* source, const char* library, const char* artist,
+         const audioMetaData* meta, const char* name);
+
+/**
+ * @brief Records the --tag settings the plan is made with.
+ *
+ * @param plan The plan.
+ * @param tags "NAME=VALUE" settings, copied into the plan.
+ * @param count The number of settings, at most MAX_TAGS.
+ * @return true on success, false if memory runs out.
+ */
+bool
+plan_set_tags(movePlan* plan, const char* const* tags, int count);
+
+/**
+ * @brief Returns the --tag settings of the plan, valid as long as the plan.
+ *
+ * @param plan The plan.
+ * @param count Set to the number of settings.
+ */
+const char* const*
+plan_tags(const movePlan* plan, int* count);
+
+/**
+ * @brief Sorts the plan by destination: library, artist, album, then file name.
+ */
+void
+plan_sort(movePlan* plan);
+
+/**
+ * @brief Returns the number of moves in the plan.
+ */
+int
+plan_count(const movePlan* plan);
+
+/**
+ * @brief Returns the moves of the plan, in the order of the last plan_sort().
+ */
+const planEntry*
+plan_entries(const movePlan* plan);
+
+/**
+ * @brief Tells whether two moves go to the same album folder.
+ */
+bool
+plan_same_folder(const planEntry* a, const planEntry* b);
+
+/**
+ * @brief Tells whether the source file of a move is unchanged since its tag edits were queued.
+ *
+ * @param entry The move. Must have edits.
+ * @return true if the file's cache key still matches.
+ */
+bool
+plan_source_unchanged(const planEntry* entry);
+
+/**
+ * @brief Writes a plan to a file in the format described above.
+ *
+ * @param plan The plan.
+ * @param path The file to create or replace.
+ * @return true on success, false otherwise (with the error reported).
+ */
+bool
+plan_write(const movePlan* plan, const char* path);
+
+/**
+ * @brief Reads a plan written by plan_write().
+ *
+ * @param path The plan file.
+ * @return The plan, or NULL (with the error reported) if the file can't be read or is malformed.
+ */
+movePlan*
+plan_read(const char* path);
+
+/**
+ * @brief Frees a plan and everything it copied.
+ *
+ * @param plan The plan. May be NULL.
+ */
+void
+plan_destroy(movePlan* plan);
+
+#endif // PLAN_H
@@ -0,0 +1,163 @@
+/**
+ * @file pool.h
+ * @brief Declarations for the worker pool used by the ingest loop.
+ *
+ * This header declares a small fixed-size thread pool with a bounded task queue,
+ * portable mutex/condition wrappers for Windows and POSIX, and a per-worker output
+ * buffer so that messages printed while a file is being processed are written to
+ * the console as one uninterrupted block.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef HANDLE thread_t;
+
+#define MUTEX_INITIALIZER       SRWLOCK_INIT
+#define mutex_init(m)           InitializeSRWLock(m)
+#define mutex_lock(m)           AcquireSRWLockExclusive(m)
+#define mutex_unlock(m)         ReleaseSRWLockExclusive(m)
+#define mutex_destroy(m)        ((void)0)
+#define cond_init(c)            InitializeConditionVariable(c)
+#define cond_wait(c, m)         SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define cond_signal(c)          WakeConditionVariable(c)
+#define cond_broadcast(c)       WakeAllConditionVariable(c)
+#define cond_destroy(c)         ((void)0)
+#define atomic_increment(p)     InterlockedIncrement((volatile LONG*)(p))
+#define THREAD_LOCAL            __declspec(thread)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_t thread_t;
+
+#define MUTEX_INITIALIZER       PTHREAD_MUTEX_INITIALIZER
+#define mutex_init(m)           pthread_mutex_init(m, NULL)
+#define mutex_lock(m)           pthread_mutex_lock(m)
+#define mutex_unlock(m)         pthread_mutex_unlock(m)
+#define mutex_destroy(m)        pthread_mutex_destroy(m)
+#define cond_init(c)            pthread_cond_init(c, NULL)
+#define cond_wait(c, m)         pthread_cond_wait(c, m)
+#define cond_signal(c)          pthread_cond_signal(c)
+#define cond_broadcast(c)       pthread_cond_broadcast(c)
+#define cond_destroy(c)         pthread_cond_destroy(c)
+#define atomic_increment(p)     __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define THREAD_LOCAL            _Thread_local
+#endif
+
+#define POOL_QUEUE_PER_THREAD 64
+
+typedef void (*poolTask)(void* arg);
+
+typedef struct workPool workPool;
+
+/**
+ * @brief Returns the number of online processor cores.
+ *
+ * @return The core count, or 1 if it cannot be determined.
+ */
+int
+get_core_count(void);
+
+/**
+ * @brief Creates a worker pool and starts its threads.
+ *
+ * The task queue holds POOL_QUEUE_PER_THREAD entries per thread; pool_submit()
+ * blocks while the queue is full so a fast producer can't run ahead of the workers.
+ *
+ * @param nthreads The number of worker threads to start (at least 1).
+ * @return A pointer to the new pool, or NULL if it could not be created.
+ */
+workPool*
+pool_create(int nthreads);
+
+/**
+ * @brief Queues a task for execution on one of the worker threads.
+ *
+ * Console output produced through out_printf() / out_perror() while the task runs
+ * is buffered per worker and flushed in one piece when the task returns.
+ *
+ * @param pool The pool to submit to.
+ * @param task The function to run.
+ * @param arg The argument passed to the task. Ownership passes to the task.
+ */
+void
+pool_submit(workPool* pool, poolTask task, void* arg);
+
+/**
+ * @brief Blocks until every queued task has finished.
+ *
+ * @param pool The pool to wait on.
+ */
+void
+pool_wait(workPool* pool);
+
+/**
+ * @brief Tells whether no task is queued or running.
+ *
+ * Only meaningful on the thread that submits tasks, which is the only one that can make
+ * the pool busy again.
+ *
+ * @param pool The pool. May be NULL, which counts as idle.
+ * @return true if the pool has nothing to do.
+ */
+bool
+pool_is_idle(workPool* pool);
+
+/**
+ * @brief Waits for outstanding tasks, stops the worker threads and frees the pool.
+ *
+ * @param pool The pool to destroy. May be NULL.
+ */
+void
+pool_destroy(workPool* pool);
+
+/**
+ * @brief Locks the console so the caller can print without interleaving with workers.
+ *
+ * @param pool The pool whose output lock should be taken. May be NULL.
+ */
+void
+pool_output_lock(workPool* pool);
+
+/**
+ * @brief Releases the console lock taken by pool_output_lock().
+ *
+ * @param pool The pool whose output lock should be released. May be NULL.
+ */
+void
+pool_output_unlock(workPool* pool);
+
+/**
+ * @brief printf() replacement that respects per-worker output buffering.
+ *
+ * On a worker thread the text is appended to that worker's buffer for the given
+ * stream; on any other thread it is written straight to the stream.
+ *
+ * @param stream stdout or stderr.
+ * @param format The printf-style format string.
+ */
+void
+out_printf(FILE* stream, const char* format, ...);
+
+/**
+ * @brief perror() replacement that respects per-worker output buffering.
+ *
+ * @param message The message printed in front of the errno description.
+ */
+void
+out_perror(const char* message);
+
+#endif // POOL_H
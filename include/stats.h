@@ -0,0 +1,173 @@
+/**
+ * @file stats.h
+ * @brief Declarations for per-stage timers, latency histograms and failure counters.
+ *
+ * Every file passes through a few stages: it is found by the scan, opened, its header
+ * parsed, changed tags rewritten, its folders created and finally it is moved. Each
+ * stage records how long it took into a histogram with power-of-two microsecond
+ * buckets, and every failed file is counted by the one reason it failed for instead of
+ * only being printed. Problems that don't keep a file out of the library, like tags that
+ * couldn't be rewritten, are counted apart as warnings.
+ *
+ * The figures can be written to a stats file as JSON, one snapshot object per line:
+ * at the end of the run and, if an interval is set, periodically while it runs. All
+ * functions may be called from any thread.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STATS_BUCKETS 24        // bucket i counts latencies below 2^(i+1) us; the last one is open
+#define STATS_MAX_INTERVAL 86400
+
+typedef enum {
+    STAGE_SCAN,         // finding the file in the source folder
+    STAGE_OPEN,         // opening the file for parsing
+    STAGE_PARSE,        // reading and parsing the header, including the open
+    STAGE_REWRITE,      // writing changed tags back
+    STAGE_MKDIR,        // creating (or looking up) the artist and album folders
+    STAGE_MOVE,         // renaming or copying the file into the library
+    STAGE_COVER,        // writing the album's cover art (--cover-art)
+    STAGE_COUNT
+} Stage;
+
+typedef enum {
+    FAIL_SETUP,             // dir.ini missing or invalid
+    FAIL_WORD_LIST,         // Lowercase= words could not be compiled
+    FAIL_UNSUPPORTED,       // neither FLAC, MP3, Ogg Vorbis/Opus nor MP4
+    FAIL_OPEN,              // the file could not be opened
+    FAIL_NOT_FLAC,          // no 'fLaC' marker
+    FAIL_NOT_ID3,           // no ID3v2 tag
+    FAIL_ID3_VERSION,       // ID3v2 version that isn't supported
+    FAIL_ID3_TOO_LARGE,     // tag larger than ID3_MAX_SIZE
+    FAIL_NOT_OGG,           // no Ogg Vorbis or Opus identification header
+    FAIL_NOT_MP4,           // no ftyp atom at the start
+    FAIL_CORRUPT,           // a block or header runs past the end of the file
+    FAIL_TAG_READ,          // the tag block could not be read
+    FAIL_TAG_PARSE,         // the Vorbis comment block is malformed
+    FAIL_BLANK_FIELD,       // no artist or no album
+    FAIL_NAME_TOO_LONG,     // a folder name doesn't fit
+    FAIL_MKDIR,             // a folder could not be created
+    FAIL_MOVE,              // the file could not be moved
+    FAIL_DUPLICATE,         // the same audio is already in the library (--dedup)
+    FAIL_DIFFERENT_ENCODE,  // the destination holds different audio (--dedup)
+    FAIL_REASON_COUNT
+} FailReason;
+
+typedef enum {
+    WARN_REWRITE,           // changed tags could not be written; the file was moved anyway
+    WARN_COVER_ART,         // the cover art could not be written (--cover-art)
+    WARN_COUNT
+} Warning;
+
+/**
+ * @brief Starts the run clock that snapshots report their elapsed time against.
+ */
+void
+stats_init(void);
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds, for stats_record().
+ */
+uint64_t
+stats_now(void);
+
+/**
+ * @brief Records that a stage took from 'start' until now.
+ *
+ * @param stage The stage.
+ * @param start A timestamp taken with stats_now() when the stage began.
+ */
+void
+stats_record(Stage stage, uint64_t start);
+
+/**
+ * @brief Counts a failure. Call it once per failed file.
+ *
+ * @param reason Why the file (or the run) failed.
+ */
+void
+stats_fail(FailReason reason);
+
+/**
+ * @brief Returns the last failure counted on the calling thread and forgets it.
+ *
+ * @return The reason, or FAIL_REASON_COUNT if none was counted since the last call.
+ */
+FailReason
+stats_take_failure(void);
+
+/**
+ * @brief Counts a problem with a file that still made it into the library.
+ *
+ * @param warning What went wrong.
+ */
+void
+stats_warn(Warning warning);
+
+/**
+ * @brief Returns the console message for a failure reason.
+ */
+const char*
+stats_fail_message(FailReason reason);
+
+/**
+ * @brief Counts a file found by the scan or the watch.
+ */
+void
+stats_found(void);
+
+/**
+ * @brief Counts a file that was moved into the library.
+ */
+void
+stats_succeeded(void);
+
+/**
+ * @brief Prints the failure counts that aren't zero, one reason per line.
+ *
+ * @param stream Where to print.
+ */
+void
+stats_print_failures(FILE* stream);
+
+/**
+ * @brief Prints the warning counts that aren't zero, one kind per line.
+ *
+ * @param stream Where to print.
+ * @return true if anything was printed.
+ */
+bool
+stats_print_warnings(FILE* stream);
+
+/**
+ * @brief Appends a snapshot of all counters to the stats file as one line of JSON.
+ *
+ * @param path The stats file.
+ * @param final Nonzero for the snapshot taken at the end of the run.
+ * @return false if the file could not be written.
+ */
+bool
+stats_write(const char* path, int final);
+
+/**
+ * @brief Starts a thread that calls stats_write() every 'seconds' seconds.
+ *
+ * @param path The stats file.
+ * @param seconds The interval, 1 to STATS_MAX_INTERVAL.
+ * @return false if the thread could not be started.
+ */
+bool
+stats_start_interval(const char* path, int seconds);
+
+/**
+ * @brief Stops the thread started by stats_start_interval(), if any.
+ */
+void
+stats_stop_interval(void);
+
+#endif // STATS_H
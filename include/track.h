@@ -0,0 +1,176 @@
+/**
+ * @file track.h
+ * @brief Declarations for compact track records and the string intern table.
+ *
+ * audioMetaData is the working record of the one file a thread is processing. Anything
+ * that keeps many tracks around keeps trackRecords instead: a few pointers and numbers
+ * per track, with the strings stored once, length-prefixed, in a string table.
+ * Artist, album, genre and file type are interned, so all tracks of an album share one
+ * copy of each; titles are copied as they are.
+ *
+ * The hash of the string table, and a slot table for looking up records kept in an array
+ * by key, are shared by the other tables of meta (folders, duplicates, cover art).
+ */
+
+#ifndef TRACK_H
+#define TRACK_H
+
+#include "metadata.h"
+#include "arena.h"
+
+#define STRTABLE_CHUNK (64 * 1024)          // arena chunk size of a string table
+#define STRTABLE_MIN_SLOTS 256
+
+typedef struct lstr {
+    uint32_t length;        // bytes in text, without the terminator
+    char text[];            // null terminated, so it can be used as a C string
+} lstr;
+
+typedef struct trackRecord {
+    const lstr* artist;     // interned
+    const lstr* album;      // interned
+    const lstr* genre;      // interned
+    const lstr* fileext;    // interned
+    const lstr* title;
+    const char* source;     // path of the file, owned by whoever built the record
+    uint16_t track[2];
+    uint16_t disc[2];
+    char date[5];
+} trackRecord;
+
+typedef struct strTable strTable;
+
+typedef struct slotTable {
+    uint32_t* slots;        // record number + 1, 0 for an empty slot; open addressing
+    uint32_t size;          // a power of two
+    uint32_t used;          // slots taken
+} slotTable;
+
+/**
+ * @brief Tells whether record 'number' (counted from 1) has the key a lookup is for.
+ */
+typedef bool (*slotMatch)(const void* records, uint32_t number, const void* key);
+
+/**
+ * @brief Hashes a string with FNV-1a.
+ *
+ * @param text The string; need not be null terminated.
+ * @param length Number of bytes in text.
+ * @return The hash.
+ */
+uint32_t
+strtable_hash(const char* text, size_t length);
+
+/**
+ * @brief Creates an empty string table.
+ *
+ * @return The table, or NULL if memory runs out.
+ */
+strTable*
+strtable_create(void);
+
+/**
+ * @brief Returns the table's copy of a string, adding it if it is new. Thread-safe.
+ *
+ * @param table The table.
+ * @param text The string; need not be null terminated.
+ * @param length Number of bytes in text.
+ * @return The shared copy, valid until the table is destroyed, or NULL if memory runs out.
+ */
+const lstr*
+strtable_intern(strTable* table, const char* text, size_t length);
+
+/**
+ * @brief Stores a string in the table without looking for an equal one. Thread-safe.
+ *
+ * For strings that are rarely shared, such as titles, where the lookup would only cost
+ * time and hash slots.
+ *
+ * @param table The table.
+ * @param text The string; need not be null terminated.
+ * @param length Number of bytes in text.
+ * @return The copy, valid until the table is destroyed, or NULL if memory runs out.
+ */
+const lstr*
+strtable_copy(strTable* table, const char* text, size_t length);
+
+/**
+ * @brief Returns the number of distinct interned strings.
+ */
+size_t
+strtable_count(strTable* table);
+
+/**
+ * @brief Returns the bytes of string storage the table holds.
+ */
+size_t
+strtable_bytes(strTable* table);
+
+/**
+ * @brief Frees a string table and every string in it.
+ *
+ * @param table The table. May be NULL.
+ */
+void
+strtable_destroy(strTable* table);
+
+/**
+ * @brief Makes an empty slot table.
+ *
+ * @param table The table to fill in.
+ * @param size The number of slots, a power of two.
+ * @return false if memory runs out.
+ */
+bool
+slottable_create(slotTable* table, uint32_t size);
+
+/**
+ * @brief Tells whether one more record would load the table past 3/4, so it should grow first.
+ */
+bool
+slottable_full(const slotTable* table);
+
+/**
+ * @brief Puts a record number in the first free slot of its probe run.
+ *
+ * @param table The table. Must not be full.
+ * @param hash The hash of the record's key.
+ * @param number The record number, counted from 1.
+ */
+void
+slottable_place(slotTable* table, uint32_t hash, uint32_t number);
+
+/**
+ * @brief Looks up a record by key.
+ *
+ * @param table The table.
+ * @param hash The hash of the key.
+ * @param match Compares a record with the key.
+ * @param records Passed to 'match'.
+ * @param key Passed to 'match'.
+ * @return The number of the first matching record, counted from 1, or 0 if none matches.
+ */
+uint32_t
+slottable_find(const slotTable* table, uint32_t hash, slotMatch match, const void* records, const void* key);
+
+/**
+ * @brief Frees the slots of a table.
+ *
+ * @param table The table. Its slots may be NULL.
+ */
+void
+slottable_destroy(slotTable* table);
+
+/**
+ * @brief Builds a compact record from parsed metadata.
+ *
+ * @param table The table the strings are stored in.
+ * @param meta The parsed metadata.
+ * @param source The path to remember with the record; not copied. May be NULL.
+ * @param record Receives the record.
+ * @return true on success, false if memory runs out.
+ */
+bool
+track_pack(strTable* table, const audioMetaData* meta, const char* source, trackRecord* record);
+
+#endif // TRACK_H
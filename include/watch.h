@@ -0,0 +1,57 @@
+/**
+ * @file watch.h
+ * @brief Declarations for the continuous ingestion (--watch) mode.
+ *
+ * The source folder is watched with inotify for files that have been closed after
+ * writing or moved in. A file is handed on once no further events have arrived for it
+ * for WATCH_SETTLE_MS, so files that are still being written are not picked up early.
+ * The files of a folder that is moved in whole are picked up with it, and if the event
+ * queue overflows, the watched tree is scanned for whatever arrived meanwhile.
+ * Watching is only available on Linux.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "filelist.h"
+
+#define WATCH_SETTLE_MS 500
+
+typedef struct dirWatch dirWatch;
+
+/**
+ * @brief Starts watching a directory tree.
+ *
+ * Call this before the initial scan so that files arriving during the scan are not missed.
+ *
+ * @param path The directory to watch.
+ * @param maxDepth How many levels of subdirectories to watch: 0 watches only 'path',
+ *                 a negative value has no limit. New subdirectories are added as they appear.
+ * @return The watch, or NULL if watching is unavailable or the directory can't be watched.
+ */
+dirWatch*
+watch_open(const char* path, int maxDepth);
+
+/**
+ * @brief Delivers completed files to a callback until SIGINT or SIGTERM is received.
+ *
+ * Blocks without a timeout while nothing is pending, so an idle watch uses no CPU.
+ * Files that have disappeared by the time they settle are skipped.
+ *
+ * @param watch The watch returned by watch_open().
+ * @param callback Called with a malloc()'d full path for every settled file.
+ * @param ctx A context pointer passed through to the callback.
+ * @return The number of files delivered.
+ */
+int
+watch_run(dirWatch* watch, fileCallback callback, void* ctx);
+
+/**
+ * @brief Stops watching and frees the watch.
+ *
+ * @param watch The watch. May be NULL.
+ */
+void
+watch_close(dirWatch* watch);
+
+#endif // WATCH_H
@@ -0,0 +1,70 @@
+/**
+ * @file wordcase.h
+ * @brief Declarations for the function-word normalizer used on artist, album and title tags.
+ *
+ * Words such as "In", "The" or "Of" are turned to lowercase when they appear inside a
+ * tag, e.g. "Song Of The Year" becomes "Song of the Year". The word list is compiled
+ * once into an Aho-Corasick automaton, so a tag is normalized in a single pass no
+ * matter how many words are listed. The first word of a tag, the last word, and words
+ * directly after an opening bracket keep their capital letter.
+ *
+ * The list defaults to WORDCASE_DEFAULT_WORDS and can be replaced with Lowercase= lines
+ * in dir.ini (see setup()).
+ */
+
+#ifndef WORDCASE_H
+#define WORDCASE_H
+
+#include "metadata.h"
+
+#define WORDCASE_MAX_WORD 32
+#define WORDCASE_MAX_STATES 8192
+#define WORDCASE_DEFAULT_WORDS "In,Is,The,With,A,As,At,And,For,From,To,Or,Of,On"
+
+// typedef'd in metadata.h
+struct caseSpan {
+    int start;              // offset of the first changed byte
+    int length;             // number of bytes in the word
+};
+
+/**
+ * @brief Adds words to the list compiled by wordcase_compile().
+ *
+ * @param list One or more words separated by commas; surrounding blanks are ignored.
+ *             Words are matched without regard to ASCII case.
+ * @return false if a word is too long or memory runs out.
+ */
+bool
+wordcase_add(const char* list);
+
+/**
+ * @brief Builds the automaton from the added words, or from WORDCASE_DEFAULT_WORDS if
+ *        none were added.
+ *
+ * Must be called before worker threads use wordcase_apply(); the automaton is only
+ * read afterwards.
+ *
+ * @return false if the automaton could not be built.
+ */
+bool
+wordcase_compile(void);
+
+/**
+ * @brief Turns the listed words inside a string to lowercase in one pass.
+ *
+ * @param str The string to modify in place.
+ * @param spans Receives the words that changed, in order. May be NULL.
+ * @param maxSpans Capacity of 'spans'.
+ * @return The number of words that changed (which may exceed maxSpans), 0 if there
+ *         were none or nothing has been compiled.
+ */
+int
+wordcase_apply(char* str, caseSpan* spans, int maxSpans);
+
+/**
+ * @brief Frees the automaton and the word list.
+ */
+void
+wordcase_free(void);
+
+#endif // WORDCASE_H
@@ -10,12 +10,13 @@ LDFLAGS = /nologo
 SRC_DIR = D:\Programs\C\meta\src
 OBJ_DIR = D:\Programs\C\meta\build
 BIN_DIR = D:\Programs\C\meta
+BENCH_DIR = D:\Programs\C\meta\bench
 
 # List of source files
-SOURCES = $(SRC_DIR)\main.c $(SRC_DIR)\metadata.c $(SRC_DIR)\config.c $(SRC_DIR)\filelist.c
+SOURCES = $(SRC_DIR)\main.c $(SRC_DIR)\metadata.c $(SRC_DIR)\config.c $(SRC_DIR)\filelist.c $(SRC_DIR)\pool.c $(SRC_DIR)\cache.c $(SRC_DIR)\watch.c $(SRC_DIR)\dircache.c $(SRC_DIR)\move.c $(SRC_DIR)\ioengine.c $(SRC_DIR)\wordcase.c $(SRC_DIR)\stats.c $(SRC_DIR)\arena.c $(SRC_DIR)\track.c $(SRC_DIR)\plan.c $(SRC_DIR)\journal.c $(SRC_DIR)\dupindex.c $(SRC_DIR)\coverart.c
 
 # Object files (manually list object files corresponding to source files)
-OBJECTS = $(OBJ_DIR)\main.obj $(OBJ_DIR)\metadata.obj $(OBJ_DIR)\config.obj $(OBJ_DIR)\filelist.obj
+OBJECTS = $(OBJ_DIR)\main.obj $(OBJ_DIR)\metadata.obj $(OBJ_DIR)\config.obj $(OBJ_DIR)\filelist.obj $(OBJ_DIR)\pool.obj $(OBJ_DIR)\cache.obj $(OBJ_DIR)\watch.obj $(OBJ_DIR)\dircache.obj $(OBJ_DIR)\move.obj $(OBJ_DIR)\ioengine.obj $(OBJ_DIR)\wordcase.obj $(OBJ_DIR)\stats.obj $(OBJ_DIR)\arena.obj $(OBJ_DIR)\track.obj $(OBJ_DIR)\plan.obj $(OBJ_DIR)\journal.obj $(OBJ_DIR)\dupindex.obj $(OBJ_DIR)\coverart.obj
 
 # Target executable
 TARGET = $(BIN_DIR)\meta.exe
@@ -39,6 +40,72 @@ $(OBJ_DIR)\config.obj: $(SRC_DIR)\config.c
 $(OBJ_DIR)\filelist.obj: $(SRC_DIR)\filelist.c
     $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\filelist.c
 
+$(OBJ_DIR)\pool.obj: $(SRC_DIR)\pool.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\pool.c
+
+$(OBJ_DIR)\cache.obj: $(SRC_DIR)\cache.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\cache.c
+
+$(OBJ_DIR)\watch.obj: $(SRC_DIR)\watch.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\watch.c
+
+$(OBJ_DIR)\dircache.obj: $(SRC_DIR)\dircache.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\dircache.c
+
+$(OBJ_DIR)\move.obj: $(SRC_DIR)\move.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\move.c
+
+$(OBJ_DIR)\ioengine.obj: $(SRC_DIR)\ioengine.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\ioengine.c
+
+$(OBJ_DIR)\wordcase.obj: $(SRC_DIR)\wordcase.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\wordcase.c
+
+$(OBJ_DIR)\stats.obj: $(SRC_DIR)\stats.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\stats.c
+
+$(OBJ_DIR)\arena.obj: $(SRC_DIR)\arena.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\arena.c
+
+$(OBJ_DIR)\track.obj: $(SRC_DIR)\track.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\track.c
+
+$(OBJ_DIR)\plan.obj: $(SRC_DIR)\plan.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\plan.c
+
+$(OBJ_DIR)\journal.obj: $(SRC_DIR)\journal.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\journal.c
+
+$(OBJ_DIR)\dupindex.obj: $(SRC_DIR)\dupindex.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\dupindex.c
+
+$(OBJ_DIR)\coverart.obj: $(SRC_DIR)\coverart.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(SRC_DIR)\coverart.c
+
+# Benchmarks (nmake /f meta.mak bench)
+BENCH_OBJECTS = $(OBJ_DIR)\bench_ingest.obj $(OBJ_DIR)\corpus.obj $(OBJ_DIR)\filelist.obj $(OBJ_DIR)\arena.obj
+BENCH_INGEST = $(BIN_DIR)\bench_ingest.exe
+KERNEL_OBJECTS = $(OBJ_DIR)\bench_kernels.obj $(OBJ_DIR)\corpus.obj $(OBJ_DIR)\config.obj $(OBJ_DIR)\filelist.obj $(OBJ_DIR)\pool.obj $(OBJ_DIR)\cache.obj $(OBJ_DIR)\watch.obj $(OBJ_DIR)\dircache.obj $(OBJ_DIR)\move.obj $(OBJ_DIR)\ioengine.obj $(OBJ_DIR)\wordcase.obj $(OBJ_DIR)\stats.obj $(OBJ_DIR)\arena.obj $(OBJ_DIR)\track.obj $(OBJ_DIR)\plan.obj $(OBJ_DIR)\journal.obj $(OBJ_DIR)\dupindex.obj $(OBJ_DIR)\coverart.obj
+BENCH_KERNELS = $(BIN_DIR)\bench_kernels.exe
+
+bench: $(BENCH_INGEST) $(BENCH_KERNELS)
+
+$(BENCH_INGEST): $(BENCH_OBJECTS)
+    $(LINK) $(LDFLAGS) /OUT:$(BENCH_INGEST) $(BENCH_OBJECTS) psapi.lib
+
+# metadata.c is compiled into bench_kernels.c to reach its static functions
+$(BENCH_KERNELS): $(KERNEL_OBJECTS)
+    $(LINK) $(LDFLAGS) /OUT:$(BENCH_KERNELS) $(KERNEL_OBJECTS)
+
+$(OBJ_DIR)\bench_kernels.obj: $(BENCH_DIR)\bench_kernels.c $(SRC_DIR)\metadata.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(BENCH_DIR)\bench_kernels.c
+
+$(OBJ_DIR)\bench_ingest.obj: $(BENCH_DIR)\bench_ingest.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(BENCH_DIR)\bench_ingest.c
+
+$(OBJ_DIR)\corpus.obj: $(BENCH_DIR)\corpus.c
+    $(CC) $(CFLAGS) /c /Fo$@ $(BENCH_DIR)\corpus.c
+
 # Clean rule
 clean:
-    del /q $(OBJECTS) $(TARGET)
+    del /q $(OBJECTS) $(TARGET) $(BENCH_OBJECTS) $(BENCH_INGEST) $(OBJ_DIR)\bench_kernels.obj $(BENCH_KERNELS)
@@ -0,0 +1,232 @@
+#include "../include/arena.h"
+#include "../include/pool.h"
+
+typedef struct arenaChunk {
+    struct arenaChunk* next;    // the chunk allocated before this one
+    size_t size;                // usable bytes after the header
+} arenaChunk;
+
+// Chunk headers are padded so the memory after them stays aligned
+#define CHUNK_HEADER ((sizeof(arenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena {
+    arenaChunk* head;           // chunk being handed out from
+    arenaChunk* first;          // the chunk kept by arena_reset()
+    size_t offset;              // bytes used in 'head'
+    size_t used;                // bytes handed out since the last reset
+    size_t chunkSize;
+    arena* nextScratch;         // next scratch arena, see arena_scratch()
+};
+
+typedef struct slabChunk {
+    struct slabChunk* next;
+} slabChunk;
+
+struct slab {
+    mutex_t lock;
+    size_t blockSize;
+    void* freeList;             // free blocks, linked through their first bytes
+    slabChunk* chunks;          // every batch of blocks ever allocated
+};
+
+static size_t scratchChunkSize = ARENA_SCRATCH_CHUNK;
+static mutex_t scratchLock = MUTEX_INITIALIZER;
+static arena* scratchList = NULL;           // every scratch arena, for arena_scratch_release()
+static THREAD_LOCAL arena* tlsScratch = NULL;
+
+static arenaChunk*
+new_chunk(size)
+    size_t size;
+{
+    arenaChunk* chunk = (arenaChunk*)malloc(CHUNK_HEADER + size);
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+arena*
+arena_create(chunkSize)
+    size_t chunkSize;
+{
+    arena* a = (arena*)calloc(1, sizeof(arena));
+    if (!a) {
+        return NULL;
+    }
+
+    a->chunkSize = chunkSize < ARENA_ALIGN ? ARENA_ALIGN : chunkSize;
+    if (!(a->first = a->head = new_chunk(a->chunkSize))) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+void*
+arena_alloc(a, size)
+    arena* a;
+    size_t size;
+{
+    void* block;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // Start a new chunk when the current one is full; oversized requests get one to themselves
+    if (a->offset + size > a->head->size) {
+        arenaChunk* chunk = new_chunk(size > a->chunkSize ? size : a->chunkSize);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = a->head;
+        a->head = chunk;
+        a->offset = 0;
+    }
+
+    block = (char*)a->head + CHUNK_HEADER + a->offset;
+    a->offset += size;
+    a->used += size;
+    return block;
+}
+
+size_t
+arena_used(a)
+    const arena* a;
+{
+    return a->used;
+}
+
+void
+arena_reset(a)
+    arena* a;
+{
+    while (a->head != a->first) {
+        arenaChunk* next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->offset = 0;
+    a->used = 0;
+}
+
+void
+arena_destroy(a)
+    arena* a;
+{
+    if (!a) {
+        return;
+    }
+
+    arena_reset(a);
+    free(a->first);
+    free(a);
+}
+
+void
+arena_scratch_init(chunkSize)
+    size_t chunkSize;
+{
+    scratchChunkSize = chunkSize;
+}
+
+arena*
+arena_scratch(void)
+{
+    if (!tlsScratch && (tlsScratch = arena_create(scratchChunkSize)) != NULL) {
+        mutex_lock(&scratchLock);
+        tlsScratch->nextScratch = scratchList;
+        scratchList = tlsScratch;
+        mutex_unlock(&scratchLock);
+    }
+    return tlsScratch;
+}
+
+void
+arena_scratch_release(void)
+{
+    mutex_lock(&scratchLock);
+    while (scratchList) {
+        arena* next = scratchList->nextScratch;
+        arena_destroy(scratchList);
+        scratchList = next;
+    }
+    mutex_unlock(&scratchLock);
+
+    // Only the calling thread's pointer can be cleared; the other threads have finished
+    tlsScratch = NULL;
+}
+
+slab*
+slab_create(blockSize)
+    size_t blockSize;
+{
+    slab* s = (slab*)calloc(1, sizeof(slab));
+    if (!s) {
+        return NULL;
+    }
+
+    mutex_init(&s->lock);
+    s->blockSize = (blockSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return s;
+}
+
+void*
+slab_get(s)
+    slab* s;
+{
+    void* block;
+
+    mutex_lock(&s->lock);
+    if (!s->freeList) {
+        // Carve a whole batch of blocks out of one allocation
+        slabChunk* chunk = (slabChunk*)malloc(ARENA_ALIGN + SLAB_BATCH * s->blockSize);
+        if (!chunk) {
+            mutex_unlock(&s->lock);
+            return NULL;
+        }
+        chunk->next = s->chunks;
+        s->chunks = chunk;
+        for (int i = SLAB_BATCH - 1; i >= 0; i--) {
+            void** blockPtr = (void**)((char*)chunk + ARENA_ALIGN + i * s->blockSize);
+            *blockPtr = s->freeList;
+            s->freeList = blockPtr;
+        }
+    }
+    block = s->freeList;
+    s->freeList = *(void**)block;
+    mutex_unlock(&s->lock);
+
+    return block;
+}
+
+void
+slab_put(s, block)
+    slab* s;
+    void* block;
+{
+    if (!block) {
+        return;
+    }
+
+    mutex_lock(&s->lock);
+    *(void**)block = s->freeList;
+    s->freeList = block;
+    mutex_unlock(&s->lock);
+}
+
+void
+slab_destroy(s)
+    slab* s;
+{
+    if (!s) {
+        return;
+    }
+
+    while (s->chunks) {
+        slabChunk* next = s->chunks->next;
+        free(s->chunks);
+        s->chunks = next;
+    }
+    mutex_destroy(&s->lock);
+    free(s);
+}
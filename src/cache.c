@@ -0,0 +1,422 @@
+#include "../include/cache.h"
+#include "../include/filelist.h"
+#include "../include/pool.h"
+#include "../include/track.h"
+#include "../include/move.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+typedef struct newRecord {
+    cacheEntry entry;
+    trackRecord track;      // strings in the cache's table, unused if rejected
+} newRecord;
+
+typedef struct saveRecord {
+    const cacheEntry* entry;
+    const char* strings;    // strings of an old record in the pool, or NULL
+    const trackRecord* track;   // strings of a record stored this run, or NULL
+    size_t length;
+    int order;              // later records win when keys repeat
+} saveRecord;
+
+struct metaCache {
+    char path[_MAX_PATH];
+    BYTE* map;              // contents of the cache file
+    size_t mapSize;
+    const cacheEntry* entries;
+    uint32_t count;
+    const char* pool;
+    uint32_t poolSize;
+    BYTE* seen;             // one flag per entry: looked up during this run
+    newRecord* added;       // records stored during this run
+    int addedCount;
+    int addedCapacity;
+    strTable* strings;      // strings of the added records, artist and album shared
+    mutex_t lock;
+};
+
+metaCache*
+cache_open(path)
+    const char* path;
+{
+    metaCache* cache = (metaCache*)calloc(1, sizeof(metaCache));
+    const cacheHeader* header;
+
+    if (!cache) {
+        return NULL;
+    }
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    if (!(cache->strings = strtable_create())) {
+        free(cache);
+        return NULL;
+    }
+    mutex_init(&cache->lock);
+
+#ifdef _WIN32
+    FILE* file;
+    if ((file = fopen(path, "rb")) != NULL) {
+        if (fseek(file, 0, SEEK_END) == 0) {
+            long size = ftell(file);
+            if (size > 0 && (cache->map = (BYTE*)malloc(size)) != NULL) {
+                rewind(file);
+                cache->mapSize = fread(cache->map, 1, size, file);
+            }
+        }
+        fclose(file);
+    }
+#else
+    int fd;
+    struct stat st;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                cache->map = (BYTE*)map;
+                cache->mapSize = st.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    // Validate the layout; anything unexpected is treated as an empty cache
+    header = (const cacheHeader*)cache->map;
+    if (cache->mapSize >= sizeof(cacheHeader) && memcmp(header->magic, CACHE_MAGIC, 8) == 0 &&
+        (uint64_t)header->count * sizeof(cacheEntry) + header->poolSize + sizeof(cacheHeader) == cache->mapSize &&
+        (header->poolSize == 0 || cache->map[cache->mapSize - 1] == '\0')) {
+        cache->entries = (const cacheEntry*)(cache->map + sizeof(cacheHeader));
+        cache->count = header->count;
+        cache->pool = (const char*)(cache->entries + cache->count);
+        cache->poolSize = header->poolSize;
+        cache->seen = (BYTE*)calloc(cache->count ? cache->count : 1, 1);
+        if (!cache->seen) {
+            cache->count = 0;
+        }
+    }
+
+    return cache;
+}
+
+bool
+cache_key(filename, key)
+    const char* filename;
+    cacheKey* key;
+{
+    struct stat st;
+
+    if (stat(filename, &st) != 0) {
+        return false;
+    }
+
+    key->dev = (uint64_t)st.st_dev;
+    key->size = (uint64_t)st.st_size;
+#ifdef _WIN32
+    // No inode numbers on Windows; a hash of the path stands in for it
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* p = filename; *p; p++) {
+        hash = (hash ^ (BYTE)*p) * 1099511628211ULL;
+    }
+    key->ino = hash;
+    key->mtime = (int64_t)st.st_mtime * 1000000000;
+#else
+    key->ino = (uint64_t)st.st_ino;
+    key->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static int
+compare_keys(a, b)
+    const cacheKey* a;
+    const cacheKey* b;
+{
+    if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+    if (a->size != b->size) return a->size < b->size ? -1 : 1;
+    if (a->mtime != b->mtime) return a->mtime < b->mtime ? -1 : 1;
+    return 0;
+}
+
+static uint32_t
+next_string(cache, offset)
+    const metaCache* cache;
+    uint32_t offset;
+{
+    // The pool ends with a null terminator, so strlen() can't run past it
+    if (offset >= cache->poolSize) {
+        return cache->poolSize;
+    }
+    return offset + (uint32_t)strlen(cache->pool + offset) + 1;
+}
+
+static const char*
+string_at(cache, offset)
+    const metaCache* cache;
+    uint32_t offset;
+{
+    // Fields missing from a short record read as empty
+    return offset < cache->poolSize ? cache->pool + offset : "";
+}
+
+CacheStatus
+cache_lookup(cache, key, filename, meta, reason)
+    metaCache* cache;
+    const cacheKey* key;
+    const char* filename;
+    audioMetaData* meta;
+    FailReason* reason;
+{
+    const cacheEntry* entry = NULL;
+    const char* ext;
+    uint32_t str;
+    long low = 0;
+    long high = (long)cache->count - 1;
+
+    // Binary search directly over the mapped entries
+    while (low <= high) {
+        long mid = low + (high - low) / 2;
+        int cmp = compare_keys(key, &cache->entries[mid].key);
+        if (cmp == 0) {
+            entry = &cache->entries[mid];
+            break;
+        }
+        if (cmp < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    if (!entry || (entry->status == CACHE_PARSED && entry->strings >= cache->poolSize) ||
+        (entry->status != CACHE_PARSED && entry->reason >= FAIL_REASON_COUNT)) {
+        return CACHE_MISS;
+    }
+
+    mutex_lock(&cache->lock);
+    cache->seen[entry - cache->entries] = 1;
+    mutex_unlock(&cache->lock);
+
+    if (entry->status != CACHE_PARSED) {
+        if (reason) {
+            *reason = (FailReason)entry->reason;
+        }
+        return CACHE_REJECTED;
+    }
+
+    memset(meta, 0, sizeof(audioMetaData));
+    snprintf(meta->pathname, sizeof(meta->pathname), "%s", filename);
+    ext = get_file_extension(filename);
+    snprintf(meta->fileext, sizeof(meta->fileext), "%s", ext ? ext : "");
+
+    // The strings are used where they lie in the mapped pool
+    str = entry->strings;
+    meta->artist = string_at(cache, str);
+    str = next_string(cache, str);
+    meta->album = string_at(cache, str);
+    str = next_string(cache, str);
+    meta->title = string_at(cache, str);
+    str = next_string(cache, str);
+    snprintf(meta->date, sizeof(meta->date), "%s", string_at(cache, str));
+    str = next_string(cache, str);
+    meta->genre = string_at(cache, str);
+
+    meta->track[0] = entry->track[0];
+    meta->track[1] = entry->track[1];
+    meta->disc[0] = entry->disc[0];
+    meta->disc[1] = entry->disc[1];
+    memcpy(meta->audioMd5, entry->audioMd5, sizeof(meta->audioMd5));
+    return CACHE_PARSED;
+}
+
+void
+cache_store(cache, key, meta, reason)
+    metaCache* cache;
+    const cacheKey* key;
+    const audioMetaData* meta;
+    FailReason reason;
+{
+    newRecord record;
+
+    // A hit rebuilds the values only, so the queued edits would never be written
+    if ((meta && meta->editCount > 0) || (!meta && reason >= FAIL_REASON_COUNT)) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.entry.key = *key;
+    record.entry.status = meta ? CACHE_PARSED : CACHE_REJECTED;
+    record.entry.reason = meta ? 0 : (uint16_t)reason;
+
+    if (meta) {
+        // Tracks of one album share their artist, album and genre strings until the cache is saved
+        if (!track_pack(cache->strings, meta, NULL, &record.track)) {
+            return;
+        }
+        memcpy(record.entry.track, record.track.track, sizeof(record.entry.track));
+        memcpy(record.entry.disc, record.track.disc, sizeof(record.entry.disc));
+        memcpy(record.entry.audioMd5, meta->audioMd5, sizeof(record.entry.audioMd5));
+    }
+
+    mutex_lock(&cache->lock);
+    if (cache->addedCount == cache->addedCapacity) {
+        int capacity = cache->addedCapacity ? cache->addedCapacity * 2 : 64;
+        newRecord* added = (newRecord*)realloc(cache->added, capacity * sizeof(newRecord));
+        if (!added) {
+            mutex_unlock(&cache->lock);
+            return;
+        }
+        cache->added = added;
+        cache->addedCapacity = capacity;
+    }
+    cache->added[cache->addedCount++] = record;
+    mutex_unlock(&cache->lock);
+}
+
+static int
+compare_save_records(a, b)
+    const void* a;
+    const void* b;
+{
+    const saveRecord* ra = (const saveRecord*)a;
+    const saveRecord* rb = (const saveRecord*)b;
+    int cmp = compare_keys(&ra->entry->key, &rb->entry->key);
+    return cmp ? cmp : ra->order - rb->order;
+}
+
+bool
+cache_save(cache)
+    metaCache* cache;
+{
+    char tmpPath[_MAX_PATH + 8];
+    saveRecord* records;
+    cacheHeader header;
+    FILE* file;
+    uint32_t poolSize = 0;
+    int count = 0;
+    int kept = 0;
+    bool result = true;
+
+    records = (saveRecord*)malloc((cache->count + cache->addedCount + 1) * sizeof(saveRecord));
+    if (!records) {
+        return false;
+    }
+
+    // Old records that were seen this run, then everything stored this run
+    for (uint32_t i = 0; i < cache->count; i++) {
+        if (cache->seen[i]) {
+            const char* start = cache->pool + cache->entries[i].strings;
+            const char* end = start;
+            if (cache->entries[i].status == CACHE_PARSED) {
+                for (int f = 0; f < 5 && end < cache->pool + cache->poolSize; f++) {
+                    end += strlen(end) + 1;
+                }
+            }
+            records[count].entry = &cache->entries[i];
+            records[count].strings = start;
+            records[count].track = NULL;
+            records[count].length = end - start;
+            records[count].order = count;
+            count++;
+        }
+    }
+    for (int i = 0; i < cache->addedCount; i++) {
+        const trackRecord* track = &cache->added[i].track;
+        records[count].entry = &cache->added[i].entry;
+        records[count].strings = NULL;
+        records[count].track = NULL;
+        records[count].length = 0;
+        if (cache->added[i].entry.status == CACHE_PARSED) {
+            records[count].track = track;
+            records[count].length = track->artist->length + track->album->length + track->title->length +
+                                    strlen(track->date) + track->genre->length + 5;
+        }
+        records[count].order = count;
+        count++;
+    }
+
+    qsort(records, count, sizeof(saveRecord), compare_save_records);
+
+    // Drop superseded duplicates, keeping the last record for each key
+    for (int i = 0; i < count; i++) {
+        if (i + 1 < count && compare_keys(&records[i].entry->key, &records[i + 1].entry->key) == 0) {
+            continue;
+        }
+        records[kept++] = records[i];
+        poolSize += (uint32_t)records[i].length;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cache->path);
+    if (!(file = fopen(tmpPath, "wb"))) {
+        perror("Error : Couldn't write metadata cache");
+        free(records);
+        return false;
+    }
+
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.count = kept;
+    header.poolSize = poolSize;
+    result = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    poolSize = 0;
+    for (int i = 0; i < kept && result; i++) {
+        cacheEntry entry = *records[i].entry;
+        entry.strings = poolSize;
+        poolSize += (uint32_t)records[i].length;
+        result = fwrite(&entry, sizeof(entry), 1, file) == 1;
+    }
+    for (int i = 0; i < kept && result; i++) {
+        const trackRecord* track = records[i].track;
+        if (track) {
+            // "artist\0album\0title\0date\0genre\0", terminators included
+            result = fwrite(track->artist->text, 1, track->artist->length + 1, file) == track->artist->length + 1 &&
+                     fwrite(track->album->text, 1, track->album->length + 1, file) == track->album->length + 1 &&
+                     fwrite(track->title->text, 1, track->title->length + 1, file) == track->title->length + 1 &&
+                     fwrite(track->date, 1, strlen(track->date) + 1, file) == strlen(track->date) + 1 &&
+                     fwrite(track->genre->text, 1, track->genre->length + 1, file) == track->genre->length + 1;
+        } else if (records[i].length > 0) {
+            result = fwrite(records[i].strings, 1, records[i].length, file) == records[i].length;
+        }
+    }
+    if (fclose(file) != 0) {
+        result = false;
+    }
+    free(records);
+
+    if (!result) {
+        fprintf(stderr, "Error : Couldn't write metadata cache\n");
+        remove(tmpPath);
+        return false;
+    }
+
+    if (move_replace(tmpPath, cache->path) != 0) {
+        perror("Error : Couldn't replace metadata cache");
+        remove(tmpPath);
+        return false;
+    }
+
+    return true;
+}
+
+void
+cache_close(cache)
+    metaCache* cache;
+{
+    if (!cache) {
+        return;
+    }
+
+#ifdef _WIN32
+    free(cache->map);
+#else
+    if (cache->map) {
+        munmap(cache->map, cache->mapSize);
+    }
+#endif
+    free(cache->added);
+    strtable_destroy(cache->strings);
+    free(cache->seen);
+    mutex_destroy(&cache->lock);
+    free(cache);
+}
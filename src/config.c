@@ -1,4 +1,9 @@
 #include "../include/config.h"
+#include "../include/pool.h"
+#include "../include/move.h"
+#include "../include/ioengine.h"
+#include "../include/wordcase.h"
+#include "../include/stats.h"
 
 int
 is_valid_drive_path(path)
@@ -67,6 +72,14 @@ setup(src_path, dest_path)
             }
         }
 
+        // Optional: replaces the default list of words turned to lowercase in tags
+        if (!strncmp(line, "Lowercase=", strlen("Lowercase="))) {
+            if (!wordcase_add(strchr(line, '=') + 1)) {
+                fprintf(stderr, "Error (dir.ini): Invalid Lowercase= word list.\n");
+                return 1;
+            }
+        }
+
         if (!strncmp(line, "Destination=", strlen("Destination="))) {
             strcpy(dest_path, strchr(line, '=') + 1);
             len = strlen(dest_path);
@@ -89,6 +102,206 @@ setup(src_path, dest_path)
     return 0;
 }
 
+int
+parse_options(argc, argv, opts)
+    int argc;
+    char* argv[];
+    runOptions* opts;
+{
+    // Defaults
+    opts->jobs = get_core_count();
+    opts->maxDepth = 0;
+    opts->probeSize = 64 * 1024;
+    opts->deferRewrite = 0;
+    opts->useCache = 1;
+    opts->watch = 0;
+    opts->syncPolicy = SYNC_FILE;
+    opts->ioBatch = 0;
+    opts->statsPath = NULL;
+    opts->statsInterval = 0;
+    opts->plan = 0;
+    opts->dryRunPath = NULL;
+    opts->executePath = NULL;
+    opts->journalPath = NULL;
+    opts->dedup = 0;
+    opts->tagCount = 0;
+    opts->coverArt = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "-j")) {
+            char* end = NULL;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->jobs = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || opts->jobs < 1) {
+                fprintf(stderr, "Error : Invalid job count '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--recursive") || !strcmp(argv[i], "-r")) {
+            opts->maxDepth = -1;
+        } else if (!strcmp(argv[i], "--depth")) {
+            char* end = NULL;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->maxDepth = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || opts->maxDepth < 0) {
+                fprintf(stderr, "Error : Invalid depth '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--probe-size")) {
+            char* end = NULL;
+            long size;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            size = strtol(argv[++i], &end, 10);
+            if (toupper((unsigned char)*end) == 'K') {
+                size *= 1024;
+                end++;
+            } else if (toupper((unsigned char)*end) == 'M') {
+                size *= 1024 * 1024;
+                end++;
+            }
+            if (*end != '\0' || size <= 0) {
+                fprintf(stderr, "Error : Invalid probe size '%s'.\n", argv[i]);
+                return 1;
+            }
+            opts->probeSize = (size_t)size;
+        } else if (!strcmp(argv[i], "--defer-rewrite")) {
+            opts->deferRewrite = 1;
+        } else if (!strcmp(argv[i], "--no-cache")) {
+            opts->useCache = 0;
+        } else if (!strcmp(argv[i], "--watch")) {
+            opts->watch = 1;
+        } else if (!strcmp(argv[i], "--fsync")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            if (!strcmp(argv[++i], "none")) {
+                opts->syncPolicy = SYNC_NONE;
+            } else if (!strcmp(argv[i], "file")) {
+                opts->syncPolicy = SYNC_FILE;
+            } else if (!strcmp(argv[i], "all")) {
+                opts->syncPolicy = SYNC_ALL;
+            } else {
+                fprintf(stderr, "Error : Invalid fsync mode '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--io-batch")) {
+            char* end = NULL;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->ioBatch = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || opts->ioBatch < 0 || opts->ioBatch > IOENGINE_MAX_BATCH) {
+                fprintf(stderr, "Error : Invalid batch size '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--stats")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->statsPath = argv[++i];
+        } else if (!strcmp(argv[i], "--stats-interval")) {
+            char* end = NULL;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->statsInterval = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || opts->statsInterval < 1 || opts->statsInterval > STATS_MAX_INTERVAL) {
+                fprintf(stderr, "Error : Invalid stats interval '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--plan")) {
+            opts->plan = 1;
+        } else if (!strcmp(argv[i], "--dry-run")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->dryRunPath = argv[++i];
+            opts->plan = 1;
+        } else if (!strcmp(argv[i], "--execute")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->executePath = argv[++i];
+        } else if (!strcmp(argv[i], "--journal")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            opts->journalPath = argv[++i];
+        } else if (!strcmp(argv[i], "--dedup")) {
+            opts->dedup = 1;
+        } else if (!strcmp(argv[i], "--tag")) {
+            const char* name;
+            const char* separator;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error : %s requires a value.\n", argv[i]);
+                return 1;
+            }
+            if (opts->tagCount == MAX_TAGS) {
+                fprintf(stderr, "Error : At most %d --tag settings are allowed.\n", MAX_TAGS);
+                return 1;
+            }
+
+            // Vorbis comment names are printable ASCII other than '='
+            name = argv[++i];
+            separator = strchr(name, '=');
+            if (!separator || separator == name) {
+                fprintf(stderr, "Error : Invalid tag setting '%s', expected NAME=VALUE.\n", name);
+                return 1;
+            }
+            for (const char* c = name; c < separator; c++) {
+                if (*c < 0x20 || *c > 0x7D) {
+                    fprintf(stderr, "Error : Invalid tag name in '%s'.\n", name);
+                    return 1;
+                }
+            }
+            opts->tags[opts->tagCount++] = name;
+        } else if (!strcmp(argv[i], "--cover-art")) {
+            opts->coverArt = 1;
+        } else {
+            fprintf(stderr, "Error : Unknown option '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (opts->statsInterval > 0 && !opts->statsPath) {
+        fprintf(stderr, "Error : --stats-interval requires --stats.\n");
+        return 1;
+    }
+
+    // A plan is built from one finite scan, and a plan file replaces the scan altogether
+    if ((opts->plan || opts->executePath) && opts->watch) {
+        fprintf(stderr, "Error : --plan, --dry-run and --execute can't be combined with --watch.\n");
+        return 1;
+    }
+    if (opts->plan && opts->executePath) {
+        fprintf(stderr, "Error : --execute can't be combined with --plan or --dry-run.\n");
+        return 1;
+    }
+
+    // A plan file carries the --tag settings its destinations were computed with
+    if (opts->tagCount > 0 && opts->executePath) {
+        fprintf(stderr, "Error : --tag can't be combined with --execute; the plan holds its own settings.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 // Test
 // int main()
 // {
@@ -0,0 +1,534 @@
+#include "../include/coverart.h"
+#include "../include/pool.h"
+#include "../include/move.h"
+#include "../include/track.h"
+
+typedef enum {
+    COVER_OPEN,             // not decided yet, or the last try failed
+    COVER_BUSY,             // a track of the album is deciding it, without the lock
+    COVER_SETTLED           // decided for this run
+} CoverState;
+
+// The image types a PICTURE block is written as, see flac_find_cover()
+static const char* const imageTypes[COVERART_TYPES] = { "jpg", "png" };
+
+typedef struct coverEntry {
+    const lstr* folder;     // the album folder, relative to the library
+    DWORD length;           // length of the image meta wrote there, 0 for none
+    uint64_t hash;          // hash of its ends, see fingerprint()
+    BYTE type;              // its type, an index into imageTypes
+    BYTE state;             // CoverState: whether the folder's art was dealt with this run
+} coverEntry;
+
+struct coverArt {
+    mutex_t lock;
+    char library[_MAX_PATH];
+    char path[_MAX_PATH];   // the record file
+    strTable* strings;      // the folders of the entries
+    coverEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    slotTable slots;        // finds the entry of a folder
+    bool dirty;             // changed since it was read
+};
+
+typedef struct folderKey {
+    const char* text;
+    size_t length;
+} folderKey;
+
+static bool
+match_folder(records, number, key)
+    const void* records;
+    uint32_t number;
+    const void* key;
+{
+    const lstr* folder = ((const coverEntry*)records)[number - 1].folder;
+    const folderKey* k = (const folderKey*)key;
+
+    return folder->length == k->length && !memcmp(folder->text, k->text, k->length);
+}
+
+static bool
+grow_slots(covers)
+    coverArt* covers;
+{
+    slotTable slots;
+
+    if (!slottable_create(&slots, covers->slots.size ? covers->slots.size * 2 : COVERART_MIN_SLOTS)) {
+        return false;
+    }
+    for (uint32_t n = 0; n < covers->count; n++) {
+        const lstr* folder = covers->entries[n].folder;
+        slottable_place(&slots, strtable_hash(folder->text, folder->length), n + 1);
+    }
+    slottable_destroy(&covers->slots);
+    covers->slots = slots;
+    return true;
+}
+
+static coverEntry*
+find_folder(covers, folder, length)
+    coverArt* covers;
+    const char* folder;
+    size_t length;
+{
+    folderKey key = { folder, length };
+    uint32_t number = slottable_find(&covers->slots, strtable_hash(folder, length), match_folder, covers->entries, &key);
+
+    return number ? &covers->entries[number - 1] : NULL;
+}
+
+static coverEntry*
+add_folder(covers, folder, length)
+    coverArt* covers;
+    const char* folder;
+    size_t length;
+{
+    coverEntry* entry;
+
+    if (covers->count == covers->capacity) {
+        uint32_t capacity = covers->capacity ? covers->capacity * 2 : COVERART_MIN_SLOTS / 2;
+        coverEntry* entries = (coverEntry*)realloc(covers->entries, capacity * sizeof(coverEntry));
+        if (!entries) {
+            return NULL;
+        }
+        covers->entries = entries;
+        covers->capacity = capacity;
+    }
+    if (slottable_full(&covers->slots) && !grow_slots(covers)) {
+        return NULL;
+    }
+
+    entry = &covers->entries[covers->count];
+    if (!(entry->folder = strtable_copy(covers->strings, folder, length))) {
+        return NULL;
+    }
+    entry->length = 0;
+    entry->hash = 0;
+    entry->type = 0;
+    entry->state = COVER_OPEN;
+    covers->count++;
+    slottable_place(&covers->slots, strtable_hash(folder, length), covers->count);
+    return entry;
+}
+
+/**
+ * Hashes the length of an image and COVERART_SAMPLE bytes from either end, which tells
+ * images apart without reading them whole.
+ */
+static bool
+fingerprint(fd, offset, length, hash)
+    int fd;
+    fileOffset offset;
+    DWORD length;
+    uint64_t* hash;
+{
+    BYTE sample[COVERART_SAMPLE];
+    DWORD size = length < COVERART_SAMPLE ? length : COVERART_SAMPLE;
+    fileOffset ends[2] = { offset, offset + (fileOffset)(length - size) };
+    uint64_t h = 14695981039346656037ull ^ length;
+
+    for (int e = 0; e < 2; e++) {
+#ifdef _WIN32
+        if (_lseeki64(fd, ends[e], SEEK_SET) != ends[e] || _read(fd, sample, size) != (int)size) {
+            return false;
+        }
+#else
+        if (pread(fd, sample, size, ends[e]) != (ssize_t)size) {
+            return false;
+        }
+#endif
+        for (DWORD i = 0; i < size; i++) {
+            h = (h ^ sample[i]) * 1099511628211ull;
+        }
+    }
+    *hash = h;
+    return true;
+}
+
+/**
+ * Fingerprints an image file in an album folder.
+ */
+static bool
+fingerprint_file(artPath, length, hash)
+    const char* artPath;
+    DWORD* length;
+    uint64_t* hash;
+{
+    fileOffset size;
+    bool result;
+    int fd;
+
+    if ((fd = _open(artPath, _O_RDONLY | _O_BINARY)) < 0) {
+        return false;
+    }
+
+    // An image too large for a PICTURE block can't be one meta wrote
+    size = _lseeki64(fd, 0, SEEK_END);
+    result = size > 0 && size <= FLAC_MAX_BLOCK && fingerprint(fd, 0, (DWORD)size, hash);
+    *length = result ? (DWORD)size : 0;
+    _close(fd);
+    return result;
+}
+
+static bool
+copy_image(fd, image, artPath)
+    int fd;
+    const coverImage* image;
+    const char* artPath;
+{
+    char tmpPath[_MAX_PATH + sizeof(MOVE_TMP_SUFFIX)];
+    bool result;
+    int art;
+
+    // Written next to the old image and renamed over it, so the folder never shows half an image
+    snprintf(tmpPath, sizeof(tmpPath), "%s%s", artPath, MOVE_TMP_SUFFIX);
+#ifdef _WIN32
+    art = _open(tmpPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    art = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+#endif
+    if (art < 0) {
+        out_perror("Error : Couldn't create the cover art");
+        return false;
+    }
+
+    result = move_copy_range(fd, image->offset, art, 0, (fileOffset)image->length) == 0;
+    if (!result) {
+        out_perror("Error : Couldn't copy the cover art");
+    }
+    if (_close(art) != 0) {
+        result = false;
+    }
+
+    if (result && move_replace(tmpPath, artPath) != 0) {
+        out_perror("Error : Couldn't replace the cover art");
+        result = false;
+    }
+    if (!result) {
+        remove(tmpPath);
+    }
+    return result;
+}
+
+/**
+ * Reads the record of the images meta wrote. Anything unexpected ends it there.
+ */
+static void
+read_record(covers)
+    coverArt* covers;
+{
+    FILE* file = fopen(covers->path, "rb");
+    BYTE* data = NULL;
+    const BYTE* p;
+    const BYTE* end;
+    uint32_t count;
+    long size;
+
+    if (!file) {
+        return;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 12 || fseek(file, 0, SEEK_SET) != 0 ||
+        !(data = (BYTE*)malloc(size)) || fread(data, 1, size, file) != (size_t)size) {
+        fclose(file);
+        free(data);
+        return;
+    }
+    fclose(file);
+
+    if (memcmp(data, COVERART_MAGIC, 8) != 0) {
+        free(data);
+        return;
+    }
+    memcpy(&count, data + 8, sizeof(count));
+    p = data + 12;
+    end = data + size;
+    for (uint32_t n = 0; n < count; n++) {
+        coverEntry* entry;
+        uint16_t length;
+        if (end - p < COVERART_RECORD_SIZE) {
+            break;
+        }
+        memcpy(&length, p + COVERART_RECORD_SIZE - 2, sizeof(length));
+        if (end - p < COVERART_RECORD_SIZE + length || p[12] >= COVERART_TYPES ||
+            find_folder(covers, (const char*)p + COVERART_RECORD_SIZE, length) ||
+            !(entry = add_folder(covers, (const char*)p + COVERART_RECORD_SIZE, length))) {
+            break;
+        }
+        memcpy(&entry->length, p, sizeof(entry->length));
+        memcpy(&entry->hash, p + 4, sizeof(entry->hash));
+        entry->type = p[12];
+        p += COVERART_RECORD_SIZE + length;
+    }
+    free(data);
+}
+
+/**
+ * Decides the art of an album folder from the first of its tracks met this run. Works on
+ * a copy of the folder's entry, without the lock, and updates the copy.
+ */
+static bool
+settle_folder(entry, fd, image, hash, trackPath, folderLength)
+    coverEntry* entry;
+    int fd;
+    const coverImage* image;
+    uint64_t hash;
+    const char* trackPath;
+    size_t folderLength;
+{
+    char artPath[COVERART_TYPES][_MAX_PATH];
+    int present = 0;
+    bool ours;
+    int type;
+
+    for (type = 0; type < COVERART_TYPES; type++) {
+        int length = snprintf(artPath[type], sizeof(artPath[type]), "%.*s%s%s.%s", (int)folderLength, trackPath,
+                              folderLength ? "/" : "", COVERART_NAME, imageTypes[type]);
+        if (length < 0 || length >= (int)sizeof(artPath[type])) {
+            return false;
+        }
+        if (_access(artPath[type], 0) == 0) {
+            present++;
+        }
+    }
+    for (type = 0; type < COVERART_TYPES && strcmp(imageTypes[type], image->ext); type++) {
+    }
+    if (type == COVERART_TYPES) {
+        return true;
+    }
+
+    // An image is only ours while it is the folder's only one and as meta wrote it
+    ours = false;
+    if (present == 1 && entry->length > 0 && _access(artPath[entry->type], 0) == 0) {
+        DWORD length;
+        uint64_t existing;
+        ours = fingerprint_file(artPath[entry->type], &length, &existing) && length == entry->length &&
+               existing == entry->hash;
+    }
+    if (present > 0 && !ours) {
+        // The user's art is left alone, and isn't ours any more if it once was
+        entry->length = 0;
+        return true;
+    }
+    if (ours && entry->type == type && entry->length == image->length && entry->hash == hash) {
+        return true;
+    }
+
+    if (!copy_image(fd, image, artPath[type])) {
+        return false;
+    }
+    if (ours && entry->type != type) {
+        remove(artPath[entry->type]);
+    }
+    entry->length = image->length;
+    entry->hash = hash;
+    entry->type = (BYTE)type;
+    return true;
+}
+
+coverArt*
+coverart_open(library)
+    const char* library;
+{
+    coverArt* covers = (coverArt*)calloc(1, sizeof(coverArt));
+
+    if (!covers) {
+        return NULL;
+    }
+    snprintf(covers->library, sizeof(covers->library), "%s", library);
+    snprintf(covers->path, sizeof(covers->path), "%s/%s", library, COVERART_FILE);
+    if (!(covers->strings = strtable_create()) || !grow_slots(covers)) {
+        strtable_destroy(covers->strings);
+        free(covers);
+        return NULL;
+    }
+    mutex_init(&covers->lock);
+    read_record(covers);
+    return covers;
+}
+
+/**
+ * Claims the entry of a folder whose art isn't decided yet, for the calling track.
+ * Returns its number, counted from 1, and a copy of it; 0 if there is nothing to do.
+ */
+static uint32_t
+claim_folder(covers, folder, length, copy)
+    coverArt* covers;
+    const char* folder;
+    size_t length;
+    coverEntry* copy;
+{
+    coverEntry* entry;
+    uint32_t number = 0;
+
+    mutex_lock(&covers->lock);
+    if (!(entry = find_folder(covers, folder, length))) {
+        entry = add_folder(covers, folder, length);
+    }
+    if (entry && entry->state == COVER_OPEN) {
+        entry->state = COVER_BUSY;
+        *copy = *entry;
+        number = (uint32_t)(entry - covers->entries) + 1;
+    }
+    mutex_unlock(&covers->lock);
+    return number;
+}
+
+/**
+ * Hands a claimed entry back, with the outcome of settle_folder() if it was called.
+ */
+static void
+release_folder(covers, number, copy, state)
+    coverArt* covers;
+    uint32_t number;
+    const coverEntry* copy;
+    CoverState state;
+{
+    coverEntry* entry;
+
+    mutex_lock(&covers->lock);
+    entry = &covers->entries[number - 1];
+    if (copy && (copy->length != entry->length || (copy->length > 0 &&
+                 (copy->hash != entry->hash || copy->type != entry->type)))) {
+        entry->length = copy->length;
+        entry->hash = copy->hash;
+        entry->type = copy->type;
+        covers->dirty = true;
+    }
+    entry->state = (BYTE)state;
+    mutex_unlock(&covers->lock);
+}
+
+bool
+coverart_write(covers, trackPath)
+    coverArt* covers;
+    const char* trackPath;
+{
+    size_t libraryLength = strlen(covers->library);
+    const char* slash = strrchr(trackPath, '/');
+    size_t folderLength = slash ? (size_t)(slash - trackPath) : 0;
+    const char* folder = trackPath;
+    size_t length = folderLength;
+    coverEntry entry;           // a copy of the folder's entry while this track decides its art
+    uint32_t number;
+    coverImage image;
+    uint64_t hash;
+    bool result = true;
+    int fd;
+
+    // Folders are keyed on their path inside the library
+    if (!strncmp(trackPath, covers->library, libraryLength) && folderLength >= libraryLength) {
+        if (folderLength == libraryLength) {
+            folder += libraryLength;
+            length = 0;
+        } else if (trackPath[libraryLength] == '/') {
+            folder += libraryLength + 1;
+            length -= libraryLength + 1;
+        }
+    }
+
+    // Once an album's art is decided, or while another of its tracks decides it, its tracks aren't even opened
+    if (!(number = claim_folder(covers, folder, length, &entry))) {
+        return true;
+    }
+
+    if ((fd = _open(trackPath, _O_RDONLY | _O_BINARY)) < 0) {
+        out_perror("Error : Couldn't open the file for its cover art");
+        release_folder(covers, number, NULL, COVER_OPEN);
+        return false;
+    }
+    if (!flac_find_cover(fd, &image) || (image.length > 0 && !fingerprint(fd, image.offset, image.length, &hash))) {
+        out_printf(stderr, "Error : Couldn't read the cover art of %s.\n", trackPath);
+        release_folder(covers, number, NULL, COVER_OPEN);
+        _close(fd);
+        return false;
+    }
+
+    // A track without art leaves the decision to the next one; the image is copied without the lock
+    if (image.length == 0) {
+        release_folder(covers, number, NULL, COVER_OPEN);
+    } else {
+        result = settle_folder(&entry, fd, &image, hash, trackPath, folderLength);
+        release_folder(covers, number, result ? &entry : NULL, result ? COVER_SETTLED : COVER_OPEN);
+    }
+
+    _close(fd);
+    return result;
+}
+
+bool
+coverart_save(covers)
+    coverArt* covers;
+{
+    char tmpPath[_MAX_PATH + 8];
+    uint32_t count = 0;
+    FILE* file;
+    bool result;
+
+    if (!covers->dirty) {
+        return true;
+    }
+
+    for (uint32_t n = 0; n < covers->count; n++) {
+        if (covers->entries[n].length > 0) {
+            count++;
+        }
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", covers->path);
+    if (!(file = fopen(tmpPath, "wb"))) {
+        perror("Error : Couldn't write the cover art record");
+        return false;
+    }
+
+    result = fwrite(COVERART_MAGIC, 1, 8, file) == 8 && fwrite(&count, sizeof(count), 1, file) == 1;
+    for (uint32_t n = 0; n < covers->count && result; n++) {
+        const coverEntry* entry = &covers->entries[n];
+        BYTE record[COVERART_RECORD_SIZE];
+        uint16_t length;
+        if (entry->length == 0) {
+            continue;
+        }
+        length = (uint16_t)entry->folder->length;
+        memcpy(record, &entry->length, sizeof(entry->length));
+        memcpy(record + 4, &entry->hash, sizeof(entry->hash));
+        record[12] = entry->type;
+        memcpy(record + COVERART_RECORD_SIZE - 2, &length, sizeof(length));
+        result = fwrite(record, 1, COVERART_RECORD_SIZE, file) == COVERART_RECORD_SIZE &&
+                 fwrite(entry->folder->text, 1, length, file) == length;
+    }
+    if (fclose(file) != 0) {
+        result = false;
+    }
+
+    if (!result) {
+        fprintf(stderr, "Error : Couldn't write the cover art record\n");
+        remove(tmpPath);
+        return false;
+    }
+
+    if (move_replace(tmpPath, covers->path) != 0) {
+        perror("Error : Couldn't replace the cover art record");
+        remove(tmpPath);
+        return false;
+    }
+
+    covers->dirty = false;
+    return true;
+}
+
+void
+coverart_close(covers)
+    coverArt* covers;
+{
+    if (!covers) {
+        return;
+    }
+
+    strtable_destroy(covers->strings);
+    free(covers->entries);
+    slottable_destroy(&covers->slots);
+    mutex_destroy(&covers->lock);
+    free(covers);
+}
@@ -0,0 +1,250 @@
+#include "../include/dircache.h"
+#include "../include/pool.h"
+#include "../include/track.h"
+
+typedef struct dirEntry {
+    char* path;             // NULL for an empty slot
+    uint32_t hash;
+    int fd;                 // open descriptor or DIRCACHE_NO_FD
+} dirEntry;
+
+static mutex_t dirLock = MUTEX_INITIALIZER;
+static dirEntry* dirTable = NULL;   // open addressing, size is a power of two
+static size_t dirTableSize = 0;
+static size_t dirCount = 0;
+static int dirOpenFds = 0;
+static int* retiredFds = NULL;      // descriptors of forgotten entries, closed by dircache_clear()
+static int retiredCount = 0;
+
+static dirEntry*
+find_entry(path, hash)
+    const char* path;
+    uint32_t hash;
+{
+    if (dirTableSize == 0) {
+        return NULL;
+    }
+    for (size_t i = hash & (dirTableSize - 1); dirTable[i].path; i = (i + 1) & (dirTableSize - 1)) {
+        if (dirTable[i].hash == hash && !strcmp(dirTable[i].path, path)) {
+            return &dirTable[i];
+        }
+    }
+    return NULL;
+}
+
+static bool
+grow_table(void)
+{
+    size_t size = dirTableSize ? dirTableSize * 2 : 256;
+    dirEntry* table = (dirEntry*)calloc(size, sizeof(dirEntry));
+
+    if (!table) {
+        return false;
+    }
+    for (size_t i = 0; i < dirTableSize; i++) {
+        if (dirTable[i].path) {
+            size_t j = dirTable[i].hash & (size - 1);
+            while (table[j].path) {
+                j = (j + 1) & (size - 1);
+            }
+            table[j] = dirTable[i];
+        }
+    }
+    free(dirTable);
+    dirTable = table;
+    dirTableSize = size;
+    return true;
+}
+
+static int
+insert_entry(path, hash, fd)
+    const char* path;
+    uint32_t hash;
+    int fd;
+{
+    dirEntry* entry = find_entry(path, hash);
+    char* copy;
+    size_t i;
+
+    // Another thread got there first; keep its entry
+    if (entry) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return entry->fd;
+    }
+
+    if (((dirCount + 1) * 4 > dirTableSize * 3 && !grow_table()) || !(copy = strdup(path))) {
+        return fd;  // not cached, still usable by the caller
+    }
+
+    for (i = hash & (dirTableSize - 1); dirTable[i].path; i = (i + 1) & (dirTableSize - 1)) {
+    }
+    dirTable[i].path = copy;
+    dirTable[i].hash = hash;
+    dirTable[i].fd = fd;
+    dirCount++;
+    if (fd >= 0) {
+        dirOpenFds++;
+    }
+    return fd;
+}
+
+static void
+forget_entry(path)
+    const char* path;
+{
+    dirEntry* entry = find_entry(path, strtable_hash(path, strlen(path)));
+    size_t i;
+
+    if (!entry) {
+        return;
+    }
+
+    // The descriptor may still be in use by another thread, so it is only closed later
+    if (entry->fd >= 0) {
+        int* fds = (int*)realloc(retiredFds, (retiredCount + 1) * sizeof(int));
+        if (fds) {
+            retiredFds = fds;
+            retiredFds[retiredCount++] = entry->fd;
+        }
+        dirOpenFds--;
+    }
+    free(entry->path);
+    entry->path = NULL;
+    dirCount--;
+
+    // Reinsert the rest of the probe chain so lookups don't stop at the hole
+    i = ((size_t)(entry - dirTable) + 1) & (dirTableSize - 1);
+    while (dirTable[i].path) {
+        dirEntry moved = dirTable[i];
+        size_t j = moved.hash & (dirTableSize - 1);
+        dirTable[i].path = NULL;
+        while (dirTable[j].path) {
+            j = (j + 1) & (dirTableSize - 1);
+        }
+        dirTable[j] = moved;
+        i = (i + 1) & (dirTableSize - 1);
+    }
+}
+
+int
+dircache_mkdir(path, parentFd, name)
+    const char* path;
+    int parentFd;
+    const char* name;
+{
+    uint32_t hash = strtable_hash(path, strlen(path));
+    dirEntry* entry;
+    int fd = DIRCACHE_NO_FD;
+    bool keepFd;
+
+    mutex_lock(&dirLock);
+    entry = find_entry(path, hash);
+    if (entry) {
+        fd = entry->fd;
+        mutex_unlock(&dirLock);
+        return fd;
+    }
+    keepFd = dirOpenFds < DIRCACHE_MAX_FDS;
+    mutex_unlock(&dirLock);
+
+#ifdef _WIN32
+    if (name ? (_mkdir(path) != 0 && errno != EEXIST) : (_access(path, 0) != 0)) {
+        return DIRCACHE_FAILED;
+    }
+#else
+    // Create relative to the parent when it is held open; an existing directory is fine
+    if (name) {
+        int rc = (parentFd >= 0) ? mkdirat(parentFd, name, FULL_PERMISSIONS) : mkdir(path, FULL_PERMISSIONS);
+        if (rc != 0 && errno != EEXIST) {
+            return DIRCACHE_FAILED;
+        }
+    }
+    if (keepFd || !name) {
+        if (name && parentFd >= 0) {
+            fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+            if (!name) {
+                return DIRCACHE_FAILED;
+            }
+            fd = DIRCACHE_NO_FD;
+        }
+    }
+#endif
+
+    mutex_lock(&dirLock);
+    fd = insert_entry(path, hash, fd);
+    mutex_unlock(&dirLock);
+    return fd;
+}
+
+int
+dircache_rename(oldPath, newPath)
+    const char* oldPath;
+    const char* newPath;
+{
+    char dir[_MAX_PATH];
+    const char* slash = strrchr(newPath, '/');
+    dirEntry* entry = NULL;
+    int fd = DIRCACHE_NO_FD;
+    int rc;
+    int err;
+
+    if (slash && (size_t)(slash - newPath) < sizeof(dir)) {
+        memcpy(dir, newPath, slash - newPath);
+        dir[slash - newPath] = '\0';
+        mutex_lock(&dirLock);
+        entry = find_entry(dir, strtable_hash(dir, strlen(dir)));
+        fd = entry ? entry->fd : DIRCACHE_NO_FD;
+        mutex_unlock(&dirLock);
+    }
+
+#ifdef _WIN32
+    rc = rename(oldPath, newPath);
+#else
+    rc = (fd >= 0) ? renameat(AT_FDCWD, oldPath, fd, slash + 1) : rename(oldPath, newPath);
+#endif
+    err = errno;
+
+    // The folder was removed behind our back: forget it and its parents so they are recreated
+    if (rc != 0 && err == ENOENT && entry) {
+        mutex_lock(&dirLock);
+        for (char* cut; (cut = strrchr(dir, '/')) != NULL && find_entry(dir, strtable_hash(dir, strlen(dir))); *cut = '\0') {
+            forget_entry(dir);
+        }
+        mutex_unlock(&dirLock);
+    }
+
+    errno = err;
+    return rc;
+}
+
+void
+dircache_clear(void)
+{
+    mutex_lock(&dirLock);
+    for (size_t i = 0; i < dirTableSize; i++) {
+        if (dirTable[i].path) {
+            if (dirTable[i].fd >= 0) {
+                close(dirTable[i].fd);
+            }
+            free(dirTable[i].path);
+        }
+    }
+    for (int i = 0; i < retiredCount; i++) {
+        close(retiredFds[i]);
+    }
+    free(dirTable);
+    free(retiredFds);
+    dirTable = NULL;
+    dirTableSize = 0;
+    dirCount = 0;
+    dirOpenFds = 0;
+    retiredFds = NULL;
+    retiredCount = 0;
+    mutex_unlock(&dirLock);
+}
@@ -0,0 +1,403 @@
+#include "../include/dupindex.h"
+#include "../include/pool.h"
+#include "../include/track.h"
+#include "../include/filelist.h"
+#include "../include/move.h"
+
+typedef struct dupEntry {
+    BYTE md5[AUDIO_MD5_SIZE];
+    const lstr* path;       // relative to the library, NULL once the track is forgotten
+    bool checked;           // known to be in the library: recorded this run, or found there
+} dupEntry;
+
+struct dupIndex {
+    mutex_t lock;
+    char library[_MAX_PATH];
+    char path[_MAX_PATH];   // the index file
+    strTable* strings;      // the paths of the entries
+    dupEntry* entries;
+    uint32_t count;         // entries in use, forgotten ones included
+    uint32_t capacity;
+    slotTable byMd5;        // finds an entry by its digest
+    slotTable byPath;       // and by its path; both are the same size
+    bool dirty;             // changed since it was read
+};
+
+static uint32_t
+hash_md5(md5)
+    const BYTE* md5;
+{
+    uint32_t hash;
+
+    // The digest is as evenly spread as a hash gets
+    memcpy(&hash, md5, sizeof(hash));
+    return hash;
+}
+
+typedef struct pathKey {
+    const char* text;
+    size_t length;
+} pathKey;
+
+static bool
+match_md5(records, number, key)
+    const void* records;
+    uint32_t number;
+    const void* key;
+{
+    const dupEntry* entry = &((const dupEntry*)records)[number - 1];
+
+    return entry->path && !memcmp(entry->md5, key, AUDIO_MD5_SIZE);
+}
+
+static bool
+match_path(records, number, key)
+    const void* records;
+    uint32_t number;
+    const void* key;
+{
+    const dupEntry* entry = &((const dupEntry*)records)[number - 1];
+    const pathKey* k = (const pathKey*)key;
+
+    return entry->path && entry->path->length == k->length && !memcmp(entry->path->text, k->text, k->length);
+}
+
+static bool
+grow_slots(index)
+    dupIndex* index;
+{
+    uint32_t size = index->byMd5.size ? index->byMd5.size * 2 : DUPINDEX_MIN_SLOTS;
+    slotTable byMd5;
+    slotTable byPath;
+
+    if (!slottable_create(&byMd5, size)) {
+        return false;
+    }
+    if (!slottable_create(&byPath, size)) {
+        slottable_destroy(&byMd5);
+        return false;
+    }
+
+    // Forgotten entries are left out, so their slots are reclaimed
+    for (uint32_t n = 0; n < index->count; n++) {
+        const dupEntry* entry = &index->entries[n];
+        if (entry->path) {
+            slottable_place(&byMd5, hash_md5(entry->md5), n + 1);
+            slottable_place(&byPath, strtable_hash(entry->path->text, entry->path->length), n + 1);
+        }
+    }
+    slottable_destroy(&index->byMd5);
+    slottable_destroy(&index->byPath);
+    index->byMd5 = byMd5;
+    index->byPath = byPath;
+    return true;
+}
+
+static bool
+add_entry(index, md5, path, length, checked)
+    dupIndex* index;
+    const BYTE* md5;
+    const char* path;
+    size_t length;
+    int checked;
+{
+    dupEntry* entry;
+
+    if (index->count == index->capacity) {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : DUPINDEX_MIN_SLOTS / 2;
+        dupEntry* entries = (dupEntry*)realloc(index->entries, capacity * sizeof(dupEntry));
+        if (!entries) {
+            return false;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+
+    if (slottable_full(&index->byMd5) && !grow_slots(index)) {
+        return false;
+    }
+
+    entry = &index->entries[index->count];
+    memcpy(entry->md5, md5, AUDIO_MD5_SIZE);
+    if (!(entry->path = strtable_copy(index->strings, path, length))) {
+        return false;
+    }
+    entry->checked = checked;
+    index->count++;
+
+    slottable_place(&index->byMd5, hash_md5(md5), index->count);
+    slottable_place(&index->byPath, strtable_hash(path, length), index->count);
+    return true;
+}
+
+static dupEntry*
+find_md5(index, md5)
+    dupIndex* index;
+    const BYTE* md5;
+{
+    uint32_t number = slottable_find(&index->byMd5, hash_md5(md5), match_md5, index->entries, md5);
+
+    return number ? &index->entries[number - 1] : NULL;
+}
+
+static dupEntry*
+find_path(index, path, length)
+    dupIndex* index;
+    const char* path;
+    size_t length;
+{
+    pathKey key = { path, length };
+    uint32_t number = slottable_find(&index->byPath, strtable_hash(path, length), match_path, index->entries, &key);
+
+    return number ? &index->entries[number - 1] : NULL;
+}
+
+/**
+ * Tells whether the track of an entry is still in the library, forgetting it if not.
+ */
+static bool
+still_there(index, entry)
+    dupIndex* index;
+    dupEntry* entry;
+{
+    char full[_MAX_PATH];
+    int length;
+
+    if (entry->checked) {
+        return true;
+    }
+    length = snprintf(full, sizeof(full), "%s/%s", index->library, entry->path->text);
+    if (length >= 0 && length < (int)sizeof(full) && _access(full, 0) == 0) {
+        entry->checked = true;
+        return true;
+    }
+
+    // Its slots stay behind as tombstones until the next growth
+    entry->path = NULL;
+    index->dirty = true;
+    return false;
+}
+
+/**
+ * Reads the index file. Returns false if there is none, or it isn't an index.
+ */
+static bool
+read_index(index)
+    dupIndex* index;
+{
+    FILE* file = fopen(index->path, "rb");
+    BYTE* data = NULL;
+    const BYTE* p;
+    const BYTE* end;
+    uint32_t count;
+    long size;
+
+    if (!file) {
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 12 || fseek(file, 0, SEEK_SET) != 0 ||
+        !(data = (BYTE*)malloc(size)) || fread(data, 1, size, file) != (size_t)size) {
+        fclose(file);
+        free(data);
+        return false;
+    }
+    fclose(file);
+
+    // Anything unexpected after the header ends the index there; it is completed as tracks come in
+    if (memcmp(data, DUPINDEX_MAGIC, 8) != 0) {
+        free(data);
+        return false;
+    }
+    memcpy(&count, data + 8, sizeof(count));
+    p = data + 12;
+    end = data + size;
+    for (uint32_t n = 0; n < count; n++) {
+        uint16_t length;
+        if (end - p < AUDIO_MD5_SIZE + 2) {
+            break;
+        }
+        memcpy(&length, p + AUDIO_MD5_SIZE, sizeof(length));
+        if (end - p < AUDIO_MD5_SIZE + 2 + length ||
+            !add_entry(index, p, (const char*)p + AUDIO_MD5_SIZE + 2, length, 0)) {
+            break;
+        }
+        p += AUDIO_MD5_SIZE + 2 + length;
+    }
+    free(data);
+    return true;
+}
+
+/**
+ * Indexes one file of the library, for scan_directory().
+ */
+static int
+index_file(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    static const BYTE unknown[AUDIO_MD5_SIZE];
+    dupIndex* index = (dupIndex*)ctx;
+    const char* ftype = get_file_extension(filename);
+    size_t libraryLength = strlen(index->library);
+    BYTE md5[AUDIO_MD5_SIZE];
+
+    if (ftype && !strcmp(ftype, "flac") && flac_read_audio_md5(filename, md5) && memcmp(md5, unknown, AUDIO_MD5_SIZE) &&
+        !strncmp(filename, index->library, libraryLength) && filename[libraryLength] == '/' &&
+        add_entry(index, md5, filename + libraryLength + 1, strlen(filename + libraryLength + 1), 1)) {
+        index->dirty = true;
+    }
+    free(filename);
+    return 0;
+}
+
+dupIndex*
+dupindex_open(library)
+    const char* library;
+{
+    dupIndex* index = (dupIndex*)calloc(1, sizeof(dupIndex));
+
+    if (!index) {
+        return NULL;
+    }
+    snprintf(index->library, sizeof(index->library), "%s", library);
+    snprintf(index->path, sizeof(index->path), "%s/%s", library, DUPINDEX_FILE);
+    if (!(index->strings = strtable_create()) || !grow_slots(index)) {
+        strtable_destroy(index->strings);
+        free(index);
+        return NULL;
+    }
+    mutex_init(&index->lock);
+
+    // Tracks filed before there was an index are in the library all the same
+    if (!read_index(index)) {
+        scan_directory(index->library, -1, NULL, index_file, index);
+        if (index->count > 0) {
+            printf("Indexed %u tracks in %s for --dedup.\n", index->count, index->library);
+        }
+    }
+    return index;
+}
+
+DupStatus
+dupindex_classify(index, md5, path, existing, size)
+    dupIndex* index;
+    const BYTE* md5;
+    const char* path;
+    char* existing;
+    size_t size;
+{
+    size_t libraryLength = strlen(index->library);
+    const dupEntry* found = NULL;
+    DupStatus status = DUP_NEW;
+    dupEntry* entry;
+
+    // Tracks are keyed on their path inside the library
+    if (!strncmp(path, index->library, libraryLength) && path[libraryLength] == '/') {
+        path += libraryLength + 1;
+    }
+
+    mutex_lock(&index->lock);
+    if ((entry = find_md5(index, md5)) != NULL && still_there(index, entry)) {
+        status = DUP_DUPLICATE;
+        found = entry;
+    } else if ((entry = find_path(index, path, strlen(path))) != NULL && still_there(index, entry)) {
+        status = DUP_DIFFERENT;
+        found = entry;
+    } else if (add_entry(index, md5, path, strlen(path), 1)) {
+        index->dirty = true;
+    }
+    if (found) {
+        snprintf(existing, size, "%s/%s", index->library, found->path->text);
+    }
+    mutex_unlock(&index->lock);
+    return status;
+}
+
+void
+dupindex_forget(index, md5)
+    dupIndex* index;
+    const BYTE* md5;
+{
+    dupEntry* entry;
+
+    // Its slots stay behind as tombstones, as for a track that left the library
+    mutex_lock(&index->lock);
+    if ((entry = find_md5(index, md5)) != NULL) {
+        entry->path = NULL;
+        index->dirty = true;
+    }
+    mutex_unlock(&index->lock);
+}
+
+bool
+dupindex_save(index)
+    dupIndex* index;
+{
+    char tmpPath[_MAX_PATH + 8];
+    uint32_t count = 0;
+    FILE* file;
+    bool result;
+
+    if (!index->dirty) {
+        return true;
+    }
+
+    for (uint32_t n = 0; n < index->count; n++) {
+        if (index->entries[n].path) {
+            count++;
+        }
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", index->path);
+    if (!(file = fopen(tmpPath, "wb"))) {
+        perror("Error : Couldn't write the duplicate index");
+        return false;
+    }
+
+    result = fwrite(DUPINDEX_MAGIC, 1, 8, file) == 8 && fwrite(&count, sizeof(count), 1, file) == 1;
+    for (uint32_t n = 0; n < index->count && result; n++) {
+        const dupEntry* entry = &index->entries[n];
+        uint16_t length;
+        if (!entry->path) {
+            continue;
+        }
+        length = (uint16_t)entry->path->length;
+        result = fwrite(entry->md5, 1, AUDIO_MD5_SIZE, file) == AUDIO_MD5_SIZE &&
+                 fwrite(&length, sizeof(length), 1, file) == 1 &&
+                 fwrite(entry->path->text, 1, length, file) == length;
+    }
+    if (fclose(file) != 0) {
+        result = false;
+    }
+
+    if (!result) {
+        fprintf(stderr, "Error : Couldn't write the duplicate index\n");
+        remove(tmpPath);
+        return false;
+    }
+
+    if (move_replace(tmpPath, index->path) != 0) {
+        perror("Error : Couldn't replace the duplicate index");
+        remove(tmpPath);
+        return false;
+    }
+
+    index->dirty = false;
+    return true;
+}
+
+void
+dupindex_close(index)
+    dupIndex* index;
+{
+    if (!index) {
+        return;
+    }
+
+    strtable_destroy(index->strings);
+    free(index->entries);
+    slottable_destroy(&index->byMd5);
+    slottable_destroy(&index->byPath);
+    mutex_destroy(&index->lock);
+    free(index);
+}
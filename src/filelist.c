@@ -1,78 +1,248 @@
 #include "../include/filelist.h"
 
-char**
-get_filenames(path, count/*, ext*/)
-    char* path;
-    int* count;
-    // const char* ext;
+typedef struct fileArray {
+    char** list;
+    int count;
+    int capacity;
+} fileArray;
+
+typedef struct scanState {
+    fileCallback callback;
+    void* ctx;
+    int maxDepth;               // deepest level to descend into, negative for no limit
+    int count;                  // files delivered so far
+    bool stopped;               // set when the callback asks to stop
+    arena* paths;               // where paths are allocated, NULL to malloc() each one
+    char path[_MAX_PATH];       // path of the directory being read, grown and trimmed per level
+} scanState;
+
+static void
+deliver_file(state, pathLen, name)
+    scanState* state;
+    size_t pathLen;
+    const char* name;
 {
+    size_t fileNameLen = strlen(name);
+    size_t totalLen = pathLen + fileNameLen + 1; // +1 for the separator
+
+    // Allocate memory for the file name with path, from the arena if there is one
+    char* filename = state->paths ? (char*)arena_alloc(state->paths, totalLen + 1) : (char*)malloc(totalLen + 1);
+    if (!filename) {
+        perror("Memory allocation error");
+        exit(1);
+    }
+
+    // Concatenate path and filename
+    memcpy(filename, state->path, pathLen);
+    filename[pathLen] = '/';
+    memcpy(filename + pathLen + 1, name, fileNameLen + 1);
+
+    state->count++;
+    if (state->callback(filename, state->ctx) != 0) {
+        state->stopped = true;
+    }
+}
+
+static bool
+descend_path(state, pathLen, name, newLen)
+    scanState* state;
+    size_t pathLen;
+    const char* name;
+    size_t* newLen;
+{
+    size_t nameLen = strlen(name);
+
+    if (pathLen + nameLen + 2 > sizeof(state->path)) {
+        fprintf(stderr, "Error : Path too long, skipping %s/%s\n", state->path, name);
+        return false;
+    }
+
+    state->path[pathLen] = '/';
+    memcpy(state->path + pathLen + 1, name, nameLen + 1);
+    *newLen = pathLen + nameLen + 1;
+    return true;
+}
+
+#ifdef _WIN32
+static void
+walk_directory(state, dir, pathLen, depth)
+    scanState* state;
+    DIR* dir;
+    size_t pathLen;
+    int depth;
+{
+    struct dirent* entry;
+
+    while (!state->stopped && (entry = readdir(dir)) != NULL) {
+        int type = entry->d_type;
+        size_t subLen;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+
+        if (type == DT_REG) {
+            deliver_file(state, pathLen, entry->d_name);
+        } else if (type == DT_DIR && (state->maxDepth < 0 || depth < state->maxDepth)) {
+            if (descend_path(state, pathLen, entry->d_name, &subLen)) {
+                DIR* sub = opendir(state->path);
+                if (!sub) {
+                    perror(state->path);
+                } else {
+                    walk_directory(state, sub, subLen, depth + 1);
+                    closedir(sub);
+                }
+                state->path[pathLen] = '\0';
+            }
+        }
+    }
+}
+#else
+static void
+walk_directory(state, dir, pathLen, depth)
+    scanState* state;
     DIR* dir;
+    size_t pathLen;
+    int depth;
+{
     struct dirent* entry;
-    // char* extension = NULL;
-    char** fileList = NULL;
-    int index = 0;
+    int fd = dirfd(dir);
+
+    while (!state->stopped && (entry = readdir(dir)) != NULL) {
+        int type = entry->d_type;
+        size_t subLen;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+
+        // Some filesystems don't fill in d_type; ask the inode, relative to the open directory
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            deliver_file(state, pathLen, entry->d_name);
+        } else if (type == DT_DIR && (state->maxDepth < 0 || depth < state->maxDepth)) {
+            if (descend_path(state, pathLen, entry->d_name, &subLen)) {
+                // Open the subdirectory relative to its parent instead of resolving the full path
+                int subfd = openat(fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                DIR* sub = (subfd >= 0) ? fdopendir(subfd) : NULL;
+                if (!sub) {
+                    perror(state->path);
+                    if (subfd >= 0) {
+                        close(subfd);
+                    }
+                } else {
+                    walk_directory(state, sub, subLen, depth + 1);
+                    closedir(sub);
+                }
+                state->path[pathLen] = '\0';
+            }
+        }
+    }
+}
+#endif
+
+int
+scan_directory(path, maxDepth, paths, callback, ctx)
+    const char* path;
+    int maxDepth;
+    arena* paths;
+    fileCallback callback;
+    void* ctx;
+{
+    DIR* dir;
+    scanState* state;
+    size_t pathLen = strlen(path);
+    int count;
 
     // Open the directory
     if (!(dir = opendir(path))) {
         char errmsg[256];
-        sprintf(errmsg, "Source directory %s", path);
+        snprintf(errmsg, sizeof(errmsg), "Source directory %s", path);
         perror(errmsg);
-        exit(1);
-    }
-
-    // Count the number of files
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) { // Check if it is a regular file
-            // extension = strrchr(entry->d_name, '.');
-            //if (extension != NULL && strcmp(extension + 1, ext) == 0)
-            (*count)++;
-        }
+        return -1;
     }
-    rewinddir(dir);
 
-    // Allocate memory for the array of strings
-    fileList = (char**)malloc((*count) * sizeof(char*));
-    if (!fileList) {
-        perror("Memory allocation error");
+    if (!(state = (scanState*)malloc(sizeof(scanState))) || pathLen >= sizeof(state->path)) {
+        fprintf(stderr, "Error : Couldn't scan source directory %s\n", path);
+        free(state);
         closedir(dir);
-        exit(1);
+        return -1;
     }
+    state->callback = callback;
+    state->ctx = ctx;
+    state->maxDepth = maxDepth;
+    state->count = 0;
+    state->stopped = false;
+    state->paths = paths;
+    memcpy(state->path, path, pathLen + 1);
 
-    // Read the names of files and store them in the array
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            // extension = strrchr(entry->d_name, '.');
-            //       if (extension != NULL && strcmp(extension + 1, ext) == 0) {
-                       // Calculate the length of the new string
-            size_t pathLen = strlen(path);
-            size_t fileNameLen = strlen(entry->d_name);
-            size_t totalLen = pathLen + fileNameLen + 1; // +1 for the null terminator
-
-            // Allocate memory for the file name with path
-            fileList[index] = (char*)malloc(totalLen + 1);
-            if (!fileList[index]) {
-                perror("Memory allocation error");
-                closedir(dir);
-                exit(1);
-            }
+    // Hand every regular file to the callback as soon as it is read
+    walk_directory(state, dir, pathLen, 0);
+    closedir(dir);
 
-            // Concatenate path and filename
-            sprintf(fileList[index], "%s/%s", path, entry->d_name);
+    count = state->count;
+    free(state);
+    return count;
+}
+
+static int
+append_filename(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    fileArray* files = (fileArray*)ctx;
 
-            index++;
-            //          }
+    // Grow the array in batches instead of counting the directory first
+    if (files->count == files->capacity) {
+        int capacity = files->capacity + FILELIST_BATCH;
+        char** list = (char**)realloc(files->list, capacity * sizeof(char*));
+        if (!list) {
+            perror("Memory allocation error");
+            exit(1);
         }
+        files->list = list;
+        files->capacity = capacity;
     }
-    closedir(dir);
 
-    return fileList;
+    files->list[files->count++] = filename;
+    return 0;
+}
+
+char**
+get_filenames(path, count/*, ext*/)
+    char* path;
+    int* count;
+    // const char* ext;
+{
+    fileArray files = { NULL, 0, 0 };
+
+    if (scan_directory(path, 0, NULL, append_filename, &files) < 0) {
+        exit(1);
+    }
+
+    *count += files.count;
+    return files.list;
 }
 
 char*
 get_file_extension(filename)
     const char* filename;
 {
-    return strrchr(filename, '.') + 1;
+    const char* dot = strrchr(filename, '.');
+    const char* slash = strrchr(filename, '/');
+
+    // The period must belong to the file name itself, not a parent folder
+    if (!dot || (slash && dot < slash) || dot[1] == '\0') {
+        return NULL;
+    }
+    return (char*)dot + 1;
 }
 
 void
@@ -0,0 +1,392 @@
+#include "../include/ioengine.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING   // kernel headers with IORING_OP_OPENAT / IORING_OP_READ (5.6)
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+typedef struct ioRing {
+    int fd;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapLen;
+    void* cqMap;
+    size_t cqMapLen;
+    size_t sqesLen;
+    unsigned pending;       // queued but not yet passed to io_uring_enter()
+} ioRing;
+#endif
+
+typedef struct headerSlot {
+    char* filename;
+    BYTE* data;
+    int fd;
+} headerSlot;
+
+struct ioEngine {
+    int batch;
+    size_t readSize;
+    headerCallback callback;
+    void* ctx;
+    slab* buffers;          // where header buffers come from, readSize bytes each
+    headerSlot* slots;
+    int count;              // files in the current batch
+#ifdef HAVE_IO_URING
+    ioRing ring;
+    bool useRing;
+#endif
+};
+
+#ifdef HAVE_IO_URING
+static bool
+ring_setup(ring, entries)
+    ioRing* ring;
+    unsigned entries;
+{
+    struct io_uring_params params;
+    BYTE* sq;
+    BYTE* cq;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        return false;
+    }
+
+    ring->sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqMapLen = ring->cqMapLen = (ring->sqMapLen > ring->cqMapLen) ? ring->sqMapLen : ring->cqMapLen;
+    }
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->cqMap != MAP_FAILED && ring->cqMap != ring->sqMap) {
+            munmap(ring->cqMap, ring->cqMapLen);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqesLen);
+        }
+        munmap(ring->sqMap, ring->sqMapLen);
+        close(ring->fd);
+        return false;
+    }
+
+    sq = (BYTE*)ring->sqMap;
+    cq = (BYTE*)ring->cqMap;
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void
+ring_close(ring)
+    ioRing* ring;
+{
+    munmap(ring->sqes, ring->sqesLen);
+    if (ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapLen);
+    }
+    munmap(ring->sqMap, ring->sqMapLen);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe*
+ring_get_sqe(ring)
+    ioRing* ring;
+{
+    // The ring has room for a whole batch, so a free entry is always available
+    unsigned tail = *ring->sqTail + ring->pending++;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    return sqe;
+}
+
+static int
+ring_enter(ring, waitFor)
+    ioRing* ring;
+    unsigned waitFor;
+{
+    unsigned submit = ring->pending;
+    int rc;
+
+    __atomic_store_n(ring->sqTail, *ring->sqTail + submit, __ATOMIC_RELEASE);
+    ring->pending = 0;
+    do {
+        rc = (int)syscall(__NR_io_uring_enter, ring->fd, submit, waitFor, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+static void
+ring_prep_read(ring, slot, index, readSize)
+    ioRing* ring;
+    headerSlot* slot;
+    int index;
+    size_t readSize;
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t)(uintptr_t)slot->data;
+    sqe->len = (uint32_t)readSize;
+    sqe->off = 0;
+    sqe->user_data = ((uint64_t)index << 1) | 1;
+}
+#endif
+
+static void
+read_header_sync(engine, slot)
+    ioEngine* engine;
+    headerSlot* slot;
+{
+    BYTE* data = slot->data;
+    size_t len = 0;
+
+#ifdef _WIN32
+    FILE* file = fopen(slot->filename, "rb");
+    if (file) {
+        len = fread(data, sizeof(BYTE), engine->readSize, file);
+        fclose(file);
+    } else {
+        slab_put(engine->buffers, data);
+        data = NULL;
+    }
+#else
+    ssize_t n;
+    if (slot->fd < 0) {
+        slot->fd = open(slot->filename, O_RDONLY | O_CLOEXEC);
+    }
+    if (slot->fd >= 0 && (n = pread(slot->fd, data, engine->readSize, 0)) >= 0) {
+        len = (size_t)n;
+    } else {
+        slab_put(engine->buffers, data);
+        data = NULL;
+    }
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+#endif
+
+    engine->callback(slot->filename, data, len, engine->ctx);
+}
+
+static void
+run_batch_sync(engine)
+    ioEngine* engine;
+{
+#ifndef _WIN32
+    // Open everything first so the kernel reads the headers ahead in parallel
+    for (int i = 0; i < engine->count; i++) {
+        headerSlot* slot = &engine->slots[i];
+        if (slot->filename && (slot->fd = open(slot->filename, O_RDONLY | O_CLOEXEC)) >= 0) {
+#ifdef POSIX_FADV_WILLNEED
+            posix_fadvise(slot->fd, 0, (off_t)engine->readSize, POSIX_FADV_WILLNEED);
+#endif
+        }
+    }
+#endif
+
+    for (int i = 0; i < engine->count; i++) {
+        if (engine->slots[i].filename) {
+            read_header_sync(engine, &engine->slots[i]);
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+static bool
+run_batch_ring(engine)
+    ioEngine* engine;
+{
+    ioRing* ring = &engine->ring;
+    int inFlight = engine->count;
+
+    for (int i = 0; i < engine->count; i++) {
+        struct io_uring_sqe* sqe = ring_get_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)engine->slots[i].filename;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = (uint64_t)i << 1;
+    }
+
+    // Each completed open queues its read; each completed read is handed on at once
+    while (inFlight > 0) {
+        unsigned head;
+        unsigned tail;
+
+        if (ring_enter(ring, 1) < 0) {
+            return false;
+        }
+
+        head = *ring->cqHead;
+        tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            headerSlot* slot = &engine->slots[cqe->user_data >> 1];
+            bool isRead = cqe->user_data & 1;
+
+            if (!isRead && cqe->res >= 0) {
+                slot->fd = cqe->res;
+                ring_prep_read(ring, slot, (int)(cqe->user_data >> 1), engine->readSize);
+                continue;
+            }
+
+            inFlight--;
+            if (cqe->res < 0) {
+                // Let the synchronous path retry, so errors are reported as usual
+                read_header_sync(engine, slot);
+            } else {
+                close(slot->fd);
+                engine->callback(slot->filename, slot->data, (size_t)cqe->res, engine->ctx);
+            }
+            slot->filename = NULL;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+#endif
+
+ioEngine*
+ioengine_create(batch, readSize, buffers, callback, ctx)
+    int batch;
+    size_t readSize;
+    slab* buffers;
+    headerCallback callback;
+    void* ctx;
+{
+    ioEngine* engine = (ioEngine*)calloc(1, sizeof(ioEngine));
+
+    if (!engine) {
+        return NULL;
+    }
+    engine->batch = batch < 1 ? 1 : (batch > IOENGINE_MAX_BATCH ? IOENGINE_MAX_BATCH : batch);
+    engine->readSize = readSize;
+    engine->callback = callback;
+    engine->ctx = ctx;
+    engine->buffers = buffers;
+    if (!(engine->slots = (headerSlot*)calloc(engine->batch, sizeof(headerSlot)))) {
+        free(engine);
+        return NULL;
+    }
+
+#ifdef HAVE_IO_URING
+    // Not available on old kernels, or when forbidden by a seccomp policy
+    engine->useRing = ring_setup(&engine->ring, (unsigned)engine->batch);
+#endif
+    return engine;
+}
+
+void
+ioengine_add(engine, filename)
+    ioEngine* engine;
+    char* filename;
+{
+    headerSlot* slot = &engine->slots[engine->count];
+
+    slot->filename = filename;
+    slot->fd = -1;
+    if (!(slot->data = (BYTE*)slab_get(engine->buffers))) {
+        engine->callback(filename, NULL, 0, engine->ctx);
+        return;
+    }
+
+    if (++engine->count == engine->batch) {
+        ioengine_flush(engine);
+    }
+}
+
+void
+ioengine_flush(engine)
+    ioEngine* engine;
+{
+    if (engine->count == 0) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (engine->useRing && !run_batch_ring(engine)) {
+        // The ring broke down mid-batch; closing it cancels what is still in flight,
+        // and files not handed on yet still hold their buffer
+        ring_close(&engine->ring);
+        engine->useRing = false;
+        for (int i = 0; i < engine->count; i++) {
+            if (engine->slots[i].filename && engine->slots[i].fd >= 0) {
+                close(engine->slots[i].fd);
+                engine->slots[i].fd = -1;
+            }
+        }
+        run_batch_sync(engine);
+    } else if (!engine->useRing) {
+        run_batch_sync(engine);
+    }
+#else
+    run_batch_sync(engine);
+#endif
+
+    engine->count = 0;
+}
+
+const char*
+ioengine_name(engine)
+    const ioEngine* engine;
+{
+#ifdef HAVE_IO_URING
+    if (engine->useRing) {
+        return "io_uring";
+    }
+#endif
+    (void)engine;
+    return "pread";
+}
+
+void
+ioengine_destroy(engine)
+    ioEngine* engine;
+{
+    if (!engine) {
+        return;
+    }
+    ioengine_flush(engine);
+#ifdef HAVE_IO_URING
+    if (engine->useRing) {
+        ring_close(&engine->ring);
+    }
+#endif
+    free(engine->slots);
+    free(engine);
+}
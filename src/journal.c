@@ -0,0 +1,643 @@
+#include "../include/journal.h"
+#include "../include/pool.h"
+#include "../include/arena.h"
+
+#include <time.h>
+
+#ifdef _WIN32
+#include <sys/stat.h>
+#define open _open
+#define write _write
+#define close _close
+#define unlink _unlink
+#define fsync _commit
+#define ftruncate _chsize_s
+#define stat _stat
+#define O_WRONLY _O_WRONLY
+#define O_CREAT _O_CREAT
+#define O_TRUNC _O_TRUNC
+#define O_APPEND _O_APPEND
+#define O_CLOEXEC 0
+#endif
+
+struct moveJournal {
+    mutex_t lock;
+    char path[_MAX_PATH];
+    int fd;                                 // the journal file, opened for appending
+    uint64_t seq;                           // number of the last recorded move
+    uint64_t firstPending;                  // stats_now() of the oldest uncommitted move
+    arena* batch;                           // paths of the uncommitted moves, rewound by each commit
+    uint64_t pending[JOURNAL_BATCH];        // numbers of the uncommitted moves
+    int pendingCount;
+    const char* dirs[2 * JOURNAL_BATCH];    // distinct folders the uncommitted moves touched
+    int dirCount;
+    const char* sources[JOURNAL_BATCH];     // sources of copies, removed once the batch is synced
+    int sourceCount;
+    int recording;                          // moves whose intent is written but that aren't pending yet
+    bool failed;                            // a commit failed; the file is kept for the next run to settle
+    cond_t pendingCond;                     // signalled when a batch starts, and on close
+    thread_t flusher;                       // commits a batch once it is JOURNAL_MAX_DELAY ms old
+    bool flusherRunning;
+    bool closing;
+};
+
+typedef struct journalIntent {
+    uint64_t seq;
+    const char* oldPath;                    // points into the journal contents
+    size_t oldLength;
+    const char* newPath;
+    size_t newLength;
+    bool copied;
+    bool committed;
+} journalIntent;
+
+static bool
+write_all(fd, data, size)
+    int fd;
+    const char* data;
+    size_t size;
+{
+    while (size > 0) {
+        int n = (int)write(fd, data, (unsigned int)(size > INT32_MAX ? INT32_MAX : size));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool
+sync_file(path)
+    const char* path;
+{
+#ifdef _WIN32
+    // _commit() fails on a descriptor that is only open for reading
+    int fd = open(path, _O_WRONLY | _O_BINARY);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    int rc;
+
+    if (fd < 0) {
+        return false;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc == 0;
+}
+
+/**
+ * Remembers the folder of 'path' for the next commit, unless it is already listed.
+ */
+static bool
+add_dir(journal, path)
+    moveJournal* journal;
+    const char* path;
+{
+    char dir[_MAX_PATH];
+    size_t length;
+    char* copy;
+
+    if (!move_parent_of(path, dir, sizeof(dir))) {
+        return false;
+    }
+    for (int i = journal->dirCount - 1; i >= 0; i--) {
+        if (!strcmp(journal->dirs[i], dir)) {
+            return true;
+        }
+    }
+    length = strlen(dir) + 1;
+    if (!(copy = (char*)arena_alloc(journal->batch, length))) {
+        return false;
+    }
+    memcpy(copy, dir, length);
+    journal->dirs[journal->dirCount++] = copy;
+    return true;
+}
+
+static bool
+commit_locked(journal)
+    moveJournal* journal;
+{
+    char line[32];
+    char* records;
+    size_t used = 0;
+    bool ok = true;
+
+    if (journal->pendingCount == 0) {
+        return true;
+    }
+
+    // The intents go first, so a crash from here on leaves a record of every move
+    if (fsync(journal->fd) != 0) {
+        out_perror("Error : Couldn't sync the move journal");
+        ok = false;
+    }
+
+    // One fsync per folder makes every rename of the batch durable
+    for (int i = 0; ok && i < journal->dirCount; i++) {
+        if (move_sync_dir(journal->dirs[i]) != 0) {
+            out_printf(stderr, "Error : Couldn't sync %s: %s\n", journal->dirs[i], strerror(errno));
+            ok = false;
+        }
+    }
+
+    // Copies are now safely in place, so their sources can go; their folders are synced again
+    for (int i = 0; ok && i < journal->sourceCount; i++) {
+        if (unlink(journal->sources[i]) != 0 && errno != ENOENT) {
+            out_printf(stderr, "Error : Couldn't remove %s: %s\n", journal->sources[i], strerror(errno));
+        }
+    }
+    if (ok && journal->sourceCount > 0) {
+        journal->dirCount = 0;
+        for (int i = 0; i < journal->sourceCount; i++) {
+            add_dir(journal, journal->sources[i]);
+        }
+        for (int i = 0; i < journal->dirCount; i++) {
+            if (move_sync_dir(journal->dirs[i]) != 0) {
+                out_printf(stderr, "Error : Couldn't sync %s: %s\n", journal->dirs[i], strerror(errno));
+                ok = false;
+            }
+        }
+    }
+
+    // Commit records need no sync of their own: replaying a committed move changes nothing
+    if (ok && !(records = (char*)arena_alloc(journal->batch, journal->pendingCount * sizeof(line)))) {
+        out_perror("Error : Out of memory");
+        ok = false;
+    }
+    if (ok) {
+        for (int i = 0; i < journal->pendingCount; i++) {
+            int n = snprintf(line, sizeof(line), "C %llu\n", (unsigned long long)journal->pending[i]);
+            memcpy(records + used, line, n);
+            used += n;
+        }
+        if (!write_all(journal->fd, records, used)) {
+            out_perror("Error : Couldn't write to the move journal");
+            ok = false;
+        }
+    }
+
+    // Whatever failed is settled when the journal is next opened, so the file has to stay
+    if (!ok) {
+        journal->failed = true;
+    }
+    arena_reset(journal->batch);
+    journal->pendingCount = 0;
+    journal->dirCount = 0;
+    journal->sourceCount = 0;
+
+    // With every recorded move committed, the records are of no use; a long --watch keeps the file short
+    if (ok && !journal->failed && journal->recording == 0 &&
+        (ftruncate(journal->fd, 0) != 0 || fsync(journal->fd) != 0)) {
+        out_perror("Error : Couldn't truncate the move journal");
+    }
+    return ok;
+}
+
+static journalIntent*
+find_intent(intents, count, seq)
+    journalIntent* intents;
+    int count;
+    uint64_t seq;
+{
+    int low = 0;
+    int high = count - 1;
+
+    // Moves are numbered in the order they were recorded
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (intents[mid].seq == seq) {
+            return &intents[mid];
+        }
+        if (intents[mid].seq < seq) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parses the journal contents into 'intents'. A torn last record is ignored.
+ */
+static int
+parse_journal(data, size, intents, capacity)
+    const char* data;
+    size_t size;
+    journalIntent* intents;
+    int capacity;
+{
+    const char* p = data;
+    const char* end = data + size;
+    int count = 0;
+
+    while (p < end) {
+        const char* eol = memchr(p, '\n', end - p);
+        unsigned long long seq;
+        unsigned long long oldLength;
+        unsigned long long newLength;
+        journalIntent* intent;
+        char line[96];
+        char type;
+
+        if (!eol || (size_t)(eol - p) >= sizeof(line)) {
+            break;
+        }
+        memcpy(line, p, eol - p);
+        line[eol - p] = '\0';
+        p = eol + 1;
+
+        if (sscanf(line, "M %llu %llu %llu", &seq, &oldLength, &newLength) == 3) {
+            // Recorded paths are never empty nor longer than a path, which also keeps the sum from wrapping
+            if (count == capacity || oldLength == 0 || newLength == 0 || oldLength >= _MAX_PATH ||
+                newLength >= _MAX_PATH || oldLength + newLength + 1 > (unsigned long long)(end - p) ||
+                p[oldLength + newLength] != '\n') {
+                break;
+            }
+            intent = &intents[count++];
+            intent->seq = seq;
+            intent->oldPath = p;
+            intent->oldLength = (size_t)oldLength;
+            intent->newPath = p + oldLength;
+            intent->newLength = (size_t)newLength;
+            intent->copied = false;
+            intent->committed = false;
+            p += oldLength + newLength + 1;
+        } else if (sscanf(line, "%c %llu", &type, &seq) == 2 && (type == 'X' || type == 'C')) {
+            if ((intent = find_intent(intents, count, seq)) != NULL) {
+                if (type == 'X') {
+                    intent->copied = true;
+                } else {
+                    intent->committed = true;
+                }
+            }
+        } else {
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ * Settles one uncommitted move. Returns 1 if it was finished, 0 if it was rolled back
+ * and -1 if it was left as it is.
+ */
+static int
+settle_intent(intent)
+    const journalIntent* intent;
+{
+    char oldPath[_MAX_PATH];
+    char newPath[_MAX_PATH];
+    char tmpPath[_MAX_PATH + sizeof(MOVE_TMP_SUFFIX)];
+    struct stat oldStat;
+    struct stat newStat;
+    bool haveOld;
+    bool haveNew;
+
+    if (intent->oldLength >= sizeof(oldPath) || intent->newLength >= sizeof(newPath)) {
+        return -1;
+    }
+    memcpy(oldPath, intent->oldPath, intent->oldLength);
+    oldPath[intent->oldLength] = '\0';
+    memcpy(newPath, intent->newPath, intent->newLength);
+    newPath[intent->newLength] = '\0';
+
+    // A copy that never made it into place is only a temporary file
+    snprintf(tmpPath, sizeof(tmpPath), "%s%s", newPath, MOVE_TMP_SUFFIX);
+    if (unlink(tmpPath) == 0) {
+        move_sync_parent(newPath);
+    }
+
+    haveOld = stat(oldPath, &oldStat) == 0;
+    haveNew = stat(newPath, &newStat) == 0;
+
+    if (haveOld && !haveNew) {
+        // Not moved, or the rename didn't reach the disk; the next scan finds the file again
+        return 0;
+    }
+    if (!haveOld && haveNew) {
+        // Renamed, but maybe not yet durable
+        return move_sync_parent(newPath) == 0 && move_sync_parent(oldPath) == 0 ? 1 : -1;
+    }
+    if (haveOld && haveNew && intent->copied && oldStat.st_size == newStat.st_size) {
+        // A complete copy whose source was still waiting for the commit
+        if (!sync_file(newPath) || move_sync_parent(newPath) != 0 || unlink(oldPath) != 0) {
+            fprintf(stderr, "Error : Couldn't finish moving %s: %s\n", oldPath, strerror(errno));
+            return -1;
+        }
+        move_sync_parent(oldPath);
+        return 1;
+    }
+
+    if (haveOld) {
+        fprintf(stderr, "Error : Both %s and %s exist, left as they are.\n", oldPath, newPath);
+    } else {
+        fprintf(stderr, "Error : Neither %s nor %s exists.\n", oldPath, newPath);
+    }
+    return -1;
+}
+
+/**
+ * Settles the moves an earlier run left uncommitted in the journal at 'path'. Returns
+ * false if the journal couldn't be read or a move was left as it is.
+ */
+static bool
+replay_journal(path)
+    const char* path;
+{
+    FILE* file = fopen(path, "rb");
+    journalIntent* intents = NULL;
+    char* data = NULL;
+    long size;
+    int capacity;
+    int count;
+    int finished = 0;
+    int rolledBack = 0;
+    int left = 0;
+
+    if (!file) {
+        return errno == ENOENT;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error : Couldn't read the move journal %s.\n", path);
+        fclose(file);
+        return false;
+    }
+    if (size == 0) {
+        fclose(file);
+        return true;
+    }
+
+    // Every intent takes at least 10 bytes ("M1 1 1\nab\n"), so the file size bounds their number
+    capacity = (int)(size / 10 + 1);
+    data = (char*)malloc(size);
+    intents = (journalIntent*)malloc(capacity * sizeof(journalIntent));
+    if (!data || !intents || fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Error : Couldn't read the move journal %s.\n", path);
+        fclose(file);
+        free(data);
+        free(intents);
+        return false;
+    }
+    fclose(file);
+
+    count = parse_journal(data, (size_t)size, intents, capacity);
+    for (int i = 0; i < count; i++) {
+        if (!intents[i].committed) {
+            switch (settle_intent(&intents[i])) {
+            case 1:
+                finished++;
+                break;
+            case 0:
+                rolledBack++;
+                break;
+            default:
+                left++;
+                break;
+            }
+        }
+    }
+    if (finished + rolledBack + left > 0) {
+        printf("Journal %s: %d interrupted moves finished, %d rolled back, %d left as they are.\n",
+               path, finished, rolledBack, left);
+    }
+
+    free(data);
+    free(intents);
+    return left == 0;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+#else
+static void*
+#endif
+flush_main(arg)
+    void* arg;
+{
+    moveJournal* journal = (moveJournal*)arg;
+
+    // Nothing to do until a batch starts, so an idle --watch costs nothing
+    mutex_lock(&journal->lock);
+    while (!journal->closing) {
+        uint64_t age;
+        uint64_t wait;
+
+        if (journal->pendingCount == 0) {
+            cond_wait(&journal->pendingCond, &journal->lock);
+            continue;
+        }
+        age = (stats_now() - journal->firstPending) / 1000000;
+        if (age >= JOURNAL_MAX_DELAY) {
+            commit_locked(journal);
+            continue;
+        }
+
+        // Short naps, so closing doesn't wait for a whole delay
+        wait = JOURNAL_MAX_DELAY - age < JOURNAL_FLUSH_NAP ? JOURNAL_MAX_DELAY - age : JOURNAL_FLUSH_NAP;
+        mutex_unlock(&journal->lock);
+#ifdef _WIN32
+        Sleep((DWORD)wait);
+#else
+        struct timespec nap = { 0, (long)wait * 1000 * 1000 };
+        nanosleep(&nap, NULL);
+#endif
+        mutex_lock(&journal->lock);
+    }
+    mutex_unlock(&journal->lock);
+    return 0;
+}
+
+moveJournal*
+journal_open(path)
+    const char* path;
+{
+    moveJournal* journal;
+
+    if (strlen(path) >= _MAX_PATH) {
+        fprintf(stderr, "Error : Journal path too long: %s\n", path);
+        return NULL;
+    }
+
+    // Truncating the journal would lose the only record of the moves still to be settled
+    if (!replay_journal(path)) {
+        fflush(stdout);
+        fprintf(stderr, "Error : The move journal %s still holds unsettled moves; move it aside once they are dealt with.\n",
+                path);
+        return NULL;
+    }
+
+    if (!(journal = (moveJournal*)calloc(1, sizeof(moveJournal))) ||
+        !(journal->batch = arena_create(JOURNAL_CHUNK))) {
+        perror("Error : Out of memory");
+        free(journal);
+        return NULL;
+    }
+    strcpy(journal->path, path);
+
+    // Everything in the old journal is settled; a fresh one is started
+    if ((journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+        fsync(journal->fd) != 0) {
+        fprintf(stderr, "Error : Couldn't open the move journal %s: %s\n", path, strerror(errno));
+        if (journal->fd >= 0) {
+            close(journal->fd);
+        }
+        arena_destroy(journal->batch);
+        free(journal);
+        return NULL;
+    }
+    mutex_init(&journal->lock);
+    cond_init(&journal->pendingCond);
+
+    // Without the flusher, batches are still committed by the next move or by closing
+#ifdef _WIN32
+    journal->flusher = (HANDLE)_beginthreadex(NULL, 0, flush_main, journal, 0, NULL);
+    journal->flusherRunning = journal->flusher != 0;
+#else
+    journal->flusherRunning = pthread_create(&journal->flusher, NULL, flush_main, journal) == 0;
+#endif
+    return journal;
+}
+
+int
+journal_move(journal, oldPath, newPath, sync)
+    moveJournal* journal;
+    const char* oldPath;
+    const char* newPath;
+    SyncPolicy sync;
+{
+    size_t oldLength = strlen(oldPath);
+    size_t newLength = strlen(newPath);
+    char header[80];
+    char line[32];
+    uint64_t seq;
+    bool copied = false;
+    bool recorded;
+    char* source = NULL;
+    int err;
+    int n;
+
+    // The intent is written before the move, so a crash in between leaves a record of it
+    mutex_lock(&journal->lock);
+    seq = ++journal->seq;
+    n = snprintf(header, sizeof(header), "M %llu %llu %llu\n",
+                 (unsigned long long)seq, (unsigned long long)oldLength, (unsigned long long)newLength);
+    recorded = write_all(journal->fd, header, n) && write_all(journal->fd, oldPath, oldLength) &&
+               write_all(journal->fd, newPath, newLength) && write_all(journal->fd, "\n", 1);
+    if (recorded) {
+        journal->recording++;
+    }
+    mutex_unlock(&journal->lock);
+    if (!recorded) {
+        out_perror("Error : Couldn't write to the move journal");
+        errno = EIO;
+        return -1;
+    }
+
+    // A copy's source is only removed by the commit, once the copy itself is on disk
+    if (move_file_keep(oldPath, newPath, sync == SYNC_NONE ? SYNC_FILE : sync, &copied, 1) != 0) {
+        // Nothing happened, so there is nothing to settle either
+        err = errno;
+        n = snprintf(line, sizeof(line), "C %llu\n", (unsigned long long)seq);
+        mutex_lock(&journal->lock);
+        write_all(journal->fd, line, n);
+        journal->recording--;
+        mutex_unlock(&journal->lock);
+        errno = err;
+        return -1;
+    }
+
+    mutex_lock(&journal->lock);
+    journal->recording--;
+    if (copied) {
+        n = snprintf(line, sizeof(line), "X %llu\n", (unsigned long long)seq);
+        if (!write_all(journal->fd, line, n) || !(source = (char*)arena_alloc(journal->batch, oldLength + 1))) {
+            // The copy is complete, but without a record the source has to go now
+            err = errno;
+            mutex_unlock(&journal->lock);
+            if (move_sync_parent(newPath) != 0 || unlink(oldPath) != 0) {
+                out_printf(stderr, "Error : Couldn't remove %s: %s\n", oldPath, strerror(errno));
+            }
+            errno = err;
+            return 0;
+        }
+        memcpy(source, oldPath, oldLength + 1);
+        journal->sources[journal->sourceCount++] = source;
+    }
+    if (journal->pendingCount == 0) {
+        journal->firstPending = stats_now();
+        cond_signal(&journal->pendingCond);
+    }
+    journal->pending[journal->pendingCount++] = seq;
+
+    // A folder that can't be listed is synced on its own right away
+    if (!add_dir(journal, newPath)) {
+        move_sync_parent(newPath);
+    }
+    if (!add_dir(journal, oldPath)) {
+        move_sync_parent(oldPath);
+    }
+
+    if (journal->pendingCount == JOURNAL_BATCH ||
+        stats_now() - journal->firstPending > (uint64_t)JOURNAL_MAX_DELAY * 1000000) {
+        commit_locked(journal);
+    }
+    mutex_unlock(&journal->lock);
+    return 0;
+}
+
+bool
+journal_commit(journal)
+    moveJournal* journal;
+{
+    bool ok;
+
+    mutex_lock(&journal->lock);
+    ok = commit_locked(journal);
+    mutex_unlock(&journal->lock);
+    return ok;
+}
+
+void
+journal_close(journal)
+    moveJournal* journal;
+{
+    bool ok;
+
+    if (!journal) {
+        return;
+    }
+
+    if (journal->flusherRunning) {
+        mutex_lock(&journal->lock);
+        journal->closing = true;
+        cond_signal(&journal->pendingCond);
+        mutex_unlock(&journal->lock);
+#ifdef _WIN32
+        WaitForSingleObject(journal->flusher, INFINITE);
+        CloseHandle(journal->flusher);
+#else
+        pthread_join(journal->flusher, NULL);
+#endif
+    }
+
+    ok = journal_commit(journal) && fsync(journal->fd) == 0;
+    close(journal->fd);
+
+    // A journal with nothing left to settle isn't worth keeping; one with a failed commit is
+    if (ok && !journal->failed) {
+        unlink(journal->path);
+    }
+
+    arena_destroy(journal->batch);
+    cond_destroy(&journal->pendingCond);
+    mutex_destroy(&journal->lock);
+    free(journal);
+}
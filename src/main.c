@@ -1,10 +1,68 @@
 #include "../include/config.h"
 #include "../include/filelist.h"
 #include "../include/metadata.h"
+#include "../include/pool.h"
+#include "../include/cache.h"
+#include "../include/watch.h"
+#include "../include/dircache.h"
+#include "../include/move.h"
+#include "../include/ioengine.h"
+#include "../include/wordcase.h"
+#include "../include/stats.h"
+#include "../include/arena.h"
+#include "../include/plan.h"
+#include "../include/journal.h"
+#include "../include/dupindex.h"
+#include "../include/coverart.h"
+
+typedef struct ingestContext {
+    workPool* pool;                       // worker threads, NULL when running serially
+    const char* dest_dir;                 // destination folder (music library)
+    const runOptions* opts;               // command line options
+    metaCache* cache;                     // parse results of earlier runs, NULL if disabled
+    ioEngine* engine;                     // batched header reads during the scan, NULL if disabled
+    arena* paths;                         // paths and task records, owned by the main thread
+    slab* headers;                        // buffers for the headers read by 'engine'
+    movePlan* plan;                       // moves recorded instead of carried out, NULL unless planning
+    moveJournal* journal;                 // records moves and syncs their folders in batches, NULL if disabled
+    dupIndex* dupes;                      // audio MD5s of the library's tracks, NULL unless --dedup
+    coverArt* covers;                     // the cover art of each album folder, NULL unless --cover-art
+    int successCount;                     // number of files successfully processed
+    int fcount;                           // number of files found so far
+    uint64_t scanMark;                    // when the scan resumed after the last file, 0 outside the scan
+} ingestContext;
+
+typedef struct fileTask {
+    char* filename;
+    BYTE* header;                         // start of the file if already read, or NULL
+    size_t headerLen;
+    ingestContext* ingest;
+} fileTask;
+
+typedef struct albumTask {
+    const planEntry* entries;             // the moves into one album folder
+    int count;
+    ingestContext* ingest;
+} albumTask;
 
 // Function prototype
-void process_file(char* filename, const char* dest_dir, int* successCount);
+void process_file(char* filename, BYTE* header, size_t headerLen, ingestContext* ingest);
 void print_summary(int successCount, int totalFiles);
+static int queue_file(char* filename, void* ctx);
+static int watch_file(char* filename, void* ctx);
+static int prefetch_file(char* filename, void* ctx);
+static void submit_file(char* filename, BYTE* header, size_t headerLen, void* ctx);
+static void run_file_task(void* arg);
+static bool plan_file(const audioMetaData* meta, const char* filename, ingestContext* ingest);
+static void execute_plan(const movePlan* plan, ingestContext* ingest);
+static void run_album_task(void* arg);
+static void move_album(const planEntry* entries, int count, ingestContext* ingest);
+static int move_into_library(const char* oldPath, const char* newPath, ingestContext* ingest);
+static bool destination_of(const audioMetaData* meta, const char* library, char* artist, char* name, char* path);
+static bool accept_track(const BYTE* md5, const char* newPath, ingestContext* ingest);
+static void release_track(const BYTE* md5, ingestContext* ingest);
+static void rewrite_tags(const char* path, const tagEdit* edits, int editCount, const runOptions* opts);
+static void write_cover_art(const char* path, ingestContext* ingest);
 
 int
 main(argc, argv)
@@ -14,85 +72,620 @@ main(argc, argv)
     //char* ftype = NULL;                 // file extension
     char src_dir[_MAX_PATH] = "";         // source folder containing audio files
     char dest_dir[_MAX_PATH] = "";        // destination folder (music library)
-    char** fileList = NULL;               // list of files
-    int fcount = 0;                       // number of files
-    int successCount = 0;                 // number of files successfully processed
+    runOptions opts;                      // command line options
+    ingestContext ingest = { NULL, dest_dir, &opts, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0 };
+    dirWatch* watch = NULL;               // source folder watch in --watch mode
+
+    if (parse_options(argc, argv, &opts) != 0) {
+        fprintf(stderr, "Usage: %s [--jobs N] [--recursive | --depth N] [--probe-size N] [--defer-rewrite] [--no-cache] [--watch] [--fsync none|file|all] [--io-batch N] [--stats FILE] [--stats-interval N] [--plan | --dry-run FILE | --execute FILE] [--journal FILE] [--dedup] [--tag NAME=VALUE]... [--cover-art]\n", argv[0]);
+        return 1;
+    }
+    stats_init();
 
     // Read configuration file / initial setup
     if (setup(src_dir, dest_dir) != 0) {
-        handle_error("Setup failed!\n");
+        handle_error(FAIL_SETUP);
         return 1;
     }
 
-    // Get a list of the file names in 'src_dir' with extension 'ftype'
-    fileList = get_filenames(src_dir, &fcount/*, ftype*/);
+    // The word list from dir.ini (or the default one) is compiled once for all workers
+    if (!wordcase_compile()) {
+        handle_error(FAIL_WORD_LIST);
+        return 1;
+    }
+
+    set_flac_probe_size(opts.probeSize);
+
+    // Paths live until the end of the run; each thread reuses one scratch chunk per file
+    arena_scratch_init(opts.probeSize + ARENA_SCRATCH_CHUNK);
+    if (!(ingest.paths = arena_create(ARENA_PATH_CHUNK))) {
+        perror("Error : Out of memory");
+        return 1;
+    }
+
+    // Carrying out a plan file parses nothing, so the cache is left as it is
+    if (opts.useCache && !opts.executePath) {
+        ingest.cache = cache_open(CACHE_FILE);
+    }
+
+    // In plan mode files are parsed into a plan first; --execute reads one instead of scanning
+    if (opts.executePath) {
+        ingest.plan = plan_read(opts.executePath);
+    } else if (opts.plan) {
+        ingest.plan = plan_create();
+    }
+    if (ingest.plan && !opts.executePath && !plan_set_tags(ingest.plan, opts.tags, opts.tagCount)) {
+        plan_destroy(ingest.plan);
+        ingest.plan = NULL;
+    }
+    if ((opts.executePath || opts.plan) && !ingest.plan) {
+        cache_close(ingest.cache);
+        arena_destroy(ingest.paths);
+        return 1;
+    }
+
+    // A plan file brings the --tag settings its destinations were computed with
+    if (opts.executePath) {
+        const char* const* tags = plan_tags(ingest.plan, &opts.tagCount);
+        memcpy(opts.tags, tags, opts.tagCount * sizeof(*tags));
+    }
+
+    // Moves an interrupted run left half done are settled before anything new is moved
+    if (opts.journalPath && !opts.dryRunPath && !(ingest.journal = journal_open(opts.journalPath))) {
+        plan_destroy(ingest.plan);
+        cache_close(ingest.cache);
+        arena_destroy(ingest.paths);
+        return 1;
+    }
 
-    printf("File List:\n");
-    print_filenames(fileList, fcount);
-    printf("\nResults:\n");
+    // A plan file was checked for duplicates when it was made, and is checked again as it is carried out
+    if (opts.dedup && !(ingest.dupes = dupindex_open(dest_dir))) {
+        perror("Error : Out of memory");
+    }
+
+    // A dry run writes no art, as it moves no tracks
+    if (opts.coverArt && !opts.dryRunPath && !(ingest.covers = coverart_open(dest_dir))) {
+        perror("Error : Out of memory");
+    }
+
+    // Fall back to processing on the main thread if the workers can't be started
+    if (opts.jobs > 1) {
+        ingest.pool = pool_create(opts.jobs);
+    }
+
+    // Start watching before the scan so files arriving meanwhile aren't missed
+    if (opts.watch && !(watch = watch_open(src_dir, opts.maxDepth))) {
+        pool_destroy(ingest.pool);
+        journal_close(ingest.journal);
+        dupindex_close(ingest.dupes);
+        coverart_close(ingest.covers);
+        cache_close(ingest.cache);
+        return 1;
+    }
+
+    // Read the headers of whole batches of files at once during the scan
+    if (opts.ioBatch > 0 && !opts.executePath && (ingest.headers = slab_create(opts.probeSize)) != NULL) {
+        ingest.engine = ioengine_create(opts.ioBatch, opts.probeSize, ingest.headers, submit_file, &ingest);
+    }
+
+    // Long runs append a snapshot of the statistics every few seconds
+    if (opts.statsPath && opts.statsInterval > 0 && !stats_start_interval(opts.statsPath, opts.statsInterval)) {
+        fprintf(stderr, "Error : Couldn't start writing %s periodically.\n", opts.statsPath);
+    }
+
+    // Scan 'src_dir' once, processing each file as soon as it is found (or its batch is read)
+    printf("Results:\n");
+    if (opts.executePath) {
+        ingest.fcount = plan_count(ingest.plan);
+        for (int i = 0; i < ingest.fcount; i++) {
+            stats_found();
+        }
+    } else {
+        ingest.scanMark = stats_now();
+        if (scan_directory(src_dir, opts.maxDepth, ingest.paths, ingest.engine ? prefetch_file : queue_file, &ingest) < 0) {
+            stats_stop_interval();
+            ioengine_destroy(ingest.engine);
+            pool_destroy(ingest.pool);
+            journal_close(ingest.journal);
+            dupindex_close(ingest.dupes);
+            coverart_close(ingest.covers);
+            cache_close(ingest.cache);
+            watch_close(watch);
+            plan_destroy(ingest.plan);
+            arena_destroy(ingest.paths);
+            slab_destroy(ingest.headers);
+            arena_scratch_release();
+            return 1;
+        }
+        ingest.scanMark = 0;
+        ioengine_destroy(ingest.engine);
+        ingest.engine = NULL;
+    }
+
+    // Once every file is parsed, the plan is carried out (or written) sorted by destination
+    if (ingest.plan) {
+        if (ingest.pool) {
+            pool_wait(ingest.pool);
+        }
+        plan_sort(ingest.plan);
+        if (opts.dryRunPath) {
+            if (plan_write(ingest.plan, opts.dryRunPath)) {
+                ingest.successCount = plan_count(ingest.plan);
+                printf("\nPlan of %d moves written to %s\n", ingest.successCount, opts.dryRunPath);
+            }
+        } else {
+            execute_plan(ingest.plan, &ingest);
+        }
+    }
+
+    // Then keep processing files as they are completed until interrupted
+    if (watch) {
+        pool_output_lock(ingest.pool);
+        printf("Watching %s for new files (Ctrl+C to stop)...\n", src_dir);
+        fflush(stdout);
+        pool_output_unlock(ingest.pool);
+        watch_run(watch, watch_file, &ingest);
+        watch_close(watch);
+    }
+    pool_destroy(ingest.pool);
+    journal_close(ingest.journal);
+    plan_destroy(ingest.plan);
 
-    // Read metadata and process files
-    for (int i = 0; i < fcount; i++) {
-        process_file(fileList[i], dest_dir, &successCount);
+    // A dry run moved nothing, so the tracks it saw aren't in the library
+    if (ingest.dupes) {
+        if (!opts.dryRunPath) {
+            dupindex_save(ingest.dupes);
+        }
+        dupindex_close(ingest.dupes);
+    }
+    if (ingest.covers) {
+        coverart_save(ingest.covers);
+        coverart_close(ingest.covers);
     }
+    dircache_clear();
+    wordcase_free();
 
-    free(fileList);
+    // Every path, task, header buffer and metadata record goes in one go
+    arena_destroy(ingest.paths);
+    slab_destroy(ingest.headers);
+    arena_scratch_release();
+
+    if (ingest.cache) {
+        cache_save(ingest.cache);
+        cache_close(ingest.cache);
+    }
 
     // Display summary
-    print_summary(successCount, fcount);
+    stats_stop_interval();
+    print_summary(ingest.successCount, ingest.fcount);
+    if (opts.statsPath && !stats_write(opts.statsPath, 1)) {
+        perror("Error : Couldn't write the statistics");
+    }
 
     return 0;
 }
 
+static int
+queue_file(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    ingestContext* ingest = (ingestContext*)ctx;
+
+    if (ingest->scanMark) {
+        stats_record(STAGE_SCAN, ingest->scanMark);
+    }
+    stats_found();
+
+    pool_output_lock(ingest->pool);
+    printf("File #%2d | %s\n", ingest->fcount++, filename);
+    pool_output_unlock(ingest->pool);
+
+    submit_file(filename, NULL, 0, ingest);
+    if (ingest->scanMark) {
+        ingest->scanMark = stats_now();
+    }
+    return 0;
+}
+
+static int
+watch_file(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    ingestContext* ingest = (ingestContext*)ctx;
+    size_t length = strlen(filename) + 1;
+    char* path;
+
+    // Nothing refers to the arena while the pool is idle, so a long watch doesn't keep growing it
+    if (arena_used(ingest->paths) > ARENA_PATH_CHUNK && pool_is_idle(ingest->pool)) {
+        arena_reset(ingest->paths);
+    }
+
+    // The watch hands over malloc()ed paths; everything after this point uses the arena
+    path = (char*)arena_alloc(ingest->paths, length);
+    if (!path) {
+        free(filename);
+        return 0;
+    }
+    memcpy(path, filename, length);
+    free(filename);
+    return queue_file(path, ctx);
+}
+
+static int
+prefetch_file(filename, ctx)
+    char* filename;
+    void* ctx;
+{
+    ingestContext* ingest = (ingestContext*)ctx;
+    const char* ftype = get_file_extension(filename);
+    audioMetaData scratch;
+    cacheKey key;
+
+    stats_record(STAGE_SCAN, ingest->scanMark);
+    stats_found();
+
+    pool_output_lock(ingest->pool);
+    printf("File #%2d | %s\n", ingest->fcount++, filename);
+    pool_output_unlock(ingest->pool);
+
+    // Only FLAC files that actually have to be parsed are worth reading ahead
+    if (ftype && !strcmp(ftype, "flac") &&
+        !(ingest->cache && cache_key(filename, &key) && cache_lookup(ingest->cache, &key, filename, &scratch, NULL) != CACHE_MISS)) {
+        ioengine_add(ingest->engine, filename);
+    } else {
+        submit_file(filename, NULL, 0, ingest);
+    }
+    ingest->scanMark = stats_now();
+    return 0;
+}
+
+static void
+submit_file(filename, header, headerLen, ctx)
+    char* filename;
+    BYTE* header;
+    size_t headerLen;
+    void* ctx;
+{
+    ingestContext* ingest = (ingestContext*)ctx;
+    fileTask* task = NULL;
+
+    if (ingest->pool && (task = (fileTask*)arena_alloc(ingest->paths, sizeof(fileTask)))) {
+        task->filename = filename;
+        task->header = header;
+        task->headerLen = headerLen;
+        task->ingest = ingest;
+        pool_submit(ingest->pool, run_file_task, task);
+    } else {
+        process_file(filename, header, headerLen, ingest);
+    }
+}
+
+static void
+run_file_task(arg)
+    void* arg;
+{
+    fileTask* task = (fileTask*)arg;
+    process_file(task->filename, task->header, task->headerLen, task->ingest);
+}
+
+static bool
+plan_file(meta, filename, ingest)
+    const audioMetaData* meta;
+    const char* filename;
+    ingestContext* ingest;
+{
+    char artist[MAX_LENGTH];
+    char name[_MAX_PATH];
+    char path[_MAX_PATH];
+
+    // Names that won't fit when the plan is carried out are rejected now
+    if (!destination_of(meta, ingest->dest_dir, artist, name, path) || !accept_track(meta->audioMd5, path, ingest)) {
+        return false;
+    }
+
+    if (!plan_add(ingest->plan, filename, ingest->dest_dir, artist, meta, name)) {
+        out_perror("Error : Couldn't add the file to the plan");
+        release_track(meta->audioMd5, ingest);
+        return false;
+    }
+    return true;
+}
+
+static void
+execute_plan(plan, ingest)
+    const movePlan* plan;
+    ingestContext* ingest;
+{
+    const planEntry* entries = plan_entries(plan);
+    int count = plan_count(plan);
+    int first = 0;
+
+    // One task per album folder, so the folder is created once and the renames into it follow each other
+    while (first < count) {
+        albumTask* task = NULL;
+        int last = first + 1;
+
+        while (last < count && plan_same_folder(&entries[first], &entries[last])) {
+            last++;
+        }
+
+        if (ingest->pool && (task = (albumTask*)arena_alloc(ingest->paths, sizeof(albumTask)))) {
+            task->entries = &entries[first];
+            task->count = last - first;
+            task->ingest = ingest;
+            pool_submit(ingest->pool, run_album_task, task);
+        } else {
+            move_album(&entries[first], last - first, ingest);
+        }
+        first = last;
+    }
+}
+
+static void
+run_album_task(arg)
+    void* arg;
+{
+    albumTask* task = (albumTask*)arg;
+    move_album(task->entries, task->count, task->ingest);
+}
+
+static void
+move_album(entries, count, ingest)
+    const planEntry* entries;
+    int count;
+    ingestContext* ingest;
+{
+    const runOptions* opts = ingest->opts;
+    char folder[MAX_LENGTH] = "";
+    char newPath[_MAX_PATH];
+    bool haveFolder = false;
+    uint64_t started;
+
+    for (int i = 0; i < count; i++) {
+        const planEntry* entry = &entries[i];
+        const char* oldPath = entry->source;
+        const tagEdit* edits = NULL;
+        int editCount = 0;
+        int length = -1;
+        int moved;
+        BYTE md5[AUDIO_MD5_SIZE];
+
+        memcpy(md5, entry->audioMd5, AUDIO_MD5_SIZE);
+
+        // The album folder is created with its first file; if that fails, the next file tries again
+        if (!haveFolder) {
+            started = stats_now();
+            haveFolder = create_album_folder(entry->library->text, entry->artist->text, entry->album->text, folder);
+            stats_record(STAGE_MKDIR, started);
+        }
+        if (haveFolder) {
+            length = snprintf(newPath, sizeof(newPath), "%s/%s", folder, entry->name->text);
+            if (length < 0 || length >= (int)sizeof(newPath)) {
+                handle_error(FAIL_NAME_TOO_LONG);
+                length = -1;
+            }
+        }
+        if (length < 0) {
+            release_track(md5, ingest);
+            out_printf(stdout, "[%s]\n", oldPath);
+            continue;
+        }
+
+        // A plan file carries no MD5s, and the library may have gained the same audio since it was made
+        if (opts->executePath && ingest->dupes) {
+            const char* ftype = get_file_extension(oldPath);
+            if (ftype && !strcmp(ftype, "flac") && !flac_read_audio_md5(oldPath, md5)) {
+                memset(md5, 0, AUDIO_MD5_SIZE);
+            }
+            if (!accept_track(md5, newPath, ingest)) {
+                out_printf(stdout, "[%s]\n", oldPath);
+                continue;
+            }
+        }
+
+        // Tags are only rewritten in the file the edits were made for
+        if (entry->edits) {
+            if (plan_source_unchanged(entry)) {
+                edits = entry->edits->edits;
+                editCount = entry->edits->count;
+            } else {
+                stats_warn(WARN_REWRITE);
+                out_printf(stderr, "Error : %s changed since it was planned, tags not rewritten.\n", oldPath);
+            }
+        }
+
+        if (!opts->deferRewrite) {
+            rewrite_tags(oldPath, edits, editCount, opts);
+        }
+
+        // A folder that was deleted meanwhile is recreated once; if that fails, it was counted
+        started = stats_now();
+        moved = move_into_library(oldPath, newPath, ingest);
+        if (moved == -1 && errno == ENOENT) {
+            moved = create_album_folder(entry->library->text, entry->artist->text, entry->album->text, folder)
+                        ? move_into_library(oldPath, newPath, ingest) : -2;
+        }
+        if (moved != 0) {
+            if (moved == -1) {
+                stats_fail(FAIL_MOVE);
+                out_perror("Error : File could not be renamed");
+            }
+            release_track(md5, ingest);
+            out_printf(stdout, "[%s]\n", oldPath);
+            continue;
+        }
+        stats_record(STAGE_MOVE, started);
+
+        if (opts->deferRewrite) {
+            rewrite_tags(newPath, edits, editCount, opts);
+        }
+        write_cover_art(newPath, ingest);
+
+        out_printf(stdout, "%s processed successfully.\n", newPath);
+        atomic_increment(&ingest->successCount);
+        stats_succeeded();
+    }
+}
+
 void
-process_file(filename, dest_dir, successCount)
+process_file(filename, header, headerLen, ingest)
     char* filename;
-    const char* dest_dir;
-    int* successCount;
+    BYTE* header;
+    size_t headerLen;
+    ingestContext* ingest;
 {
+    const runOptions* opts = ingest->opts;
+    arena* scratch = arena_scratch();     // everything below that isn't on the stack
     audioMetaData* meta = NULL;
+    audioMetaData* parsed = NULL;         // metadata as parsed, kept for the cache
     char oldPath[_MAX_PATH] = "";
     char newPath[_MAX_PATH] = "";
+    char artist[MAX_LENGTH];
+    char name[_MAX_PATH];
     bool mkdir_success = false;
+    bool moved = false;
+    bool planned = false;                 // recorded in the plan instead of being moved now
+    cacheKey key;
+    CacheStatus cached = CACHE_MISS;
+    FailReason reason = FAIL_REASON_COUNT;  // why the file was rejected, now or by an earlier run
+    bool keyed = false;                   // key is valid and the outcome should be cached
+    uint64_t started;                     // start of the current stage
+    int result;                           // of the move: 0, -1 failed, -2 folders failed (counted)
 
     const char* ftype = get_file_extension(filename);
+    bool isFlac = ftype && !strcmp(ftype, "flac");
+    bool isMp3 = ftype && !strcmp(ftype, "mp3");
+    bool isOgg = ftype && (!strcmp(ftype, "ogg") || !strcmp(ftype, "opus"));
+    bool isMp4 = ftype && (!strcmp(ftype, "m4a") || !strcmp(ftype, "mp4"));
+
+    // The previous file's record and read window are no longer needed
+    if (scratch) {
+        arena_reset(scratch);
+    }
 
-    if (!strcmp(ftype, "flac")) {
-        meta = get_audioMetaData_flac(filename);
-    } else if (!strcmp(ftype, "mp3")) {
-        handle_error("mp3 not yet implemented.");
-        // meta = get_audioMetaData_mp3(filename);
+    if (isFlac || isMp3 || isOgg || isMp4) {
+        // Files that are unchanged since an earlier run are not read again
+        keyed = ingest->cache && cache_key(filename, &key);
+        if (keyed && scratch && (meta = (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)))) {
+            cached = cache_lookup(ingest->cache, &key, filename, meta, &reason);
+            if (cached != CACHE_PARSED) {
+                meta = NULL;
+            }
+        }
+
+        if (cached == CACHE_REJECTED) {
+            handle_error(reason);
+        } else if (cached == CACHE_MISS) {
+            stats_take_failure();
+            started = stats_now();
+            if (isMp3) {
+                meta = get_audioMetaData_mp3(filename);
+            } else if (isOgg) {
+                meta = get_audioMetaData_ogg(filename);
+            } else if (isMp4) {
+                meta = get_audioMetaData_mp4(filename);
+            } else if (header) {
+                meta = get_audioMetaData_flac_prefix(filename, header, headerLen);
+            } else {
+                meta = get_audioMetaData_flac(filename);
+            }
+            stats_record(STAGE_PARSE, started);
+            reason = meta ? FAIL_REASON_COUNT : stats_take_failure();
+            if (meta && keyed && (parsed = (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)))) {
+                *parsed = *meta;
+            }
+        }
     } else {
-        handle_error("Unsupported file type.");
+        handle_error(FAIL_UNSUPPORTED);
     }
 
-    // procedure if meta contains metadata
-    if (meta != NULL) {
+    // Tracks are filed under the tags they are about to be given; the cache keeps the tags as parsed
+    if (meta != NULL && isFlac) {
+        for (int i = 0; i < opts->tagCount; i++) {
+            apply_tag_setting(meta, opts->tags[i]);
+        }
+    }
+
+    // In plan mode the destination is only recorded; nothing is rewritten or moved until the plan is carried out
+    if (meta != NULL && ingest->plan) {
+        planned = plan_file(meta, filename, ingest);
+    }
+
+    // procedure if meta contains metadata; duplicates are turned away before anything is changed
+    if (meta != NULL && !ingest->plan && destination_of(meta, ingest->dest_dir, artist, name, newPath) &&
+        accept_track(meta->audioMd5, newPath, ingest)) {
         // copy the old pathname from the struct
         strcpy(oldPath, meta->pathname);
 
+        // Unless deferred until after the move, rewrite changed tags in the source file now
+        if (!opts->deferRewrite && (meta->editCount > 0 || (isFlac && opts->tagCount > 0))) {
+            rewrite_tags(oldPath, meta->edits, meta->editCount, opts);
+            meta->editCount = 0;
+            keyed = keyed && cache_key(oldPath, &key);
+        }
+
         // meta->pathname is modified by create_folder_structure()
-        mkdir_success = create_folder_structure(meta, dest_dir);
+        started = stats_now();
+        mkdir_success = create_folder_structure(meta, ingest->dest_dir);
+        stats_record(STAGE_MKDIR, started);
+        if (!mkdir_success) {
+            release_track(meta->audioMd5, ingest);
+        }
     }
 
     // skip if a file contains no metadata or folder creation fails
-    if (meta == NULL || !mkdir_success) {
-        printf("[%s]\n", filename);
+    if (planned) {
+        // Files about to be moved aren't worth caching; a dry run leaves them where they are
+        moved = !opts->dryRunPath;
+    } else if (meta == NULL || !mkdir_success) {
+        out_printf(stdout, "[%s]\n", filename);
     } else {
         // copy the new pathname from the struct after modification
         strcpy(newPath, meta->pathname);
 
-        if (rename(oldPath, newPath) == -1) {
-            perror("Error : File could not be renamed");
+        // A cached folder that was deleted meanwhile is recreated once; if that fails, it was counted
+        started = stats_now();
+        result = move_into_library(oldPath, newPath, ingest);
+        if (result == -1 && errno == ENOENT) {
+            result = create_folder_structure(meta, ingest->dest_dir) ? move_into_library(oldPath, newPath, ingest) : -2;
+        }
+        if (result != 0) {
+            if (result == -1) {
+                stats_fail(FAIL_MOVE);
+                out_perror("Error : File could not be renamed");
+            }
+            release_track(meta->audioMd5, ingest);
         } else {
+            stats_record(STAGE_MOVE, started);
+            if (opts->deferRewrite) {
+                rewrite_tags(newPath, meta->edits, meta->editCount, opts);
+                meta->editCount = 0;
+            }
+            write_cover_art(newPath, ingest);
+
             // count and print files that did not fail
-            printf("%s processed successfully.\n", newPath);
-            (*successCount)++;
+            out_printf(stdout, "%s processed successfully.\n", newPath);
+            atomic_increment(&ingest->successCount);
+            stats_succeeded();
+            moved = true;
         }
     }
 
-    free(meta);
-    free(filename);
+    // Remember why files that stay in the source folder failed; unreadable files are retried
+    if (keyed && !moved && cached == CACHE_MISS) {
+        if (meta) {
+            if (parsed) {
+                cache_store(ingest->cache, &key, parsed, FAIL_REASON_COUNT);
+            }
+        } else if (reason != FAIL_OPEN && _access(filename, 4) == 0) {
+            cache_store(ingest->cache, &key, NULL, reason);
+        }
+    }
+
+    // The header buffer goes back to the engine's slab; the rest belongs to the arenas
+    slab_put(ingest->headers, header);
 }
 
 void
@@ -102,4 +695,142 @@ print_summary(successCount, totalFiles)
 {
     printf("\n%d files processed successfully,", successCount);
     printf(" %d files failed.\n\n", totalFiles - successCount);
+
+    // Why they failed, one line per reason that occurred
+    if (totalFiles > successCount) {
+        stats_print_failures(stdout);
+        printf("\n");
+    }
+
+    // Problems with files that were moved all the same
+    if (stats_print_warnings(stdout)) {
+        printf("\n");
+    }
+}
+
+static int
+move_into_library(oldPath, newPath, ingest)
+    const char* oldPath;
+    const char* newPath;
+    ingestContext* ingest;
+{
+    if (ingest->journal) {
+        return journal_move(ingest->journal, oldPath, newPath, ingest->opts->syncPolicy);
+    }
+    return move_file(oldPath, newPath, ingest->opts->syncPolicy);
+}
+
+/**
+ * Computes where a track goes in the library without creating anything: its artist folder
+ * name (MAX_LENGTH bytes), file name and full path (_MAX_PATH bytes each). A failure is counted.
+ */
+static bool
+destination_of(meta, library, artist, name, path)
+    const audioMetaData* meta;
+    const char* library;
+    char* artist;
+    char* name;
+    char* path;
+{
+    int length;
+
+    if (!get_artist_folder_name(meta, artist)) {
+        return false;
+    }
+
+    length = snprintf(path, _MAX_PATH, "%s/%s/%s/", library, artist, meta->album);
+    if (length < 0 || length > MAX_LENGTH || !format_file_name(meta, name, _MAX_PATH) ||
+        (size_t)length + strlen(name) >= _MAX_PATH) {
+        handle_error(FAIL_NAME_TOO_LONG);
+        return false;
+    }
+    strcpy(path + length, name);
+    return true;
+}
+
+static bool
+accept_track(md5, newPath, ingest)
+    const BYTE* md5;
+    const char* newPath;
+    ingestContext* ingest;
+{
+    static const BYTE unknown[AUDIO_MD5_SIZE];
+    char existing[_MAX_PATH];
+
+    // Without a STREAMINFO MD5 (MP3s, some encoders) there is nothing to compare
+    if (!ingest->dupes || !memcmp(md5, unknown, AUDIO_MD5_SIZE)) {
+        return true;
+    }
+
+    switch (dupindex_classify(ingest->dupes, md5, newPath, existing, sizeof(existing))) {
+    case DUP_DUPLICATE:
+        handle_error(FAIL_DUPLICATE);
+        out_printf(stderr, "(%s) ", existing);
+        return false;
+    case DUP_DIFFERENT:
+        handle_error(FAIL_DIFFERENT_ENCODE);
+        out_printf(stderr, "(%s) ", existing);
+        return false;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Takes a track accept_track() let in back out of the duplicate index once it isn't moved.
+ */
+static void
+release_track(md5, ingest)
+    const BYTE* md5;
+    ingestContext* ingest;
+{
+    static const BYTE unknown[AUDIO_MD5_SIZE];
+
+    if (ingest->dupes && memcmp(md5, unknown, AUDIO_MD5_SIZE)) {
+        dupindex_forget(ingest->dupes, md5);
+    }
+}
+
+static void
+rewrite_tags(path, edits, editCount, opts)
+    const char* path;
+    const tagEdit* edits;
+    int editCount;
+    const runOptions* opts;
+{
+    const char* ftype = get_file_extension(path);
+    bool setTags = opts->tagCount > 0 && ftype && !strcmp(ftype, "flac");
+    uint64_t started;
+
+    if (editCount == 0 && !setTags) {
+        return;
+    }
+
+    // The in-place edits go first, while their offsets still hold
+    started = stats_now();
+    if (!write_tag_edits(edits, editCount, path) ||
+        (setTags && !flac_write_comments(path, opts->tags, opts->tagCount))) {
+        stats_warn(WARN_REWRITE);
+    }
+    stats_record(STAGE_REWRITE, started);
+}
+
+static void
+write_cover_art(path, ingest)
+    const char* path;
+    ingestContext* ingest;
+{
+    const char* ftype = get_file_extension(path);
+    uint64_t started;
+
+    // Only FLAC PICTURE blocks are looked at; the image is read from the track in its new place
+    if (!ingest->covers || !ftype || strcmp(ftype, "flac")) {
+        return;
+    }
+
+    started = stats_now();
+    if (!coverart_write(ingest->covers, path)) {
+        stats_warn(WARN_COVER_ART);
+    }
+    stats_record(STAGE_COVER, started);
 }
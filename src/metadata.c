@@ -1,4 +1,451 @@
 #include "../include/metadata.h"
+#include "../include/pool.h"
+#include "../include/dircache.h"
+#include "../include/wordcase.h"
+#include "../include/arena.h"
+#include "../include/move.h"
+
+// Bytes read from the start of a FLAC file in one go, see set_flac_probe_size()
+static size_t flacProbeSize = FLAC_PROBE_SIZE;
+
+// Vorbis comment names handled by parseFlacMeta(), grouped by name length
+static const vorbisTag vorbisTags[] = {
+    { "DATE",        Date },        // 4
+    { "DISC",        DiscNumber },
+    { "ALBUM",       Album },       // 5
+    { "GENRE",       Genre },
+    { "TITLE",       Title },
+    { "TRACK",       TrackNumber },
+    { "ARTIST",      Artist },      // 6
+    { "DISCTOTAL",   TotalDiscs },  // 9
+    { "TRACKTOTAL",  TotalTracks }, // 10
+    { "DISCNUMBER",  DiscNumber },
+    { "TOTALDISCS",  TotalDiscs },
+    { "TRACKNUMBER", TrackNumber }, // 11
+    { "TOTALTRACKS", TotalTracks },
+};
+
+// vorbisTags[vorbisTagBucket[n]] .. vorbisTags[vorbisTagBucket[n + 1] - 1] are the names of length n
+static const signed char vorbisTagBucket[VORBIS_TAG_MAX + 2] = {
+    0, 0, 0, 0, 0, 2, 6, 7, 7, 7, 8, 11, 13
+};
+
+// ID3v2 text frames handled by parseId3Frames()
+static const id3Frame id3Frames[] = {
+    { "TPE1", "TP1", Artist },
+    { "TALB", "TAL", Album },
+    { "TIT2", "TT2", Title },
+    { "TRCK", "TRK", TrackNumber },
+    { "TPOS", "TPA", DiscNumber },
+    { "TDRC", "",    Date },        // 2.4
+    { "TYER", "TYE", Date },        // 2.2 / 2.3
+    { "TCON", "TCO", Genre },
+};
+
+// trkn and disk hold both numbers; TrackNumber and DiscNumber stand for the pair
+static const mp4Item mp4Items[] = {
+    { "\xA9" "ART", Artist },
+    { "\xA9" "alb", Album },
+    { "\xA9" "nam", Title },
+    { "\xA9" "day", Date },
+    { "\xA9" "gen", Genre },
+    { "trkn",        TrackNumber },
+    { "disk",        DiscNumber },
+};
+
+/**
+ * @brief Initializes an audioMetaData structure with default values.
+ *
+ * This function initializes an audioMetaData structure by setting default values
+ * for various metadata fields. It is typically called before populating the structure
+ * with actual metadata from a file.
+ *
+ * @param meta Pointer to the audioMetaData structure to be initialized.
+ * @param filename The path to the audio file associated with the metadata.
+ * @param ext The file extension of the audio file.
+ */
+static void
+initialize_audioMetaData(audioMetaData* meta, const char* filename, char* ext);
+
+/**
+ * @brief Validates the FLAC metadata block by checking for the presence of "libFLAC".
+ *
+ * This function checks if the FLAC metadata block contains the expected "libFLAC"
+ * identifier, validating the integrity of the metadata. It advances the buffer
+ * pointer and updates the offset if the identifier is found.
+ *
+ * @param buffer Pointer to the buffer containing the FLAC metadata block.
+ *               The pointer is advanced if validation is successful.
+ * @param offset Pointer to the offset tracking the position in the FLAC metadata block.
+ *               The offset is updated if validation is successful.
+ * @param length The length of the identifier in the metadata block.
+ *
+ * @return Returns true if validation is successful, indicating the presence of "libFLAC",
+ *         and false if validation fails.
+ *
+ * @note The identifier is searched for in place; nothing is allocated.
+ */
+static bool
+validateFlacMeta(BYTE** buffer, int* offset, DWORD length);
+
+/**
+ * @brief Looks up a Vorbis comment name in the table of recognized tags.
+ *
+ * The table is bucketed by name length at compile time, so a lookup compares the
+ * name against at most a few entries of the same length, ignoring case.
+ *
+ * @param name Pointer to the comment name (not null terminated).
+ * @param length Length of the name, excluding the '='.
+ * @return The matching table entry, or NULL if the tag is not used.
+ */
+static const vorbisTag*
+lookupVorbisTag(const BYTE* name, size_t length);
+
+/**
+ * @brief Copies a comment value into a fixed-size field, truncating it if necessary.
+ *
+ * @param field The destination field.
+ * @param fieldSize The size of the destination field, including the null terminator.
+ * @param value Pointer to the value inside the comment block (not null terminated).
+ * @param length Length of the value.
+ */
+static void
+copyTagValue(char* field, size_t fieldSize, const BYTE* value, DWORD length);
+
+/**
+ * @brief Copies a comment value, whatever its length, into the calling thread's scratch arena.
+ *
+ * @param value Pointer to the value inside the comment block (not null terminated).
+ * @param length Length of the value.
+ * @return The null terminated copy, or NULL if memory runs out.
+ */
+static char*
+copyTagString(const BYTE* value, DWORD length);
+
+/**
+ * @brief Parses the leading decimal number of a comment value such as "3" or "3/12".
+ *
+ * @param value Pointer to the value inside the comment block (not null terminated).
+ * @param length Length of the value.
+ * @return The number, or 0 if the value does not start with a digit.
+ */
+static int
+parseTagNumber(const BYTE* value, DWORD length);
+
+/**
+ * @brief Updates metadata in the file.
+ *
+ * This function copies the whole value of an ARTIST, ALBUM or TITLE comment with
+ * copyTagString() and, if toLowerCase() changes it, queues a rewrite of the
+ * value at the same position in the file. Nothing is written until
+ * write_pending_tags() is called.
+ *
+ * @param flac_meta Pointer to the audioMetaData structure containing metadata.
+ * @param type The type of metadata to update (Artist, Album, Title).
+ * @param value Pointer to the value inside the comment block (not null terminated).
+ * @param length Length of the value.
+ * @param valueOffset Offset of the value from the start of the comment block, or -1
+ *                    if the value can't be rewritten in place.
+ *
+ * @note The function modifies the metadata in the audioMetaData structure. It also
+ *       converts the updated field to lowercase, if applicable.
+ */
+static void
+updateMetadata(struct audioMetaData* flac_meta, MetadataField type, const BYTE* value, DWORD length, int valueOffset);
+
+/**
+ * @brief Stores the value of a recognized comment in the audioMetaData structure.
+ *
+ * ARTIST, ALBUM and TITLE go through updateMetadata(); the other fields are copied or
+ * parsed as numbers.
+ *
+ * @param meta Pointer to the audioMetaData structure to be updated.
+ * @param field The field the comment is stored in.
+ * @param value The value (not null terminated).
+ * @param length Length of the value.
+ * @param valueOffset As for updateMetadata().
+ */
+static void
+storeTagValue(audioMetaData* meta, MetadataField field, const BYTE* value, DWORD length, int valueOffset);
+
+/**
+ * @brief Reads bytes at a file offset without moving the file position (on POSIX).
+ *
+ * @return true if all 'size' bytes were read.
+ */
+static bool
+read_at(int fd, void* data, size_t size, fileOffset offset);
+
+/**
+ * @brief Writes bytes at a file offset without moving the file position (on POSIX).
+ *
+ * @return true if all 'size' bytes were written.
+ */
+static bool
+write_at(int fd, const void* data, size_t size, fileOffset offset);
+
+/**
+ * @brief Builds a new Vorbis comment block with some comments replaced.
+ *
+ * The vendor string and every comment whose name doesn't match a setting (compared
+ * without regard to case) are kept in their order; the settings with a value are
+ * appended after them.
+ *
+ * @param block The current comment block.
+ * @param size Size of the current block.
+ * @param tags The settings, as "NAME=value" comments. An empty value removes the comment.
+ * @param count Number of settings.
+ * @param newSize Receives the size of the new block.
+ * @return The new block, to be freed by the caller, or NULL if the current block is
+ *         corrupt, memory runs out or the new block is larger than FLAC_MAX_BLOCK.
+ */
+static BYTE*
+buildVorbisComments(const BYTE* block, DWORD size, const char* const* tags, int count, DWORD* newSize);
+
+/**
+ * @brief Writes a copy of a FLAC file with a new comment block.
+ *
+ * The metadata blocks are copied in their order, with the new comment block in place
+ * of the old one and FLAC_REWRITE_PADDING bytes of padding right after it; other
+ * padding is dropped. The audio frames are copied with move_copy_range(), in the
+ * kernel where possible, so the file is never loaded into memory.
+ *
+ * @param fd The FLAC file.
+ * @param tmpPath The copy. Created; must not exist.
+ * @param comments The new comment block.
+ * @param size Size of the new comment block.
+ * @return true if the copy was written and synced, false otherwise (the copy is removed).
+ */
+static bool
+rewrite_flac_file(int fd, const char* tmpPath, const BYTE* comments, DWORD size);
+
+/**
+ * @brief Replaces specified characters in a string with hyphens.
+ *
+ * This function iterates through each character in the input string and replaces
+ * occurrences of '/', '\\', and '?' with hyphens ('-'). It modifies the input
+ * string in-place.
+ *
+ * @param str Pointer to the string in which characters are to be replaced.
+ */
+static void
+replaceChars(char *str);
+
+/**
+ * @brief Parses the FLAC metadata block and updates the audioMetaData structure.
+ *
+ * This function is responsible for parsing the FLAC metadata block, extracting
+ * relevant information, and updating the audioMetaData structure accordingly.
+ * It specifically handles tags such as ARTIST, ALBUM, TITLE, GENRE, DATE,
+ * TRACKNUMBER, TRACKTOTAL, DISCNUMBER, DISCTOTAL, etc. Comments are read in place
+ * from the block; each name is matched with one lookupVorbisTag() call and
+ * unrecognized comments are skipped by their length without being copied.
+ *
+ * @param flac_meta Pointer to the audioMetaData structure to be updated.
+ * @param buffer Pointer to the buffer containing the FLAC metadata block.
+ * @param size Size of the FLAC metadata block.
+ *
+ * @return Returns true on successful parsing and updating of metadata, and false
+ *         on any errors during the process, including lengths that run past the block.
+ */
+static bool
+parseFlacMeta(audioMetaData* flac_meta, BYTE* buffer, int size);
+
+/**
+ * @brief Parses Vorbis comments, as found in FLAC and in Ogg Vorbis and Opus files.
+ *
+ * The vendor string and comment count are skipped; every comment is then dispatched
+ * as described for parseFlacMeta(). Trailing bytes shorter than a length field, such
+ * as the framing bit of an Ogg Vorbis comment header, are ignored.
+ *
+ * @param meta Pointer to the audioMetaData structure to be updated.
+ * @param buffer The comments, starting with the length of the vendor string.
+ * @param size Size of the comments.
+ * @param inPlace Nonzero if meta->metaPtr plus an offset in 'buffer' is the file offset
+ *                of that byte; changed values may then be rewritten in the file.
+ *
+ * @return Returns true on success, false if a length runs past the comments.
+ */
+static bool
+parseVorbisComments(audioMetaData* meta, BYTE* buffer, int size, int inPlace);
+
+/**
+ * @brief Makes sure a range of the file is present in the probe window.
+ *
+ * If the range is not already inside the window, the window is refilled with one
+ * positioned read starting at 'offset', large enough for the range and at least the
+ * probe size.
+ *
+ * @param probe The probe window.
+ * @param offset File offset of the first byte needed.
+ * @param size Number of bytes needed.
+ * @return true if the range is available, false on a read error or end of file.
+ */
+static bool
+probe_ensure(flacProbe* probe, fileOffset offset, size_t size);
+
+/**
+ * @brief Reads a 28-bit "syncsafe" integer (7 bits per byte) as used by ID3v2.
+ *
+ * @param bytes The four bytes of the integer.
+ * @return The decoded value.
+ */
+static DWORD
+id3Syncsafe(const BYTE* bytes);
+
+/**
+ * @brief Reads the header and lacing table of an Ogg page.
+ *
+ * @param probe The probe window over the file.
+ * @param pos File offset of the page.
+ * @param page Receives the page header.
+ * @return true on success, false if there is no valid page at 'pos'.
+ */
+static bool
+ogg_read_page(flacProbe* probe, fileOffset pos, oggPage* page);
+
+/**
+ * @brief Reassembles an Ogg packet that starts on the page at 'pos'.
+ *
+ * Pages of other logical streams are skipped. Reading stops with the segment that
+ * ends the packet, so nothing after it (e.g. audio pages) is parsed.
+ *
+ * @param probe The probe window over the file.
+ * @param pos File offset of the page the packet starts on.
+ * @param serial The logical stream of the packet.
+ * @param packet Receives the packet, or NULL to only measure it.
+ * @param size Size of 'packet'.
+ * @return The length of the packet, or -1 if the pages are corrupt, the packet doesn't
+ *         fit 'packet' or it is longer than OGG_MAX_COMMENTS.
+ */
+static long
+ogg_read_packet(flacProbe* probe, fileOffset pos, DWORD serial, BYTE* packet, long size);
+
+/**
+ * @brief Reads the header of an MP4 atom.
+ *
+ * 64-bit sizes are supported, and a size of 0 runs to 'limit'.
+ *
+ * @param probe The probe window over the file.
+ * @param pos File offset of the atom.
+ * @param limit End of the enclosing atom, or of the file.
+ * @param atom Receives the type and extent of the atom.
+ * @return true on success, false if the header is unreadable or the atom runs past 'limit'.
+ */
+static bool
+mp4_read_atom(flacProbe* probe, fileOffset pos, fileOffset limit, mp4Atom* atom);
+
+/**
+ * @brief Finds the first atom of a type among the atoms from 'pos' to 'end'.
+ *
+ * Only headers are read; other atoms are skipped by their size, however large.
+ *
+ * @param probe The probe window over the file.
+ * @param pos File offset of the first atom.
+ * @param end End of the atoms to search.
+ * @param type The four byte atom type.
+ * @param atom Receives the atom that was found.
+ * @return true if it was found, false if not or if a header is unreadable.
+ */
+static bool
+mp4_find_atom(flacProbe* probe, fileOffset pos, fileOffset end, const char* type, mp4Atom* atom);
+
+/**
+ * @brief Parses the items of an MP4 ilst atom.
+ *
+ * \251ART, \251alb, \251nam, \251day, \251gen, trkn and disk are stored; every other
+ * item, e.g. covr pictures, is skipped without being read. Changed artist, album and
+ * title values may be rewritten in place.
+ *
+ * @param meta Pointer to the audioMetaData structure to fill in.
+ * @param probe The probe window over the file.
+ * @param ilst The ilst atom.
+ */
+static void
+parseMp4Items(audioMetaData* meta, flacProbe* probe, const mp4Atom* ilst);
+
+/**
+ * @brief Reverses ID3v2 unsynchronisation in place by dropping each 0x00 that follows 0xFF.
+ *
+ * @param data The unsynchronised bytes.
+ * @param length Number of bytes in 'data'.
+ * @return The length after decoding.
+ */
+static DWORD
+id3RemoveUnsync(BYTE* data, DWORD length);
+
+/**
+ * @brief Finds the table entry for an ID3v2 frame id.
+ *
+ * @param id The frame id (not null terminated).
+ * @param version The major version of the tag (2, 3 or 4).
+ * @return The entry, or NULL if the frame is not used.
+ */
+static const id3Frame*
+lookupId3Frame(const BYTE* id, int version);
+
+/**
+ * @brief Appends a code point to a field as UTF-8.
+ *
+ * @param field The buffer to append to.
+ * @param fieldSize Size of the buffer, including the terminator.
+ * @param n Number of bytes already in the buffer; advanced past the new character.
+ * @param codepoint The character to append.
+ * @return false if the character doesn't fit; the buffer is left unchanged.
+ */
+static bool
+putUtf8(char* field, size_t fieldSize, size_t* n, uint32_t codepoint);
+
+/**
+ * @brief Decodes the text of an ID3v2 text frame into a UTF-8 field.
+ *
+ * The first byte of the frame selects the encoding: 0 for ISO-8859-1, 1 for UTF-16
+ * with a byte order mark, 2 for UTF-16BE and 3 for UTF-8. Only the first string of
+ * the frame is used; it is truncated if it doesn't fit the field.
+ *
+ * @param field The buffer to store the value in.
+ * @param fieldSize Size of the buffer, including the terminator.
+ * @param data The frame data, starting with the encoding byte.
+ * @param length Length of the frame data.
+ */
+static void
+copyId3Text(char* field, size_t fieldSize, const BYTE* data, DWORD length);
+
+/**
+ * @brief Parses the frames of an ID3v2 tag.
+ *
+ * TPE1, TALB, TIT2, TRCK, TPOS, TDRC/TYER and TCON (TP1, TAL, TT2, TRK, TPA, TYE and
+ * TCO in ID3v2.2) are stored; every other frame, e.g. APIC pictures, is skipped
+ * without being copied. Compressed and encrypted frames are skipped as well.
+ *
+ * @param meta Pointer to the audioMetaData structure to fill in. meta->metaPtr must
+ *             hold the file offset of 'tag'.
+ * @param tag The frame area of the tag, after the header and any extended header.
+ * @param size Length of the frame area.
+ * @param version The major version of the tag (2, 3 or 4).
+ * @param inPlace Nonzero if offsets in 'tag' match the file, i.e. no unsynchronisation
+ *                was removed from the whole tag; changed values may then be rewritten.
+ */
+static void
+parseId3Frames(audioMetaData* meta, BYTE* tag, DWORD size, int version, int inPlace);
+
+/**
+ * @brief Converts specified "function words" in a string to lowercase.
+ *
+ * This function takes a string and converts "function words" such as "In", "The"
+ * or "Of" to lowercase in a single pass, using the word list compiled by
+ * wordcase_compile() (see wordcase.h).
+ *
+ * @param str Pointer to the string to be processed. The function modifies this
+ *            string in-place.
+ * @param changed Receives the range from the first to the last changed byte, if
+ *                anything changed.
+ *
+ * @return Returns the number of conversions (number of function words converted to
+ *         lowercase) in the given string.
+ */
+static int
+toLowerCase(char* str, caseSpan* changed);
 
 static void
 initialize_audioMetaData(meta, filename, ext)
@@ -7,13 +454,13 @@ initialize_audioMetaData(meta, filename, ext)
     char* ext;
 {
     // Initialize struct member values
-    strcpy(meta->pathname, filename);
-    strcpy(meta->fileext, ext);
-    strcpy(meta->artist, "");
-    strcpy(meta->album, "");
-    strcpy(meta->title, "");
-    strcpy(meta->date, "");
-    strcpy(meta->genre, "");
+    snprintf(meta->pathname, sizeof(meta->pathname), "%s", filename);
+    snprintf(meta->fileext, sizeof(meta->fileext), "%s", ext);
+    meta->artist = "";
+    meta->album = "";
+    meta->title = "";
+    meta->date[0] = '\0';
+    meta->genre = "";
     for (int i = 0; i < 2; i++) {
         meta->track[i] = 0;
         meta->disc[i] = 0;
@@ -22,6 +469,8 @@ initialize_audioMetaData(meta, filename, ext)
     for (int i = 0; i < 9; i++) {
         meta->offset[i] = 0;
     }
+    meta->editCount = 0;
+    memset(meta->audioMd5, 0, sizeof(meta->audioMd5));
 }
 
 void
@@ -37,330 +486,1726 @@ print_audioMetaData(meta)
     if (meta->disc[0] != 0) {
         printf("Disc:    \t%d/%d\n", meta->disc[0], meta->disc[1]);
     }
-    printf("Source file:  \t%s\n\n", meta->pathname);
+    printf("Source file:  \t%s\n\n", meta->pathname);
+}
+
+static bool
+validateFlacMeta(buffer, offset, length)
+    BYTE** buffer;
+    int* offset;
+    DWORD length;
+{
+    static const char id[] = "libFLAC";
+    const size_t idLength = sizeof(id) - 1;
+
+    // Check if "libFLAC" is found in the vendor string, advance the pointer if true
+    for (DWORD i = 0; i + idLength <= length; i++) {
+        if ((*buffer)[i] == 'l' && memcmp(*buffer + i, id, idLength) == 0) {
+            *buffer += sizeof(DWORD) + length; // Advance the buffer pointer
+            *offset += sizeof(DWORD) + length; // Update the offset
+            return true;
+        }
+    }
+
+    // identifier not found, validation failed
+    out_printf(stderr, "Error: Metadata tags missing or corrupt. ");
+    return false;
+}
+
+static const vorbisTag*
+lookupVorbisTag(name, length)
+    const BYTE* name;
+    size_t length;
+{
+    int first;
+
+    if (length == 0 || length > VORBIS_TAG_MAX) {
+        return NULL;
+    }
+
+    // Only the handful of names with the same length are compared
+    first = toupper(name[0]);
+    for (int i = vorbisTagBucket[length]; i < vorbisTagBucket[length + 1]; i++) {
+        if (vorbisTags[i].name[0] == first && _strnicmp((const char*)name, vorbisTags[i].name, length) == 0) {
+            return &vorbisTags[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+copyTagValue(field, fieldSize, value, length)
+    char* field;
+    size_t fieldSize;
+    const BYTE* value;
+    DWORD length;
+{
+    // Truncate values that don't fit instead of overflowing the field
+    size_t n = length < fieldSize - 1 ? length : fieldSize - 1;
+    memcpy(field, value, n);
+    field[n] = '\0';
+}
+
+static char*
+copyTagString(value, length)
+    const BYTE* value;
+    DWORD length;
+{
+    arena* scratch = arena_scratch();
+    char* str = scratch ? (char*)arena_alloc(scratch, (size_t)length + 1) : NULL;
+
+    if (str) {
+        memcpy(str, value, length);
+        str[length] = '\0';
+    }
+    return str;
+}
+
+static int
+parseTagNumber(value, length)
+    const BYTE* value;
+    DWORD length;
+{
+    int number = 0;
+    DWORD i = 0;
+
+    // The value is not null terminated, so atoi() can't be used
+    while (i < length && isspace(value[i])) {
+        i++;
+    }
+    while (i < length && isdigit(value[i]) && number < 100000) {
+        number = number * 10 + (value[i] - '0');
+        i++;
+    }
+
+    return number;
+}
+
+static void
+updateMetadata(flac_meta, type, value, length, valueOffset)
+    struct audioMetaData* flac_meta;
+    MetadataField type;
+    const BYTE* value;
+    DWORD length;
+    int valueOffset;
+{
+    const char** targetField;
+    char* copy;
+    caseSpan changed;
+
+    switch (type) {
+        case Artist:
+            targetField = &flac_meta->artist;
+            break;
+        case Album:
+            targetField = &flac_meta->album;
+            break;
+        case Title:
+            targetField = &flac_meta->title;
+            break;
+        default:
+            return; // Invalid type
+    }
+
+    if (!(copy = copyTagString(value, length))) {
+        return;
+    }
+    *targetField = copy;
+    if (toLowerCase(copy, &changed) && valueOffset >= 0 && flac_meta->editCount < FLAC_MAX_EDITS) {
+        flac_meta->offset[type] = flac_meta->metaPtr + valueOffset;
+
+        // Queue the rewrite of just the changed bytes; write_pending_tags() applies all of them with one open
+        tagEdit* edit = &flac_meta->edits[flac_meta->editCount++];
+        edit->offset = flac_meta->offset[type] + changed.start;
+        edit->length = changed.length;
+        edit->text = copy + changed.start;
+    }
+}
+
+bool
+write_pending_tags(meta, path)
+    audioMetaData* meta;
+    const char* path;
+{
+    bool result = write_tag_edits(meta->edits, meta->editCount, path);
+
+    meta->editCount = 0;
+    return result;
+}
+
+bool
+write_tag_edits(edits, count, path)
+    const tagEdit* edits;
+    int count;
+    const char* path;
+{
+    bool result = true;
+
+    if (count == 0) {
+        return true;
+    }
+
+#ifdef _WIN32
+    FILE* file;
+    if (!(file = fopen(path, "r+b"))) {
+        out_perror("Error : Couln't open file");
+        return false;
+    }
+    for (int i = 0; i < count && result; i++) {
+        const tagEdit* edit = &edits[i];
+        if (fseek(file, edit->offset, SEEK_SET) != 0) {
+            out_perror("Error : Couldn't seek file");
+            result = false;
+        } else if (fwrite(edit->text, sizeof(char), edit->length, file) != (size_t)edit->length) {
+            out_perror("Error : Couldn't write metadata to file");
+            result = false;
+        }
+    }
+    fclose(file);
+#else
+    int fd;
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+        out_perror("Error : Couln't open file");
+        return false;
+    }
+    // Positioned writes on the one descriptor, no seeks in between
+    for (int i = 0; i < count && result; i++) {
+        const tagEdit* edit = &edits[i];
+        if (pwrite(fd, edit->text, edit->length, edit->offset) != edit->length) {
+            out_perror("Error : Couldn't write metadata to file");
+            result = false;
+        }
+    }
+    close(fd);
+#endif
+
+    return result;
+}
+
+static bool
+read_at(fd, data, size, offset)
+    int fd;
+    void* data;
+    size_t size;
+    fileOffset offset;
+{
+#ifdef _WIN32
+    return _lseeki64(fd, offset, SEEK_SET) == offset && _read(fd, data, (unsigned)size) == (int)size;
+#else
+    return pread(fd, data, size, offset) == (ssize_t)size;
+#endif
+}
+
+static bool
+write_at(fd, data, size, offset)
+    int fd;
+    const void* data;
+    size_t size;
+    fileOffset offset;
+{
+#ifdef _WIN32
+    return _lseeki64(fd, offset, SEEK_SET) == offset && _write(fd, data, (unsigned)size) == (int)size;
+#else
+    return pwrite(fd, data, size, offset) == (ssize_t)size;
+#endif
+}
+
+static BYTE*
+buildVorbisComments(block, size, tags, count, newSize)
+    const BYTE* block;
+    DWORD size;
+    const char* const* tags;
+    int count;
+    DWORD* newSize;
+{
+    const BYTE* p;
+    const BYTE* end = block + size;
+    DWORD vendorLength = 0;
+    DWORD comments = 0;
+    DWORD kept = 0;
+    DWORD length = 0;
+    size_t total = size;
+    BYTE* out;
+    BYTE* q;
+
+    if (size < 2 * sizeof(DWORD)) {
+        return NULL;
+    }
+    memcpy(&vendorLength, block, sizeof(DWORD));
+    if (vendorLength > size - 2 * sizeof(DWORD)) {
+        return NULL;
+    }
+    memcpy(&comments, block + sizeof(DWORD) + vendorLength, sizeof(DWORD));
+
+    // At most the old block plus every setting
+    for (int i = 0; i < count; i++) {
+        total += sizeof(DWORD) + strlen(tags[i]);
+    }
+    if (!(out = (BYTE*)malloc(total))) {
+        return NULL;
+    }
+
+    // The vendor string stays; the comment count is filled in at the end
+    memcpy(out, block, sizeof(DWORD) + vendorLength);
+    p = block + 2 * sizeof(DWORD) + vendorLength;
+    q = out + 2 * sizeof(DWORD) + vendorLength;
+
+    for (DWORD n = 0; n < comments; n++) {
+        bool replaced = false;
+
+        if (end - p < (long)sizeof(DWORD)) {
+            free(out);
+            return NULL;
+        }
+        memcpy(&length, p, sizeof(DWORD));
+        if (length > (DWORD)(end - p) - sizeof(DWORD)) {
+            free(out);
+            return NULL;
+        }
+
+        // Names are compared up to the '=' of the setting
+        for (int i = 0; i < count && !replaced; i++) {
+            size_t nameLength = (size_t)(strchr(tags[i], '=') - tags[i]);
+            replaced = length > nameLength && p[sizeof(DWORD) + nameLength] == '=' &&
+                       _strnicmp((const char*)p + sizeof(DWORD), tags[i], nameLength) == 0;
+        }
+        if (!replaced) {
+            memcpy(q, p, sizeof(DWORD) + length);
+            q += sizeof(DWORD) + length;
+            kept++;
+        }
+        p += sizeof(DWORD) + length;
+    }
+
+    // A setting without a value only removes the comments of its name
+    for (int i = 0; i < count; i++) {
+        if (strchr(tags[i], '=')[1] != '\0') {
+            length = (DWORD)strlen(tags[i]);
+            memcpy(q, &length, sizeof(DWORD));
+            memcpy(q + sizeof(DWORD), tags[i], length);
+            q += sizeof(DWORD) + length;
+            kept++;
+        }
+    }
+    memcpy(out + sizeof(DWORD) + vendorLength, &kept, sizeof(DWORD));
+
+    if ((size_t)(q - out) > FLAC_MAX_BLOCK) {
+        free(out);
+        return NULL;
+    }
+    *newSize = (DWORD)(q - out);
+    return out;
+}
+
+static bool
+rewrite_flac_file(fd, tmpPath, comments, size)
+    int fd;
+    const char* tmpPath;
+    const BYTE* comments;
+    DWORD size;
+{
+    BYTE header[4];
+    BYTE* padding = NULL;
+    fileOffset pos = 4;     // next block header in the file
+    fileOffset out = 4;     // next block header in the copy
+    fileOffset last = -1;   // last block header written to the copy
+    BYTE lastType = 0;      // and its first byte
+    fileOffset end;
+    bool finalBlock = false;
+    bool result;
+    int tmp;
+
+    if ((end = _lseeki64(fd, 0, SEEK_END)) < 0) {
+        out_perror("Error : Couldn't read file");
+        return false;
+    }
+
+#ifdef _WIN32
+    tmp = _open(tmpPath, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    struct stat st;
+    tmp = fstat(fd, &st) == 0 ? open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777) : -1;
+#endif
+    if (tmp < 0) {
+        out_perror("Error : Couldn't create the rewritten file");
+        return false;
+    }
+
+    result = write_at(tmp, "fLaC", 4, 0);
+    while (result && !finalBlock) {
+        DWORD blockSize;
+        int blockType;
+
+        if (!(result = read_at(fd, header, 4, pos))) {
+            break;
+        }
+        blockType = header[0] & 0x7F;
+        blockSize = (header[1] << 16) | (header[2] << 8) | header[3];
+        finalBlock = header[0] & 0x80;
+
+        // The last flag is set on whichever block ends up last
+        if (blockType == FLAC_META_VORBIS_COMMENT) {
+            header[0] = FLAC_META_VORBIS_COMMENT;
+            header[1] = (BYTE)(size >> 16);
+            header[2] = (BYTE)(size >> 8);
+            header[3] = (BYTE)size;
+            result = write_at(tmp, header, 4, out) && write_at(tmp, comments, size, out + 4);
+            out += 4 + size;
+
+            // New padding right behind the comments, so the next edit is made in place
+            if (result && (padding = (BYTE*)calloc(1, 4 + FLAC_REWRITE_PADDING)) != NULL) {
+                padding[0] = FLAC_META_PADDING;
+                padding[1] = (BYTE)(FLAC_REWRITE_PADDING >> 16);
+                padding[2] = (BYTE)(FLAC_REWRITE_PADDING >> 8);
+                padding[3] = (BYTE)FLAC_REWRITE_PADDING;
+                result = write_at(tmp, padding, 4 + FLAC_REWRITE_PADDING, out);
+                free(padding);
+                last = out;
+                lastType = FLAC_META_PADDING;
+                out += 4 + FLAC_REWRITE_PADDING;
+            } else {
+                last = out - 4 - size;
+                lastType = FLAC_META_VORBIS_COMMENT;
+            }
+        } else if (blockType != FLAC_META_PADDING) {
+            header[0] &= 0x7F;
+            result = write_at(tmp, header, 4, out) && move_copy_range(fd, pos + 4, tmp, out + 4, blockSize) == 0;
+            last = out;
+            lastType = header[0];
+            out += 4 + blockSize;
+        }
+        pos += 4 + blockSize;
+    }
+
+    if (result && last >= 0) {
+        lastType |= 0x80;
+        result = write_at(tmp, &lastType, 1, last);
+    }
+
+    // The audio frames go from file to file without passing through memory where the kernel allows
+    result = result && pos <= end && move_copy_range(fd, pos, tmp, out, end - pos) == 0;
+
+#ifdef _WIN32
+    result = result && _commit(tmp) == 0;
+#else
+    // The copy must be on disk before it replaces the original
+    result = result && fchmod(tmp, st.st_mode & 07777) == 0 && fsync(tmp) == 0;
+#endif
+    if (!result) {
+        out_perror("Error : Couldn't rewrite file");
+    }
+    if (_close(tmp) != 0) {
+        result = false;
+    }
+    if (!result) {
+        remove(tmpPath);
+    }
+    return result;
+}
+
+bool
+flac_write_comments(path, tags, count)
+    const char* path;
+    const char* const* tags;
+    int count;
+{
+    char tmpPath[_MAX_PATH + sizeof(FLAC_REWRITE_SUFFIX)];
+    BYTE header[4];
+    BYTE* block = NULL;         // the comment block as it is
+    BYTE* comments = NULL;      // the comment block as it should be
+    BYTE* out = NULL;
+    fileOffset pos = 4;
+    fileOffset commentPos = -1; // header of the comment block
+    DWORD commentSize = 0;
+    fileOffset paddingPos = -1;       // header of a padding block right behind it
+    DWORD paddingSize = 0;
+    int paddingLast = 0;
+    DWORD newSize = 0;
+    bool finalBlock = false;
+    bool rewrite = false;
+    bool result = false;
+    int fd;
+
+    if (count == 0) {
+        return true;
+    }
+
+#ifdef _WIN32
+    fd = _open(path, _O_RDWR | _O_BINARY);
+#else
+    fd = open(path, O_RDWR | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        out_perror("Error : Couln't open file");
+        return false;
+    }
+
+    if (!read_at(fd, header, 4, 0) || memcmp(header, "fLaC", 4) != 0) {
+        out_printf(stderr, "Error : %s is not a FLAC file, tags not written.\n", path);
+        goto done;
+    }
+
+    // Only block headers are read, up to the block behind the comments
+    while (!finalBlock) {
+        DWORD blockSize;
+        int blockType;
+
+        if (!read_at(fd, header, 4, pos)) {
+            out_printf(stderr, "Error : %s is corrupt, tags not written.\n", path);
+            goto done;
+        }
+        blockType = header[0] & 0x7F;
+        blockSize = (header[1] << 16) | (header[2] << 8) | header[3];
+        finalBlock = header[0] & 0x80;
+
+        if (commentPos >= 0) {
+            if (blockType == FLAC_META_PADDING) {
+                paddingPos = pos;
+                paddingSize = blockSize;
+                paddingLast = finalBlock;
+            }
+            break;
+        }
+        if (blockType == FLAC_META_VORBIS_COMMENT) {
+            commentPos = pos;
+            commentSize = blockSize;
+        }
+        pos += 4 + blockSize;
+    }
+    if (commentPos < 0) {
+        out_printf(stderr, "Error : %s has no comment block, tags not written.\n", path);
+        goto done;
+    }
+
+    if (!(block = (BYTE*)malloc(commentSize ? commentSize : 1)) || !read_at(fd, block, commentSize, commentPos + 4) ||
+        !(comments = buildVorbisComments(block, commentSize, tags, count, &newSize))) {
+        out_printf(stderr, "Error : Metadata tags of %s missing, corrupt or too long, tags not written.\n", path);
+        goto done;
+    }
+
+    if (newSize == commentSize) {
+        // Nothing moves; an unchanged block isn't even written
+        result = memcmp(comments, block, newSize) == 0 || write_at(fd, comments, newSize, commentPos + 4);
+    } else if (paddingPos >= 0 && newSize <= commentSize + paddingSize &&
+               commentSize + paddingSize - newSize <= FLAC_MAX_BLOCK) {
+        // The padding gives or takes the difference; bytes the shorter comments leave behind become padding
+        DWORD padding = commentSize + paddingSize - newSize;
+        DWORD stale = commentSize > newSize ? commentSize - newSize : 0;
+        size_t length = 8 + (size_t)newSize + stale;
+
+        if ((out = (BYTE*)calloc(1, length)) != NULL) {
+            out[0] = FLAC_META_VORBIS_COMMENT;
+            out[1] = (BYTE)(newSize >> 16);
+            out[2] = (BYTE)(newSize >> 8);
+            out[3] = (BYTE)newSize;
+            memcpy(out + 4, comments, newSize);
+            out[4 + newSize] = (BYTE)((paddingLast ? 0x80 : 0) | FLAC_META_PADDING);
+            out[5 + newSize] = (BYTE)(padding >> 16);
+            out[6 + newSize] = (BYTE)(padding >> 8);
+            out[7 + newSize] = (BYTE)padding;
+            result = write_at(fd, out, length, commentPos);
+        }
+    } else if (paddingPos >= 0 && newSize == commentSize + paddingSize + 4) {
+        // The comments take the place of the padding, header and all
+        if ((out = (BYTE*)malloc(4 + (size_t)newSize)) != NULL) {
+            out[0] = (BYTE)((paddingLast ? 0x80 : 0) | FLAC_META_VORBIS_COMMENT);
+            out[1] = (BYTE)(newSize >> 16);
+            out[2] = (BYTE)(newSize >> 8);
+            out[3] = (BYTE)newSize;
+            memcpy(out + 4, comments, newSize);
+            result = write_at(fd, out, 4 + (size_t)newSize, commentPos);
+        }
+    } else {
+        rewrite = true;
+    }
+
+    if (!rewrite && !result) {
+        out_perror("Error : Couldn't write metadata to file");
+    }
+
+    // Out of padding: write the whole file anew next to it, then swap it in
+    if (rewrite) {
+        snprintf(tmpPath, sizeof(tmpPath), "%s%s", path, FLAC_REWRITE_SUFFIX);
+        result = rewrite_flac_file(fd, tmpPath, comments, newSize);
+        _close(fd);
+        fd = -1;
+        if (result && move_replace(tmpPath, path) != 0) {
+            out_perror("Error : Couldn't replace file");
+            remove(tmpPath);
+            result = false;
+        }
+    }
+
+done:
+    if (fd >= 0) {
+        _close(fd);
+    }
+    free(block);
+    free(comments);
+    free(out);
+    return result;
+}
+
+bool
+flac_find_cover(fd, image)
+    int fd;
+    coverImage* image;
+{
+    BYTE header[FLAC_MIME_MAX + 8];
+    fileOffset pos = 4;
+    bool finalBlock = false;
+
+    image->length = 0;
+    if (!read_at(fd, header, 4, 0) || memcmp(header, "fLaC", 4) != 0) {
+        return false;
+    }
+
+    while (!finalBlock) {
+        DWORD blockSize;
+        DWORD pictureType;
+        DWORD mimeLength;
+        DWORD descLength;
+        DWORD dataLength;
+        fileOffset data;
+        const char* ext;
+
+        if (!read_at(fd, header, 4, pos)) {
+            return false;
+        }
+        blockSize = (header[1] << 16) | (header[2] << 8) | header[3];
+        finalBlock = header[0] & 0x80;
+        if ((header[0] & 0x7F) != FLAC_META_PICTURE) {
+            pos += 4 + blockSize;
+            continue;
+        }
+
+        // Picture type, MIME type and description length; the fields are big-endian
+        if (blockSize < 32 || !read_at(fd, header, 8, pos + 4)) {
+            return false;
+        }
+        pictureType = ((DWORD)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+        mimeLength = ((DWORD)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+        if (mimeLength > FLAC_MIME_MAX || mimeLength > blockSize - 32 ||
+            !read_at(fd, header, mimeLength + 4, pos + 12)) {
+            pos += 4 + blockSize;
+            continue;
+        }
+        descLength = ((DWORD)header[mimeLength] << 24) | (header[mimeLength + 1] << 16) |
+                     (header[mimeLength + 2] << 8) | header[mimeLength + 3];
+        if (mimeLength == 10 && !_strnicmp((const char*)header, "image/jpeg", 10)) {
+            ext = "jpg";
+        } else if (mimeLength == 9 && !_strnicmp((const char*)header, "image/jpg", 9)) {
+            ext = "jpg";
+        } else if (mimeLength == 9 && !_strnicmp((const char*)header, "image/png", 9)) {
+            ext = "png";
+        } else {
+            ext = NULL;
+        }
+
+        // Width, height, depth and colors are skipped for the length of the data
+        if (ext && descLength <= blockSize - 32 - mimeLength) {
+            data = pos + 4 + 32 + mimeLength + descLength;
+            if (!read_at(fd, header, 4, data - 4)) {
+                return false;
+            }
+            dataLength = ((DWORD)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+            if (dataLength > 0 && dataLength <= blockSize - 32 - mimeLength - descLength &&
+                (pictureType == FLAC_PICTURE_FRONT || (pictureType == FLAC_PICTURE_OTHER && image->length == 0))) {
+                image->offset = data;
+                image->length = dataLength;
+                image->ext = ext;
+                if (pictureType == FLAC_PICTURE_FRONT) {
+                    return true;
+                }
+            }
+        }
+        pos += 4 + blockSize;
+    }
+
+    return true;
+}
+
+bool
+flac_read_audio_md5(path, md5)
+    const char* path;
+    BYTE* md5;
+{
+    BYTE header[8 + FLAC_STREAMINFO_SIZE];
+    int fd = _open(path, _O_RDONLY | _O_BINARY);
+    bool result;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // STREAMINFO is always the first block, right after the marker
+    result = read_at(fd, header, sizeof(header), 0) && !memcmp(header, "fLaC", 4) &&
+             (header[4] & 0x7F) == FLAC_META_STREAMINFO;
+    if (result) {
+        memcpy(md5, header + 8 + FLAC_STREAMINFO_MD5, AUDIO_MD5_SIZE);
+    }
+    _close(fd);
+    return result;
+}
+
+static void
+replaceChars(str)
+    char* str;
+{
+    while (*str) {
+        if (*str == '/' || *str == '\\' || *str == '?') {
+            *str = '-';
+        }
+        str++;
+    }
+}
+
+static bool
+parseFlacMeta(flac_meta, buffer, size)
+    audioMetaData* flac_meta;
+    BYTE* buffer;
+    int size;
+{
+    BYTE* vendor = buffer + sizeof(DWORD);
+    DWORD length = 0;
+    int totalBytes = sizeof(DWORD);
+
+    if (size < (int)(2 * sizeof(DWORD))) {
+        return false;
+    }
+
+    // The vendor string must name libFLAC
+    memcpy(&length, buffer, sizeof(DWORD));
+    if (length > (DWORD)(size - 2 * sizeof(DWORD)) || !validateFlacMeta(&vendor, &totalBytes, length)) {
+        return false;
+    }
+
+    return parseVorbisComments(flac_meta, buffer, size, 1);
+}
+
+static bool
+parseVorbisComments(meta, buffer, size, inPlace)
+    audioMetaData* meta;
+    BYTE* buffer;
+    int size;
+    int inPlace;
+{
+    BYTE* block = buffer;          // Start of the comments, for value offsets
+    DWORD length = 0;              // Stores the length of the current comment
+    int totalBytes = 0;            // Counter for the total number of bytes processed in the metadata
+
+    if (size < (int)(2 * sizeof(DWORD))) {
+        return false;
+    }
+
+    // Skip the vendor string and the comment count
+    memcpy(&length, buffer, sizeof(DWORD));
+    if (length > (DWORD)(size - 2 * sizeof(DWORD))) {
+        return false;
+    }
+    buffer += 2 * sizeof(DWORD) + length;
+    totalBytes += 2 * sizeof(DWORD) + length;
+
+    // Loop until the entire metadata block is processed; comments are used in place
+    while (totalBytes + (int)sizeof(DWORD) <= size) {
+        const vorbisTag* tag;
+        const BYTE* separator;
+        const BYTE* value;
+        DWORD valueLength;
+
+        // Read 4 bytes as the length of the next comment
+        memcpy(&length, buffer, sizeof(DWORD));
+        buffer += sizeof(DWORD);
+        totalBytes += sizeof(DWORD);
+        if (length > (DWORD)(size - totalBytes)) {
+            return false;
+        }
+
+        // Only the first few bytes are searched for '=', so long values (LYRICS...) cost nothing
+        separator = memchr(buffer, '=', length < VORBIS_TAG_MAX + 1 ? length : VORBIS_TAG_MAX + 1);
+        tag = separator ? lookupVorbisTag(buffer, (size_t)(separator - buffer)) : NULL;
+
+        if (tag) {
+            value = separator + 1;
+            valueLength = length - (DWORD)(value - buffer);
+            storeTagValue(meta, tag->field, value, valueLength, inPlace ? (int)(value - block) : -1);
+        }
+
+        // Advance the pointer by length bytes
+        buffer += length;
+        totalBytes += length;
+    }
+
+    return true;
+}
+
+static void
+storeTagValue(meta, field, value, length, valueOffset)
+    audioMetaData* meta;
+    MetadataField field;
+    const BYTE* value;
+    DWORD length;
+    int valueOffset;
+{
+    char* copy;
+
+    switch (field) {
+        case Artist:
+        case Album:
+        case Title:
+            updateMetadata(meta, field, value, length, valueOffset);
+            break;
+        case Genre:
+            if ((copy = copyTagString(value, length)) != NULL) {
+                meta->genre = copy;
+            }
+            break;
+        case Date:
+            copyTagValue(meta->date, sizeof(meta->date), value, length);
+            break;
+        case TrackNumber:
+            meta->track[0] = parseTagNumber(value, length);
+            break;
+        case TotalTracks:
+            meta->track[1] = parseTagNumber(value, length);
+            break;
+        case DiscNumber:
+            meta->disc[0] = parseTagNumber(value, length);
+            break;
+        case TotalDiscs:
+            meta->disc[1] = parseTagNumber(value, length);
+            break;
+    }
+}
+
+void
+apply_tag_setting(meta, comment)
+    audioMetaData* meta;
+    const char* comment;
+{
+    const char* separator = strchr(comment, '=');
+    const vorbisTag* tag = separator ? lookupVorbisTag((const BYTE*)comment, (size_t)(separator - comment)) : NULL;
+
+    // Never queued for an in-place rewrite; the setting is written to the file as a whole
+    if (tag) {
+        storeTagValue(meta, tag->field, (const BYTE*)separator + 1, (DWORD)strlen(separator + 1), -1);
+    }
+}
+
+void
+set_flac_probe_size(size)
+    size_t size;
+{
+    flacProbeSize = size < FLAC_PROBE_MIN ? FLAC_PROBE_MIN : size;
+}
+
+static bool
+probe_ensure(probe, offset, size)
+    flacProbe* probe;
+    fileOffset offset;
+    size_t size;
+{
+    size_t want = size > flacProbeSize ? size : flacProbeSize;
+    long bytesRead;
+
+    // Already inside the window
+    if (offset >= probe->base && offset + size <= probe->base + probe->len) {
+        return true;
+    }
+
+    // Take a larger window from the scratch arena if a single block is larger than the probe size;
+    // the old one is simply left behind, the whole window is read again anyway
+    if (want > probe->cap) {
+        BYTE* data = (BYTE*)arena_alloc(arena_scratch(), want);
+        if (!data) {
+            return false;
+        }
+        probe->data = data;
+        probe->cap = want;
+    }
+
+    // The start of the file was handed in; open it only now that more is needed
+    if (probe->fd < 0) {
+        uint64_t opened = stats_now();
+        probe->fd = _open(probe->path, _O_RDONLY | _O_BINARY);
+        stats_record(STAGE_OPEN, opened);
+        if (probe->fd < 0) {
+            return false;
+        }
+    }
+
+    // One positioned read of the whole window
+#ifdef _WIN32
+    if (_lseeki64(probe->fd, offset, SEEK_SET) != offset) {
+        return false;
+    }
+    bytesRead = _read(probe->fd, probe->data, (unsigned)want);
+#else
+    bytesRead = (long)pread(probe->fd, probe->data, want, offset);
+#endif
+    if (bytesRead < 0) {
+        return false;
+    }
+    probe->base = offset;
+    probe->len = (size_t)bytesRead;
+
+    return probe->len >= size;
+}
+
+audioMetaData*
+get_audioMetaData_flac(filename)
+    const char* filename;
+{
+    return get_audioMetaData_flac_prefix(filename, NULL, 0);
+}
+
+audioMetaData*
+get_audioMetaData_flac_prefix(filename, data, len)
+    const char* filename;
+    BYTE* data;
+    size_t len;
+{
+    arena* scratch = arena_scratch();
+    audioMetaData* flac_meta = scratch ? (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)) : NULL;
+    flacProbe probe = { -1, data, len, 0, len, filename };  // in-memory window over the start of the file
+    fileOffset pos = 4;             // file offset of the next block header
+    bool finalBlock = false;        // true if the current block is the final one (MSB of header is set)
+
+    if (!flac_meta) {
+        return NULL;
+    }
+
+    // Open the FLAC file for reading unless its start was read already; the probe window replaces stdio,
+    // which would also malloc() a FILE for every file
+    if (!data) {
+        uint64_t opened = stats_now();
+        probe.fd = _open(filename, _O_RDONLY | _O_BINARY);
+        stats_record(STAGE_OPEN, opened);
+        if (probe.fd < 0) {
+            stats_fail(FAIL_OPEN);
+            out_perror("Error : Couldn't open the file");
+            return NULL;
+        }
+    }
+
+    // Read the header region in one go and check for 'fLaC' indicating a valid flac file
+    if (!probe_ensure(&probe, 0, 4) || memcmp(probe.data, "fLaC", 4) != 0) {
+        handle_error(FAIL_NOT_FLAC);
+        goto cleanup;
+    }
+
+    // Initialize default struct values for artist/album...etc
+    initialize_audioMetaData(flac_meta, filename, "flac");
+
+    // Walk the block headers in memory; stop once the comment block has been parsed
+    // Check the MSB of the first byte. If set, this is the final block
+    while (!finalBlock) {
+        if (!probe_ensure(&probe, pos, 4)) {
+            handle_error(FAIL_CORRUPT);
+            goto cleanup;
+        }
+
+        BYTE* header = probe.data + (pos - probe.base);
+        int blockType = header[0] & 0x7F;
+        int blockSize = (header[1] << 16) | (header[2] << 8) | header[3];
+
+        finalBlock = header[0] & 0x80;
+        pos += 4;
+
+        // STREAMINFO comes first and carries the MD5 of the decoded audio, so duplicates
+        // are recognized without reading a single audio frame
+        if (blockType == FLAC_META_STREAMINFO && blockSize >= FLAC_STREAMINFO_SIZE) {
+            if (!probe_ensure(&probe, pos, FLAC_STREAMINFO_SIZE)) {
+                handle_error(FAIL_CORRUPT);
+                goto cleanup;
+            }
+            memcpy(flac_meta->audioMd5, probe.data + (pos - probe.base) + FLAC_STREAMINFO_MD5, AUDIO_MD5_SIZE);
+        }
+
+        if (blockType == FLAC_META_VORBIS_COMMENT) {
+            // Track the offset of the comment block
+            flac_meta->metaPtr = pos;
+
+            // Only re-read if the block crosses the end of the window
+            if (!probe_ensure(&probe, pos, blockSize)) {
+                handle_error(FAIL_TAG_READ);
+                goto cleanup;
+            }
+
+            if (!(parseFlacMeta(flac_meta, probe.data + (pos - probe.base), blockSize))) {
+                handle_error(FAIL_TAG_PARSE);
+                goto cleanup;
+            }
+            break;
+        }
+
+        // Skip to the next header
+        pos += blockSize;
+    }
+
+    if (probe.fd >= 0) {
+        _close(probe.fd);
+    }
+    return flac_meta;
+
+cleanup:
+    if (probe.fd >= 0) {
+        _close(probe.fd);
+    }
+    return NULL;
+}
+
+static bool
+ogg_read_page(probe, pos, page)
+    flacProbe* probe;
+    fileOffset pos;
+    oggPage* page;
+{
+    const BYTE* header;
+    int size = 0;
+
+    if (!probe_ensure(probe, pos, OGG_PAGE_HEADER)) {
+        return false;
+    }
+    header = probe->data + (pos - probe->base);
+    if (memcmp(header, "OggS", 4) != 0 || header[4] != 0) {
+        return false;
+    }
+    page->flags = header[5];
+    page->serial = (DWORD)header[14] | (DWORD)header[15] << 8 | (DWORD)header[16] << 16 | (DWORD)header[17] << 24;
+    page->segments = header[26];
+
+    // The lacing table may lie past the window; 'header' is not used after this
+    if (!probe_ensure(probe, pos + OGG_PAGE_HEADER, page->segments)) {
+        return false;
+    }
+    memcpy(page->lacing, probe->data + (pos + OGG_PAGE_HEADER - probe->base), page->segments);
+    for (int i = 0; i < page->segments; i++) {
+        size += page->lacing[i];
+    }
+    page->body = pos + OGG_PAGE_HEADER + page->segments;
+    page->next = page->body + size;
+    return true;
+}
+
+static long
+ogg_read_packet(probe, pos, serial, packet, size)
+    flacProbe* probe;
+    fileOffset pos;
+    DWORD serial;
+    BYTE* packet;
+    long size;
+{
+    bool first = true;
+    long length = 0;
+
+    for (;;) {
+        oggPage page;
+        fileOffset offset;
+
+        if (!ogg_read_page(probe, pos, &page)) {
+            return -1;
+        }
+
+        // Pages of other logical streams are skipped by their length
+        if (page.serial != serial) {
+            pos = page.next;
+            continue;
+        }
+
+        // The packet must start on the first page and go on on every following one
+        if (first == ((page.flags & OGG_FLAG_CONTINUED) != 0)) {
+            return -1;
+        }
+        first = false;
+
+        offset = page.body;
+        for (int i = 0; i < page.segments; i++) {
+            int n = page.lacing[i];
+            if (length + n > OGG_MAX_COMMENTS || (packet && length + n > size)) {
+                return -1;
+            }
+            if (packet && n > 0) {
+                if (!probe_ensure(probe, offset, n)) {
+                    return -1;
+                }
+                memcpy(packet + length, probe->data + (offset - probe->base), n);
+            }
+            length += n;
+            offset += n;
+
+            // A segment shorter than 255 bytes ends the packet; whatever follows is not read
+            if (n < 255) {
+                return length;
+            }
+        }
+        pos = page.next;
+    }
+}
+
+audioMetaData*
+get_audioMetaData_ogg(filename)
+    const char* filename;
+{
+    arena* scratch = arena_scratch();
+    audioMetaData* ogg_meta = scratch ? (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)) : NULL;
+    flacProbe probe = { -1, NULL, 0, 0, 0, filename };
+    const char* dot = strrchr(filename, '.');
+    const char* tagsId;             // start of the comment header packet
+    size_t tagsIdLength;
+    const BYTE* id;
+    BYTE* packet;
+    oggPage page;
+    long length;
+    uint64_t opened;
+
+    if (!ogg_meta) {
+        return NULL;
+    }
+
+    opened = stats_now();
+    probe.fd = _open(filename, _O_RDONLY | _O_BINARY);
+    stats_record(STAGE_OPEN, opened);
+    if (probe.fd < 0) {
+        stats_fail(FAIL_OPEN);
+        out_perror("Error : Couldn't open the file");
+        return NULL;
+    }
+
+    // The first page holds the identification header alone; it names the codec
+    if (!ogg_read_page(&probe, 0, &page) || !(page.flags & OGG_FLAG_FIRST) || page.segments == 0 ||
+        !probe_ensure(&probe, page.body, 8)) {
+        handle_error(FAIL_NOT_OGG);
+        goto cleanup;
+    }
+    id = probe.data + (page.body - probe.base);
+    if (memcmp(id, "\x01vorbis", 7) == 0) {
+        tagsId = "\x03vorbis";
+        tagsIdLength = 7;
+    } else if (memcmp(id, "OpusHead", 8) == 0) {
+        tagsId = "OpusTags";
+        tagsIdLength = 8;
+    } else {
+        handle_error(FAIL_NOT_OGG);
+        goto cleanup;
+    }
+
+    // Opus is found in .ogg files too; the file keeps the extension it has
+    initialize_audioMetaData(ogg_meta, filename, (char*)(dot ? dot + 1 : tagsIdLength == 8 ? "opus" : "ogg"));
+
+    // The comment header is the next packet and starts a page of its own. Its size is
+    // taken from the lacing tables first, so it is copied out of the pages only once.
+    length = ogg_read_packet(&probe, page.next, page.serial, NULL, 0);
+    if (length < (long)(tagsIdLength + 2 * sizeof(DWORD)) || !(packet = (BYTE*)arena_alloc(scratch, length)) ||
+        ogg_read_packet(&probe, page.next, page.serial, packet, length) != length) {
+        handle_error(FAIL_TAG_READ);
+        goto cleanup;
+    }
+
+    // Values are reassembled from the pages, so they can't be rewritten in place
+    if (memcmp(packet, tagsId, tagsIdLength) != 0 ||
+        !parseVorbisComments(ogg_meta, packet + tagsIdLength, (int)(length - tagsIdLength), 0)) {
+        handle_error(FAIL_TAG_PARSE);
+        goto cleanup;
+    }
+
+    _close(probe.fd);
+    return ogg_meta;
+
+cleanup:
+    _close(probe.fd);
+    return NULL;
 }
 
 static bool
-validateFlacMeta(buffer, offset, length)
-    BYTE** buffer;
-    int* offset;
-    DWORD length;
+mp4_read_atom(probe, pos, limit, atom)
+    flacProbe* probe;
+    fileOffset pos;
+    fileOffset limit;
+    mp4Atom* atom;
 {
-    bool result = true;
+    const BYTE* header;
+    uint64_t size;
+    long headerSize = 8;
 
-    // Allocate memory for the reference libFLAC identifier
-    char* id = (char*)malloc(length + 1);   // +1 for the null terminator
-    memcpy(id, *buffer, length);
-    id[length] = '\0';  // Null terminate the string
+    if (limit - pos < 8 || !probe_ensure(probe, pos, limit - pos >= 16 ? 16 : 8)) {
+        return false;
+    }
+    header = probe->data + (pos - probe->base);
+    size = (uint64_t)header[0] << 24 | (uint64_t)header[1] << 16 | (uint64_t)header[2] << 8 | header[3];
+    memcpy(atom->type, header + 4, 4);
 
-    // Check if "libFLAC" is found in the initial string, advance the pointer if true
-    if (strstr(id, "libFLAC") != NULL) {
-        *buffer += sizeof(DWORD) + length; // Advance the buffer pointer
-        *offset += sizeof(DWORD) + length; // Update the offset
+    // A size of 1 means a 64-bit size follows, as for an mdat over 4 GB; 0 runs to the end
+    if (size == 1) {
+        if (limit - pos < 16) {
+            return false;
+        }
+        size = 0;
+        for (int i = 8; i < 16; i++) {
+            size = size << 8 | header[i];
+        }
+        headerSize = 16;
+    } else if (size == 0) {
+        size = (uint64_t)(limit - pos);
     }
-    // identifier not found, validation failed
-    else {
-        printf("Error: Metadata tags missing or corrupt. ");
-        result = false; // Set the result to false
+
+    if (size < (uint64_t)headerSize || size > (uint64_t)(limit - pos)) {
+        return false;
     }
+    atom->body = pos + headerSize;
+    atom->end = pos + (fileOffset)size;
+    return true;
+}
 
-    free(id);
-    return result;
+static bool
+mp4_find_atom(probe, pos, end, type, atom)
+    flacProbe* probe;
+    fileOffset pos;
+    fileOffset end;
+    const char* type;
+    mp4Atom* atom;
+{
+    // Only headers are read; the contents of every other atom, mdat included, are hopped over
+    while (pos < end) {
+        if (!mp4_read_atom(probe, pos, end, atom)) {
+            return false;
+        }
+        if (memcmp(atom->type, type, 4) == 0) {
+            return true;
+        }
+        pos = atom->end;
+    }
+    return false;
 }
 
 static void
-updateMetadata(flac_meta, type, tagString, totalBytes)
-    struct audioMetaData* flac_meta;
-    enum MetadataType type;
-    const char* tagString;
-    int totalBytes;
+parseMp4Items(meta, probe, ilst)
+    audioMetaData* meta;
+    flacProbe* probe;
+    const mp4Atom* ilst;
 {
-    const char* tagNames[] = {"ARTIST=", "ALBUM=", "TITLE="};
-    size_t tagLengths[] = {strlen("ARTIST="), strlen("ALBUM="), strlen("TITLE=")};
+    mp4Atom item;
+    mp4Atom data;
+    char* copy;
 
-    size_t tagIndex = type;
-    size_t tagLength = tagLengths[tagIndex];
+    for (fileOffset pos = ilst->body; pos < ilst->end && mp4_read_atom(probe, pos, ilst->end, &item); pos = item.end) {
+        const mp4Item* known = NULL;
+        const BYTE* value;
+        fileOffset valuePos;
+        DWORD length;
 
-    if (_strnicmp(tagString, tagNames[tagIndex], tagLength) == 0) {
-        char* targetField;
-        switch (type) {
-            case Artist:
-                targetField = flac_meta->artist;
-                break;
-            case Album:
-                targetField = flac_meta->album;
-                break;
-            case Title:
-                targetField = flac_meta->title;
+        for (size_t i = 0; i < sizeof(mp4Items) / sizeof(mp4Item); i++) {
+            if (memcmp(item.type, mp4Items[i].type, 4) == 0) {
+                known = &mp4Items[i];
                 break;
-            default:
-                return; // Invalid type
+            }
         }
 
-        strcpy(targetField, strchr(tagString, '=') + 1);
-        if (toLowerCase(targetField)) {
-            flac_meta->offset[type] = flac_meta->metaPtr + sizeof(int) + totalBytes + tagLength;
+        // Cover art and everything else unknown is skipped without being read
+        if (!known || !mp4_find_atom(probe, item.body, item.end, "data", &data) ||
+            data.end - data.body < 8 || data.end - data.body - 8 > MP4_MAX_VALUE) {
+            continue;
+        }
 
-            FILE* file;
-            if (!(file = fopen(flac_meta->pathname, "r+"))) {
-                perror("Error : Couln't open file");
-            } else {
-                if (fseek(file, flac_meta->offset[type], SEEK_SET) != 0) {
-                    perror("Error : Couldn't seek file");
-                } else {
-                    size_t fieldLength = strlen(targetField);
-                    if (fwrite(targetField, sizeof(char), fieldLength, file) != fieldLength) {
-                        perror("Error : Couldn't write metadata to file");
-                    }
-                }
-                fclose(file);
-            }
+        // The data atom starts with a type indicator and a locale
+        valuePos = data.body + 8;
+        length = (DWORD)(data.end - valuePos);
+        if (!probe_ensure(probe, valuePos, length)) {
+            continue;
         }
-    }
-}
+        value = probe->data + (valuePos - probe->base);
 
-static void
-replaceChars(str)
-    char* str;
-{
-    while (*str) {
-        if (*str == '/' || *str == '\\' || *str == '?') {
-            *str = '-';
+        switch (known->field) {
+            case Artist:
+            case Album:
+            case Title:
+                // No checksums cover the values, so changes are rewritten in place like FLAC comments
+                updateMetadata(meta, known->field, value, length, valuePos <= INT32_MAX ? (int)valuePos : -1);
+                break;
+            case Genre:
+                if ((copy = copyTagString(value, length)) != NULL) {
+                    meta->genre = copy;
+                }
+                break;
+            case Date:
+                copyTagValue(meta->date, sizeof(meta->date), value, length);
+                break;
+            case TrackNumber:
+            case DiscNumber:
+                // Two reserved bytes, the number, the total: 16 bits each, big-endian
+                if (length >= 6) {
+                    int* pair = known->field == TrackNumber ? meta->track : meta->disc;
+                    pair[0] = value[2] << 8 | value[3];
+                    pair[1] = value[4] << 8 | value[5];
+                }
+                break;
+            default:
+                break;
         }
-        str++;
     }
 }
 
-static bool
-parseFlacMeta(flac_meta, buffer, size)
-    audioMetaData* flac_meta;
-    BYTE* buffer;
-    int size;
+audioMetaData*
+get_audioMetaData_mp4(filename)
+    const char* filename;
 {
-    DWORD length = 0;              // Stores the length of the current metadata block
-    char* tagString = NULL;        // Pointer to dynamically allocated memory for the current tag string
-    int totalBytes = 0;            // Counter for the total number of bytes processed in the metadata
-    int tagLength = 0;             // Stores the length of specific tag strings
+    arena* scratch = arena_scratch();
+    audioMetaData* mp4_meta = scratch ? (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)) : NULL;
+    flacProbe probe = { -1, NULL, 0, 0, 0, filename };
+    const char* dot = strrchr(filename, '.');
+    mp4Atom atom;
+    mp4Atom moov;
+    mp4Atom udta;
+    mp4Atom meta;
+    fileOffset fileSize;
+    fileOffset children;
+    uint64_t opened;
 
-    // Read 4 bytes and advance the buffer
-    memcpy(&length, buffer, sizeof(DWORD));
-    buffer += sizeof(DWORD);
-    totalBytes += sizeof(DWORD);
+    if (!mp4_meta) {
+        return NULL;
+    }
 
-    if (!validateFlacMeta(&buffer, &totalBytes, length)) {
-        return false;
+    opened = stats_now();
+    probe.fd = _open(filename, _O_RDONLY | _O_BINARY);
+    stats_record(STAGE_OPEN, opened);
+    if (probe.fd < 0) {
+        stats_fail(FAIL_OPEN);
+        out_perror("Error : Couldn't open the file");
+        return NULL;
     }
 
-    // Loop until the entire metadata block is processed
-    while (totalBytes < size) {
+    // Every MP4 file starts with ftyp
+    fileSize = _lseeki64(probe.fd, 0, SEEK_END);
+    if (fileSize < 0 || !mp4_read_atom(&probe, 0, fileSize, &atom) || memcmp(atom.type, "ftyp", 4) != 0) {
+        handle_error(FAIL_NOT_MP4);
+        goto cleanup;
+    }
 
-        // Read 4 bytes as an integer for the next iteration
-        memcpy(&length, buffer, sizeof(DWORD));
-        buffer += sizeof(DWORD);
+    // moov may come before or after mdat; either way only atom headers are read to find it
+    if (!mp4_find_atom(&probe, atom.end, fileSize, "moov", &moov)) {
+        handle_error(FAIL_CORRUPT);
+        goto cleanup;
+    }
 
-        // Reallocate memory for the next tag string
-        tagString = (char*)realloc(tagString, length + 1);
-        memcpy(tagString, buffer, length);
-        tagString[length] = '\0';  // Null terminate the string
+    initialize_audioMetaData(mp4_meta, filename, (char*)(dot ? dot + 1 : "m4a"));
 
-        // Check for the specific tags and call the updateMetadata function
-        if (_strnicmp(tagString, "ARTIST=", strlen("ARTIST=")) == 0) {
-            updateMetadata(flac_meta, Artist, tagString, totalBytes);
-        } else if (_strnicmp(tagString, "ALBUM=", strlen("ALBUM=")) == 0) {
-            updateMetadata(flac_meta, Album, tagString, totalBytes);
-        } else if (_strnicmp(tagString, "TITLE=", strlen("TITLE=")) == 0) {
-            updateMetadata(flac_meta, Title, tagString, totalBytes);
+    // iTunes puts the tags in moov/udta/meta/ilst, some tools in moov/meta/ilst
+    if ((mp4_find_atom(&probe, moov.body, moov.end, "udta", &udta) &&
+         mp4_find_atom(&probe, udta.body, udta.end, "meta", &meta)) ||
+        mp4_find_atom(&probe, moov.body, moov.end, "meta", &meta)) {
+        // meta is a full atom with a version and flags, except in QuickTime files
+        children = meta.body;
+        if (meta.end - meta.body >= 8 && probe_ensure(&probe, meta.body, 8) &&
+            memcmp(probe.data + (meta.body - probe.base) + 4, "hdlr", 4) != 0) {
+            children += 4;
         }
-
-        tagLength = strlen("GENRE=");
-        if (_strnicmp(tagString, "GENRE=", tagLength) == 0) {
-            strcpy(flac_meta->genre, strchr(tagString, '=') + 1);
+        if (mp4_find_atom(&probe, children, meta.end, "ilst", &atom)) {
+            parseMp4Items(mp4_meta, &probe, &atom);
         }
+    }
 
-        tagLength = strlen("DATE=");
-        if (_strnicmp(tagString, "DATE=", tagLength) == 0) {
-            strcpy(flac_meta->date, strchr(tagString, '=') + 1);
-        }
+    _close(probe.fd);
+    return mp4_meta;
 
-        else if (_strnicmp(tagString, "TRACKNUMBER=", 12) == 0 ||
-            _strnicmp(tagString, "TRACKTOTAL=", 11) == 0 ||
-            _strnicmp(tagString, "TRACK=", 6) == 0 ||
-            _strnicmp(tagString, "TOTALTRACKS=", 12) == 0) {
-            if (_strnicmp(tagString, "TRACKNUMBER=", 12) == 0 || _strnicmp(tagString, "TRACK=", 6) == 0) {
-                flac_meta->track[0] = atoi(strchr(tagString, '=') + 1);
-            }
-            else {
-                flac_meta->track[1] = atoi(strchr(tagString, '=') + 1);
-            }
+cleanup:
+    _close(probe.fd);
+    return NULL;
+}
+
+static DWORD
+id3Syncsafe(bytes)
+    const BYTE* bytes;
+{
+    return ((DWORD)(bytes[0] & 0x7F) << 21) | ((DWORD)(bytes[1] & 0x7F) << 14) |
+           ((DWORD)(bytes[2] & 0x7F) << 7) | (DWORD)(bytes[3] & 0x7F);
+}
+
+static DWORD
+id3RemoveUnsync(data, length)
+    BYTE* data;
+    DWORD length;
+{
+    DWORD out = 0;
+
+    for (DWORD i = 0; i < length; i++) {
+        data[out++] = data[i];
+        if (data[i] == 0xFF && i + 1 < length && data[i + 1] == 0x00) {
+            i++;
         }
-        else if (_strnicmp(tagString, "DISCNUMBER=", 11) == 0 ||
-            _strnicmp(tagString, "DISCTOTAL=", 10) == 0 ||
-            _strnicmp(tagString, "DISC=", 5) == 0 ||
-            _strnicmp(tagString, "TOTALDISCS=", 11) == 0) {
-            if (_strnicmp(tagString, "DISCNUMBER=", 11) == 0 || _strnicmp(tagString, "DISC=", 5) == 0) {
-                flac_meta->disc[0] = atoi(strchr(tagString, '=') + 1);
-            }
-            else {
-                flac_meta->disc[1] = atoi(strchr(tagString, '=') + 1);
-            }
+    }
+
+    return out;
+}
+
+static const id3Frame*
+lookupId3Frame(id, version)
+    const BYTE* id;
+    int version;
+{
+    for (size_t i = 0; i < sizeof(id3Frames) / sizeof(id3Frame); i++) {
+        const char* name = (version == 2) ? id3Frames[i].id22 : id3Frames[i].id;
+        if (name[0] && memcmp(id, name, version == 2 ? 3 : 4) == 0) {
+            return &id3Frames[i];
         }
-        // Advance the pointer by length bytes
-        buffer += length;
-        totalBytes += sizeof(DWORD) + length;
     }
 
-    free(tagString);
+    return NULL;
+}
+
+static bool
+putUtf8(field, fieldSize, n, codepoint)
+    char* field;
+    size_t fieldSize;
+    size_t* n;
+    uint32_t codepoint;
+{
+    size_t need = codepoint < 0x80 ? 1 : codepoint < 0x800 ? 2 : codepoint < 0x10000 ? 3 : 4;
 
+    if (*n + need >= fieldSize) {
+        return false;
+    }
+    if (need == 1) {
+        field[(*n)++] = (char)codepoint;
+    } else if (need == 2) {
+        field[(*n)++] = (char)(0xC0 | (codepoint >> 6));
+        field[(*n)++] = (char)(0x80 | (codepoint & 0x3F));
+    } else if (need == 3) {
+        field[(*n)++] = (char)(0xE0 | (codepoint >> 12));
+        field[(*n)++] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        field[(*n)++] = (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        field[(*n)++] = (char)(0xF0 | (codepoint >> 18));
+        field[(*n)++] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        field[(*n)++] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        field[(*n)++] = (char)(0x80 | (codepoint & 0x3F));
+    }
     return true;
 }
 
-audioMetaData*
-get_audioMetaData_flac(filename)
-    const char* filename;
+static void
+copyId3Text(field, fieldSize, data, length)
+    char* field;
+    size_t fieldSize;
+    const BYTE* data;
+    DWORD length;
 {
-    audioMetaData* flac_meta = (audioMetaData*)malloc(sizeof(audioMetaData));
-    FILE* file;                     // the FLAC file containing metadata
-    BYTE header[sizeof(int)];       // for each 4 byte header containing the type and size of the following block
-    BYTE* buffer = NULL;            // a buffer for the relevant metadata
-    int bytesRead;                  // used to verify fread() function is successful
-    bool finalBlock = false;        // true if the current block is the final one (MSB of header is set)
+    size_t n = 0;
+    DWORD i = 1;
+    bool bigEndian = true;
 
-    // Open the FLAC file for reading
-    if (!(file = fopen(filename, "rb"))) {
-        perror("Error : Couldn't open the file");
-        return NULL;
+    if (length == 0) {
+        field[0] = '\0';
+        return;
     }
 
-    // Check if the first 4 bytes are 'fLaC' indicating a valid flac file
-    bytesRead = fread(header, sizeof(BYTE), 4, file);
-    if (bytesRead < 4 || memcmp(header, "fLaC", 4) != 0) {
-        handle_error("Not a real FLAC file.");
-        goto cleanup;
+    switch (data[0]) {
+        case 0:     // ISO-8859-1, each byte is its own code point
+            while (i < length && data[i] && putUtf8(field, fieldSize, &n, data[i])) {
+                i++;
+            }
+            break;
+        case 1:     // UTF-16 with byte order mark
+            if (i + 1 < length && data[i] == 0xFF && data[i + 1] == 0xFE) {
+                bigEndian = false;
+                i += 2;
+            } else if (i + 1 < length && data[i] == 0xFE && data[i + 1] == 0xFF) {
+                i += 2;
+            }
+            // fall through
+        case 2:     // UTF-16BE
+            while (i + 1 < length) {
+                uint32_t unit = bigEndian ? (data[i] << 8 | data[i + 1]) : (data[i + 1] << 8 | data[i]);
+                i += 2;
+                if (unit == 0) {
+                    break;
+                }
+                // Combine surrogate pairs
+                if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < length) {
+                    uint32_t low = bigEndian ? (data[i] << 8 | data[i + 1]) : (data[i + 1] << 8 | data[i]);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                        i += 2;
+                    }
+                }
+                if (!putUtf8(field, fieldSize, &n, unit)) {
+                    break;
+                }
+            }
+            break;
+        case 3:     // UTF-8
+            while (i < length && data[i] && n + 1 < fieldSize) {
+                field[n++] = (char)data[i++];
+            }
+            break;
     }
 
-    // Initialize default struct values for artist/album...etc
-    initialize_audioMetaData(flac_meta, filename, "flac");
+    field[n] = '\0';
+}
 
-    // Get the block type and size from each header
-    // Check the MSB of the first byte. If set, this is the final block
-    while (!finalBlock) {
-        bytesRead = fread(header, sizeof(BYTE), 4, file);
-        if (bytesRead < sizeof(int)) {
-            handle_error("Data missing or corrupt.");
-            goto cleanup;
+static void
+parseId3Frames(meta, tag, size, version, inPlace)
+    audioMetaData* meta;
+    BYTE* tag;
+    DWORD size;
+    int version;
+    int inPlace;
+{
+    const DWORD headerSize = (version == 2) ? 6 : 10;
+    DWORD pos = 0;
+
+    while (pos + headerSize <= size) {
+        BYTE* frame = tag + pos;
+        BYTE* data = frame + headerSize;
+        const id3Frame* entry;
+        DWORD length;
+        int flags = 0;
+        bool raw = inPlace;
+        char* text;
+        size_t textSize;
+
+        // Padding after the last frame
+        if (frame[0] == 0) {
+            break;
         }
 
-        finalBlock = header[0] & 0x80;
+        if (version == 2) {
+            length = (DWORD)frame[3] << 16 | (DWORD)frame[4] << 8 | frame[5];
+        } else if (version == 3) {
+            length = (DWORD)frame[4] << 24 | (DWORD)frame[5] << 16 | (DWORD)frame[6] << 8 | frame[7];
+            flags = frame[8] << 8 | frame[9];
+        } else {
+            length = id3Syncsafe(frame + 4);
+            flags = frame[8] << 8 | frame[9];
+        }
+        if (length > size - pos - headerSize) {
+            break;
+        }
+        pos += headerSize + length;
 
-        int blockType = header[0] & 0x7F;
-        int blockSize = (header[1] << 16) | (header[2] << 8) | header[3];
+        // Everything else, pictures included, is stepped over where it lies
+        if (!(entry = lookupId3Frame(frame, version))) {
+            continue;
+        }
 
-        if (blockType == FLAC_META_VORBIS_COMMENT) {
-            // Track the offset of the comment block
-            flac_meta->metaPtr = ftell(file);
-            // Allocate buffer for metadata block
-            if (!(buffer = (BYTE*)malloc(blockSize))) {
-                goto cleanup;
+        if (version == 3) {
+            if (flags & 0x00C0) {           // compressed or encrypted
+                continue;
             }
-
-            // Read metadata block into the buffer
-            bytesRead = fread(buffer, sizeof(BYTE), blockSize, file);
-            if (bytesRead < blockSize) {
-                handle_error("Couldn't read tag info.");
-                goto cleanup;
+            if ((flags & 0x0020) && length > 0) {   // group id
+                data++;
+                length--;
             }
-
-            if (!(parseFlacMeta(flac_meta, buffer, blockSize))) {
-                handle_error("FLAC file could not be parsed.");
-                goto cleanup;
+        } else if (version == 4) {
+            if (flags & 0x000C) {           // compressed or encrypted
+                continue;
+            }
+            if ((flags & 0x0040) && length > 0) {   // group id
+                data++;
+                length--;
+            }
+            if (flags & 0x0001) {           // data length indicator
+                if (length < 4) {
+                    continue;
+                }
+                data += 4;
+                length -= 4;
+            }
+            if (flags & 0x0002) {           // unsynchronised frame
+                length = id3RemoveUnsync(data, length);
+                raw = false;
             }
+        }
 
-            // Free the buffer after processing
-            free(buffer);
+        // Decoded text takes at most two bytes per byte of the frame (Latin-1 and UTF-16)
+        textSize = 2 * (size_t)length + 1;
+        if (!(text = (char*)arena_alloc(arena_scratch(), textSize))) {
+            continue;
         }
-        else {
-            // Advance the file pointer to the next header
-            fseek(file, blockSize, SEEK_CUR);
+        copyId3Text(text, textSize, data, length);
+
+        switch (entry->field) {
+            case Artist:
+            case Album:
+            case Title:
+                // Only text stored byte for byte as decoded can be rewritten in place
+                if (raw && length > 0 && data[0] == 0) {
+                    for (DWORD i = 1; i < length && data[i]; i++) {
+                        if (data[i] & 0x80) {
+                            raw = false;
+                            break;
+                        }
+                    }
+                } else if (length == 0 || data[0] != 3) {
+                    raw = false;
+                }
+                updateMetadata(meta, entry->field, (const BYTE*)text, (DWORD)strlen(text),
+                               raw ? (int)(data + 1 - tag) : -1);
+                break;
+            case Genre: {
+                // Drop ID3v1 genre references such as "(17)" in front of the name
+                const char* genre = text;
+                while (genre[0] == '(' && isdigit((unsigned char)genre[1])) {
+                    const char* close = strchr(genre, ')');
+                    if (!close || close[1] == '\0') {
+                        break;
+                    }
+                    genre = close + 1;
+                }
+                meta->genre = genre;
+                break;
+            }
+            case Date:
+                copyTagValue(meta->date, sizeof(meta->date), (const BYTE*)text, (DWORD)strlen(text));
+                break;
+            case TrackNumber:
+            case DiscNumber: {
+                // "n" or "n/total"
+                int* number = (entry->field == TrackNumber) ? meta->track : meta->disc;
+                const char* slash = strchr(text, '/');
+                number[0] = parseTagNumber((const BYTE*)text, (DWORD)strlen(text));
+                if (slash) {
+                    number[1] = parseTagNumber((const BYTE*)slash + 1, (DWORD)strlen(slash + 1));
+                }
+                break;
+            }
+            default:
+                break;
         }
     }
-
-    fclose(file);
-    return flac_meta;
-
-cleanup:
-    fclose(file);
-    free(buffer);
-    free(flac_meta);
-    return NULL;
 }
 
 audioMetaData*
 get_audioMetaData_mp3(filename)
     const char* filename;
 {
-    audioMetaData* mp3_meta = (audioMetaData*)malloc(sizeof(audioMetaData));
+    arena* scratch = arena_scratch();
+    audioMetaData* mp3_meta = scratch ? (audioMetaData*)arena_alloc(scratch, sizeof(audioMetaData)) : NULL;
     FILE* file;                     // the MP3 file containing metadata
-    BYTE header[10];                // for the 10 byte header containing the ID3 tag info 
-    BYTE* buffer;                   // a buffer for the relevant metadata
+    BYTE header[ID3_HEADER_SIZE];   // for the 10 byte header containing the ID3 tag info
+    BYTE* buffer = NULL;            // the whole tag, read at once
+    BYTE* frames;                   // start of the frames inside buffer
+    DWORD size;                     // tag size from the header, excluding the header
+    int version;
+    int flags;
+    bool inPlace = true;
+    uint64_t opened;
+
+    if (!mp3_meta) {
+        return NULL;
+    }
 
     // Open the MP3 file for reading
-    if (!(file = fopen(filename, "rb"))) {
-        char errmsg[256];
-        sprintf(errmsg, "fopen(%s, \"rb\")", filename);
-        perror(errmsg);
+    opened = stats_now();
+    file = fopen(filename, "rb");
+    stats_record(STAGE_OPEN, opened);
+    if (!file) {
+        stats_fail(FAIL_OPEN);
+        out_perror("Error : Couldn't open the file");
         return NULL;
     }
+    setvbuf(file, NULL, _IONBF, 0);
 
     // Check if the first 3 bytes are 'ID3' indicating an mp3 file with ID3 tags
-    fread(header, sizeof(BYTE), 10, file);
-    if (memcmp(header, "ID3", 3) != 0) {
-        handle_error("Not an ID3v2 mp3 file.");
-        fclose(file);
-        free(mp3_meta);
-        return NULL;
+    if (fread(header, sizeof(BYTE), ID3_HEADER_SIZE, file) != ID3_HEADER_SIZE || memcmp(header, "ID3", 3) != 0) {
+        handle_error(FAIL_NOT_ID3);
+        goto cleanup;
+    }
+
+    version = header[3];
+    flags = header[5];
+    size = id3Syncsafe(header + 6);
+    if (version < 2 || version > 4 || header[4] == 0xFF || (version == 2 && (flags & 0x40))) {
+        handle_error(FAIL_ID3_VERSION);
+        goto cleanup;
+    }
+    if (size > ID3_MAX_SIZE) {
+        handle_error(FAIL_ID3_TOO_LARGE);
+        goto cleanup;
+    }
+
+    // The size in the header covers the whole tag, so one read gets all of it
+    if (!(buffer = (BYTE*)arena_alloc(scratch, size ? size : 1)) || fread(buffer, sizeof(BYTE), size, file) != size) {
+        handle_error(FAIL_TAG_READ);
+        goto cleanup;
+    }
+    fclose(file);
+    file = NULL;
+
+    // Unsynchronisation covers the whole tag before 2.4, each frame in 2.4
+    if ((flags & 0x80) && version < 4) {
+        size = id3RemoveUnsync(buffer, size);
+        inPlace = false;
+    }
+    frames = buffer;
+
+    // Skip the extended header; its size field differs between 2.3 and 2.4
+    if ((flags & 0x40) && version > 2) {
+        DWORD extSize;
+        if (size < 6) {
+            handle_error(FAIL_CORRUPT);
+            goto cleanup;
+        }
+        if (version == 3) {
+            extSize = 4 + ((DWORD)buffer[0] << 24 | (DWORD)buffer[1] << 16 | (DWORD)buffer[2] << 8 | buffer[3]);
+        } else {
+            extSize = id3Syncsafe(buffer);
+        }
+        if (extSize > size) {
+            handle_error(FAIL_CORRUPT);
+            goto cleanup;
+        }
+        frames += extSize;
+        size -= extSize;
     }
 
     // Initialize default struct values for artist/album...etc
     initialize_audioMetaData(mp3_meta, filename, "mp3");
+    mp3_meta->metaPtr = ID3_HEADER_SIZE + (int)(frames - buffer);
+
+    parseId3Frames(mp3_meta, frames, size, version, inPlace);
 
-    fclose(file);
     return mp3_meta;
+
+cleanup:
+    if (file) {
+        fclose(file);
+    }
+    return NULL;
 }
 
 static int
-toLowerCase(str)
+toLowerCase(str, changed)
     char* str;
+    caseSpan* changed;
 {
-    // "function words" that are converted to lowercase
-    char* words[] = {
-        " In ", " Is ", " The ", " With ", " A ", " As ", " At ",
-        " And ", " For ", " From ", " To ", " Or ", " Of ", " On "
-    };
-
-    int conversionCount = 0;  // Counter for the number of conversions
-
-    // Iterate through each word and convert to lowercase
-    for (int i = 0; i < sizeof(words) / sizeof(char*); i++) {
-        char* word = words[i];
-        char* start = str;
-        while ((start = strstr(start, word)) != NULL) {
-            char* end = start + strlen(word);
-            while (start < end) {
-                *start = tolower(*start);
-                start++;
-            }
-            conversionCount = 1;  // Set the flag to indicate at least one conversion
-        }
+    caseSpan spans[MAX_LENGTH / 2];
+    int count;
+    const caseSpan* last;
+
+    // One pass over the string with the compiled word list, see wordcase.h
+    if (!(count = wordcase_apply(str, spans, MAX_LENGTH / 2))) {
+        return 0;
     }
 
-    return conversionCount;
+    // The range from the first to the last changed word; past the spans' capacity it runs
+    // to the end of the string, rewriting unchanged bytes with themselves
+    changed->start = spans[0].start;
+    if (count > MAX_LENGTH / 2) {
+        changed->length = (int)strlen(str) - spans[0].start;
+    } else {
+        last = &spans[count - 1];
+        changed->length = last->start + last->length - spans[0].start;
+    }
+    return count;
 }
 
 void
-handle_error(message)
-    const char* message;
+handle_error(reason)
+    FailReason reason;
 {
-    fprintf(stderr, "Error : %-30s ", message);
+    stats_fail(reason);
+    out_printf(stderr, "Error : %-30s ", stats_fail_message(reason));
 }
 
 bool
@@ -371,16 +2216,15 @@ create_artist_folder(dest_dir, artist, folder_name)
 {
     int result = snprintf(folder_name, MAX_LENGTH, "%s/%s", dest_dir, artist);
     if (result < 0 || result >= MAX_LENGTH) {
-        handle_error("Couldn't format the artist folder name");
+        handle_error(FAIL_NAME_TOO_LONG);
         return false;
     }
 
-    // Check if the artist folder already exists
-    if (_access(folder_name, 0) == -1) {
-        if (_mkdir(folder_name) != 0) {
-            perror("Error : Couldn't create artist directory");
-            return false;
-        }
+    // Folders seen before cost a hash lookup; new ones are created relative to the destination
+    if (dircache_mkdir(folder_name, dircache_mkdir(dest_dir, DIRCACHE_NO_FD, NULL), artist) == DIRCACHE_FAILED) {
+        stats_fail(FAIL_MKDIR);
+        out_perror("Error : Couldn't create artist directory");
+        return false;
     }
 
     return true;
@@ -393,32 +2237,81 @@ create_album_folder(dest_dir, artist, album, folder_name)
     const char* album;
     char* folder_name;
 {
+    char artist_folder[MAX_LENGTH];
+    size_t artistLength = strlen(dest_dir) + 1 + strlen(artist);
+    int artistFd;
+
     int result = snprintf(folder_name, MAX_LENGTH, "%s/%s/%s", dest_dir, artist, album);
     if (result < 0 || result >= MAX_LENGTH) {
-        handle_error("Couldn't format the album folder name");
+        handle_error(FAIL_NAME_TOO_LONG);
         return false;
     }
 
-    if (_access(folder_name, 0) == -1) {
-        if (_mkdir(folder_name) != 0) {
-            perror("Error : Couldn't create album directory");
-            return false;
-        }
+    // The album path starts with the artist path; create the album relative to that folder
+    memcpy(artist_folder, folder_name, artistLength);
+    artist_folder[artistLength] = '\0';
+    artistFd = dircache_mkdir(artist_folder, dircache_mkdir(dest_dir, DIRCACHE_NO_FD, NULL), artist);
+
+    if (dircache_mkdir(folder_name, artistFd, album) == DIRCACHE_FAILED) {
+        stats_fail(FAIL_MKDIR);
+        out_perror("Error : Couldn't create album directory");
+        return false;
     }
 
     return true;
 }
 
-void
+bool
+format_file_name(meta, name, size)
+    const audioMetaData* meta;
+    char* name;
+    size_t size;
+{
+    int length = snprintf(name, size, "%02d. %s.%s", meta->track[0], meta->title, meta->fileext);
+    if (length < 0 || (size_t)length >= size) {
+        return false;
+    }
+
+    // Only the copy of the title is changed; neither the number nor extensions contain these characters
+    replaceChars(name);
+    return true;
+}
+
+bool
 reformat_file_path(meta, folder_name)
     audioMetaData* meta;
     const char* folder_name;
 {
-    if (strchr(meta->title, '/') || strchr(meta->title, '\\') || strchr(meta->title, '?')) {
-        // Assuming replaceChars is a function that replaces specific characters in a string
-        replaceChars(meta->title);
+    size_t size = sizeof(meta->pathname);
+    int prefix = snprintf(meta->pathname, size, "%s/", folder_name);
+
+    return prefix >= 0 && (size_t)prefix < size && format_file_name(meta, meta->pathname + prefix, size - prefix);
+}
+
+bool
+get_artist_folder_name(meta, artist)
+    const audioMetaData* meta;
+    char* artist;
+{
+    int result;
+
+    if (strlen(meta->artist) == 0 || strlen(meta->album) == 0) {
+        handle_error(FAIL_BLANK_FIELD);
+        return false;
+    }
+
+    // If the artist name starts with "The ", move "The" to the end of the folder name.
+    if (strncmp(meta->artist, "The ", strlen("The ")) == 0) {
+        result = snprintf(artist, MAX_LENGTH, "%s, The", meta->artist + strlen("The "));
+    } else {
+        result = snprintf(artist, MAX_LENGTH, "%s", meta->artist);
+    }
+    if (result < 0 || result >= MAX_LENGTH) {
+        handle_error(FAIL_NAME_TOO_LONG);
+        return false;
     }
-    sprintf(meta->pathname, "%s/%02d. %s.%s", folder_name, meta->track[0], meta->title, meta->fileext);
+
+    return true;
 }
 
 bool
@@ -427,28 +2320,24 @@ create_folder_structure(meta, dest_dir)
     const char* dest_dir;
 {
     char folder_name[MAX_LENGTH] = "";
+    char artist[MAX_LENGTH];
 
-    if (strlen(meta->artist) == 0 || strlen(meta->album) == 0) {
-        handle_error("A field is blank.");
+    if (!get_artist_folder_name(meta, artist)) {
         return false;
     }
 
-    // If the artist name starts with "The ", move "The" to the end.
-    if (strncmp(meta->artist, "The ", strlen("The ")) == 0) {
-        char temp[MAX_LENGTH];
-        snprintf(temp, MAX_LENGTH, "%s, The", meta->artist + strlen("The "));
-        strcpy(meta->artist, temp);
+    if (!create_artist_folder(dest_dir, artist, folder_name)) {
+        return false;
     }
 
-    if (!create_artist_folder(dest_dir, meta->artist, folder_name)) {
+    if (!create_album_folder(dest_dir, artist, meta->album, folder_name)) {
         return false;
     }
 
-    if (!create_album_folder(dest_dir, meta->artist, meta->album, folder_name)) {
+    if (!reformat_file_path(meta, folder_name)) {
+        handle_error(FAIL_NAME_TOO_LONG);
         return false;
     }
 
-    reformat_file_path(meta, folder_name);
-
     return true;
 }
\ No newline at end of file
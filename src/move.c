@@ -0,0 +1,445 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // copy_file_range()
+#endif
+
+#include "../include/move.h"
+#include "../include/dircache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+bool
+move_parent_of(path, dir, size)
+    const char* path;
+    char* dir;
+    size_t size;
+{
+    size_t end = strlen(path);
+
+    while (end > 0 && path[end - 1] != '/' && path[end - 1] != '\\') {
+        end--;
+    }
+    if (end > 1) {
+        end--;
+    }
+    if (end == 0) {
+        dir[0] = '.';
+        end = 1;
+    } else if (end >= size) {
+        return false;
+    } else {
+        memcpy(dir, path, end);
+    }
+    dir[end] = '\0';
+    return true;
+}
+
+int
+move_sync_dir(dir)
+    const char* dir;
+{
+#ifdef _WIN32
+    // Folders can't be synced on Windows; MoveFileEx() writes through for copies instead
+    (void)dir;
+    return 0;
+#else
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int rc;
+    int err;
+
+    if (fd < 0) {
+        return -1;
+    }
+    rc = fsync(fd);
+    err = errno;
+    close(fd);
+    errno = err;
+    return rc;
+#endif
+}
+
+int
+move_sync_parent(path)
+    const char* path;
+{
+    char dir[_MAX_PATH];
+
+    if (!move_parent_of(path, dir, sizeof(dir))) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return move_sync_dir(dir);
+}
+
+int
+move_replace(tmpPath, path)
+    const char* tmpPath;
+    const char* path;
+{
+#ifdef _WIN32
+    // rename() won't replace a file on Windows, and removing it first would leave a gap
+    if (!MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        errno = GetLastError() == ERROR_ACCESS_DENIED ? EACCES : EIO;
+        return -1;
+    }
+    return 0;
+#else
+    return rename(tmpPath, path);
+#endif
+}
+
+#ifndef _WIN32
+static int
+copy_kernel(src, dst, size)
+    int src;
+    int dst;
+    off_t size;
+{
+#ifdef __linux__
+    off_t done = 0;
+
+    // A reflink shares the extents, so nothing is copied at all
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return 0;
+    }
+#endif
+
+    // Let the kernel copy in large chunks
+    while (done < size) {
+        ssize_t n = copy_file_range(src, NULL, dst, NULL, MOVE_CHUNK, 0);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done == size) {
+        return 0;
+    }
+
+    // copy_file_range() refused (older kernel, or these file systems): try sendfile() from where it stopped
+    while (done < size) {
+        off_t offset = done;
+        ssize_t n = sendfile(dst, src, &offset, MOVE_CHUNK);
+        if (n <= 0) {
+            break;
+        }
+        done = offset;
+    }
+    if (done == size) {
+        return 0;
+    }
+#else
+    (void)src;
+    (void)dst;
+    (void)size;
+#endif
+
+    return 1;   // fall back to the userspace copy
+}
+
+static int
+copy_user(src, dst, size)
+    int src;
+    int dst;
+    off_t size;
+{
+    char* buffer = (char*)malloc(MOVE_BUFFER);
+    off_t done = 0;
+
+    if (!buffer) {
+        return -1;
+    }
+
+    // Start over; a partial kernel copy may have left anything behind
+    if (lseek(src, 0, SEEK_SET) != 0 || ftruncate(dst, 0) != 0 || lseek(dst, 0, SEEK_SET) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    while (done < size) {
+        ssize_t n = read(src, buffer, MOVE_BUFFER);
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(dst, buffer + written, n - written);
+            if (w < 0) {
+                free(buffer);
+                return -1;
+            }
+            written += w;
+        }
+        done += n;
+    }
+
+    free(buffer);
+    return done == size ? 0 : -1;
+}
+
+static int
+copy_across(oldPath, newPath, sync, keepSource)
+    const char* oldPath;
+    const char* newPath;
+    SyncPolicy sync;
+    int keepSource;
+{
+    char tmpPath[_MAX_PATH + sizeof(MOVE_TMP_SUFFIX)];
+    struct stat srcStat;
+    struct stat dstStat;
+    struct timespec times[2];
+    int src = -1;
+    int dst = -1;
+    int err = 0;
+    bool created = false;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s%s", newPath, MOVE_TMP_SUFFIX);
+
+    if ((src = open(oldPath, O_RDONLY | O_CLOEXEC)) < 0 || fstat(src, &srcStat) != 0) {
+        err = errno;
+        goto fail;
+    }
+    if ((dst = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, srcStat.st_mode & 0777)) < 0) {
+        err = errno;
+        goto fail;
+    }
+    created = true;
+
+    if (copy_kernel(src, dst, srcStat.st_size) != 0 && copy_user(src, dst, srcStat.st_size) != 0) {
+        err = errno ? errno : EIO;
+        goto fail;
+    }
+
+    // Never remove the source unless the copy is complete
+    if (fstat(dst, &dstStat) != 0 || dstStat.st_size != srcStat.st_size) {
+        err = EIO;
+        goto fail;
+    }
+
+    // Keep the timestamps, as a rename would
+    times[0] = srcStat.st_atim;
+    times[1] = srcStat.st_mtim;
+    futimens(dst, times);
+
+    if (sync != SYNC_NONE && fsync(dst) != 0) {
+        err = errno;
+        goto fail;
+    }
+    if (close(dst) != 0) {
+        dst = -1;
+        err = errno;
+        goto fail;
+    }
+    dst = -1;
+    close(src);
+    src = -1;
+
+    if (rename(tmpPath, newPath) != 0) {
+        err = errno;
+        goto fail;
+    }
+    created = false;
+
+    // The journal removes the source itself once the copy's folder has been synced
+    if (keepSource) {
+        return 0;
+    }
+    if (sync == SYNC_ALL && move_sync_parent(newPath) != 0) {
+        err = errno;
+        unlink(newPath);
+        errno = err;
+        return -1;
+    }
+
+    // The copy is safely in place; now the source can go
+    if (unlink(oldPath) != 0) {
+        err = errno;
+        unlink(newPath);
+        errno = err;
+        return -1;
+    }
+    return 0;
+
+fail:
+    if (src >= 0) {
+        close(src);
+    }
+    if (dst >= 0) {
+        close(dst);
+    }
+    if (created) {
+        unlink(tmpPath);
+    }
+    errno = err;
+    return -1;
+}
+#else
+static int
+copy_across(oldPath, newPath, sync, keepSource)
+    const char* oldPath;
+    const char* newPath;
+    SyncPolicy sync;
+    int keepSource;
+{
+    char tmpPath[_MAX_PATH + sizeof(MOVE_TMP_SUFFIX)];
+    WIN32_FILE_ATTRIBUTE_DATA srcInfo;
+    WIN32_FILE_ATTRIBUTE_DATA dstInfo;
+    HANDLE file;
+    bool flushed = true;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s%s", newPath, MOVE_TMP_SUFFIX);
+
+    if (!GetFileAttributesExA(oldPath, GetFileExInfoStandard, &srcInfo) || !CopyFileA(oldPath, tmpPath, TRUE)) {
+        errno = EIO;
+        return -1;
+    }
+
+    // Never remove the source unless the copy is complete
+    if (!GetFileAttributesExA(tmpPath, GetFileExInfoStandard, &dstInfo) ||
+        dstInfo.nFileSizeHigh != srcInfo.nFileSizeHigh || dstInfo.nFileSizeLow != srcInfo.nFileSizeLow) {
+        DeleteFileA(tmpPath);
+        errno = EIO;
+        return -1;
+    }
+
+    if (sync != SYNC_NONE) {
+        file = CreateFileA(tmpPath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        flushed = file != INVALID_HANDLE_VALUE && FlushFileBuffers(file);
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+    }
+    if (!flushed ||
+        !MoveFileExA(tmpPath, newPath, MOVEFILE_REPLACE_EXISTING | (sync != SYNC_NONE ? MOVEFILE_WRITE_THROUGH : 0))) {
+        DeleteFileA(tmpPath);
+        errno = EIO;
+        return -1;
+    }
+
+    // The journal removes the source itself once the copy's folder has been synced
+    if (keepSource) {
+        return 0;
+    }
+    if (!DeleteFileA(oldPath)) {
+        DeleteFileA(newPath);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+int
+move_file(oldPath, newPath, sync)
+    const char* oldPath;
+    const char* newPath;
+    SyncPolicy sync;
+{
+    bool copied;
+    return move_file_keep(oldPath, newPath, sync, &copied, 0);
+}
+
+int
+move_file_keep(oldPath, newPath, sync, copied, keepSource)
+    const char* oldPath;
+    const char* newPath;
+    SyncPolicy sync;
+    bool* copied;
+    int keepSource;
+{
+    *copied = false;
+    if (dircache_rename(oldPath, newPath) == 0) {
+        return 0;
+    }
+    if (errno != EXDEV) {
+        return -1;
+    }
+
+    if (copy_across(oldPath, newPath, sync, keepSource) != 0) {
+        return -1;
+    }
+    *copied = true;
+    return 0;
+}
+
+int
+move_copy_range(src, srcOffset, dst, dstOffset, size)
+    int src;
+    fileOffset srcOffset;
+    int dst;
+    fileOffset dstOffset;
+    fileOffset size;
+{
+    char* buffer;
+    fileOffset done = 0;
+
+#ifdef __linux__
+    // Explicit offsets, so neither file position matters
+    while (done < size) {
+        off_t in = srcOffset + done;
+        off_t out = dstOffset + done;
+        ssize_t n = copy_file_range(src, &in, dst, &out, (size_t)(size - done < MOVE_CHUNK ? size - done : MOVE_CHUNK), 0);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    // copy_file_range() refused (older kernel, or these file systems): sendfile() writes at the file position
+    if (done < size && lseek(dst, dstOffset + done, SEEK_SET) == dstOffset + done) {
+        while (done < size) {
+            off_t in = srcOffset + done;
+            ssize_t n = sendfile(dst, src, &in, (size_t)(size - done < MOVE_CHUNK ? size - done : MOVE_CHUNK));
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+    }
+    if (done == size) {
+        return 0;
+    }
+#endif
+
+    // Go on through a user buffer from where the kernel stopped
+    if (!(buffer = (char*)malloc(MOVE_BUFFER))) {
+        return -1;
+    }
+    errno = 0;
+    while (done < size) {
+        size_t want = (size_t)(size - done < MOVE_BUFFER ? size - done : MOVE_BUFFER);
+        long n;
+#ifdef _WIN32
+        if (_lseeki64(src, srcOffset + done, SEEK_SET) != srcOffset + done || (n = _read(src, buffer, (unsigned)want)) <= 0 ||
+            _lseeki64(dst, dstOffset + done, SEEK_SET) != dstOffset + done || _write(dst, buffer, (unsigned)n) != n) {
+            break;
+        }
+#else
+        if ((n = (long)pread(src, buffer, want, srcOffset + done)) <= 0) {
+            break;
+        }
+        for (long written = 0; written < n; ) {
+            ssize_t w = pwrite(dst, buffer + written, n - written, dstOffset + done + written);
+            if (w < 0) {
+                free(buffer);
+                return -1;
+            }
+            written += w;
+        }
+#endif
+        done += n;
+    }
+
+    free(buffer);
+    if (done != size && errno == 0) {
+        errno = EIO;
+    }
+    return done == size ? 0 : -1;
+}
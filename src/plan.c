@@ -0,0 +1,504 @@
+#include "../include/plan.h"
+#include "../include/pool.h"
+
+struct movePlan {
+    mutex_t lock;
+    strTable* strings;      // names, and the sources of a plan read from a file
+    arena* edits;           // planEdits and their texts, under 'lock'
+    planEntry* entries;
+    int count;
+    int capacity;
+    const char* tags[MAX_TAGS];     // --tag settings, in 'strings'
+    int tagCount;
+};
+
+movePlan*
+plan_create(void)
+{
+    movePlan* plan = (movePlan*)calloc(1, sizeof(movePlan));
+
+    if (!plan) {
+        return NULL;
+    }
+    if (!(plan->strings = strtable_create()) || !(plan->edits = arena_create(STRTABLE_CHUNK))) {
+        strtable_destroy(plan->strings);
+        free(plan);
+        return NULL;
+    }
+    mutex_init(&plan->lock);
+    return plan;
+}
+
+/**
+ * Appends an entry; the caller holds the plan's lock.
+ */
+static bool
+append_entry(plan, entry)
+    movePlan* plan;
+    const planEntry* entry;
+{
+    if (plan->count == plan->capacity) {
+        int capacity = plan->capacity ? plan->capacity * 2 : PLAN_MIN_ENTRIES;
+        planEntry* entries = (planEntry*)realloc(plan->entries, capacity * sizeof(planEntry));
+        if (!entries) {
+            return false;
+        }
+        plan->entries = entries;
+        plan->capacity = capacity;
+    }
+    plan->entries[plan->count++] = *entry;
+    return true;
+}
+
+/**
+ * Copies tag edits and their texts into the plan's arena; the caller holds the plan's lock.
+ */
+static planEdits*
+copy_edits(plan, edits, count, key)
+    movePlan* plan;
+    const tagEdit* edits;
+    int count;
+    const cacheKey* key;
+{
+    planEdits* copy = (planEdits*)arena_alloc(plan->edits, sizeof(planEdits));
+
+    if (!copy) {
+        return NULL;
+    }
+    copy->key = *key;
+    copy->count = 0;
+    for (int i = 0; i < count && i < FLAC_MAX_EDITS; i++) {
+        char* text = (char*)arena_alloc(plan->edits, edits[i].length ? edits[i].length : 1);
+        if (!text) {
+            return NULL;
+        }
+        memcpy(text, edits[i].text, edits[i].length);
+        copy->edits[i].offset = edits[i].offset;
+        copy->edits[i].length = edits[i].length;
+        copy->edits[i].text = text;
+        copy->count++;
+    }
+    return copy;
+}
+
+bool
+plan_add(plan, source, library, artist, meta, name)
+    movePlan* plan;
+    const char* source;
+    const char* library;
+    const char* artist;
+    const audioMetaData* meta;
+    const char* name;
+{
+    planEntry entry;
+    cacheKey key;
+    bool keyed = meta->editCount > 0 && cache_key(source, &key);
+    bool result;
+
+    entry.source = source;
+    entry.library = strtable_intern(plan->strings, library, strlen(library));
+    entry.artist = strtable_intern(plan->strings, artist, strlen(artist));
+    entry.album = strtable_intern(plan->strings, meta->album, strlen(meta->album));
+    entry.name = strtable_copy(plan->strings, name, strlen(name));
+    entry.edits = NULL;
+    memcpy(entry.audioMd5, meta->audioMd5, AUDIO_MD5_SIZE);
+    if (!entry.library || !entry.artist || !entry.album || !entry.name) {
+        return false;
+    }
+
+    mutex_lock(&plan->lock);
+    result = (!keyed || (entry.edits = copy_edits(plan, meta->edits, meta->editCount, &key)) != NULL) &&
+             append_entry(plan, &entry);
+    mutex_unlock(&plan->lock);
+    return result;
+}
+
+bool
+plan_set_tags(plan, tags, count)
+    movePlan* plan;
+    const char* const* tags;
+    int count;
+{
+    for (plan->tagCount = 0; plan->tagCount < count && plan->tagCount < MAX_TAGS; plan->tagCount++) {
+        const lstr* copy = strtable_copy(plan->strings, tags[plan->tagCount], strlen(tags[plan->tagCount]));
+        if (!copy) {
+            return false;
+        }
+        plan->tags[plan->tagCount] = copy->text;
+    }
+    return true;
+}
+
+const char* const*
+plan_tags(plan, count)
+    const movePlan* plan;
+    int* count;
+{
+    *count = plan->tagCount;
+    return plan->tags;
+}
+
+static int
+compare_lstr(a, b)
+    const lstr* a;
+    const lstr* b;
+{
+    return a == b ? 0 : strcmp(a->text, b->text);
+}
+
+static int
+compare_entries(a, b)
+    const void* a;
+    const void* b;
+{
+    const planEntry* ea = (const planEntry*)a;
+    const planEntry* eb = (const planEntry*)b;
+    int cmp;
+
+    if ((cmp = compare_lstr(ea->library, eb->library)) != 0 ||
+        (cmp = compare_lstr(ea->artist, eb->artist)) != 0 ||
+        (cmp = compare_lstr(ea->album, eb->album)) != 0) {
+        return cmp;
+    }
+    // Names start with the track number, so an album's files follow in track order
+    return compare_lstr(ea->name, eb->name);
+}
+
+void
+plan_sort(plan)
+    movePlan* plan;
+{
+    qsort(plan->entries, plan->count, sizeof(planEntry), compare_entries);
+}
+
+int
+plan_count(plan)
+    const movePlan* plan;
+{
+    return plan->count;
+}
+
+const planEntry*
+plan_entries(plan)
+    const movePlan* plan;
+{
+    return plan->entries;
+}
+
+bool
+plan_same_folder(a, b)
+    const planEntry* a;
+    const planEntry* b;
+{
+    // Folder names are interned, so equal names are the same pointer
+    return a->library == b->library && a->artist == b->artist && a->album == b->album;
+}
+
+bool
+plan_source_unchanged(entry)
+    const planEntry* entry;
+{
+    cacheKey key;
+    const cacheKey* planned = &entry->edits->key;
+
+    return cache_key(entry->source, &key) && key.dev == planned->dev && key.ino == planned->ino &&
+           key.size == planned->size && key.mtime == planned->mtime;
+}
+
+static void
+write_field(file, text)
+    FILE* file;
+    const char* text;
+{
+    putc('\t', file);
+    for (; *text; text++) {
+        if (*text == '\t') {
+            fputs("\\t", file);
+        } else if (*text == '\n') {
+            fputs("\\n", file);
+        } else if (*text == '\\') {
+            fputs("\\\\", file);
+        } else {
+            putc(*text, file);
+        }
+    }
+}
+
+bool
+plan_write(plan, path)
+    const movePlan* plan;
+    const char* path;
+{
+    FILE* file;
+    bool result;
+
+    if (!(file = fopen(path, "wb"))) {
+        perror("Error : Couldn't write the plan");
+        return false;
+    }
+
+    fprintf(file, "%s\n", PLAN_HEADER);
+    for (int i = 0; i < plan->tagCount; i++) {
+        putc('T', file);
+        write_field(file, plan->tags[i]);
+        putc('\n', file);
+    }
+    for (int i = 0; i < plan->count; i++) {
+        const planEntry* entry = &plan->entries[i];
+
+        putc('F', file);
+        write_field(file, entry->source);
+        write_field(file, entry->library->text);
+        write_field(file, entry->artist->text);
+        write_field(file, entry->album->text);
+        write_field(file, entry->name->text);
+        putc('\n', file);
+
+        if (entry->edits) {
+            const planEdits* edits = entry->edits;
+            fprintf(file, "E\t%llu\t%llu\t%llu\t%lld", (unsigned long long)edits->key.dev,
+                    (unsigned long long)edits->key.ino, (unsigned long long)edits->key.size,
+                    (long long)edits->key.mtime);
+            for (int e = 0; e < edits->count; e++) {
+                fprintf(file, "\t%d:", edits->edits[e].offset);
+                for (int b = 0; b < edits->edits[e].length; b++) {
+                    fprintf(file, "%02x", (BYTE)edits->edits[e].text[b]);
+                }
+            }
+            putc('\n', file);
+        }
+    }
+
+    result = !ferror(file);
+    result = (fclose(file) == 0) && result;
+    if (!result) {
+        fprintf(stderr, "Error : Couldn't write the plan to %s\n", path);
+    }
+    return result;
+}
+
+/**
+ * Splits a line at its tabs and undoes the escapes of each field in place.
+ * Returns the number of fields, or maxFields + 1 if there are more.
+ */
+static int
+split_fields(line, fields, maxFields)
+    char* line;
+    char** fields;
+    int maxFields;
+{
+    int count = 0;
+    char* out = line;
+
+    fields[count++] = out;
+    for (char* in = line; *in; in++) {
+        if (*in == '\t') {
+            *out++ = '\0';
+            if (count == maxFields) {
+                return count + 1;   // too many
+            }
+            fields[count++] = out;
+        } else if (*in == '\\' && (in[1] == 't' || in[1] == 'n' || in[1] == '\\')) {
+            in++;
+            *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : '\\';
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return count;
+}
+
+static int
+hex_digit(c)
+    int c;
+{
+    return isdigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+/**
+ * Parses the fields of an E line into the edits of the last entry.
+ */
+static bool
+parse_edits(plan, fields, count)
+    movePlan* plan;
+    char** fields;
+    int count;
+{
+    planEntry* entry = plan->count ? &plan->entries[plan->count - 1] : NULL;
+    tagEdit edits[FLAC_MAX_EDITS];
+    cacheKey key;
+    char* end;
+    bool valid;
+
+    if (!entry || entry->edits || count < 6 || count - 5 > FLAC_MAX_EDITS) {
+        return false;
+    }
+
+    for (int i = 1; i <= 4; i++) {
+        if (!isdigit((BYTE)fields[i][0]) && fields[i][0] != '-') {
+            return false;
+        }
+    }
+    key.dev = strtoull(fields[1], &end, 10);
+    valid = *end == '\0';
+    key.ino = strtoull(fields[2], &end, 10);
+    valid = valid && *end == '\0';
+    key.size = strtoull(fields[3], &end, 10);
+    valid = valid && *end == '\0';
+    key.mtime = strtoll(fields[4], &end, 10);
+    if (!valid || *end != '\0') {
+        return false;
+    }
+
+    // "offset:hex"; the bytes are decoded over the hex digits in place
+    for (int i = 5; i < count; i++) {
+        tagEdit* edit = &edits[i - 5];
+        char* hex;
+        long offset = strtol(fields[i], &hex, 10);
+        size_t digits;
+
+        if (hex == fields[i] || *hex != ':' || offset < 0 || offset > INT32_MAX) {
+            return false;
+        }
+        hex++;
+        digits = strlen(hex);
+        if (digits == 0 || digits % 2 != 0 || digits / 2 > INT32_MAX) {
+            return false;
+        }
+        for (size_t b = 0; b < digits / 2; b++) {
+            int high = hex_digit(hex[2 * b]);
+            int low = hex_digit(hex[2 * b + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            hex[b] = (char)(high << 4 | low);
+        }
+        edit->offset = (int)offset;
+        edit->length = (int)(digits / 2);
+        edit->text = hex;
+    }
+
+    return (entry->edits = copy_edits(plan, edits, count - 5, &key)) != NULL;
+}
+
+movePlan*
+plan_read(path)
+    const char* path;
+{
+    FILE* file;
+    movePlan* plan;
+    char* data;
+    char* line;
+    long size;
+    int lineNumber = 0;
+
+    if (!(file = fopen(path, "rb"))) {
+        perror("Error : Couldn't open the plan");
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0 ||
+        !(data = (char*)malloc((size_t)size + 1))) {
+        fprintf(stderr, "Error : Couldn't read the plan %s\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (fread(data, 1, (size_t)size, file) != (size_t)size) {
+        fprintf(stderr, "Error : Couldn't read the plan %s\n", path);
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+    fclose(file);
+    data[size] = '\0';
+
+    if (!(plan = plan_create())) {
+        free(data);
+        return NULL;
+    }
+
+    // Lines are cut out of the buffer in place; the strings are copied into the plan
+    for (line = data; line && *line; ) {
+        char* next = strchr(line, '\n');
+        char* fields[5 + FLAC_MAX_EDITS];
+        int count;
+        bool valid = true;
+
+        if (next) {
+            *next++ = '\0';
+        }
+        if (*line && line[strlen(line) - 1] == '\r') {
+            line[strlen(line) - 1] = '\0';
+        }
+        lineNumber++;
+
+        if (lineNumber == 1) {
+            valid = !strcmp(line, PLAN_HEADER);
+        } else if (line[0] == 'F' && line[1] == '\t') {
+            planEntry entry;
+            const lstr* source;
+
+            valid = split_fields(line, fields, 6) == 6;
+            if (valid) {
+                source = strtable_copy(plan->strings, fields[1], strlen(fields[1]));
+                entry.source = source ? source->text : NULL;
+                entry.library = strtable_intern(plan->strings, fields[2], strlen(fields[2]));
+                entry.artist = strtable_intern(plan->strings, fields[3], strlen(fields[3]));
+                entry.album = strtable_intern(plan->strings, fields[4], strlen(fields[4]));
+                entry.name = strtable_copy(plan->strings, fields[5], strlen(fields[5]));
+                entry.edits = NULL;
+                memset(entry.audioMd5, 0, AUDIO_MD5_SIZE);
+                valid = entry.source && entry.library && entry.artist && entry.album && entry.name &&
+                        *fields[1] && *fields[2] && *fields[3] && *fields[4] && *fields[5] &&
+                        append_entry(plan, &entry);
+            }
+        } else if (line[0] == 'T' && line[1] == '\t') {
+            const lstr* tag;
+
+            // Settings apply to the whole plan, so they come before its first move
+            valid = plan->count == 0 && plan->tagCount < MAX_TAGS && split_fields(line, fields, 2) == 2 &&
+                    strchr(fields[1], '=') && fields[1][0] != '=' &&
+                    (tag = strtable_copy(plan->strings, fields[1], strlen(fields[1]))) != NULL;
+            if (valid) {
+                plan->tags[plan->tagCount++] = tag->text;
+            }
+        } else if (line[0] == 'E' && line[1] == '\t') {
+            count = split_fields(line, fields, 5 + FLAC_MAX_EDITS);
+            valid = count <= 5 + FLAC_MAX_EDITS && parse_edits(plan, fields, count);
+        } else {
+            // Blank lines and comments are allowed
+            valid = line[0] == '\0' || line[0] == '#';
+        }
+
+        if (!valid) {
+            fprintf(stderr, "Error : %s line %d: not a valid plan line.\n", path, lineNumber);
+            plan_destroy(plan);
+            free(data);
+            return NULL;
+        }
+        line = next;
+    }
+
+    free(data);
+    if (lineNumber == 0) {
+        fprintf(stderr, "Error : %s is not a plan.\n", path);
+        plan_destroy(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+void
+plan_destroy(plan)
+    movePlan* plan;
+{
+    if (!plan) {
+        return;
+    }
+
+    free(plan->entries);
+    strtable_destroy(plan->strings);
+    arena_destroy(plan->edits);
+    mutex_destroy(&plan->lock);
+    free(plan);
+}
@@ -0,0 +1,334 @@
+#include "../include/pool.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+typedef struct poolItem {
+    poolTask task;
+    void* arg;
+} poolItem;
+
+typedef struct outBuffer {
+    char* data;
+    size_t len;
+    size_t cap;
+} outBuffer;
+
+struct workPool {
+    mutex_t lock;           // protects the queue and the counters below
+    mutex_t outputLock;     // serializes console output between workers
+    cond_t notEmpty;        // signalled when a task is queued or the pool stops
+    cond_t notFull;         // signalled when a worker takes a task off the queue
+    cond_t idle;            // signalled when the last running task finishes
+    poolItem* queue;        // circular task queue
+    int capacity;
+    int head;
+    int count;
+    int active;             // tasks currently running
+    int nthreads;
+    thread_t* threads;
+    bool stopping;
+};
+
+// Output buffers of the calling worker thread, NULL on non-worker threads
+static THREAD_LOCAL outBuffer* tlsOut = NULL;
+static THREAD_LOCAL outBuffer* tlsErr = NULL;
+
+int
+get_core_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+static void
+buffer_vappend(buf, format, args)
+    outBuffer* buf;
+    const char* format;
+    va_list args;
+{
+    va_list copy;
+    int needed;
+
+    va_copy(copy, args);
+    needed = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (needed < 0) {
+        return;
+    }
+
+    // Grow the buffer geometrically to fit the formatted text and its terminator
+    if (buf->len + needed + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + needed + 1) {
+            cap *= 2;
+        }
+        char* data = (char*)realloc(buf->data, cap);
+        if (!data) {
+            return;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+    buf->len += needed;
+}
+
+void
+out_printf(FILE* stream, const char* format, ...)
+{
+    va_list args;
+    outBuffer* buf = (stream == stderr) ? tlsErr : (stream == stdout) ? tlsOut : NULL;
+
+    va_start(args, format);
+    if (buf) {
+        buffer_vappend(buf, format, args);
+    } else {
+        vfprintf(stream, format, args);
+    }
+    va_end(args);
+}
+
+void
+out_perror(message)
+    const char* message;
+{
+    int err = errno;    // save errno before any library call can overwrite it
+    out_printf(stderr, "%s: %s\n", message, strerror(err));
+}
+
+static void
+flush_worker_output(pool, out, err)
+    workPool* pool;
+    outBuffer* out;
+    outBuffer* err;
+{
+    if (out->len == 0 && err->len == 0) {
+        return;
+    }
+
+    // Errors are written first so that they end up on the same line as the file name
+    mutex_lock(&pool->outputLock);
+    if (err->len) {
+        fwrite(err->data, 1, err->len, stderr);
+        fflush(stderr);
+    }
+    if (out->len) {
+        fwrite(out->data, 1, out->len, stdout);
+        fflush(stdout);
+    }
+    mutex_unlock(&pool->outputLock);
+
+    out->len = 0;
+    err->len = 0;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+worker_main(void* arg)
+#else
+static void*
+worker_main(void* arg)
+#endif
+{
+    workPool* pool = (workPool*)arg;
+    outBuffer out = { NULL, 0, 0 };
+    outBuffer err = { NULL, 0, 0 };
+
+    tlsOut = &out;
+    tlsErr = &err;
+
+    for (;;) {
+        poolItem item;
+
+        mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            cond_wait(&pool->notEmpty, &pool->lock);
+        }
+        if (pool->count == 0 && pool->stopping) {
+            mutex_unlock(&pool->lock);
+            break;
+        }
+
+        // Take the next task off the queue
+        item = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->active++;
+        cond_signal(&pool->notFull);
+        mutex_unlock(&pool->lock);
+
+        item.task(item.arg);
+        flush_worker_output(pool, &out, &err);
+
+        mutex_lock(&pool->lock);
+        pool->active--;
+        if (pool->active == 0 && pool->count == 0) {
+            cond_broadcast(&pool->idle);
+        }
+        mutex_unlock(&pool->lock);
+    }
+
+    tlsOut = NULL;
+    tlsErr = NULL;
+    free(out.data);
+    free(err.data);
+    return 0;
+}
+
+workPool*
+pool_create(nthreads)
+    int nthreads;
+{
+    workPool* pool = (workPool*)calloc(1, sizeof(workPool));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    pool->capacity = nthreads * POOL_QUEUE_PER_THREAD;
+    pool->queue = (poolItem*)malloc(pool->capacity * sizeof(poolItem));
+    pool->threads = (thread_t*)calloc(nthreads, sizeof(thread_t));
+    if (!pool->queue || !pool->threads) {
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    mutex_init(&pool->lock);
+    mutex_init(&pool->outputLock);
+    cond_init(&pool->notEmpty);
+    cond_init(&pool->notFull);
+    cond_init(&pool->idle);
+
+    // Start the workers, keeping whatever number could be created
+    for (int i = 0; i < nthreads; i++) {
+#ifdef _WIN32
+        pool->threads[i] = (HANDLE)_beginthreadex(NULL, 0, worker_main, pool, 0, NULL);
+        if (pool->threads[i] == 0) {
+            break;
+        }
+#else
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            break;
+        }
+#endif
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+pool_submit(pool, task, arg)
+    workPool* pool;
+    poolTask task;
+    void* arg;
+{
+    mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity) {
+        cond_wait(&pool->notFull, &pool->lock);
+    }
+    pool->queue[(pool->head + pool->count) % pool->capacity].task = task;
+    pool->queue[(pool->head + pool->count) % pool->capacity].arg = arg;
+    pool->count++;
+    cond_signal(&pool->notEmpty);
+    mutex_unlock(&pool->lock);
+}
+
+bool
+pool_is_idle(pool)
+    workPool* pool;
+{
+    bool idle;
+
+    if (!pool) {
+        return true;
+    }
+
+    mutex_lock(&pool->lock);
+    idle = pool->count == 0 && pool->active == 0;
+    mutex_unlock(&pool->lock);
+    return idle;
+}
+
+void
+pool_wait(pool)
+    workPool* pool;
+{
+    mutex_lock(&pool->lock);
+    while (pool->count > 0 || pool->active > 0) {
+        cond_wait(&pool->idle, &pool->lock);
+    }
+    mutex_unlock(&pool->lock);
+}
+
+void
+pool_destroy(pool)
+    workPool* pool;
+{
+    if (!pool) {
+        return;
+    }
+
+    mutex_lock(&pool->lock);
+    pool->stopping = true;
+    cond_broadcast(&pool->notEmpty);
+    mutex_unlock(&pool->lock);
+
+    // Workers drain the queue before they exit
+    for (int i = 0; i < pool->nthreads; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+
+    mutex_destroy(&pool->lock);
+    mutex_destroy(&pool->outputLock);
+    cond_destroy(&pool->notEmpty);
+    cond_destroy(&pool->notFull);
+    cond_destroy(&pool->idle);
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
+
+void
+pool_output_lock(pool)
+    workPool* pool;
+{
+    if (pool) {
+        mutex_lock(&pool->outputLock);
+    }
+}
+
+void
+pool_output_unlock(pool)
+    workPool* pool;
+{
+    if (pool) {
+        mutex_unlock(&pool->outputLock);
+    }
+}
@@ -0,0 +1,351 @@
+#include "../include/stats.h"
+#include "../include/pool.h"
+
+#include <string.h>
+#include <time.h>
+
+typedef struct stageStats {
+    mutex_t lock;
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[STATS_BUCKETS];
+} stageStats;
+
+typedef struct failInfo {
+    const char* name;       // key in the stats file
+    const char* message;    // printed by handle_error()
+} failInfo;
+
+static const char* stageNames[STAGE_COUNT] = {
+    "scan", "open", "parse", "rewrite", "mkdir", "move", "cover"
+};
+
+// Indexed by FailReason
+static const failInfo failInfos[FAIL_REASON_COUNT] = {
+    { "setup",          "Setup failed!\n" },
+    { "word_list",      "Couldn't compile the Lowercase= word list.\n" },
+    { "unsupported",    "Unsupported file type." },
+    { "open",           "Couldn't open the file." },
+    { "not_flac",       "Not a real FLAC file." },
+    { "not_id3",        "Not an ID3v2 mp3 file." },
+    { "id3_version",    "Unsupported ID3v2 version." },
+    { "id3_too_large",  "ID3v2 tag too large." },
+    { "not_ogg",        "Not an Ogg Vorbis or Opus file." },
+    { "not_mp4",        "Not an MP4 file." },
+    { "corrupt",        "Data missing or corrupt." },
+    { "tag_read",       "Couldn't read tag info." },
+    { "tag_parse",      "FLAC file could not be parsed." },
+    { "blank_field",    "A field is blank." },
+    { "name_too_long",  "Folder name too long." },
+    { "mkdir",          "Couldn't create a folder." },
+    { "move",           "File could not be moved." },
+    { "duplicate",      "Already in the library." },
+    { "different_encode", "A different encode is already in the library." },
+};
+
+// Indexed by Warning; shares the shape of failInfo
+static const failInfo warnInfos[WARN_COUNT] = {
+    { "rewrite",        "Couldn't rewrite the tags." },
+    { "cover_art",      "Couldn't write the cover art." },
+};
+
+static stageStats stages[STAGE_COUNT];
+static int stagesReady = 0;
+static volatile long failures[FAIL_REASON_COUNT];
+static volatile long warnings[WARN_COUNT];
+static THREAD_LOCAL int lastFailure = FAIL_REASON_COUNT;    // see stats_take_failure()
+static volatile long filesFound = 0;
+static volatile long filesSucceeded = 0;
+static uint64_t runStart = 0;
+
+static mutex_t fileLock = MUTEX_INITIALIZER;   // one snapshot at a time
+static mutex_t intervalLock = MUTEX_INITIALIZER;
+static thread_t intervalThread;
+static int intervalRunning = 0;
+static int intervalStopping = 0;
+static int intervalSeconds = 0;
+static const char* intervalPath = NULL;
+
+void
+stats_init(void)
+{
+    if (!stagesReady) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            mutex_init(&stages[i].lock);
+        }
+        stagesReady = 1;
+    }
+    runStart = stats_now();
+}
+
+uint64_t
+stats_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void
+stats_record(stage, start)
+    Stage stage;
+    uint64_t start;
+{
+    uint64_t elapsed = stats_now() - start;
+    uint64_t us = elapsed / 1000;
+    int bucket = 0;
+    stageStats* s = &stages[stage];
+
+    if (!stagesReady) {
+        return;
+    }
+
+    // Bucket i holds latencies below 2^(i+1) us
+    while (bucket < STATS_BUCKETS - 1 && (us >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+
+    mutex_lock(&s->lock);
+    s->count++;
+    s->totalNs += elapsed;
+    if (elapsed > s->maxNs) {
+        s->maxNs = elapsed;
+    }
+    s->buckets[bucket]++;
+    mutex_unlock(&s->lock);
+}
+
+void
+stats_fail(reason)
+    FailReason reason;
+{
+    atomic_increment(&failures[reason]);
+    lastFailure = reason;
+}
+
+FailReason
+stats_take_failure(void)
+{
+    FailReason reason = (FailReason)lastFailure;
+
+    lastFailure = FAIL_REASON_COUNT;
+    return reason;
+}
+
+void
+stats_warn(warning)
+    Warning warning;
+{
+    atomic_increment(&warnings[warning]);
+}
+
+const char*
+stats_fail_message(reason)
+    FailReason reason;
+{
+    return failInfos[reason].message;
+}
+
+void
+stats_found(void)
+{
+    atomic_increment(&filesFound);
+}
+
+void
+stats_succeeded(void)
+{
+    atomic_increment(&filesSucceeded);
+}
+
+void
+stats_print_failures(stream)
+    FILE* stream;
+{
+    for (int i = 0; i < FAIL_REASON_COUNT; i++) {
+        if (failures[i] > 0) {
+            fprintf(stream, "%8ld  %s\n", (long)failures[i], failInfos[i].message);
+        }
+    }
+}
+
+bool
+stats_print_warnings(stream)
+    FILE* stream;
+{
+    bool printed = false;
+
+    for (int i = 0; i < WARN_COUNT; i++) {
+        if (warnings[i] > 0) {
+            fprintf(stream, "%8ld  Warning : %s\n", (long)warnings[i], warnInfos[i].message);
+            printed = true;
+        }
+    }
+    return printed;
+}
+
+/**
+ * Returns the upper bound of the bucket that holds the given fraction of the samples,
+ * or the maximum if that is the open last bucket.
+ */
+static uint64_t
+percentile_us(s, fraction)
+    const stageStats* s;
+    double fraction;
+{
+    uint64_t rank = (uint64_t)(fraction * (double)s->count);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+        seen += s->buckets[i];
+        if (seen > rank) {
+            uint64_t bound = (uint64_t)1 << (i + 1);
+            return bound < s->maxNs / 1000 ? bound : s->maxNs / 1000;
+        }
+    }
+    return s->maxNs / 1000;
+}
+
+bool
+stats_write(path, final)
+    const char* path;
+    int final;
+{
+    FILE* file;
+    bool ok;
+
+    mutex_lock(&fileLock);
+    if (!(file = fopen(path, "a"))) {
+        mutex_unlock(&fileLock);
+        return false;
+    }
+
+    fprintf(file, "{\"time\":%lld,\"elapsed\":%.3f,\"final\":%s,",
+            (long long)time(NULL), (double)(stats_now() - runStart) / 1e9, final ? "true" : "false");
+    fprintf(file, "\"files\":{\"found\":%ld,\"succeeded\":%ld},", (long)filesFound, (long)filesSucceeded);
+
+    fprintf(file, "\"stages\":{");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        stageStats s;
+
+        // Copy under the lock so a snapshot is consistent while workers keep recording
+        mutex_lock(&stages[i].lock);
+        s = stages[i];
+        mutex_unlock(&stages[i].lock);
+
+        fprintf(file, "%s\"%s\":{\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"histogram\":[",
+                i ? "," : "", stageNames[i], (unsigned long long)s.count, (unsigned long long)(s.totalNs / 1000),
+                (unsigned long long)(s.maxNs / 1000), (unsigned long long)percentile_us(&s, 0.5),
+                (unsigned long long)percentile_us(&s, 0.99));
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            fprintf(file, "%s%llu", b ? "," : "", (unsigned long long)s.buckets[b]);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "},");
+
+    fprintf(file, "\"failures\":{");
+    for (int i = 0; i < FAIL_REASON_COUNT; i++) {
+        fprintf(file, "%s\"%s\":%ld", i ? "," : "", failInfos[i].name, (long)failures[i]);
+    }
+    fprintf(file, "},");
+
+    fprintf(file, "\"warnings\":{");
+    for (int i = 0; i < WARN_COUNT; i++) {
+        fprintf(file, "%s\"%s\":%ld", i ? "," : "", warnInfos[i].name, (long)warnings[i]);
+    }
+    fprintf(file, "}}\n");
+
+    ok = !ferror(file);
+    ok = (fclose(file) == 0) && ok;
+    mutex_unlock(&fileLock);
+    return ok;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+#else
+static void*
+#endif
+interval_main(arg)
+    void* arg;
+{
+    int ticks = 0;      // tenths of a second since the last snapshot
+
+    (void)arg;
+    for (;;) {
+        bool stopping;
+
+        // Short naps, so stopping doesn't wait for a whole interval
+#ifdef _WIN32
+        Sleep(100);
+#else
+        struct timespec nap = { 0, 100 * 1000 * 1000 };
+        nanosleep(&nap, NULL);
+#endif
+        mutex_lock(&intervalLock);
+        stopping = intervalStopping;
+        mutex_unlock(&intervalLock);
+        if (stopping) {
+            break;
+        }
+
+        if (++ticks >= intervalSeconds * 10) {
+            ticks = 0;
+            stats_write(intervalPath, 0);
+        }
+    }
+    return 0;
+}
+
+bool
+stats_start_interval(path, seconds)
+    const char* path;
+    int seconds;
+{
+    if (intervalRunning || seconds < 1 || seconds > STATS_MAX_INTERVAL) {
+        return false;
+    }
+
+    intervalPath = path;
+    intervalSeconds = seconds;
+    intervalStopping = 0;
+#ifdef _WIN32
+    intervalThread = (HANDLE)_beginthreadex(NULL, 0, interval_main, NULL, 0, NULL);
+    intervalRunning = intervalThread != 0;
+#else
+    intervalRunning = pthread_create(&intervalThread, NULL, interval_main, NULL) == 0;
+#endif
+    return intervalRunning;
+}
+
+void
+stats_stop_interval(void)
+{
+    if (!intervalRunning) {
+        return;
+    }
+
+    mutex_lock(&intervalLock);
+    intervalStopping = 1;
+    mutex_unlock(&intervalLock);
+
+#ifdef _WIN32
+    WaitForSingleObject(intervalThread, INFINITE);
+    CloseHandle(intervalThread);
+#else
+    pthread_join(intervalThread, NULL);
+#endif
+    intervalRunning = 0;
+}
@@ -0,0 +1,264 @@
+#include "../include/track.h"
+#include "../include/pool.h"
+
+struct strTable {
+    mutex_t lock;
+    arena* strings;         // every string, interned or copied
+    const lstr** slots;     // interned strings, open addressing, size is a power of two
+    uint32_t* hashes;       // hash of the string in each slot
+    size_t slotCount;
+    size_t count;           // interned strings
+};
+
+uint32_t
+strtable_hash(text, length)
+    const char* text;
+    size_t length;
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (BYTE)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const lstr*
+store_text(table, text, length)
+    strTable* table;
+    const char* text;
+    size_t length;
+{
+    lstr* str;
+
+    if (length > UINT32_MAX || !(str = (lstr*)arena_alloc(table->strings, sizeof(lstr) + length + 1))) {
+        return NULL;
+    }
+    str->length = (uint32_t)length;
+    memcpy(str->text, text, length);
+    str->text[length] = '\0';
+    return str;
+}
+
+static bool
+grow_slots(table)
+    strTable* table;
+{
+    size_t size = table->slotCount ? table->slotCount * 2 : STRTABLE_MIN_SLOTS;
+    const lstr** slots = (const lstr**)calloc(size, sizeof(const lstr*));
+    uint32_t* hashes = (uint32_t*)malloc(size * sizeof(uint32_t));
+
+    if (!slots || !hashes) {
+        free(slots);
+        free(hashes);
+        return false;
+    }
+    for (size_t i = 0; i < table->slotCount; i++) {
+        if (table->slots[i]) {
+            size_t j = table->hashes[i] & (size - 1);
+            while (slots[j]) {
+                j = (j + 1) & (size - 1);
+            }
+            slots[j] = table->slots[i];
+            hashes[j] = table->hashes[i];
+        }
+    }
+    free(table->slots);
+    free(table->hashes);
+    table->slots = slots;
+    table->hashes = hashes;
+    table->slotCount = size;
+    return true;
+}
+
+strTable*
+strtable_create(void)
+{
+    strTable* table = (strTable*)calloc(1, sizeof(strTable));
+
+    if (!table) {
+        return NULL;
+    }
+    if (!(table->strings = arena_create(STRTABLE_CHUNK)) || !grow_slots(table)) {
+        arena_destroy(table->strings);
+        free(table);
+        return NULL;
+    }
+    mutex_init(&table->lock);
+    return table;
+}
+
+const lstr*
+strtable_intern(table, text, length)
+    strTable* table;
+    const char* text;
+    size_t length;
+{
+    uint32_t hash = strtable_hash(text, length);
+    const lstr* str = NULL;
+    size_t i;
+
+    mutex_lock(&table->lock);
+
+    // Keep the load below 3/4 so probe runs stay short
+    if ((table->count + 1) * 4 > table->slotCount * 3 && !grow_slots(table)) {
+        mutex_unlock(&table->lock);
+        return NULL;
+    }
+
+    for (i = hash & (table->slotCount - 1); table->slots[i]; i = (i + 1) & (table->slotCount - 1)) {
+        const lstr* slot = table->slots[i];
+        if (table->hashes[i] == hash && slot->length == length && !memcmp(slot->text, text, length)) {
+            str = slot;
+            break;
+        }
+    }
+
+    if (!str && (str = store_text(table, text, length)) != NULL) {
+        table->slots[i] = str;
+        table->hashes[i] = hash;
+        table->count++;
+    }
+
+    mutex_unlock(&table->lock);
+    return str;
+}
+
+const lstr*
+strtable_copy(table, text, length)
+    strTable* table;
+    const char* text;
+    size_t length;
+{
+    const lstr* str;
+
+    mutex_lock(&table->lock);
+    str = store_text(table, text, length);
+    mutex_unlock(&table->lock);
+    return str;
+}
+
+size_t
+strtable_count(table)
+    strTable* table;
+{
+    size_t count;
+
+    mutex_lock(&table->lock);
+    count = table->count;
+    mutex_unlock(&table->lock);
+    return count;
+}
+
+size_t
+strtable_bytes(table)
+    strTable* table;
+{
+    size_t bytes;
+
+    mutex_lock(&table->lock);
+    bytes = arena_used(table->strings);
+    mutex_unlock(&table->lock);
+    return bytes;
+}
+
+void
+strtable_destroy(table)
+    strTable* table;
+{
+    if (!table) {
+        return;
+    }
+
+    arena_destroy(table->strings);
+    free(table->slots);
+    free(table->hashes);
+    mutex_destroy(&table->lock);
+    free(table);
+}
+
+bool
+slottable_create(table, size)
+    slotTable* table;
+    uint32_t size;
+{
+    table->slots = (uint32_t*)calloc(size, sizeof(uint32_t));
+    table->size = table->slots ? size : 0;
+    table->used = 0;
+    return table->slots != NULL;
+}
+
+bool
+slottable_full(table)
+    const slotTable* table;
+{
+    // Keep the load below 3/4 so probe runs stay short
+    return (table->used + 1) * 4 > table->size * 3;
+}
+
+void
+slottable_place(table, hash, number)
+    slotTable* table;
+    uint32_t hash;
+    uint32_t number;
+{
+    uint32_t mask = table->size - 1;
+    uint32_t i = hash & mask;
+
+    while (table->slots[i]) {
+        i = (i + 1) & mask;
+    }
+    table->slots[i] = number;
+    table->used++;
+}
+
+uint32_t
+slottable_find(table, hash, match, records, key)
+    const slotTable* table;
+    uint32_t hash;
+    slotMatch match;
+    const void* records;
+    const void* key;
+{
+    uint32_t mask = table->size - 1;
+
+    for (uint32_t i = hash & mask; table->slots[i]; i = (i + 1) & mask) {
+        if (match(records, table->slots[i], key)) {
+            return table->slots[i];
+        }
+    }
+    return 0;
+}
+
+void
+slottable_destroy(table)
+    slotTable* table;
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->used = 0;
+}
+
+bool
+track_pack(table, meta, source, record)
+    strTable* table;
+    const audioMetaData* meta;
+    const char* source;
+    trackRecord* record;
+{
+    // Numbers above 65535 are not track numbers; they are clamped rather than wrapped
+    for (int i = 0; i < 2; i++) {
+        record->track[i] = (uint16_t)(meta->track[i] < 0 ? 0 : meta->track[i] > UINT16_MAX ? UINT16_MAX : meta->track[i]);
+        record->disc[i] = (uint16_t)(meta->disc[i] < 0 ? 0 : meta->disc[i] > UINT16_MAX ? UINT16_MAX : meta->disc[i]);
+    }
+    memcpy(record->date, meta->date, sizeof(record->date));
+    record->source = source;
+
+    record->artist = strtable_intern(table, meta->artist, strlen(meta->artist));
+    record->album = strtable_intern(table, meta->album, strlen(meta->album));
+    record->genre = strtable_intern(table, meta->genre, strlen(meta->genre));
+    record->fileext = strtable_intern(table, meta->fileext, strlen(meta->fileext));
+    record->title = strtable_copy(table, meta->title, strlen(meta->title));
+
+    return record->artist && record->album && record->genre && record->fileext && record->title;
+}
@@ -0,0 +1,389 @@
+#include "../include/watch.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#define WATCH_FILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY)
+#define WATCH_DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct watchedDir {
+    int wd;
+    int depth;
+    char* path;
+} watchedDir;
+
+typedef struct pendingFile {
+    char* path;
+    long long readyAt;      // monotonic milliseconds after which the file counts as complete
+    bool complete;          // a close-after-write or move-in has been seen
+} pendingFile;
+
+struct dirWatch {
+    int fd;
+    int maxDepth;
+    watchedDir* dirs;
+    int dirCount;
+    int dirCapacity;
+    pendingFile* pending;
+    int pendingCount;
+    int pendingCapacity;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void scan_watched(dirWatch* watch, const char* path, int depth, int noteFiles);
+
+static void
+request_stop(sig)
+    int sig;
+{
+    stopRequested = 1;
+}
+
+static long long
+monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static watchedDir*
+find_watch(watch, wd)
+    dirWatch* watch;
+    int wd;
+{
+    for (int i = 0; i < watch->dirCount; i++) {
+        if (watch->dirs[i].wd == wd) {
+            return &watch->dirs[i];
+        }
+    }
+    return NULL;
+}
+
+static bool
+find_watch_path(watch, path)
+    dirWatch* watch;
+    const char* path;
+{
+    for (int i = 0; i < watch->dirCount; i++) {
+        if (!strcmp(watch->dirs[i].path, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+note_file(watch, dirPath, name, complete)
+    dirWatch* watch;
+    const char* dirPath;
+    const char* name;
+    int complete;
+{
+    char path[_MAX_PATH];
+    pendingFile* file = NULL;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dirPath, name) >= (int)sizeof(path)) {
+        return;
+    }
+
+    for (int i = 0; i < watch->pendingCount; i++) {
+        if (!strcmp(watch->pending[i].path, path)) {
+            file = &watch->pending[i];
+            break;
+        }
+    }
+
+    if (!file) {
+        // A write that hasn't been closed yet is not worth tracking on its own
+        if (!complete) {
+            return;
+        }
+        if (watch->pendingCount == watch->pendingCapacity) {
+            int capacity = watch->pendingCapacity ? watch->pendingCapacity * 2 : 64;
+            pendingFile* pending = (pendingFile*)realloc(watch->pending, capacity * sizeof(pendingFile));
+            if (!pending) {
+                return;
+            }
+            watch->pending = pending;
+            watch->pendingCapacity = capacity;
+        }
+        file = &watch->pending[watch->pendingCount++];
+        file->path = strdup(path);
+        file->complete = false;
+    }
+
+    // Every event pushes the deadline out again
+    file->complete = file->complete || complete;
+    file->readyAt = monotonic_ms() + WATCH_SETTLE_MS;
+}
+
+static void
+add_watch(watch, path, depth, noteFiles)
+    dirWatch* watch;
+    const char* path;
+    int depth;
+    int noteFiles;
+{
+    int wd = inotify_add_watch(watch->fd, path, WATCH_FILE_EVENTS | WATCH_DIR_EVENTS);
+
+    if (wd < 0) {
+        perror(path);
+        return;
+    }
+
+    if (watch->dirCount == watch->dirCapacity) {
+        int capacity = watch->dirCapacity ? watch->dirCapacity * 2 : 16;
+        watchedDir* dirs = (watchedDir*)realloc(watch->dirs, capacity * sizeof(watchedDir));
+        if (!dirs) {
+            inotify_rm_watch(watch->fd, wd);
+            return;
+        }
+        watch->dirs = dirs;
+        watch->dirCapacity = capacity;
+    }
+    watch->dirs[watch->dirCount].wd = wd;
+    watch->dirs[watch->dirCount].depth = depth;
+    watch->dirs[watch->dirCount].path = strdup(path);
+    watch->dirCount++;
+
+    scan_watched(watch, path, depth, noteFiles);
+}
+
+/**
+ * Watches the subdirectories of a watched directory that aren't watched yet, and with
+ * 'noteFiles' queues the files already in it: those of a directory that was moved in
+ * whole, or that arrived while events were lost.
+ */
+static void
+scan_watched(watch, path, depth, noteFiles)
+    dirWatch* watch;
+    const char* path;
+    int depth;
+    int noteFiles;
+{
+    bool deeper = watch->maxDepth < 0 || depth < watch->maxDepth;
+    struct dirent* entry;
+    DIR* dir;
+
+    if ((!deeper && !noteFiles) || (dir = opendir(path)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char sub[_MAX_PATH];
+        struct stat st;
+        bool isDir;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (entry->d_type != DT_DIR && entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        if (snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name) >= (int)sizeof(sub)) {
+            continue;
+        }
+        if (entry->d_type == DT_UNKNOWN) {
+            if (lstat(sub, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+                continue;
+            }
+            isDir = S_ISDIR(st.st_mode);
+        } else {
+            isDir = entry->d_type == DT_DIR;
+        }
+
+        if (!isDir) {
+            if (noteFiles) {
+                note_file(watch, path, entry->d_name, 1);
+            }
+        } else if (deeper && !(noteFiles && find_watch_path(watch, sub))) {
+            add_watch(watch, sub, depth + 1, noteFiles);
+        }
+    }
+    closedir(dir);
+}
+
+static void
+read_events(watch)
+    dirWatch* watch;
+{
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + len; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            watchedDir* dir = find_watch(watch, event->wd);
+            p += sizeof(struct inotify_event) + event->len;
+
+            // Events were dropped: whatever arrived meanwhile is picked up from the tree itself
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (int i = 0, count = watch->dirCount; i < count; i++) {
+                    char* path = strdup(watch->dirs[i].path);
+                    if (path) {
+                        scan_watched(watch, path, watch->dirs[i].depth, 1);
+                        free(path);
+                    }
+                }
+                continue;
+            }
+            if (!dir || event->len == 0) {
+                continue;
+            }
+
+            if (event->mask & IN_ISDIR) {
+                // New subdirectory: watch it if it is within the depth limit, with the files already in it
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                    (watch->maxDepth < 0 || dir->depth < watch->maxDepth)) {
+                    char sub[_MAX_PATH];
+                    int depth = dir->depth + 1;
+                    if (snprintf(sub, sizeof(sub), "%s/%s", dir->path, event->name) < (int)sizeof(sub)) {
+                        add_watch(watch, sub, depth, 1);
+                    }
+                }
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                note_file(watch, dir->path, event->name, 1);
+            } else if (event->mask & IN_MODIFY) {
+                note_file(watch, dir->path, event->name, 0);
+            }
+        }
+    }
+}
+
+dirWatch*
+watch_open(path, maxDepth)
+    const char* path;
+    int maxDepth;
+{
+    dirWatch* watch = (dirWatch*)calloc(1, sizeof(dirWatch));
+
+    if (!watch) {
+        return NULL;
+    }
+    if ((watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        perror("Error : Couldn't start watching");
+        free(watch);
+        return NULL;
+    }
+    watch->maxDepth = maxDepth;
+
+    // The files already there are left to the initial scan
+    add_watch(watch, path, 0, 0);
+    if (watch->dirCount == 0) {
+        watch_close(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+int
+watch_run(watch, callback, ctx)
+    dirWatch* watch;
+    fileCallback callback;
+    void* ctx;
+{
+    struct pollfd pfd;
+    int count = 0;
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+
+    while (!stopRequested) {
+        long long now = monotonic_ms();
+        long long next = -1;
+        int timeout;
+
+        // Hand on the files that have settled and work out when the next one will
+        for (int i = 0; i < watch->pendingCount; ) {
+            pendingFile* file = &watch->pending[i];
+            if (file->complete && file->readyAt <= now) {
+                char* path = file->path;
+                watch->pending[i] = watch->pending[--watch->pendingCount];
+                if (access(path, F_OK) == 0) {
+                    count++;
+                    if (callback(path, ctx) != 0) {
+                        stopRequested = 1;
+                    }
+                } else {
+                    free(path);
+                }
+                continue;
+            }
+            if (file->complete && (next < 0 || file->readyAt < next)) {
+                next = file->readyAt;
+            }
+            i++;
+        }
+
+        // Sleep until an event arrives or the next file settles
+        timeout = next < 0 ? -1 : (int)(next - now > 0 ? next - now : 0);
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error : Watching failed");
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            read_events(watch);
+        }
+    }
+
+    return count;
+}
+
+void
+watch_close(watch)
+    dirWatch* watch;
+{
+    if (!watch) {
+        return;
+    }
+
+    close(watch->fd);
+    for (int i = 0; i < watch->dirCount; i++) {
+        free(watch->dirs[i].path);
+    }
+    for (int i = 0; i < watch->pendingCount; i++) {
+        free(watch->pending[i].path);
+    }
+    free(watch->dirs);
+    free(watch->pending);
+    free(watch);
+}
+
+#else
+
+dirWatch*
+watch_open(path, maxDepth)
+    const char* path;
+    int maxDepth;
+{
+    fprintf(stderr, "Error : --watch is only supported on Linux.\n");
+    return NULL;
+}
+
+int
+watch_run(watch, callback, ctx)
+    dirWatch* watch;
+    fileCallback callback;
+    void* ctx;
+{
+    return 0;
+}
+
+void
+watch_close(watch)
+    dirWatch* watch;
+{
+}
+
+#endif
@@ -0,0 +1,216 @@
+#include "../include/wordcase.h"
+
+static char** caseWords = NULL;         // words added by wordcase_add()
+static int caseWordCount = 0;
+static uint16_t (*caseNext)[256] = NULL;    // complete transition table, input folded to lowercase
+static uint8_t* caseWordLen = NULL;     // length of the word ending in a state, leading space included
+static uint16_t* caseDictLink = NULL;   // next shorter state on the suffix chain that ends a word
+static int caseStates = 0;
+
+static int
+fold(c)
+    int c;
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+bool
+wordcase_add(list)
+    const char* list;
+{
+    while (*list) {
+        const char* end = strchr(list, ',');
+        size_t length = end ? (size_t)(end - list) : strlen(list);
+        const char* word = list;
+        char** grown;
+
+        list += length + (end ? 1 : 0);
+
+        // Trim blanks around the word
+        while (length > 0 && isspace((unsigned char)*word)) {
+            word++;
+            length--;
+        }
+        while (length > 0 && isspace((unsigned char)word[length - 1])) {
+            length--;
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (length > WORDCASE_MAX_WORD) {
+            return false;
+        }
+
+        if (!(grown = (char**)realloc(caseWords, (caseWordCount + 1) * sizeof(char*)))) {
+            return false;
+        }
+        caseWords = grown;
+        if (!(caseWords[caseWordCount] = (char*)malloc(length + 1))) {
+            return false;
+        }
+        memcpy(caseWords[caseWordCount], word, length);
+        caseWords[caseWordCount][length] = '\0';
+        caseWordCount++;
+    }
+
+    return true;
+}
+
+static void
+free_automaton(void)
+{
+    free(caseNext);
+    free(caseWordLen);
+    free(caseDictLink);
+    caseNext = NULL;
+    caseWordLen = NULL;
+    caseDictLink = NULL;
+    caseStates = 0;
+}
+
+bool
+wordcase_compile(void)
+{
+    uint16_t* fail = NULL;
+    uint16_t* queue = NULL;
+    int maxStates = 1;
+    int head = 0;
+    int tail = 0;
+
+    if (caseWordCount == 0 && !wordcase_add(WORDCASE_DEFAULT_WORDS)) {
+        return false;
+    }
+
+    // One state per byte of every pattern (" word") at most, plus the root
+    for (int i = 0; i < caseWordCount; i++) {
+        maxStates += 1 + (int)strlen(caseWords[i]);
+    }
+    if (maxStates > WORDCASE_MAX_STATES) {
+        maxStates = WORDCASE_MAX_STATES;
+    }
+
+    free_automaton();
+    caseNext = calloc(maxStates, sizeof(*caseNext));
+    caseWordLen = (uint8_t*)calloc(maxStates, sizeof(uint8_t));
+    caseDictLink = (uint16_t*)calloc(maxStates, sizeof(uint16_t));
+    fail = (uint16_t*)calloc(maxStates, sizeof(uint16_t));
+    queue = (uint16_t*)malloc(maxStates * sizeof(uint16_t));
+    if (!caseNext || !caseWordLen || !caseDictLink || !fail || !queue) {
+        goto failed;
+    }
+    caseStates = 1;
+
+    // Build the trie; 0 means "no child" since the root is nobody's child
+    for (int i = 0; i < caseWordCount; i++) {
+        const char* word = caseWords[i];
+        int state = caseNext[0][' '];
+        int length = 1 + (int)strlen(word);
+
+        if (state == 0) {
+            if (caseStates >= maxStates) {
+                goto failed;
+            }
+            state = caseNext[0][' '] = (uint16_t)caseStates++;
+        }
+        for (const char* p = word; *p; p++) {
+            int c = fold((BYTE)*p);
+            if (caseNext[state][c] == 0) {
+                if (caseStates >= maxStates) {
+                    goto failed;
+                }
+                caseNext[state][c] = (uint16_t)caseStates++;
+            }
+            state = caseNext[state][c];
+        }
+        caseWordLen[state] = (uint8_t)length;
+    }
+
+    // Breadth first: fill in failure links and turn the trie into a complete automaton
+    for (int c = 0; c < 256; c++) {
+        if (caseNext[0][c]) {
+            queue[tail++] = caseNext[0][c];
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (int c = 0; c < 256; c++) {
+            int child = caseNext[state][c];
+            if (child) {
+                int link = caseNext[fail[state]][c];
+                fail[child] = (uint16_t)link;
+                caseDictLink[child] = caseWordLen[link] ? (uint16_t)link : caseDictLink[link];
+                queue[tail++] = (uint16_t)child;
+            } else {
+                caseNext[state][c] = caseNext[fail[state]][c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return true;
+
+failed:
+    free(fail);
+    free(queue);
+    free_automaton();
+    return false;
+}
+
+int
+wordcase_apply(str, spans, maxSpans)
+    char* str;
+    caseSpan* spans;
+    int maxSpans;
+{
+    int changes = 0;
+    int state = 0;
+
+    if (!caseNext) {
+        return 0;
+    }
+
+    for (int i = 0; str[i]; i++) {
+        BYTE after = (BYTE)str[i + 1];
+
+        state = caseNext[state][fold((BYTE)str[i])];
+
+        // Only whole words count, and the last word keeps its capital
+        if (after == '\0' || isalnum(after) || after == '\'' || after >= 0x80) {
+            continue;
+        }
+
+        for (int s = caseWordLen[state] ? state : caseDictLink[state]; s; s = caseDictLink[s]) {
+            int start = i - caseWordLen[s] + 2;     // first letter, after the space
+            bool changed = false;
+
+            for (int j = start; j <= i; j++) {
+                if (str[j] >= 'A' && str[j] <= 'Z') {
+                    str[j] += 'a' - 'A';
+                    changed = true;
+                }
+            }
+            if (changed) {
+                if (changes < maxSpans && spans) {
+                    spans[changes].start = start;
+                    spans[changes].length = i - start + 1;
+                }
+                changes++;
+            }
+        }
+    }
+
+    return changes;
+}
+
+void
+wordcase_free(void)
+{
+    free_automaton();
+    for (int i = 0; i < caseWordCount; i++) {
+        free(caseWords[i]);
+    }
+    free(caseWords);
+    caseWords = NULL;
+    caseWordCount = 0;
+}